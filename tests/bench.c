@@ -0,0 +1,144 @@
+// Benchmarks for number parsing and xv_program_eval_parallel.
+//
+// ./run.sh bench [rows] [max-threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../xv.h"
+
+static double now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec*1e9 + now.tv_nsec) / 1e9;
+}
+
+static volatile double sink;
+
+static void bench_parse(const char *name, const char **nums, size_t n) {
+    size_t iters = 1000000;
+    struct xv strs[16];
+    for (size_t i = 0; i < n; i++) {
+        strs[i] = xv_new_string(nums[i]);
+    }
+    double sum = 0;
+    double start = now();
+    for (size_t i = 0; i < iters; i++) {
+        sum += xv_double(strs[i%n]);
+    }
+    double parse = (now()-start)*1e9/(double)iters;
+    start = now();
+    for (size_t i = 0; i < iters; i++) {
+        sum += strtod(nums[i%n], NULL);
+    }
+    double ref = (now()-start)*1e9/(double)iters;
+    sink = sum;
+    printf("  %-8s xv_double %6.2f ns/op, strtod %6.2f ns/op\n", name, 
+        parse, ref);
+}
+
+// bench_numbers compares converting strings to numbers, which uses the
+// library's parser, with strtod. Typical literals are computed exactly by the
+// parser, and hard ones are rounded by strtod.
+static void bench_numbers(void) {
+    const char *typical[] = {
+        "0", "42", "-17", "3.14159", "1e10", "-2.5e-3", "123456.789", "0.1",
+        "6.02214076e23", "1024.5",
+    };
+    const char *hard[] = {
+        "9007199254740993", "1.7976931348623157e308", "2.2250738585072014e-308",
+        "0.30000000000000000555", 
+    };
+    printf("numbers\n");
+    bench_parse("typical", typical, sizeof(typical)/sizeof(typical[0]));
+    bench_parse("hard", hard, sizeof(hard)/sizeof(hard[0]));
+}
+
+// bench times the expression over the columns with 1 to maxthreads threads.
+// The first row must evaluate to the boolean row0, which catches expressions
+// that only measure the error path.
+static void bench(const char *expr, const struct xv_column *columns,
+    size_t ncolumns, size_t nrows, struct xv *out, int maxthreads, bool row0)
+{
+    struct xv_program *prog = xv_program_new(expr, strlen(expr), NULL);
+    if (!prog) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    printf("%s\n", expr);
+    double base = 0;
+    for (int nthreads = 1; nthreads <= maxthreads; nthreads++) {
+        // warm up the threads and their memory
+        if (!xv_program_eval_parallel(prog, columns, ncolumns, nrows, out,
+            nthreads))
+        {
+            fprintf(stderr, "eval failed\n");
+            exit(1);
+        }
+        if (xv_type(out[0]) != XV_BOOLEAN || xv_bool(out[0]) != row0) {
+            char msg[128];
+            xv_string_copy(out[0], msg, sizeof(msg));
+            fprintf(stderr, "row 0: expected '%s', got '%s'\n", 
+                row0 ? "true" : "false", msg);
+            exit(1);
+        }
+        double best = 0;
+        for (int i = 0; i < 5; i++) {
+            double start = now();
+            xv_program_eval_parallel(prog, columns, ncolumns, nrows, out,
+                nthreads);
+            double elapsed = now()-start;
+            if (i == 0 || elapsed < best) best = elapsed;
+        }
+        if (nthreads == 1) base = best;
+        printf("  %2d threads %8.2f ns/row %6.2fx\n", nthreads,
+            best*1e9/(double)nrows, base/best);
+        xv_cleanup();
+    }
+    xv_program_free(prog);
+}
+
+int main(int argc, char **argv) {
+    size_t nrows = argc > 2 ? (size_t)atol(argv[2]) : 4000000;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxthreads = argc > 3 ? atoi(argv[3]) : ncpu > 0 ? (int)ncpu : 1;
+    double *x = malloc(nrows*sizeof(double));
+    int32_t *n = malloc(nrows*sizeof(int32_t));
+    uint64_t *offsets = malloc((nrows+1)*sizeof(uint64_t));
+    char *bytes = malloc(nrows*5);
+    struct xv *out = malloc(nrows*sizeof(struct xv));
+    if (!x || !n || !offsets || !bytes || !out) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    static const char *words[] = { "abc", "zebra", "m", "", "ABC" };
+    size_t len = 0;
+    for (size_t i = 0; i < nrows; i++) {
+        x[i] = (double)(i%1000) * 0.5;
+        n[i] = (int32_t)(i%37);
+        offsets[i] = len;
+        memcpy(bytes+len, words[i%5], strlen(words[i%5]));
+        len += strlen(words[i%5]);
+    }
+    offsets[nrows] = len;
+    struct xv_column columns[] = {
+        { .name = "x", .type = XV_FLOAT64, .data = x },
+        { .name = "n", .type = XV_INT32, .data = n },
+        { .name = "s", .type = XV_UTF8, .data = bytes, .offsets = offsets },
+    };
+    bench_numbers();
+    printf("%zu rows, 1 to %d threads\n", nrows, maxthreads);
+    bench("x * 2 + n > 100 && n < 30", columns, 3, nrows, out, maxthreads,
+        false);
+    bench("s.toLowerCase() == 'abc' || x / (n + 1) > 3", columns, 3, nrows,
+        out, maxthreads, true);
+    xv_cleanup_thread();
+    free(x);
+    free(n);
+    free(offsets);
+    free(bytes);
+    free(out);
+    return 0;
+}
@@ -50,13 +50,13 @@ echo "CFLAGS: $CFLAGS"
 $CC --version
 
 if [[ "$1" == bench* ]]; then
-    echo "benchmarks are not included"
-    # echo "BENCHMARKING..."
-    # echo $CC $CFLAGS ../xv.c ../json.c bench.c -lm 
-    # $CC $CFLAGS ../xv.c ../json.c bench.c -lm 
-    # ./a.out $@
+    echo "BENCHMARKING..."
+    echo $CC $CFLAGS ../xv.c ../json.c ../ryu.c bench.c -lm -lpthread
+    $CC $CFLAGS ../xv.c ../json.c ../ryu.c bench.c -lm -lpthread
+    ./a.out $@
+    rm -f a.out
 else
-    # echo "For benchmarks: 'run.sh bench'"
+    echo "For benchmarks: 'run.sh bench'"
     echo "TESTING..."
     for f in *; do 
         if [[ "$f" != test_*.c ]]; then continue; fi 
@@ -72,7 +72,7 @@ else
             if [[ "$f" != $p* ]]; then continue; fi
         fi
         # echo $CC $CFLAGS ../json.c $f
-        $CC $CFLAGS -o $f.test ../xv.c ../json.c ../ryu.c -lm $f
+        $CC $CFLAGS -o $f.test ../xv.c ../json.c ../ryu.c $f -lm -lpthread
         if [[ "$WITHCOV" == "1" ]]; then
             MallocNanoZone=0 LLVM_PROFILE_FILE="$f.profraw" ./$f.test $@
         elif [[ "$CC" == "clang" ]]; then
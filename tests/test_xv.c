@@ -60,6 +60,12 @@ struct xv myfn2(struct xv value, struct xv args,
     return xv_new_double(sum);
 }
 
+static const double f64s[] = { 1.5, -2, 0.25, 4 };
+static const float f32s[] = { 1.5f, -2, 0.25f };
+static const int64_t i64s[] = { 9007199254740993, -2, 3 };
+static const int32_t i32s[] = { 7, -1, 0, 5, 2 };
+static double embed[1003];
+
 struct xv eref(struct xv this, struct xv ident, 
     void *udata)
 {
@@ -84,6 +90,24 @@ struct xv eref(struct xv this, struct xv ident,
         if (xv_string_compare(ident, "howdy") == 0) {
             return xv_new_string("hiya");
         }
+        if (xv_string_compare(ident, "f64s") == 0) {
+            return xv_new_typed_array(f64s, 4, XV_FLOAT64);
+        }
+        if (xv_string_compare(ident, "f32s") == 0) {
+            return xv_new_typed_array(f32s, 3, XV_FLOAT32);
+        }
+        if (xv_string_compare(ident, "i64s") == 0) {
+            return xv_new_typed_array(i64s, 3, XV_INT64);
+        }
+        if (xv_string_compare(ident, "i32s") == 0) {
+            return xv_new_typed_array(i32s, 5, XV_INT32);
+        }
+        if (xv_string_compare(ident, "empty") == 0) {
+            return xv_new_typed_array(NULL, 0, XV_FLOAT64);
+        }
+        if (xv_string_compare(ident, "embed") == 0) {
+            return xv_new_typed_array(embed, 1003, XV_FLOAT64);
+        }
         if (xv_string_compare(ident, "user1") == 0) {
             return xv_new_object(NULL, 99);
         }
@@ -94,7 +118,10 @@ struct xv eref(struct xv this, struct xv ident,
                 "\"empty\": [],"
                 "\"one\": [15],"
                 "\"enc\": \"Big\\nBot\","
-                "\"data\": [1,true,false,null,{\"a\":1}]"
+                "\"data\": [1,true,false,null,{\"a\":1}],"
+                "\"nets\": [\"10.0.0.0/8\", \"192.168.1.0/24\", "
+                    "\"2001:db8::/32\", \"::1\"],"
+                "\"zone\": [[0,0],[0,2],[2,2],[2,0]]"
             "}");
         }
         if (xv_string_compare(ident, "badj") == 0) {
@@ -130,6 +157,7 @@ struct xv eref(struct xv this, struct xv ident,
 }
 
 static bool nocase = false;
+static bool intmath = false;
 
 #define eval(input, expect) { \
     int failed = 0; \
@@ -138,6 +166,7 @@ static bool nocase = false;
         struct xv_env env = { \
             .ref = eref, \
             .no_case = nocase, \
+            .int_math = intmath, \
         }; \
         struct xv value = xv_eval((input), &env); \
         char *got = xv_string(value); \
@@ -626,7 +655,7 @@ void test_xv_various(void) {
     eval((" | 1 | 1 "), ("SyntaxError"));
     eval(("1 + [2] + 3"), ("123"));
     eval(("1 * [2] * 3"), ("6"));
-    eval(("1 * [{}] * 3"), ("SyntaxError"));
+    eval(("1 * [{}] * 3"), ("NaN"));
 
     // bad strings escape sequences
     eval(("'\\n'"), ("\n"));
@@ -828,6 +857,2039 @@ void test_xv_maxdepth(void) {
 
 
 
+}
+
+void test_xv_numbers(void) {
+    eval("0.1 + 0.2", "0.30000000000000004");
+    eval("123456789012345678", "123456789012345680");
+    eval("9007199254740993", "9007199254740992");
+    eval("1e23", "1e+23");
+    eval("8.98846567431158e307", "8.98846567431158e+307");
+    eval("2.2250738585072014e-308", "2.2250738585072014e-308");
+    eval("4.9e-324", "5e-324");
+    eval("1e-400", "0");
+    eval("1e400", "Infinity");
+    eval("0.000000000000000000000000000000000000001", "1e-39");
+    eval("1.00000000000000011102230246251565404236316680908203125", "1");
+    eval("1.00000000000000011102230246251565404236316680908203126", 
+        "1.0000000000000002");
+    eval("000123.4500", "123.45");
+    eval("5.", "5");
+    eval("1e", "SyntaxError");
+    eval("1e+", "SyntaxError");
+    eval("1.2.3", "SyntaxError");
+    eval("0x", "SyntaxError");
+    eval("0xFf", "255");
+    eval("0x-1", "SyntaxError");
+    eval("99999999999999999999u64", "18446744073709551615");
+    eval("-99999999999999999999i64", "-9223372036854775808");
+    eval("99999999999999999999i64", "9223372036854775807");
+    eval("'\\u0041BC'", "ABC");
+    eval("'\\x41BC'", "ABC");
+    eval("'\\u{41}BC'", "ABC");
+    eval("json.age + 1", "38");
+    eval("'12.5' * 2", "25");
+    eval("'0x10' * 1", "16");
+    eval("' 12' * 1", "NaN");
+    eval("'1,5' * 1", "NaN");
+    eval("'-' * 1", "NaN");
+
+    // expressions that are slices of a larger buffer must not read past len
+    struct xv value = xv_evaln("12345", 2, NULL);
+    assert(xv_double(value) == 12);
+    value = xv_evaln("1.5e10", 3, NULL);
+    assert(xv_double(value) == 1.5);
+    value = xv_evaln("77i64 + 1", 5, NULL);
+    assert(xv_int64(value) == 77);
+    assert(xv_double(xv_new_stringn("2.25xyz", 4)) == 2.25);
+    assert(xv_int64(xv_new_stringn("-42000", 3)) == -42);
+    assert(xv_uint64(xv_new_stringn("42000", 2)) == 42);
+    assert(xv_uint64(xv_new_string("-1")) == 0);
+    assert(xv_int64(xv_new_string("99999999999999999999")) == INT64_MAX);
+    assert(xv_double(xv_new_jsonn("3.75}", 4)) == 3.75);
+}
+
+void test_xv_int_math(void) {
+    eval("9007199254740993 - 9007199254740992", "0");
+    intmath = true;
+    eval("9007199254740993 - 9007199254740992", "1");
+    eval("9007199254740993", "9007199254740993");
+    eval("-9223372036854775808", "-9223372036854775808");
+    eval("-(-9223372036854775808)", "9223372036854776000");
+    eval("9223372036854775807 + 1", "9223372036854776000");
+    eval("-9223372036854775807 - 2", "-9223372036854776000");
+    eval("4611686018427387904 * 4", "18446744073709552000");
+    eval("99999999999999999999", "100000000000000000000");
+    eval("3 * 4", "12");
+    eval("8 / 2", "4");
+    eval("7 / 2", "3.5");
+    eval("-(7) / 2", "-3.5");
+    eval("1 / 0", "Infinity");
+    eval("0 / 0", "NaN");
+    eval("7 % 3", "1");
+    eval("7 % (-1)", "0");
+    eval("7 % 0", "NaN");
+    eval("1.5 + 1", "2.5");
+    eval("0xFF | 1.5", "255");
+    eval("0xFF + 1", "256");
+    eval("5 & 3", "1");
+    eval("-5 ^ 1", "-6");
+    eval("(2.5 | 0) / 2", "1");
+    eval("5 === 5.0", "true");
+    eval("5 !== 5.0", "false");
+    eval("5 == '5'", "true");
+    eval("json.age === 37", "true");
+    eval("json.age / 2", "18.5");
+    eval("json.age + 0.5", "37.5");
+    eval("json.one[0] * 9007199254740993", "135107988821114895");
+    eval("9007199254740993i64 - 1", "9007199254740992");
+    eval("1 + 2 + 'a'", "3a");
+    // -0 stays a double
+    eval("1 / (-0)", "-Infinity");
+    eval("1 / (-(0))", "-Infinity");
+    eval("1 / (0 * (-5))", "-Infinity");
+    eval("1 / (-5 * 0)", "-Infinity");
+    eval("1 / (0 / (-5))", "-Infinity");
+    eval("1 / (-6 % 3)", "-Infinity");
+    eval("1 / (-6 % (-1))", "-Infinity");
+    eval("1 / (0 * 5)", "Infinity");
+    eval("1 / (6 % 3)", "Infinity");
+    eval("1 / (0 - 0)", "Infinity");
+    intmath = false;
+    eval("1 / (-0)", "-Infinity");
+    eval("1 / (-6 % 3)", "-Infinity");
+
+    // int_math is after the fields that came before it
+    assert(offsetof(struct xv_env, no_case) < offsetof(struct xv_env, udata));
+    assert(offsetof(struct xv_env, udata) < offsetof(struct xv_env, ref));
+    assert(offsetof(struct xv_env, ref) < offsetof(struct xv_env, int_math));
+    struct xv_env env = { .ref = eref };
+    assert(!env.int_math);
+    char buf[32];
+    xv_string_copy(xv_eval("howdy", &env), buf, sizeof(buf));
+    assert(strcmp(buf, "hiya") == 0);
+    xv_cleanup();
+}
+
+void test_xv_string_compare(void) {
+    // long strings cover the vectorized and the scalar tail paths
+    const char *a = "'The quick brown fox jumps over the lazy dog, twice!'";
+    const char *b = "'THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG, TWICE!'";
+    const char *c = "'THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG, TWICE?'";
+    char expr[512];
+    nocase = false;
+    snprintf(expr, sizeof(expr), "%s == %s", a, b);
+    eval(expr, "false");
+    snprintf(expr, sizeof(expr), "%s > %s", a, b);
+    eval(expr, "true");
+    snprintf(expr, sizeof(expr), "%s == %s", a, a);
+    eval(expr, "true");
+    snprintf(expr, sizeof(expr), "%s <= %s", a, a);
+    eval(expr, "true");
+    nocase = true;
+    snprintf(expr, sizeof(expr), "%s == %s", a, b);
+    eval(expr, "true");
+    snprintf(expr, sizeof(expr), "%s === %s", a, b);
+    eval(expr, "true");
+    snprintf(expr, sizeof(expr), "%s != %s", a, b);
+    eval(expr, "false");
+    snprintf(expr, sizeof(expr), "%s < %s", a, c);
+    eval(expr, "true");
+    snprintf(expr, sizeof(expr), "%s >= %s", c, a);
+    eval(expr, "true");
+    snprintf(expr, sizeof(expr), "%s > %s", a, b);
+    eval(expr, "false");
+    snprintf(expr, sizeof(expr), "%s <= %s", a, b);
+    eval(expr, "true");
+    eval("'abcdefghijklmnopqrstuvwxyz0123456789' == "
+        "'ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'", "true");
+    eval("'abcdefghijklmnopqrstuvwxyz012345678' == "
+        "'ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'", "false");
+    eval("'@[`{' == '@[`{'", "true");
+    eval("'@' == '`'", "false");
+    eval("'[' < 'a'", "true");
+    eval("'_' < 'A'", "true");
+    eval("'\xC0' == '\xE0'", "false");
+    eval("'' == ''", "true");
+    eval("'' < 'a'", "true");
+    nocase = false;
+    eval("'\xC0' < '\xE0'", "true");
+    eval("'a' < ''", "false");
+    eval("NaN == NaN", "false");
+    eval("NaN <= NaN", "false");
+    eval("NaN >= 1", "false");
+    eval("1 <= 1", "true");
+    eval("2 >= 1", "true");
+    eval("undefined == undefined", "true");
+    eval("null == null", "true");
+    eval("true == true", "true");
+    eval("true == false", "false");
+    eval("1u64 <= 1u64", "true");
+    eval("1i64 >= 2i64", "false");
+}
+
+void test_xv_unicode_case(void) {
+    nocase = false;
+    eval("'\\u00C0' == '\\u00E0'", "false");
+    eval("'Ärger' == 'ärger'", "false");
+    nocase = true;
+    eval("'\\u00C0' == '\\u00E0'", "true");
+    eval("'Ärger' == 'ärger'", "true");
+    eval("'ÄRGER' == 'ärger'", "true");
+    eval("'Ärger' < 'ärgern'", "true");
+    eval("'Ärgern' > 'ärger'", "true");
+    eval("'Straße' == 'STRAẞE'", "true");
+    eval("'ΟΔΥΣΣΕΥΣ' == 'οδυσσευς'", "true");
+    eval("'ΟΔΥΣΣΕΥΣ' == 'οδυσσευς'", "true");
+    eval("'Ωmega' == 'ωMEGA'", "true");
+    eval("'Привет, Мир' == 'привет, мир'", "true");
+    eval("'Āā' == 'āĀ'", "true");
+    eval("'\\u212A' == 'k'", "true");
+    eval("'K' == '\\u212A'", "true");
+    eval("'\\u212Aa' < 'kb'", "true");
+    eval("'µ' == 'μ'", "true");
+    eval("'Ꭰ' == 'ꭰ'", "true");
+    eval("'𐐀' == '𐐨'", "true");
+    eval("'ä' < 'b'", "false");
+    eval("'ä' > 'Z'", "true");
+    eval("'A\xFF' == 'a\xFF'", "true");
+    eval("'A\xFF' == 'a\xFE'", "false");
+    eval("'a\xE2\x84' < 'a\xE2\x84\xAA'", "true");
+    eval("'The quick brown fox jumps over the lazy dög' == "
+        "'THE QUICK BROWN FOX JUMPS OVER THE LAZY DÖG'", "true");
+    eval("'The quick brown fox jumps over the lazy dög' < "
+        "'THE QUICK BROWN FOX JUMPS OVER THE LAZY DÖH'", "true");
+    nocase = false;
+}
+
+void test_xv_string_methods(void) {
+    eval("'hello'.length", "5");
+    eval("''.length", "0");
+    eval("'héllo'.length", "5");
+    eval("'a😀b'.length", "4");
+    eval("json.name.first.length", "5");
+    eval("json.enc.length", "7");
+    eval("'api/v1/users'.startsWith('api/')", "true");
+    eval("'api/v1/users'.startsWith('v1')", "false");
+    eval("'api/v1/users'.startsWith('v1', 4)", "true");
+    eval("'api'.startsWith('api/')", "false");
+    eval("'api/v1/users'.endsWith('users')", "true");
+    eval("'api/v1/users'.endsWith('v1', 6)", "true");
+    eval("'api/v1/users'.endsWith('api/v1/users/')", "false");
+    eval("'googlebot/2.1'.includes('bot')", "true");
+    eval("'googlebot/2.1'.includes('bot', 7)", "false");
+    eval("'googlebot/2.1'.includes('')", "true");
+    eval("'Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)'"
+        ".includes('bot.html')", "true");
+    eval("'Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)'"
+        ".includes('bot.htm!')", "false");
+    eval("'Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)'"
+        ".indexOf('google.com')", "52");
+    eval("'host:8080'.indexOf(':')", "4");
+    eval("'host:8080'.indexOf('8', 6)", "7");
+    eval("'host'.indexOf(':')", "-1");
+    eval("'héllo:x'.indexOf(':')", "5");
+    eval("'a:b:c'.lastIndexOf(':')", "3");
+    eval("'abc'.lastIndexOf('z')", "-1");
+    eval("'abcabc'.lastIndexOf('abc', 2)", "0");
+    eval("'abcabc'.lastIndexOf('abc', 3)", "3");
+    eval("'abcabc'.lastIndexOf('abc', 100)", "3");
+    eval("'abcabc'.lastIndexOf('abc', -5)", "0");
+    eval("'abcabc'.lastIndexOf('c', 1)", "-1");
+    eval("'abcabc'.lastIndexOf('b', NaN)", "4");
+    eval("'abc'.lastIndexOf('', 1)", "1");
+    eval("'ää:ä'.lastIndexOf('ä', 2)", "1");
+    eval("'hello world'.slice(6)", "world");
+    eval("'hello world'.slice(0, 5)", "hello");
+    eval("'hello world'.slice(-5)", "world");
+    eval("'hello world'.slice(-5, -3)", "wo");
+    eval("'hello world'.slice(5, 2)", "");
+    eval("'héllo'.slice(1, 3)", "él");
+    eval("'hello'.substring(3, 1)", "el");
+    eval("'hello'.substring(-3, 2)", "he");
+    eval("'hello'.substring(NaN, 100)", "hello");
+    eval("'Hello WORLD'.toLowerCase()", "hello world");
+    eval("'ÄRGER'.toLowerCase()", "ärger");
+    eval("'hello'.toLowerCase()", "hello");
+    // the lowercase mapping, which isn't the case folding
+    eval("'µς'.toLowerCase()", "µς");
+    eval("'ſϐϑ'.toLowerCase()", "ſϐϑ");
+    eval("'ᏣᎳᎩ'.toLowerCase()", "ꮳꮃꭹ");
+    eval("'ꮳꮃꭹ'.toLowerCase()", "ꮳꮃꭹ");
+    eval("'KΩ'.toLowerCase()", "kω");
+    eval("'İ'.toLowerCase()", "i\xCC\x87");
+    eval("'ΟΔΥΣΣΕΥΣ'.toLowerCase()", "οδυσσευς");
+    eval("'ΑΣ ΣΑ Σ'.toLowerCase()", "ας σα σ");
+    eval("'ΑΣ.'.toLowerCase()", "ας.");
+    eval("'  hi  '.trim()", "hi");
+    eval("'Api/V1'.toLowerCase().startsWith('api/')", "true");
+    eval("json.name.first.startsWith('Ja')", "true");
+    eval("('x' + 'yz').indexOf('z') + 1", "3");
+    eval("'abc'.indexOf(bad)", "ReferenceError: Can't find variable: 'bad'");
+    eval("'abc'.indexOf('b'", "SyntaxError");
+    eval("'abc'.nope", "undefined");
+    eval("'abc'?.length", "3");
+
+    // slice, substring and trim return views without allocating
+    xv_cleanup();
+    struct xv value = xv_eval("'hello world'.slice(6).trim()", NULL);
+    assert(xv_string_compare(value, "world") == 0);
+    assert(xv_memstats().thread_allocs == 0);
+    xv_cleanup();
+}
+
+void test_xv_regex(void) {
+    eval("/bot/.test('Googlebot/2.1')", "true");
+    eval("/bot/.test('Mozilla/5.0')", "false");
+    eval("/bot/i.test('GOOGLEBOT')", "true");
+    eval("/^\\/api\\/v[0-9]+\\//.test('/api/v12/users')", "true");
+    eval("/^\\/api\\/v[0-9]+\\//.test('/web/api/v1/')", "false");
+    eval("/Chrome\\/(\\d+)/.test('Mozilla/5.0 Chrome/118.0')", "true");
+    eval("/\\.(png|jpe?g|gif)$/i.test('/img/cat.JPG')", "true");
+    eval("/\\.(png|jpe?g|gif)$/i.test('/img/cat.jpg.exe')", "false");
+    eval("/a.c/.test('a\\nc')", "false");
+    eval("/a.c/s.test('a\\nc')", "true");
+    eval("/^b/.test('a\\nb')", "false");
+    eval("/^b$/m.test('a\\nb\\nc')", "true");
+    eval("/\\bcat\\b/.test('a cat!')", "true");
+    eval("/\\bcat\\b/.test('concat')", "false");
+    eval("/\\Bcat/.test('concat')", "true");
+    eval("/[^a-z]/.test('abc')", "false");
+    eval("/[^a-z]/.test('abC')", "true");
+    eval("/[\\w-]+@[\\w.]+/.test('joe-bob@ex.com')", "true");
+    eval("/\\s/.test('a\\tb')", "true");
+    eval("/^\\S+$/.test('a b')", "false");
+    eval("/^a{2,3}$/.test('aa')", "true");
+    eval("/^a{2,3}$/.test('aaaa')", "false");
+    eval("/^a{2,}$/.test('aaaaaa')", "true");
+    eval("/^a{,2}$/.test('a{,2}')", "true");
+    eval("/^(ab|cd)*$/.test('abcdab')", "true");
+    eval("/^(ab|cd)*$/.test('abcda')", "false");
+    eval("/^.$/.test('日')", "true");
+    eval("/^\\u65e5\\x41$/.test('日A')", "true");
+    eval("/^\\u{1F600}$/.test('😀')", "true");
+    eval("/straße/i.test('STRASSE')", "false");
+    eval("/ärger/i.test('ÄRGER')", "true");
+    eval("/[à-ö]+/i.test('ÇÉ')", "true");
+    eval("/[k]/i.test('K')", "true");
+    eval("/a|/.test('x')", "true");
+    eval("/$/.test('')", "true");
+
+    // no catastrophic backtracking
+    eval("/(a+)+$/.test('aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa!')", 
+        "false");
+    eval("/^(a|a)*b$/.test('aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaac')", 
+        "false");
+    eval("/(x+x+)+y/.test('xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx')", 
+        "false");
+
+    // literals and division
+    eval("10 / 2 / 5", "1");
+    eval("(10) / 2", "5");
+    eval("1 + /a/.test('a')", "2");
+    eval("!/a/.test('b')", "true");
+    eval("true ? /a:b/.test('a:b') : false", "true");
+    eval("/a,b/.test('a,b') && /x|y/.test('y')", "true");
+    eval("/it's/.test(\"it's\")", "true");
+    eval("/[/]/.test('a/b')", "true");
+    eval("/a/ + ''", "/a/");
+    eval("/a|b/gi.source", "a|b");
+    eval("/a/yigm.flags", "gimy");
+    eval("/a/", "/a/");
+    eval("/a", "SyntaxError");
+    eval("/a(/", "SyntaxError");
+    eval("/a)/", "SyntaxError");
+    eval("/*a/", "SyntaxError");
+    eval("/a**/", "SyntaxError");
+    eval("/a{3,2}/", "SyntaxError");
+    eval("/[b-a]/", "SyntaxError");
+    eval("/(a)\\1/", "SyntaxError");
+    eval("/(?=a)/", "SyntaxError");
+    eval("/a/x", "SyntaxError");
+    eval("/a/gg", "SyntaxError");
+
+    // match, exec and search
+    eval("'Mozilla/5.0 Chrome/118.0'.match(/Chrome\\/(\\d+)/)", "Chrome/118,118");
+    eval("'Mozilla/5.0 Chrome/118.0'.match(/Chrome\\/(\\d+)/)[1]", "118");
+    eval("'Mozilla/5.0'.match(/Chrome/)", "null");
+    eval("'a1b22c333'.match(/\\d+/g)", "1,22,333");
+    eval("'a1b22c333'.match(/\\d+/g).length", "3");
+    eval("'abc'.match(/x*/g).length", "4");
+    eval("'aXbx'.match('x')", "x");
+    eval("'abcd'.match(/(a|ab)(c|bcd)(d*)/)", "abcd,a,bcd,");
+    eval("'aaa'.match(/a+?/)", "a");
+    eval("'ab'.match(/(?<first>a)(x)?/)[2]", "undefined");
+    eval("/(\\d+)-(\\d+)/.exec('call 555-1234 now')", "555-1234,555,1234");
+    eval("/(\\d+)-(\\d+)/.exec('call 555-1234 now')[2]", "1234");
+    eval("'héllo wörld'.search(/w/)", "6");
+    eval("'hello'.search(/z/)", "-1");
+    eval("'a.b'.search('.')", "0");
+    eval("'abc'.match('(')", "SyntaxError");
+    eval("[1,2,3].length", "3");
+    eval("[1,2,3][1]", "2");
+    eval("[1,2,3][3]", "undefined");
+}
+
+void test_xv_regex_chaos(void) {
+    test_xv_regex();
+}
+
+void test_xv_glob(void) {
+    eval("match('/v1/users/orders/7', '/v1/*/orders/?')", "true");
+    eval("match('/v1/users/orders/', '/v1/*/orders/?')", "false");
+    eval("match('/v1/users/orders/77', '/v1/*/orders/?')", "false");
+    eval("match('/v2/users/orders/7', '/v1/*/orders/?')", "false");
+    eval("match('hello', 'hello')", "true");
+    eval("match('hello', 'hell')", "false");
+    eval("match('hello', '*')", "true");
+    eval("match('', '*')", "true");
+    eval("match('', '')", "true");
+    eval("match('', '?')", "false");
+    eval("match('hello', 'h*l*o')", "true");
+    eval("match('hello', 'h*x*o')", "false");
+    eval("match('abcbc', '*bc')", "true");
+    eval("match('abcbcx', '*bc')", "false");
+    eval("match('aaa', 'a*a*a')", "true");
+    eval("match('aa', 'a*a*a')", "false");
+    eval("match('ab', '*?*?*')", "true");
+    eval("match('a', '*?*?*')", "false");
+    eval("match('h\u00e9llo', 'h?llo')", "true");
+    eval("match('\u65e5\u672c\u8a9e', '?\u672c?')", "true");
+    eval("match('a*b', 'a\\\\*b')", "true");
+    eval("match('axb', 'a\\\\*b')", "false");
+    eval("match('a?b', 'a\\\\?b')", "true");
+    eval("match('axb', 'a\\\\?b')", "false");
+    eval("match('HELLO', 'h*o')", "false");
+    eval("matchNoCase('HELLO', 'h*o')", "true");
+    eval("matchNoCase('\u00c9T\u00c9', '\u00e9t?')", "true");
+    eval("match(123, '1*')", "true");
+    eval("match('x')", "false");
+    eval("match('a', '*') && !match('a', 'b')", "true");
+    eval("match('a', '*'", "SyntaxError");
+    nocase = true;
+    eval("match('HELLO', 'h*o')", "true");
+    nocase = false;
+}
+
+void test_xv_glob_chaos(void) {
+    test_xv_glob();
+}
+
+void test_xv_literal_sets(void) {
+    eval("howdy == 'a' || howdy == 'b' || howdy == 'c' || howdy == 'd' || "
+         "howdy == 'e' || howdy == 'f' || howdy == 'g' || howdy == 'hiya'", 
+         "true");
+    eval("howdy == 'a' || howdy == 'b' || howdy == 'c' || howdy == 'd' || "
+         "howdy == 'e' || howdy == 'f' || howdy == 'g' || howdy == 'h'", 
+         "false");
+    eval("'a' == howdy || 'b' == howdy || 'c' == howdy || 'd' == howdy || "
+         "'e' == howdy || 'f' == howdy || 'g' == howdy || 'hiya' == howdy", 
+         "true");
+    eval("howdy === 'a' || howdy === 'b' || howdy === 'c' || howdy === 'd' ||"
+         "howdy === 'e' || howdy === 'f' || howdy === 'g' || howdy === 'hiya'",
+         "true");
+    eval("howdy == 'a' || howdy == 'b' || howdy == 'c' || howdy == 'd' || "
+         "howdy == 'e' || howdy == 'f' || howdy == 'g' || howdy == 'HIYA'", 
+         "false");
+    eval("json.age == 1 || json.age == 2 || json.age == 3 || json.age == 4 ||"
+         "json.age == 5 || json.age == 6 || json.age == 7 || json.age == 37", 
+         "true");
+    eval("json.age == 1 || json.age == 2 || json.age == 3 || json.age == 4 ||"
+         "json.age == 5 || json.age == 6 || json.age == 7 || json.age == '37'",
+         "true");
+    eval("json.age === 1 || json.age === 2 || json.age === 3 || "
+         "json.age === 4 || json.age === 5 || json.age === 6 || "
+         "json.age === 7 || json.age === '37'", "false");
+    eval("json.age == 1 || json.age == 2 || json.age == 3 || json.age == 4 ||"
+         "json.age == 5 || json.age == 6 || json.age == 7 || json.ag == 37",
+         "false");
+    eval("json.age == 1 || json.age == 2 || json.age == 3 || json.age == 4 ||"
+         "json.age == 5 || json.age == 6 || json.age == 7 || json.age == 8 ?"
+         "'yes' : 'no'", "no");
+    eval("nope == 1 || nope == 2 || nope == 3 || nope == 4 || nope == 5 || "
+         "nope == 6 || nope == 7 || nope == 8", 
+         "ReferenceError: Can't find variable: 'nope'");
+    eval("[1,2,3,4,5,6,7,8,37].includes(json.age)", "true");
+    eval("[1,2,3,4,5,6,7,8,9].includes(json.age)", "false");
+    eval("[1,2,3,4,5,6,7,8,9,'37'].includes(json.age)", "false");
+    eval("['a','b','c','d','e','f','g','hiya'].includes(howdy)", "true");
+    eval("['a','b','c','d','e','f','g','hiya'].includes(1)", "false");
+    eval("['a','b','c','d','e','f','g','h'].includes()", "false");
+    eval("[1,2,3,4,5,6,7,8,-0].includes(0)", "true");
+    eval("[1,2,3].includes(2)", "true");
+    eval("[1,2,3].includes('2')", "false");
+    eval("[1,NaN,3].includes(NaN)", "true");
+    eval("[1,2,3,4,5,6,7,8,9].includes(nope)", 
+         "ReferenceError: Can't find variable: 'nope'");
+    eval("howdy == 'a' ? 1 : howdy == 'b' ? 2 : howdy == 'c' ? 3 : "
+         "howdy == 'd' ? 4 : howdy == 'e' ? 5 : howdy == 'f' ? 6 : "
+         "howdy == 'g' ? 7 : howdy == 'hiya' ? 8 : 0", "8");
+    eval("howdy == 'a' ? 1 : howdy == 'b' ? 2 : howdy == 'c' ? 3 : "
+         "howdy == 'd' ? 4 : howdy == 'e' ? 5 : howdy == 'f' ? 6 : "
+         "howdy == 'g' ? 7 : howdy == 'h' ? 8 : 0", "0");
+    eval("howdy == 'a' ? 1 : howdy == 'hiya' ? 2 : howdy == 'c' ? 3 : "
+         "howdy == 'd' ? 4 : howdy == 'e' ? 5 : howdy == 'f' ? 6 : "
+         "howdy == 'g' ? 7 : howdy == 'hiya' ? 8 : 0", "2");
+    eval("json.age == 1 ? 'a' : json.age == 2 ? 'b' : json.age == 3 ? 'c' : "
+         "json.age == 4 ? 'd' : json.age == 5 ? 'e' : json.age == 6 ? 'f' : "
+         "json.age == 7 ? 'g' : json.age == 37 ? json.age + 1 : 'z'", "38");
+    eval("json.age == 1 ? 'a' : json.age == 2 ? 'b' : json.age == 3 ? 'c' : "
+         "json.age == 4 ? 'd' : json.age == 5 ? 'e' : json.age == 6 ? 'f' : "
+         "json.age == 7 ? 'g' : json.age == 8 ? 'h' : "
+         "howdy == 'hiya' ? 'y' : 'n'", "y");
+    eval("json.age == 1 ? 'a' : json.age == 2 ? 'b' : json.age == 3 ? 'c' : "
+         "json.age == 4 ? 'd' : json.age == 5 ? 'e' : json.age == 6 ? 'f' : "
+         "json.age == 7 ? 'g' : json.age == 37 ? (howdy ? 'x:' : 'y') : 'z'",
+         "x:");
+    eval("json.age == 1 ? 'a' : json.age == 2 ? 'b' : json.age == 3 ? 'c' : "
+         "json.age == 4 ? 'd' : json.age == 5 ? 'e' : json.age == 6 ? 'f' : "
+         "json.age == 7 ? 'g' : json.age == 37 ? howdy ? 1 : 2 : 'z'", "1");
+    eval("json.age == 1 ? 'a' : json.age == 2 ? 'b' : json.age == 3 ? 'c' : "
+         "json.age == 4 ? 'd' : json.age == 5 ? 'e' : json.age == 6 ? 'f' : "
+         "json.age == 7 ? 'g' : json.age == 36 ? 'h' :", "SyntaxError");
+    nocase = true;
+    eval("howdy == 'a' || howdy == 'b' || howdy == 'c' || howdy == 'd' || "
+         "howdy == 'e' || howdy == 'f' || howdy == 'g' || howdy == 'HIYA'", 
+         "true");
+    eval("['a','b','c','d','e','f','g','HIYA'].includes(howdy)", "true");
+    nocase = false;
+    intmath = true;
+    eval("json.age === 1 || json.age === 2 || json.age === 3 || "
+         "json.age === 4 || json.age === 5 || json.age === 6 || "
+         "json.age === 7 || json.age === 37", "true");
+    eval("[1,2,3,4,5,6,7,8,37].includes(json.age)", "true");
+    eval("[1,2,3,4,5,6,7,8,37].includes(37.0)", "true");
+    intmath = false;
+
+    // includes is strict, the same with and without a set
+    const char *probes[][3] = {
+        { "1,2,3,4,5,6,7", "'1'", "false" },
+        { "1,2,3,4,5,6,7", "true", "false" },
+        { "1,2,3,4,5,6,7", "1", "true" },
+        { "1,2,3,4,5,6,7", "-0", "false" },
+        { "0,2,3,4,5,6,7", "-0", "true" },
+        { "1,2,3,4,5,6,7", "NaN", "false" },
+        { "'1','2','3','4','5','6','7'", "1", "false" },
+        { "'1','2','3','4','5','6','7'", "'1'", "true" },
+        { "'1','2','3','4','5','6','7'", "json.nope", "false" },
+    };
+    char expr[256];
+    for (size_t i = 0; i < sizeof(probes)/sizeof(probes[0]); i++) {
+        for (int j = 0; j < 2; j++) {
+            intmath = j == 1;
+            snprintf(expr, sizeof(expr), "[%s].includes(%s)", probes[i][0], 
+                probes[i][1]);
+            eval(expr, probes[i][2]);
+            snprintf(expr, sizeof(expr), "[%s,%s].includes(%s)", probes[i][0],
+                probes[i][0][0] == '\'' ? "'8'" : "8", probes[i][1]);
+            eval(expr, probes[i][2]);
+        }
+    }
+    intmath = false;
+    eval("[1,2,3,4,5,6,7].includes(1i64)", "false");
+    eval("[1,2,3,4,5,6,7,8].includes(1i64)", "false");
+    intmath = true;
+    eval("[1,2,3,4,5,6,7].includes(1i64)", "true");
+    eval("[1,2,3,4,5,6,7,8].includes(1i64)", "true");
+    intmath = false;
+
+    // sets that are in use aren't evicted by the sets in the argument, which
+    // are more than the 32 that are cached
+    int nsets = 40;
+    static char big[8192];
+    size_t n = 0;
+    n += (size_t)snprintf(big+n, sizeof(big)-n, 
+        "[1,2,3,4,5,6,7,8,%d].includes(", nsets);
+    for (int i = 0; i < nsets; i++) {
+        n += (size_t)snprintf(big+n, sizeof(big)-n, 
+            "%s[1,2,3,4,5,6,7,8,%d].includes(%d)", i > 0 ? " + " : "", 
+            100+i, 100+i);
+    }
+    snprintf(big+n, sizeof(big)-n, ")");
+    eval(big, "true");
+    // and more sets in use than the cache holds
+    n = 0;
+    for (int i = 0; i < nsets; i++) {
+        n += (size_t)snprintf(big+n, sizeof(big)-n,
+            "[1,2,3,4,5,6,7,%d].includes(", 100+i);
+    }
+    n += (size_t)snprintf(big+n, sizeof(big)-n, "1");
+    for (int i = 0; i < nsets; i++) {
+        n += (size_t)snprintf(big+n, sizeof(big)-n, ") * 1");
+    }
+    eval(big, "1");
+}
+
+void test_xv_literal_sets_chaos(void) {
+    test_xv_literal_sets();
+}
+
+void test_xv_math(void) {
+    eval("Math.abs(-2.5)", "2.5");
+    eval("Math.floor(2.7)", "2");
+    eval("Math.ceil(2.1)", "3");
+    eval("Math.round(2.5)", "3");
+    eval("Math.round(-2.5)", "-2");
+    eval("1/Math.round(-0.2)", "-Infinity");
+    eval("Math.round(0.49999999999999994)", "0");
+    eval("Math.trunc(-1.7)", "-1");
+    eval("Math.sign(-3)", "-1");
+    eval("Math.sqrt(16)", "4");
+    eval("Math.round(Math.cbrt(27) * 1e6) / 1e6", "3");
+    eval("Math.exp(0)", "1");
+    eval("Math.log(Math.E)", "1");
+    eval("Math.log2(8)", "3");
+    eval("Math.log10(1000)", "3");
+    eval("Math.pow(2, 10)", "1024");
+    eval("Math.pow(1, Infinity)", "NaN");
+    eval("Math.pow(2)", "NaN");
+    eval("Math.PI", "3.141592653589793");
+    eval("Math.E", "2.718281828459045");
+    eval("Math.max(1, 5, 3)", "5");
+    eval("Math.min(4, 2, 8)", "2");
+    eval("Math.min(3, '2')", "2");
+    eval("Math.max(1, NaN)", "NaN");
+    eval("Math.max()", "-Infinity");
+    eval("Math.min()", "Infinity");
+    eval("1/Math.max(-0, 0)", "Infinity");
+    eval("1/Math.min(0, -0)", "-Infinity");
+    eval("Math.abs()", "NaN");
+    eval("Math.abs(json.age - 40)", "3");
+    eval("Math.sqrt(16) + Math.floor(2.7) * Math.ceil(1.1)", "8");
+    eval("Math.max(Math.min(json.age, 30), 10)", "30");
+    eval("Math.max(1, nope)", "ReferenceError: Can't find variable: 'nope'");
+    eval("Math.sqrt(", "SyntaxError");
+    eval("Math", "ReferenceError: Can't find variable: 'Math'");
+    eval("Math.nope(1)", "ReferenceError: Can't find variable: 'Math'");
+    intmath = true;
+    eval("Math.max(1, 5, 3)", "5");
+    eval("Math.max(9223372036854775807, 1) === 9223372036854775807", "true");
+    eval("Math.max(1, 5.5)", "5.5");
+    eval("Math.abs(-3)", "3");
+    eval("Math.floor(7)", "7");
+    eval("Math.sign(-7)", "-1");
+    intmath = false;
+}
+
+void test_xv_aggregates(void) {
+    eval("sum([1,2,3])", "6");
+    eval("sum(1,2,3)", "6");
+    eval("sum()", "0");
+    eval("sum([])", "0");
+    eval("sum(5)", "5");
+    eval("sum(['5', 2])", "7");
+    eval("sum([1,2],3)", "NaN");
+    eval("sum([0.1,0.2,0.3])", "0.6000000000000001");
+    eval("min([3,1,-2.5])", "-2.5");
+    eval("max([3,1,2])", "3");
+    eval("min([])", "Infinity");
+    eval("max([1,NaN,3])", "NaN");
+    eval("1/min([0,-0])", "-Infinity");
+    eval("1/max([-0,0])", "Infinity");
+    eval("1/max([-0])", "-Infinity");
+    eval("avg([1,2,3,4])", "2.5");
+    eval("avg([])", "NaN");
+    eval("count([1,2,3])", "3");
+    eval("count(5)", "1");
+    eval("count()", "0");
+    eval("sum(json.data)", "NaN");
+    eval("count(json.data)", "5");
+    eval("sum(json.one)", "15");
+    eval("sum(json.empty)", "0");
+    eval("max(json.one, json.age)", "37");
+    eval("sum('a1b22c333'.match(/\\d+/g))", "356");
+    eval("sum(nope)", "ReferenceError: Can't find variable: 'nope'");
+    eval("sum([1,2", "SyntaxError");
+    eval("sum", "ReferenceError: Can't find variable: 'sum'");
+    intmath = true;
+    eval("sum([1,2,3]) === 6", "true");
+    eval("sum([9223372036854775807, 1])", "9223372036854776000");
+    eval("max([9223372036854775807, 1]) === 9223372036854775807", "true");
+    eval("min([3,1.5])", "1.5");
+    eval("avg([1,2])", "1.5");
+    intmath = false;
+
+    // long runs go through the buffer more than once
+    char expr[8192];
+    size_t n = 0;
+    n += snprintf(expr+n, sizeof(expr)-n, "[");
+    for (int i = 1; i <= 1000; i++) {
+        n += snprintf(expr+n, sizeof(expr)-n, "%s%d", i > 1 ? "," : "", 
+            i == 500 ? -i : i);
+    }
+    snprintf(expr+n, sizeof(expr)-n, "]");
+    char sexpr[8300];
+    snprintf(sexpr, sizeof(sexpr), "sum(%s)", expr);
+    eval(sexpr, "499500");
+    snprintf(sexpr, sizeof(sexpr), "min(%s)", expr);
+    eval(sexpr, "-500");
+    snprintf(sexpr, sizeof(sexpr), "max(%s)", expr);
+    eval(sexpr, "1000");
+    snprintf(sexpr, sizeof(sexpr), "count(%s)", expr);
+    eval(sexpr, "1000");
+}
+
+void test_xv_aggregates_chaos(void) {
+    test_xv_aggregates();
+}
+
+struct xv hostsum(struct xv value, struct xv args, void *udata) {
+    (void)value, (void)args, (void)udata;
+    return xv_new_double(42);
+}
+
+struct xv host_ref(struct xv this, struct xv ident, void *udata) {
+    (void)udata;
+    if (xv_is_global(this)) {
+        if (xv_string_compare(ident, "sum") == 0) {
+            return xv_new_function(hostsum);
+        }
+        if (xv_string_compare(ident, "bucket") == 0) {
+            return xv_new_function(hostsum);
+        }
+        if (xv_string_compare(ident, "Math") == 0) {
+            return xv_new_json("{\"PI\":3}");
+        }
+        if (xv_string_compare(ident, "isIP") == 0) {
+            return xv_new_error("ReferenceError: host");
+        }
+    }
+    return xv_new_undefined();
+}
+
+void test_xv_builtin_host(void) {
+    // names that the host defines win over the built-ins
+    struct { const char *expr, *expect; } cases[] = {
+        { "sum([1,2,3])", "42" },
+        { "bucket('id', 'exp', 5)", "42" },
+        { "Math.PI", "3" },
+        { "isIP('1.2.3.4')", "ReferenceError: host" },
+        { "max([1,2,3])", "3" },
+        { "Math.PI === 3 && count([1,2]) == 2", "true" },
+    };
+    struct xv_env env = { .ref = host_ref };
+    char buf[64];
+    for (size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        xv_string_copy(xv_eval(cases[i].expr, &env), buf, sizeof(buf));
+        if (strcmp(buf, cases[i].expect) != 0) {
+            fprintf(stderr, "%s: expected '%s', got '%s'\n", cases[i].expr,
+                cases[i].expect, buf);
+            exit(1);
+        }
+        xv_cleanup();
+    }
+}
+
+void test_xv_lambdas(void) {
+    eval(("[1,2,30].some(x => x > 10)"), ("true"));
+    eval(("[1,2,3].some(x => x > 10)"), ("false"));
+    eval(("[].some(x => true)"), ("false"));
+    eval(("[1,2,30].every(x => x > 0)"), ("true"));
+    eval(("[1,-2,30].every(x => x > 0)"), ("false"));
+    eval(("[].every(x => false)"), ("true"));
+    eval(("[1,2,30].filter(x => x > 1)"), ("2,30"));
+    eval(("[1,2,30].filter(x => x > 1).length"), ("2"));
+    eval(("[1,2,3].map(x => x * 2)"), ("2,4,6"));
+    eval(("[1,2,3].map((x, i) => x * i)"), ("0,2,6"));
+    eval(("[1,2].map(() => 7)"), ("7,7"));
+    eval(("[1,2,3].find(x => x > 1)"), ("2"));
+    eval(("[1,2,3].find(x => x > 5)"), ("undefined"));
+    eval(("[1,2,3].reduce((acc, x) => acc + x)"), ("6"));
+    eval(("[1,2,3].reduce((acc, x) => acc + x, 10)"), ("16"));
+    eval(("[1,2,3].reduce((acc, x, i) => acc + i, '')"), ("012"));
+    eval(("[].reduce((acc, x) => acc + x, 5)"), ("5"));
+    eval(("[].reduce((acc, x) => acc + x)"), 
+        ("TypeError: Reduce of empty array with no initial value"));
+    eval(("[1,2,3].map(x => x > 1 ? 'a' : 'b')"), ("b,a,a"));
+    eval(("[1,2,3].filter(x => x != 2).map(x => x * 10)"), ("10,30"));
+    eval(("[[1,2],[3]].map(a => a.some(y => y > 2))"), ("false,true"));
+    eval(("[1,2].map(x => [3,4].map(y => x * y))"), ("3,4,6,8"));
+    eval(("[1,2].map(x => Math.max(x, 2))"), ("2,2"));
+    eval(("[1,2].map(x => sum([x, x, 1]))"), ("3,5"));
+    eval(("[1,2].map(x => x == 1 || x == 3)"), ("true,false"));
+    eval(("['a','b'].find(x => x == howdy.slice(1, 2))"), ("undefined"));
+    eval(("['i','b'].find(x => x == howdy.slice(1, 2))"), ("i"));
+    // early stop
+    eval(("[1,2,3].some(x => x == 1 ? true : nope)"), ("true"));
+    eval(("[1,2,3].some(x => x == 2 ? true : nope)"), 
+        ("ReferenceError: Can't find variable: 'nope'"));
+    eval(("[0,1,2].every(x => x > 0 ? nope : false)"), ("false"));
+    eval(("[1,2,3].find(x => x == 1 ? true : nope)"), ("1"));
+    // parameters are local to the body
+    eval(("[1,2].some(x => x > 1) && x"), 
+        ("ReferenceError: Can't find variable: 'x'"));
+    eval(("[1].map(howdy => howdy + 1)"), ("2"));
+    eval(("[1].map(x => howdy)"), ("hiya"));
+    // JSON arrays
+    eval(("json.data.some(x => x === null)"), ("true"));
+    eval(("json.data.find(x => x.a == 1).a"), ("1"));
+    eval(("json.data.filter(x => x === true || x === false).length"), ("2"));
+    eval(("json.one.map(x => x + 1)"), ("16"));
+    eval(("json.one.includes(15)"), ("true"));
+    eval(("json.empty.every(x => false)"), ("true"));
+    eval(("json.name.some(x => true)"), 
+        ("TypeError: some is not a function"));
+    // not a function
+    eval(("[1,2].some(5)"), ("TypeError: 5 is not a function"));
+    eval(("[1,2].some()"), ("TypeError: undefined is not a function"));
+    eval(("[1,2].map(x => )"), ("SyntaxError"));
+    eval(("[1,2].map(x => x"), ("SyntaxError"));
+    eval(("[1,2].map((x, y, z, w) => x)"), 
+        ("TypeError: (x, y, z, w) => x is not a function"));
+}
+
+void test_xv_lambdas_chaos(void) {
+    test_xv_lambdas();
+}
+
+void test_xv_hash(void) {
+    // hashes must not change across versions or platforms
+    eval(("hash64('')"), ("10602188539874428322"));
+    eval(("hash64('Janet')"), ("13522917302022154978"));
+    eval(("hash64('hello world!', 7)"), ("7128582554997707708"));
+    eval(("hash64('abcdefghijklmnopqrstuvwxyz0123456789"
+        "abcdefghijklmnopqrstuvwxyz', 'salt')"), ("14385251942527065538"));
+    eval(("bucket('Janet', 'exp42', 100)"), ("8"));
+    eval(("bucket(37, 'exp42', 1000)"), ("536"));
+    eval(("hash64(json.name.first) == hash64('Janet')"), ("true"));
+    eval(("hash64(json.enc) == hash64('Big\\nBot')"), ("true"));
+    eval(("hash64(json.age) == hash64('37')"), ("true"));
+    eval(("hash64(37) == hash64('37')"), ("true"));
+    eval(("hash64('a', 1) == hash64('a', 1.0)"), ("true"));
+    eval(("hash64('a', 1) == hash64('a', 2)"), ("false"));
+    eval(("hash64('a', 's') == hash64('a', 't')"), ("false"));
+    eval(("bucket('Janet', 'exp42', 1)"), ("0"));
+    eval(("bucket('Janet', 'exp42', 0)"), ("NaN"));
+    eval(("bucket('Janet', 'exp42')"), ("NaN"));
+    eval(("bucket('Janet', 'exp42', -5)"), ("NaN"));
+    eval(("bucket(nope, 'exp42', 10)"), 
+        ("ReferenceError: Can't find variable: 'nope'"));
+    char expr[2048];
+    char *p = expr;
+    p += sprintf(p, "[");
+    for (int i = 0; i < 200; i++) {
+        p += sprintf(p, "%s%d", i == 0 ? "" : ",", i);
+    }
+    sprintf(p, "].map(x => bucket(x, 'exp', 10))");
+    char sexpr[2200];
+    snprintf(sexpr, sizeof(sexpr), "%s.every(b => b >= 0 && b < 10)", expr);
+    eval(sexpr, "true");
+    snprintf(sexpr, sizeof(sexpr), 
+        "Math.abs(%s.filter(b => b == 3).length - 20) < 12", expr);
+    eval(sexpr, "true");
+    intmath = true;
+    eval(("bucket('Janet', 'exp42', 100)"), ("8"));
+    eval(("hash64('a', 1) == hash64('a', 1u64)"), ("true"));
+    intmath = false;
+
+    // negative seeds are the same with and without int_math
+    for (int i = 0; i < 2; i++) {
+        intmath = i == 1;
+        eval(("hash64('a', -1)"), ("14704993645724172688"));
+        eval(("hash64('a', -1i64)"), ("14704993645724172688"));
+        eval(("hash64('a', 18446744073709551615u64)"), 
+            ("14704993645724172688"));
+        eval(("hash64('a', 0)"), ("12460635889546412024"));
+        eval(("hash64('a', -0)"), ("12460635889546412024"));
+        eval(("hash64('a', -1) == hash64('a', -7)"), ("false"));
+        eval(("hash64('a', 1.5) == hash64('a', 1)"), ("false"));
+        eval(("bucket('id', -5, 100) == bucket('id', -5i64, 100)"), ("true"));
+    }
+    intmath = false;
+}
+
+void test_xv_hash_chaos(void) {
+    test_xv_hash();
+}
+
+void test_xv_dates(void) {
+    eval(("Date.parse('2026-01-01')"), ("1767225600000"));
+    eval(("Date.parse('2026-01-01T00:00:00Z')"), ("1767225600000"));
+    eval(("Date.parse('2026-01-01t00:00:00z')"), ("1767225600000"));
+    eval(("Date.parse('2026-01-01T10:00')"), ("1767261600000"));
+    eval(("Date.parse('2026-01-01T08:30:00.250+02:00')"), ("1767249000250"));
+    eval(("Date.parse('2026-01-01 08:30:00.25-0130')"), ("1767261600250"));
+    eval(("Date.parse('2026-01-01T00:00:00.123456Z')"), ("1767225600123"));
+    eval(("Date.parse('1969-12-31T23:59:59.999Z')"), ("-1"));
+    eval(("Date.parse('1970-01-01T00:00:00Z')"), ("0"));
+    eval(("Date.parse('0001-01-01')"), ("-62135596800000"));
+    eval(("Date.parse('2024-02-29')"), ("1709164800000"));
+    eval(("Date.parse('2000-02-29') > 0"), ("true"));
+    eval(("Date.parse('1900-02-29')"), ("NaN"));
+    eval(("Date.parse('2023-02-29')"), ("NaN"));
+    eval(("Date.parse('2026-04-31')"), ("NaN"));
+    eval(("Date.parse('2026-13-01')"), ("NaN"));
+    eval(("Date.parse('2026-1-01')"), ("NaN"));
+    eval(("Date.parse('2026-01-01T24:00Z')"), ("NaN"));
+    eval(("Date.parse('2026-01-01T10:60Z')"), ("NaN"));
+    eval(("Date.parse('2026-01-01T10:00:00.Z')"), ("NaN"));
+    eval(("Date.parse('2026-01-01T10:00Zx')"), ("NaN"));
+    eval(("Date.parse('2026-01-01T10:00+2')"), ("NaN"));
+    eval(("Date.parse('2026-01-01T')"), ("NaN"));
+    eval(("Date.parse('')"), ("NaN"));
+    eval(("Date.parse(20260101)"), ("NaN"));
+    eval(("Date.parse()"), ("NaN"));
+    eval(("Date.parse(nope)"), ("ReferenceError: Can't find variable: 'nope'"));
+    eval(("Date.now() > Date.parse('2026-01-01')"), ("true"));
+    eval(("Date.now() - Date.now() <= 1s"), ("true"));
+    eval(("Date.nope"), ("ReferenceError: Can't find variable: 'Date'"));
+    eval(("Date.parse('2026-01-02') - Date.parse('2026-01-01') == 1d"), 
+        ("true"));
+    eval(("Date.parse('2026-01-01T10:00:00+01:00') == "
+          "Date.parse('2026-01-01T09:00Z')"), ("true"));
+    eval(("500ms"), ("500"));
+    eval(("30s"), ("30000"));
+    eval(("15m"), ("900000"));
+    eval(("1.5h"), ("5400000"));
+    eval(("7d"), ("604800000"));
+    eval(("-2d"), ("-172800000"));
+    eval(("1h - 30m == 1800s"), ("true"));
+    eval(("5x"), ("SyntaxError"));
+    eval(("5sm"), ("SyntaxError"));
+    eval(("5 s"), ("SyntaxError"));
+    intmath = true;
+    eval(("Date.parse('2026-01-01T08:30:00.250+02:00')"), ("1767249000250"));
+    eval(("7d"), ("604800000"));
+    eval(("1.5h"), ("5400000"));
+    eval(("9223372036854775807d"), ("7.968993439842526e+26"));
+    intmath = false;
+}
+
+void test_xv_ip(void) {
+    eval(("isIP('1.2.3.4')"), ("4"));
+    eval(("isIP('255.255.255.255')"), ("4"));
+    eval(("isIP('01.2.3.4')"), ("0"));
+    eval(("isIP('256.1.1.1')"), ("0"));
+    eval(("isIP('1.2.3')"), ("0"));
+    eval(("isIP('1.2.3.4.5')"), ("0"));
+    eval(("isIP('::')"), ("6"));
+    eval(("isIP('::1')"), ("6"));
+    eval(("isIP('2001:db8::1')"), ("6"));
+    eval(("isIP('2001:DB8:0:0:0:0:0:1')"), ("6"));
+    eval(("isIP('64:ff9b::1.2.3.4')"), ("6"));
+    eval(("isIP('::ffff:1.2.3.4')"), ("4"));
+    eval(("isIP('1:2:3:4:5:6:7::')"), ("6"));
+    eval(("isIP('1:2:3:4:5:6:7:8:9')"), ("0"));
+    eval(("isIP('1:2:3:4:5:6:7:8::')"), ("0"));
+    eval(("isIP('1::2::3')"), ("0"));
+    eval(("isIP(':1')"), ("0"));
+    eval(("isIP('1:')"), ("0"));
+    eval(("isIP('12345::')"), ("0"));
+    eval(("isIP('fe80::1%eth0')"), ("0"));
+    eval(("isIP('')"), ("0"));
+    eval(("isIP(1234)"), ("0"));
+    eval(("cidrMatch('10.1.2.3', '10.0.0.0/8')"), ("true"));
+    eval(("cidrMatch('11.1.2.3', '10.0.0.0/8')"), ("false"));
+    eval(("cidrMatch('10.1.3.255', ['192.168.0.0/16', '10.1.2.0/23'])"), 
+        ("true"));
+    eval(("cidrMatch('10.1.4.0', ['192.168.0.0/16', '10.1.2.0/23'])"), 
+        ("false"));
+    eval(("cidrMatch('10.1.2.3', ['10.1.2.3/23'])"), ("true"));
+    eval(("cidrMatch('1.2.3.4', ['1.2.3.4'])"), ("true"));
+    eval(("cidrMatch('1.2.3.5', ['1.2.3.4'])"), ("false"));
+    eval(("cidrMatch('1.2.3.4', ['0.0.0.0/0'])"), ("true"));
+    eval(("cidrMatch('::1', ['0.0.0.0/0'])"), ("false"));
+    eval(("cidrMatch('::1', ['::/0'])"), ("true"));
+    eval(("cidrMatch('2001:db8:ffff::5', ['2001:db8::/32'])"), ("true"));
+    eval(("cidrMatch('2001:db9::5', ['2001:db8::/32'])"), ("false"));
+    eval(("cidrMatch('::ffff:10.0.0.1', ['10.0.0.0/8'])"), ("true"));
+    eval(("cidrMatch('10.0.0.1', ['::ffff:10.0.0.0/104'])"), ("true"));
+    eval(("cidrMatch('1.2.3.4', ['1.2.3.0/24',])"), ("SyntaxError"));
+    eval(("cidrMatch('1.2.3.4', [])"), ("false"));
+    eval(("cidrMatch('x', ['1.0.0.0/8'])"), ("false"));
+    eval(("cidrMatch(1, ['1.0.0.0/8'])"), ("false"));
+    eval(("cidrMatch('1.2.3.4', ['1.2.3.0/33'])"), 
+        ("TypeError: Invalid CIDR block"));
+    eval(("cidrMatch('1.2.3.4', ['1.2.3.0/024'])"), 
+        ("TypeError: Invalid CIDR block"));
+    eval(("cidrMatch('1.2.3.4', ['bad'])"), ("TypeError: Invalid CIDR block"));
+    eval(("cidrMatch('1.2.3.4', 'bad')"), ("TypeError: Invalid CIDR block"));
+    eval(("cidrMatch('1.2.3.4', [1])"), ("TypeError: Invalid CIDR block"));
+    eval(("cidrMatch('1.2.3.4')"), ("TypeError: Invalid CIDR block"));
+    eval(("cidrMatch('1.2.3.4', [nope])"), 
+        ("ReferenceError: Can't find variable: 'nope'"));
+    eval(("cidrMatch(nope, ['1.0.0.0/8'])"), 
+        ("ReferenceError: Can't find variable: 'nope'"));
+    eval(("cidrMatch('1.2.3.4', ['1.0.0.0/8'], 'x')"), ("true"));
+    eval(("cidrMatch('1.2.3.4', ['1.0.0.0/8'"), ("SyntaxError"));
+    // lists that are not literals
+    eval(("cidrMatch('1.2.3.4', ['1.0.0.0/8'].map(x => x))"), ("true"));
+    eval(("cidrMatch('1.2.3.4', [howdy])"), ("TypeError: Invalid CIDR block"));
+    eval(("cidrMatch('10.9.8.7', json.nets)"), ("true"));
+    eval(("cidrMatch('192.168.1.77', json.nets)"), ("true"));
+    eval(("cidrMatch('192.168.2.77', json.nets)"), ("false"));
+    eval(("cidrMatch('2001:db8::77', json.nets)"), ("true"));
+    eval(("cidrMatch('::1', json.nets)"), ("true"));
+    eval(("cidrMatch('::2', json.nets)"), ("false"));
+    eval(("cidrMatch('1.2.3.4', json.data)"), 
+        ("TypeError: Invalid CIDR block"));
+    eval(("cidrMatch(json.nets[0].slice(0, 8), json.nets[0])"), ("true"));
+    // results inside of arrays
+    eval(("[5, cidrMatch('1.2.3.4', '1.0.0.0/8')]"), ("5,true"));
+    eval(("[5, [1,2].reduce((a, x) => a + x, 10)]"), ("5,13"));
+}
+
+void test_xv_ip_chaos(void) {
+    test_xv_ip();
+}
+
+void test_xv_ip_large(void) {
+    char expr[65536];
+    char *p = expr;
+    p += sprintf(p, "cidrMatch(ip, [");
+    for (int i = 0; i < 2000; i++) {
+        p += sprintf(p, "%s'10.%d.%d.0/24'", i == 0 ? "" : ",", i/256, 
+            i%256);
+    }
+    sprintf(p, "])");
+    const char *ips[][2] = {
+        { "'10.0.0.9'", "true" }, { "'10.7.207.1'", "true" },
+        { "'10.7.208.1'", "false" }, { "'10.3.128.255'", "true" }, 
+        { "'10.8.0.0'", "false" }, { "'9.0.0.0'", "false" },
+        { "'::ffff:10.1.1.1'", "true" }, { "'::10.1.1.1'", "false" },
+    };
+    char sexpr[65600];
+    for (size_t i = 0; i < sizeof(ips)/sizeof(ips[0]); i++) {
+        snprintf(sexpr, sizeof(sexpr), "cidrMatch(%s%s", ips[i][0], 
+            expr+strlen("cidrMatch(ip"));
+        eval(sexpr, ips[i][1]);
+    }
+}
+
+void test_xv_geo(void) {
+    eval(("Math.round(Geo.distance(48.8647, 2.3490, 33.4255, -111.9412))"), 
+        ("8795951"));
+    eval(("Geo.distance(1, 1, 1, 1)"), ("0"));
+    eval(("Math.round(Geo.distance(0, 0, 0, 180))"), ("20015087"));
+    eval(("Geo.distance(1, 2)"), ("NaN"));
+    eval(("Geo.distance(1, 2, 3, 'x')"), ("NaN"));
+    eval(("Geo.distance(1, 2, 3, nope)"), 
+        ("ReferenceError: Can't find variable: 'nope'"));
+    eval(("Geo.withinBBox(10, 20, 0, 0, 20, 30)"), ("true"));
+    eval(("Geo.withinBBox(0, 0, 0, 0, 20, 30)"), ("true"));
+    eval(("Geo.withinBBox(10, 40, 0, 0, 20, 30)"), ("false"));
+    eval(("Geo.withinBBox(-1, 20, 0, 0, 20, 30)"), ("false"));
+    eval(("Geo.withinBBox(10, 179, 0, 170, 20, -170)"), ("true"));
+    eval(("Geo.withinBBox(10, -175, 0, 170, 20, -170)"), ("true"));
+    eval(("Geo.withinBBox(10, 0, 0, 170, 20, -170)"), ("false"));
+    eval(("Geo.withinBBox(10, 20, 0, 0, 20)"), ("false"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,2],[2,2],[2,0]])"), ("true"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,2],[2,2],[2,0],[0,0]])"), 
+        ("true"));
+    eval(("Geo.withinPolygon(3, 1, [[0,0],[0,2],[2,2],[2,0]])"), ("false"));
+    eval(("Geo.withinPolygon(1, 1.5, [[0,0],[2,1],[0,2]])"), ("false"));
+    eval(("Geo.withinPolygon(1, 0.5, [[0,0],[2,1],[0,2]])"), ("true"));
+    eval(("Geo.withinPolygon(-1.5e0, 1, [[-2,0],[-2,2],[-1,2],[-1,0]])"), 
+        ("true"));
+    eval(("Geo.withinPolygon(1, 1, [[[0,0],[0,4],[4,4],[4,0]],"
+          "[[0.5,0.5],[0.5,1.5],[1.5,1.5],[1.5,0.5]]])"), ("false"));
+    eval(("Geo.withinPolygon(3, 3, [[[0,0],[0,4],[4,4],[4,0]],"
+          "[[0.5,0.5],[0.5,1.5],[1.5,1.5],[1.5,0.5]]])"), ("true"));
+    eval(("Geo.withinPolygon(1, 1, json.zone)"), ("true"));
+    eval(("Geo.withinPolygon(1, 3, json.zone)"), ("false"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,2],[2,2],[2,0]].map(p => p))"), 
+        ("true"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,2],[json.age/18.5,2]])"), ("true"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,2],[2,json.age]])"), ("false"));
+    eval(("Geo.withinPolygon(nope, 1, json.zone)"), 
+        ("ReferenceError: Can't find variable: 'nope'"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,nope],[2,2]])"), 
+        ("ReferenceError: Can't find variable: 'nope'"));
+    eval(("Geo.withinPolygon('x', 1, json.zone)"), ("false"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,2]])"), 
+        ("TypeError: Invalid polygon"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,2],['a',1]])"), 
+        ("TypeError: Invalid polygon"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,2],[1,1,1]])"), 
+        ("TypeError: Invalid polygon"));
+    eval(("Geo.withinPolygon(1, 1, 5)"), ("TypeError: Invalid polygon"));
+    eval(("Geo.withinPolygon(1, 1, json.data)"), 
+        ("TypeError: Invalid polygon"));
+    eval(("Geo.withinPolygon(1, 1)"), ("TypeError: Invalid polygon"));
+    eval(("Geo.withinPolygon(1, 1, [[0,0],[0,2],[2,2]]"), ("SyntaxError"));
+    eval(("[7, Geo.withinPolygon(1, 1, json.zone)]"), ("7,true"));
+    eval(("Geo.nope"), ("ReferenceError: Can't find variable: 'Geo'"));
+}
+
+void test_xv_geo_chaos(void) {
+    test_xv_geo();
+}
+
+void test_xv_geo_large(void) {
+    // a square with 4000 vertices
+    char expr[131072];
+    char *p = expr;
+    p += sprintf(p, "Geo.withinPolygon(lat, lon, [");
+    for (int i = 0; i < 4000; i++) {
+        double lat = i < 1000 ? i/100.0 : i < 2000 ? 10 : 
+            i < 3000 ? 10-(i-2000)/100.0 : 0;
+        double lon = i < 1000 ? 0 : i < 2000 ? (i-1000)/100.0 : 
+            i < 3000 ? 10 : 10-(i-3000)/100.0;
+        p += sprintf(p, "%s[%g,%g]", i == 0 ? "" : ",", lat, lon);
+    }
+    sprintf(p, "])");
+    const char *pts[][2] = {
+        { "5, 5", "true" }, { "0.005, 9.995", "true" }, 
+        { "10.5, 5", "false" }, { "5, -0.001", "false" }, 
+        { "9.999, 0.001", "true" },
+    };
+    char sexpr[131200];
+    for (size_t i = 0; i < sizeof(pts)/sizeof(pts[0]); i++) {
+        snprintf(sexpr, sizeof(sexpr), "Geo.withinPolygon(%s%s", pts[i][0], 
+            expr+strlen("Geo.withinPolygon(lat, lon"));
+        eval(sexpr, pts[i][1]);
+    }
+}
+
+void test_xv_objects(void) {
+    eval(("{a: 1, b: 'x'}"), ("{\"a\":1,\"b\":\"x\"}"));
+    eval(("{}"), ("{}"));
+    eval(("{ }"), ("{}"));
+    eval(("{a: 1, b: 'x'}.b"), ("x"));
+    eval(("{a: 1, b: 'x'}['a']"), ("1"));
+    eval(("{a: 1}.nope"), ("undefined"));
+    eval(("{a: {b: {c: 5}}}.a.b.c"), ("5"));
+    eval(("{score: json.age/10, reason: 'age'}"), 
+        ("{\"score\":3.7,\"reason\":\"age\"}"));
+    eval(("{'a b': 1, \"c\": 2, 007: 3, [1+1]: 4}"), 
+        ("{\"a b\":1,\"c\":2,\"7\":3,\"2\":4}"));
+    eval(("{a: 1, b: 2, a: 3}"), ("{\"a\":3,\"b\":2}"));
+    eval(("{if: 1}.if"), ("1"));
+    eval(("{json}.json.age"), ("37"));
+    eval(("{s: 'a\"b\\\\\\n'}"), ("{\"s\":\"a\\\"b\\\\\\n\"}"));
+    eval(("{a: [1, 'q', {d: null}], b: true}"), 
+        ("{\"a\":[1,\"q\",{\"d\":null}],\"b\":true}"));
+    eval(("{x: undefined, y: 1/0, z: 0/0, f: howdy.myfn1}"), 
+        ("{\"y\":null,\"z\":null}"));
+    eval(("{a: json.data}"), ("{\"a\":[1,true,false,null,{\"a\":1}]}"));
+    eval(("{a: [1,2,3].map(x => x*2)}.a[1]"), ("4"));
+    eval(("[1,2].map(x => ({v: x})).find(o => o.v == 2).v"), ("2"));
+    eval(("[7, {a: 1}]"), ("7,{\"a\":1}"));
+    eval(("[7, ({a: 1}).a]"), ("7,1"));
+    eval(("[7, [1,2][1]]"), ("7,2"));
+    eval(("true ? {a: 1} : {b: 2}"), ("{\"a\":1}"));
+    eval(("!{}"), ("false"));
+    eval(("hash64({a: 1}) == hash64('{\"a\":1}')"), ("true"));
+    eval(("{a: nope}"), ("ReferenceError: Can't find variable: 'nope'"));
+    eval(("{a: 1,}"), ("SyntaxError"));
+    eval(("{a: 1,, b: 2}"), ("SyntaxError"));
+    eval(("{a 1}"), ("SyntaxError"));
+    eval(("{a:}"), ("SyntaxError"));
+    eval(("{: 1}"), ("SyntaxError"));
+    eval(("{...a}"), ("SyntaxError"));
+    eval(("{1.5: 2}"), ("SyntaxError"));
+    eval(("{a: 1"), ("SyntaxError"));
+
+    // a map that fits the thread arena is a single allocation
+    xv_cleanup();
+    struct xv value = xv_eval("{score: 3, reason: 'ok'}", NULL);
+    char str[64];
+    xv_string_copy(value, str, sizeof(str));
+    assert(strcmp(str, "{\"score\":3,\"reason\":\"ok\"}") == 0);
+    assert(xv_type(value) == XV_OBJECT);
+    assert(xv_memstats().thread_allocs == 1);
+    assert(xv_memstats().heap_allocs == 0);
+    xv_cleanup();
+}
+
+void test_xv_objects_chaos(void) {
+    test_xv_objects();
+}
+
+void test_xv_typed_arrays(void) {
+    for (int i = 0; i < 1003; i++) {
+        embed[i] = (i%7)-3 + (i%2)*0.5;
+    }
+    eval(("f64s"), ("1.5,-2,0.25,4"));
+    eval(("f64s.length"), ("4"));
+    eval(("f64s[2]"), ("0.25"));
+    eval(("f64s[3] * 2"), ("8"));
+    eval(("f64s[4]"), ("undefined"));
+    eval(("f32s[0] + f32s[2]"), ("1.75"));
+    eval(("i64s[0]"), ("9007199254740992"));
+    eval(("i32s"), ("7,-1,0,5,2"));
+    eval(("empty.length"), ("0"));
+    eval(("empty * 1"), ("0"));
+    eval(("sum(f64s)"), ("3.75"));
+    eval(("min(f64s)"), ("-2"));
+    eval(("max(f64s)"), ("4"));
+    eval(("avg(f64s)"), ("0.9375"));
+    eval(("count(f64s)"), ("4"));
+    eval(("sum(f32s)"), ("-0.25"));
+    eval(("sum(i64s)"), ("9007199254740992"));
+    eval(("sum(i32s)"), ("13"));
+    eval(("min(i32s)"), ("-1"));
+    eval(("max(empty)"), ("-Infinity"));
+    eval(("sum(embed)"), ("245.5"));
+    eval(("min(embed) + max(embed)"), ("0.5"));
+    eval(("dot(f64s, f64s)"), ("22.3125"));
+    eval(("dot(f64s, [1, 1, 1, 1])"), ("3.75"));
+    eval(("dot([1, 2, 3], json.data)"), ("NaN"));
+    eval(("dot([1, 2, 3], [4, 5, 6])"), ("32"));
+    eval(("dot(i32s, [1, 0, 0, 0, 1])"), ("9"));
+    eval(("dot(f64s, f32s)"), ("NaN"));
+    eval(("dot(f64s)"), ("NaN"));
+    eval(("dot(embed, embed) == sum(embed.map(x => x*x))"), ("true"));
+    eval(("f64s.some(x => x > 3)"), ("true"));
+    eval(("f64s.filter(x => x > 0)"), ("1.5,0.25,4"));
+    eval(("f64s.includes(0.25)"), ("true"));
+    eval(("{v: f64s, n: i64s}"), 
+        ("{\"v\":[1.5,-2,0.25,4],\"n\":[9007199254740993,-2,3]}"));
+    intmath = true;
+    eval(("i64s[0]"), ("9007199254740993"));
+    eval(("sum(i64s)"), ("9007199254740994"));
+    eval(("min(i32s)"), ("-1"));
+    eval(("sum(f64s)"), ("3.75"));
+    intmath = false;
+
+    struct xv arr = xv_new_typed_array(i32s, 5, XV_INT32);
+    assert(xv_array_length(arr) == 5);
+    assert(xv_int64(xv_array_at(arr, 3)) == 5);
+    assert(xv_is_undefined(xv_array_at(arr, 5)));
+    assert(xv_is_undefined(xv_new_typed_array(NULL, 1, XV_FLOAT64)));
+    assert(xv_is_undefined(xv_new_typed_array(f64s, 4, XV_UTF8)));
+    assert(xv_is_undefined(xv_new_typed_array(f64s, (size_t)1<<48, 
+        XV_FLOAT64)));
+    arr = xv_new_typed_array(f64s, ((size_t)1<<48)-1, XV_FLOAT64);
+    assert(xv_array_length(arr) == ((size_t)1<<48)-1);
+}
+
+struct each_results {
+    char str[256];
+    size_t len;
+    int count;
+};
+
+static void each_collect(struct xv value, void *udata) {
+    struct each_results *res = udata;
+    if (res->count > 0 && res->len < sizeof(res->str)-1) {
+        res->str[res->len++] = '|';
+    }
+    res->len += xv_string_copy(value, res->str+res->len, 
+        sizeof(res->str)-res->len);
+    res->count++;
+}
+
+static void each_count(struct xv value, void *udata) {
+    struct each_results *res = udata;
+    char str[32];
+    snprintf(str, sizeof(str), "item-%d", res->count);
+    assert(xv_string_compare(value, str) == 0);
+    res->count++;
+}
+
+#define eval_each(input, expect, expect_err) { \
+    struct each_results res = { 0 }; \
+    struct xv_env env = { .ref = eref }; \
+    struct xv err = xv_eval_each((input), strlen(input), &env, each_collect, \
+        &res); \
+    char str[256]; \
+    xv_string_copy(err, str, sizeof(str)); \
+    if (strcmp(res.str, (expect)) != 0 || strcmp(str, (expect_err)) != 0) { \
+        fprintf(stderr, "line %d: expected '%s' '%s', got '%s' '%s'\n", \
+            __LINE__, (expect), (expect_err), res.str, str); \
+        exit(1); \
+    } \
+    xv_cleanup(); \
+}
+
+void test_xv_eval_each(void) {
+    eval_each("1, 'a' + 'b', json.age", "1|ab|37", "undefined");
+    eval_each("7", "7", "undefined");
+    eval_each("", "", "undefined");
+    eval_each("[1, 2], {a: 1}", "1,2|{\"a\":1}", "undefined");
+    eval_each("1, true ? 2 : 3, (4, 5)", "1|2|5", "undefined");
+    eval_each("1, sum(2, 3), 4", "1|5|4", "undefined");
+    eval_each("1, nope, 3", "1", "ReferenceError: Can't find variable: 'nope'");
+    eval_each("1, 2,", "1|2", "SyntaxError");
+
+    // memory stays flat however many results there are
+    char *expr = xmalloc(65536);
+    size_t len = 0;
+    for (int i = 0; i < 2000; i++) {
+        len += (size_t)sprintf(expr+len, "%s'item-' + %d", i ? ", " : "", i);
+    }
+    struct each_results res = { 0 };
+    struct xv err = xv_eval_each(expr, len, NULL, each_count, &res);
+    assert(xv_is_undefined(err));
+    assert(res.count == 2000);
+    assert(xv_memstats().heap_allocs == 0);
+    assert(xv_memstats().thread_size == 0);
+    xv_cleanup();
+    xfree(expr);
+}
+
+void test_xv_value_keys(void) {
+    struct xv one = xv_new_double(1);
+    struct xv one_s = xv_new_string("1");
+    struct xv one_i = xv_new_int64(1);
+    struct xv nan = xv_new_double(NAN);
+    assert(xv_equals(one, one_s, false));
+    assert(!xv_equals(one, one_s, true));
+    assert(xv_equals(one, one_i, false));
+    assert(!xv_equals(one, one_i, true));
+    assert(xv_equals(xv_new_string("abc"), xv_new_string("abc"), true));
+    assert(!xv_equals(xv_new_string("abc"), xv_new_string("ABC"), false));
+    assert(xv_equals(xv_new_double(0), xv_new_double(-0.0), true));
+    assert(!xv_equals(nan, nan, false));
+    assert(xv_equals(xv_new_null(), xv_new_null(), true));
+    assert(!xv_equals(xv_new_null(), xv_new_boolean(false), true));
+
+    assert(xv_compare(one, xv_new_double(2)) == -1);
+    assert(xv_compare(xv_new_double(2), one_s) == 1);
+    assert(xv_compare(one, one_s) == 0);
+    assert(xv_compare(xv_new_string("2"), xv_new_string("10")) == 1);
+    assert(xv_compare(xv_new_double(2), xv_new_string("10")) == -1);
+    assert(xv_compare(one, nan) == 2);
+    assert(xv_compare(xv_new_string("a"), one) == 2);
+
+    assert(xv_hash(one, 0) == xv_hash(xv_new_double(1), 0));
+    assert(xv_hash(one, 0) == xv_hash(one_i, 0));
+    assert(xv_hash(one, 0) != xv_hash(one, 1));
+    assert(xv_hash(one, 0) != xv_hash(xv_new_double(2), 0));
+    assert(xv_hash(one, 0) != xv_hash(xv_new_boolean(true), 0));
+    assert(xv_hash(xv_new_double(0), 0) == xv_hash(xv_new_double(-0.0), 0));
+    assert(xv_hash(xv_new_string("abc"), 0) == 
+        xv_hash(xv_new_stringn("abcd", 3), 0));
+    assert(xv_hash(xv_new_string("abc"), 0) != 
+        xv_hash(xv_new_string("abd"), 0));
+    assert(xv_hash(xv_new_null(), 0) == xv_hash(xv_new_null(), 0));
+    assert(xv_hash(xv_new_null(), 0) != xv_hash(xv_new_undefined(), 0));
+
+    // values from expressions
+    struct xv a = xv_eval("'ab' + 'c'", NULL);
+    assert(xv_equals(a, xv_new_string("abc"), true));
+    assert(xv_hash(a, 7) == xv_hash(xv_new_string("abc"), 7));
+    xv_cleanup();
+
+    // long values are compared in full
+    char json[4096];
+    size_t len = (size_t)sprintf(json, "[");
+    for (int i = 0; i < 500; i++) {
+        len += (size_t)sprintf(json+len, "%s%d", i ? "," : "", i);
+    }
+    sprintf(json+len, "]");
+    struct xv value = xv_new_json(json);
+    char other[4096];
+    strcpy(other, json);
+    assert(xv_string_equal(value, other));
+    other[len-1] = '8';
+    assert(!xv_string_equal(value, other));
+    assert(xv_string_compare(value, other) > 0);
+}
+
+#define BATCH_ROWS 2500
+
+static double batch_x[BATCH_ROWS];
+static int32_t batch_n[BATCH_ROWS];
+static int64_t batch_b[BATCH_ROWS];
+static float batch_f[BATCH_ROWS];
+static double batch_d[BATCH_ROWS];
+static uint8_t batch_valid[(BATCH_ROWS+7)/8];
+static char batch_bytes[BATCH_ROWS*8];
+static uint64_t batch_offsets[BATCH_ROWS+1];
+static size_t batch_row;
+
+static const struct xv_column batch_columns[] = {
+    { .name = "x", .type = XV_FLOAT64, .data = batch_x, 
+        .validity = batch_valid },
+    { .name = "n", .type = XV_INT32, .data = batch_n },
+    { .name = "b", .type = XV_INT64, .data = batch_b },
+    { .name = "s", .type = XV_UTF8, .data = batch_bytes, 
+        .offsets = batch_offsets },
+    { .name = "f", .type = XV_FLOAT32, .data = batch_f, 
+        .validity = batch_valid },
+    { .name = "d", .type = XV_FLOAT64, .data = batch_d },
+};
+
+static int batch_calls = 0;
+
+struct xv batch_expensive(struct xv this, struct xv args, void *udata) {
+    (void)this, (void)udata;
+    batch_calls++;
+    return xv_new_boolean(xv_double(xv_array_at(args, 0)) > 0);
+}
+
+// batch_ref reads the columns at batch_row, for checking a batch against
+// xv_eval.
+struct xv batch_ref(struct xv this, struct xv ident, void *udata) {
+    if (xv_is_global(this)) {
+        size_t i = batch_row;
+        if (xv_string_compare(ident, "expensive") == 0) {
+            return xv_new_function(batch_expensive);
+        }
+        if (xv_string_compare(ident, "x") == 0) {
+            if (!((batch_valid[i>>3]>>(i&7))&1)) return xv_new_null();
+            return xv_new_double(batch_x[i]);
+        }
+        if (xv_string_compare(ident, "n") == 0) {
+            return intmath ? xv_new_int64(batch_n[i]) : 
+                xv_new_double(batch_n[i]);
+        }
+        if (xv_string_compare(ident, "b") == 0) {
+            return intmath ? xv_new_int64(batch_b[i]) : 
+                xv_new_double((double)batch_b[i]);
+        }
+        if (xv_string_compare(ident, "f") == 0) {
+            if (!((batch_valid[i>>3]>>(i&7))&1)) return xv_new_null();
+            return xv_new_double(batch_f[i]);
+        }
+        if (xv_string_compare(ident, "d") == 0) {
+            return xv_new_double(batch_d[i]);
+        }
+        if (xv_string_compare(ident, "s") == 0) {
+            return xv_new_stringn(batch_bytes+batch_offsets[i],
+                batch_offsets[i+1]-batch_offsets[i]);
+        }
+    }
+    return eref(this, ident, udata);
+}
+
+#define eval_batch(input) { \
+    struct xv_env env = { \
+        .ref = batch_ref, \
+        .no_case = nocase, \
+        .int_math = intmath, \
+    }; \
+    struct xv_program *prog = xv_program_new((input), strlen(input), &env); \
+    assert(prog); \
+    static struct xv out[BATCH_ROWS]; \
+    assert(xv_program_eval_batch(prog, batch_columns, 6, BATCH_ROWS, out)); \
+    for (batch_row = 0; batch_row < BATCH_ROWS; batch_row++) { \
+        struct xv value = xv_eval((input), &env); \
+        char expect[256], got[256]; \
+        xv_string_copy(value, expect, sizeof(expect)); \
+        xv_string_copy(out[batch_row], got, sizeof(got)); \
+        if (strcmp(expect, got) != 0 || \
+            xv_type(value) != xv_type(out[batch_row])) \
+        { \
+            fprintf(stderr, "line %d: %s: row %zu: expected '%s', got '%s'\n",\
+                __LINE__, (input), batch_row, expect, got); \
+            exit(1); \
+        } \
+    } \
+    xv_program_free(prog); \
+    xv_cleanup(); \
+}
+
+static void batch_exprs(void) {
+    eval_batch("x");
+    eval_batch("x + 1");
+    eval_batch("x * 2 - n / 3");
+    eval_batch("x % 7 + n % 3");
+    eval_batch("-x");
+    eval_batch("- -x + -5");
+    eval_batch("x - -5");
+    eval_batch("!x");
+    eval_batch("!!n");
+    eval_batch("!x == !n");
+    eval_batch("x > 10 && n < 5");
+    eval_batch("x > 10 || s == 'b' || !n");
+    eval_batch("x >= n && x <= 40 && s != 'abc'");
+    eval_batch("x == null");
+    eval_batch("x === null");
+    eval_batch("x !== null && n !== 3");
+    eval_batch("null == x");
+    eval_batch("n == 3");
+    eval_batch("n === 3");
+    eval_batch("x === n");
+    eval_batch("(x > 1) === true");
+    eval_batch("(x > 1) === (n > 1)");
+    eval_batch("x < n < 1");
+    eval_batch("true + x");
+    eval_batch("(x + n) * 2");
+    eval_batch("x + n > 5 == true");
+    eval_batch("b * 3 + n");
+    eval_batch("b / n");
+    eval_batch("b == n");
+    eval_batch("x / 0");
+    eval_batch("n % 0");
+    eval_batch("1e3 + x");
+    eval_batch("0x10 + n");
+    eval_batch("NaN == x");
+    eval_batch("Infinity > x");
+    eval_batch("undefined == x");
+    eval_batch("s");
+    eval_batch("s + x");
+    eval_batch("s < 'm'");
+    eval_batch("s == 'ABC'");
+    eval_batch("'x' + s + 1");
+    eval_batch("s.length > 2");
+    eval_batch("s.toUpperCase() + n");
+    eval_batch("x > 0 ? s : n");
+    eval_batch("Date.parse('2026-01-01T00:00:00Z') + x");
+    eval_batch("x * 1e12 < Date.parse(\"2026-01-01\")");
+    eval_batch("Date.parse( '2026-02-30' ) || n");
+    eval_batch("Date . parse('2026-01-01') || n");
+    eval_batch("Date.parse('2026-01-01') - Date.parse(s)");
+    eval_batch("Math.PI * 2 + x");
+    eval_batch("Math.pow(2, 10) > x * n");
+    eval_batch("Math.max(1, 2e1, -3) + n");
+    eval_batch("Math.sqrt(x) + Math.sqrt(2)");
+    eval_batch("Math.floor(1.5 / 0) || n");
+    eval_batch("x, n");
+    eval_batch("x ?? 5");
+    eval_batch("x | 0");
+    eval_batch("n & 1 && x");
+    eval_batch("Math.max(x, n) >= 2");
+    eval_batch("[x, n].length + x");
+    eval_batch("{a: x}.a");
+    eval_batch("howdy + s");
+    eval_batch("cust(n) + x");
+    eval_batch("nothere + x");
+    eval_batch("custom_err || x > 1");
+    eval_batch("x + ");
+    eval_batch("(x");
+    eval_batch("x == = 1");
+    eval_batch("x --n");
+    eval_batch("!");
+    eval_batch("x > /a/");
+    eval_batch("");
+    eval_batch("()");
+    eval_batch("  1 + 2 ");
+    eval_batch("d * f - d / 2");
+    eval_batch("f === null || d > 3");
+    eval_batch("((((x)))) + ((d))");
+    eval_batch("x+d+n+b+f+x+d+n+b+f+x+d+n+b+f+x+d+n+b+f+x+d+n+b+f");
+    eval_batch("s == 'a\\'b' || s == \"abc\"");
+    eval_batch("false || x != n");
+    eval_batch("-s + -(x > 1)");
+    eval_batch("(x > 1) !== x");
+    eval_batch("-5 + x - 1e-3 * x");
+    eval_batch("s?.length + x");
+    eval_batch("(s).length + 'abc'.length + x");
+    eval_batch("1.2.3 + x");
+    eval_batch("s.length.toFixed + x.foo");
+    eval_batch("s.x.y");
+    eval_batch("howdy.length * n");
+    eval_batch("f64s.length + f64s.includes + i64s.map");
+    eval_batch("Math.PI * x");
+    eval_batch("null.x + n");
+    eval_batch("custom_err.x");
+    eval_batch("nothere.x.y");
+}
+
+static void batch_fill(void) {
+    for (size_t i = 0; i < BATCH_ROWS; i++) {
+        batch_x[i] = (double)(i%97) * 0.5 - 5;
+        if (i%13 == 0) batch_x[i] = NAN;
+        if (i%17 == 0) batch_x[i] = -0.0;
+        if (i%5 != 0) batch_valid[i>>3] |= 1<<(i&7);
+        batch_n[i] = (int32_t)(i%11) - 3;
+        batch_b[i] = (int64_t)i * 1000003 - 7;
+        batch_f[i] = (float)batch_x[i];
+        batch_d[i] = (double)(i%31) - 10;
+    }
+    static const char *words[] = { "abc", "b", "", "ABC", "zebra", "m" };
+    size_t len = 0;
+    for (size_t i = 0; i < BATCH_ROWS; i++) {
+        batch_offsets[i] = len;
+        const char *w = words[i%6];
+        memcpy(batch_bytes+len, w, strlen(w));
+        len += strlen(w);
+    }
+    batch_offsets[BATCH_ROWS] = len;
+}
+
+static int math_refs = 0;
+
+struct xv math_ref(struct xv this, struct xv ident, void *udata) {
+    (void)udata;
+    if (xv_is_global(this) && xv_string_compare(ident, "Math") == 0) {
+        math_refs++;
+    }
+    return xv_new_undefined();
+}
+
+void test_xv_batch(void) {
+    batch_fill();
+    batch_exprs();
+    nocase = true;
+    batch_exprs();
+    nocase = false;
+    intmath = true;
+    batch_exprs();
+    intmath = false;
+
+    // columns are checked
+    struct xv_program *prog = xv_program_new("x", 1, NULL);
+    struct xv out[1];
+    struct xv_column bad = { .name = "x", .type = XV_UTF8, .data = "" };
+    assert(!xv_program_eval_batch(prog, &bad, 1, 1, out));
+    assert(xv_program_eval_batch(prog, &bad, 1, 0, out));
+    xv_program_free(prog);
+
+    // Date.parse of a literal is folded, unless a column or the environment
+    // has a Date of its own
+    const char *date = "Date.parse('2026-01-01')";
+    prog = xv_program_new(date, strlen(date), NULL);
+    assert(xv_program_eval_batch(prog, NULL, 0, 1, out));
+    assert(xv_double(out[0]) == 1767225600000);
+    double one = 1;
+    struct xv_column col = { .name = "Date", .type = XV_FLOAT64, .data = &one };
+    assert(xv_program_eval_batch(prog, &col, 1, 1, out));
+    assert(xv_is_error(out[0]));
+    xv_program_free(prog);
+    struct xv_env env = { .ref = host_ref };
+    const char *pi = "Math.PI + Date.parse('2026-01-01')";
+    prog = xv_program_new(pi, strlen(pi), &env);
+    assert(xv_program_eval_batch(prog, NULL, 0, 1, out));
+    assert(xv_double(out[0]) == 1767225600003);
+    xv_program_free(prog);
+
+    // Math with constant arguments is folded, so Math is only looked up
+    // when the program is compiled
+    struct { const char *expr; double expect; } maths[] = {
+        { "Math.sqrt(2)", sqrt(2) },
+        { "Math.PI * 2", 3.141592653589793 * 2 },
+        { "Math.pow(2, 10)", 1024 },
+        { "Math.max(1, -2.5e1) + Math.E", 1 + 2.718281828459045 },
+    };
+    env = (struct xv_env){ .ref = math_ref };
+    struct xv outs[100];
+    for (size_t i = 0; i < sizeof(maths)/sizeof(maths[0]); i++) {
+        math_refs = 0;
+        prog = xv_program_new(maths[i].expr, strlen(maths[i].expr), &env);
+        int compiled = math_refs;
+        assert(compiled > 0);
+        assert(xv_program_eval_batch(prog, NULL, 0, 100, outs));
+        assert(math_refs == compiled);
+        assert(xv_double(outs[0]) == maths[i].expect);
+        assert(xv_double(outs[99]) == maths[i].expect);
+        // a column named Math is used instead
+        struct xv_column mcol = { .name = "Math", .type = XV_FLOAT64, 
+            .data = &one };
+        assert(xv_program_eval_batch(prog, &mcol, 1, 1, outs));
+        assert(!(xv_double(outs[0]) == maths[i].expect));
+        xv_program_free(prog);
+        xv_cleanup();
+    }
+    xv_cleanup();
+}
+
+// filter_batch checks the selected rows of a predicate against xv_eval.
+#define filter_batch(input) { \
+    struct xv_env env = { .ref = batch_ref }; \
+    struct xv_program *prog = xv_program_new((input), strlen(input), &env); \
+    static size_t sel[BATCH_ROWS]; \
+    static uint8_t bitmap[(BATCH_ROWS+7)/8]; \
+    size_t nsel; \
+    assert(xv_program_select(prog, batch_columns, 6, BATCH_ROWS, sel, \
+        &nsel)); \
+    memset(bitmap, 0xAA, sizeof(bitmap)); \
+    assert(xv_program_bitmap(prog, batch_columns, 6, BATCH_ROWS, bitmap)); \
+    size_t j = 0; \
+    for (batch_row = 0; batch_row < BATCH_ROWS; batch_row++) { \
+        struct xv value = xv_eval((input), &env); \
+        bool expect = !xv_is_error(value) && xv_bool(value); \
+        bool got = j < nsel && sel[j] == batch_row; \
+        j += got; \
+        if (got != expect || \
+            ((bitmap[batch_row/8]>>(batch_row%8))&1) != expect) \
+        { \
+            fprintf(stderr, "line %d: %s: row %zu: expected %d\n", \
+                __LINE__, (input), batch_row, expect); \
+            exit(1); \
+        } \
+    } \
+    assert(j == nsel); \
+    xv_program_free(prog); \
+    xv_cleanup(); \
+}
+
+void test_xv_batch_filter(void) {
+    filter_batch("x > 5");
+    filter_batch("x");
+    filter_batch("s");
+    filter_batch("x > 5 && n < 3");
+    filter_batch("x > 5 || s == 'b'");
+    filter_batch("x > 5 && n < 3 || s.length > 3 && !n");
+    filter_batch("!(x > 5) && !!n");
+    filter_batch("!(x > 5 || n) || d > 15");
+    filter_batch("s.length > 2 && x");
+    filter_batch("x > 0 ? n : 0");
+    filter_batch("nothere");
+    filter_batch("nothere || x > 5");
+    filter_batch("x > 5 && custom_err");
+    filter_batch("d > 100 && x");
+    filter_batch("d < 100 || x");
+
+    // the right side of '&&' is only evaluated for rows where the left is
+    // truthy.
+    struct xv_program *prog = xv_program_new("x > 5 && expensive(n)", 21, 
+        &(struct xv_env){ .ref = batch_ref });
+    static size_t sel[BATCH_ROWS];
+    size_t nsel;
+    batch_calls = 0;
+    assert(xv_program_select(prog, batch_columns, 6, BATCH_ROWS, sel, &nsel));
+    int expect_calls = 0;
+    size_t expect_nsel = 0;
+    for (size_t i = 0; i < BATCH_ROWS; i++) {
+        if ((batch_valid[i>>3]>>(i&7))&1 && batch_x[i] > 5) {
+            expect_calls++;
+            expect_nsel += batch_n[i] > 0;
+        }
+    }
+    assert(batch_calls == expect_calls);
+    assert(nsel == expect_nsel);
+    xv_program_free(prog);
+
+    // and the right side of '||' only where it's falsy.
+    prog = xv_program_new("x > 5 || custom_err", 19, 
+        &(struct xv_env){ .ref = batch_ref });
+    assert(xv_program_select(prog, batch_columns, 6, BATCH_ROWS, sel, &nsel));
+    assert(nsel == (size_t)expect_calls);
+    xv_program_free(prog);
+
+    // memory is released as blocks are filtered
+    prog = xv_program_new("(s + x).length > 3", 18, NULL);
+    assert(xv_program_select(prog, batch_columns, 6, BATCH_ROWS, sel, &nsel));
+    assert(xv_memstats().heap_allocs == 0);
+    xv_program_free(prog);
+    xv_cleanup();
+}
+
+void test_xv_batch_chaos(void) {
+    static struct xv out[BATCH_ROWS];
+    const char *expr = "x+d+n+b+f+x+d+n+b+f+x+d+n+b+f+x+d+n+b+f > 3 && !f";
+    for (int i = 0; i < 100; i++) {
+        struct xv_program *prog = xv_program_new(expr, strlen(expr), NULL);
+        if (!prog) continue;
+        if (xv_program_eval_batch(prog, batch_columns, 6, BATCH_ROWS, out)) {
+            assert(xv_type(out[BATCH_ROWS-1]) == XV_BOOLEAN);
+        }
+        static size_t sel[BATCH_ROWS];
+        size_t nsel;
+        if (xv_program_select(prog, batch_columns, 6, BATCH_ROWS, sel, &nsel))
+        {
+            assert(nsel <= BATCH_ROWS);
+        }
+        xv_program_free(prog);
+    }
+}
+
+#define PARALLEL_ROWS 40000
+
+static double parallel_x[PARALLEL_ROWS];
+static int32_t parallel_n[PARALLEL_ROWS];
+static char parallel_bytes[PARALLEL_ROWS*8];
+static uint64_t parallel_offsets[PARALLEL_ROWS+1];
+static char parallel_json[PARALLEL_ROWS*48];
+static struct xv parallel_docs[PARALLEL_ROWS];
+static uint8_t parallel_valid[(PARALLEL_ROWS+7)/8];
+
+static const struct xv_column parallel_columns[] = {
+    { .name = "x", .type = XV_FLOAT64, .data = parallel_x }, 
+    { .name = "n", .type = XV_INT32, .data = parallel_n },
+    { .name = "s", .type = XV_UTF8, .data = parallel_bytes, 
+        .offsets = parallel_offsets },
+    { .name = "doc", .type = XV_VALUE, .data = parallel_docs, 
+        .validity = parallel_valid },
+};
+
+static void parallel_exprs(bool intmath) {
+    static const char *exprs[] = {
+        "x * 2 + n",
+        "x > 10 && n < 3 || s == 'm'",
+        "s + n",
+        "s.toUpperCase() + doc?.name",
+        "doc.age * 2 + x",
+        "(x + 1) / n",
+        "doc.tags[1] ?? 'none'",
+    };
+    static struct xv want[PARALLEL_ROWS];
+    static struct xv got[PARALLEL_ROWS];
+    for (size_t i = 0; i < sizeof(exprs)/sizeof(exprs[0]); i++) {
+        struct xv_env env = { .ref = eref, .int_math = intmath };
+        struct xv_program *prog = 
+            xv_program_new(exprs[i], strlen(exprs[i]), &env);
+        assert(prog);
+        assert(xv_program_eval_batch(prog, parallel_columns, 4, PARALLEL_ROWS,
+            want));
+        int nthreads[] = { 1, 2, 3, 8, 0 };
+        for (int j = 0; j < 5; j++) {
+            memset(got, 0, sizeof(got));
+            assert(xv_program_eval_parallel(prog, parallel_columns, 4, 
+                PARALLEL_ROWS, got, nthreads[j]));
+            for (size_t k = 0; k < PARALLEL_ROWS; k++) {
+                char expect[64], actual[64];
+                xv_string_copy(want[k], expect, sizeof(expect));
+                xv_string_copy(got[k], actual, sizeof(actual));
+                if (strcmp(expect, actual) != 0 || 
+                    xv_type(want[k]) != xv_type(got[k]))
+                {
+                    fprintf(stderr, "%s: threads %d: row %zu: "
+                        "expected '%s', got '%s'\n", exprs[i], nthreads[j],
+                        k, expect, actual);
+                    exit(1);
+                }
+            }
+        }
+        xv_program_free(prog);
+        xv_cleanup();
+    }
+}
+
+void test_xv_parallel(void) {
+    static const char *words[] = { "abc", "b", "", "ABC", "zebra", "m" };
+    size_t len = 0;
+    size_t jlen = 0;
+    for (size_t i = 0; i < PARALLEL_ROWS; i++) {
+        parallel_x[i] = (double)(i%101) * 0.25 - 3;
+        parallel_n[i] = (int32_t)(i%7) - 2;
+        parallel_offsets[i] = len;
+        const char *w = words[i%6];
+        memcpy(parallel_bytes+len, w, strlen(w));
+        len += strlen(w);
+        char *json = parallel_json+jlen;
+        jlen += (size_t)sprintf(json, "{\"name\":\"%s\",\"age\":%zu%s}", 
+            w, i%90, i%4 ? ",\"tags\":[1,2]" : "");
+        parallel_docs[i] = xv_new_json(json);
+        jlen++;
+        if (i%9 != 0) parallel_valid[i>>3] |= 1<<(i&7);
+    }
+    parallel_offsets[PARALLEL_ROWS] = len;
+
+    parallel_exprs(false);
+    parallel_exprs(true);
+
+    // islands call the ref callback from every thread
+    struct xv_program *prog = xv_program_new("howdy + x", 9, 
+        &(struct xv_env){ .ref = eref });
+    static struct xv out[PARALLEL_ROWS];
+    assert(xv_program_eval_parallel(prog, parallel_columns, 4, PARALLEL_ROWS,
+        out, 4));
+    assert(xv_string_equal(out[0], "hiya-3"));
+    assert(xv_string_equal(out[PARALLEL_ROWS-1], "hiya-2.25"));
+
+    // too few rows for more than one thread
+    assert(xv_program_eval_parallel(prog, parallel_columns, 4, 10, out, 4));
+    assert(xv_string_equal(out[9], "hiya-0.75"));
+    assert(xv_program_eval_parallel(prog, parallel_columns, 4, 0, out, 4));
+
+    // invalid columns
+    struct xv_column bad = { .name = "x", .type = XV_UTF8, 
+        .data = parallel_bytes };
+    assert(!xv_program_eval_parallel(prog, &bad, 1, PARALLEL_ROWS, out, 4));
+    xv_program_free(prog);
+    xv_cleanup();
+}
+
+static struct xv rules_doc;
+
+// rules_ref reads the document that is being matched, for checking a rule
+// set against xv_eval.
+struct xv rules_ref(struct xv this, struct xv ident, void *udata) {
+    if (xv_is_global(this) && xv_string_compare(ident, "json") == 0) {
+        return rules_doc;
+    }
+    return eref(this, ident, udata);
+}
+
+static const char *rules_docs[] = {
+    "{\"event\":\"login\",\"amount\":150,\"tags\":[\"x\",\"y\"],"
+        "\"user\":{\"tier\":\"gold\",\"id\":9,\"name\":\"Janet\","
+        "\"active\":true}}",
+    "{\"event\":\"logout\",\"amount\":20,\"tags\":[],"
+        "\"user\":{\"tier\":\"Silver\",\"id\":4,\"name\":\"Al\"}}",
+    "{\"event\":\"login\",\"amount\":\"75\",\"user\":{\"tier\":\"GOLD\"}}",
+    "{\"event\":\"e7\",\"amount\":8}",
+    "{\"event\":5,\"amount\":-0.0,\"tags\":[\"5\"],"
+        "\"user\":{\"tier\":\"\u212aing\",\"id\":1e300}}",
+    "[1,2,3]",
+    "null",
+};
+
+// match_rules checks that matching each document sets the bits of the rules
+// that are truthy with xv_eval, and returns the statistics of the rule set.
+static struct xv_ruleset_stats match_rules(const char **rules, size_t nrules,
+    struct xv_env *env)
+{
+    struct xv_ruleset *rs = xv_ruleset_new(rules, nrules, env);
+    assert(rs);
+    size_t ndocs = sizeof(rules_docs)/sizeof(rules_docs[0]);
+    struct xv docs[sizeof(rules_docs)/sizeof(rules_docs[0])];
+    for (size_t i = 0; i < ndocs; i++) {
+        docs[i] = xv_new_json(rules_docs[i]);
+    }
+    struct xv_column col = { .name = "json", .type = XV_VALUE, .data = docs };
+    uint8_t matches[1024];
+    assert(nrules <= sizeof(matches)*8);
+    for (size_t i = 0; i < ndocs; i++) {
+        assert(xv_ruleset_match(rs, &col, 1, i, matches));
+        rules_doc = docs[i];
+        struct xv_env eenv = *env;
+        eenv.ref = rules_ref;
+        for (size_t j = 0; j < nrules; j++) {
+            struct xv value = xv_eval(rules[j], &eenv);
+            bool expect = !xv_is_error(value) && xv_bool(value);
+            bool got = (matches[j>>3]>>(j&7))&1;
+            if (expect != got) {
+                fprintf(stderr, "%s: doc %zu: expected %d, got %d\n", 
+                    rules[j], i, expect, got);
+                exit(1);
+            }
+            xv_cleanup();
+        }
+    }
+    assert(xv_memstats().heap_allocs == 0);
+    struct xv_ruleset_stats stats = xv_ruleset_stats(rs);
+    assert(stats.calls == ndocs);
+    xv_ruleset_free(rs);
+    return stats;
+}
+
+void test_xv_ruleset(void) {
+    const char *rules[] = {
+        "json.user.tier == 'gold'",
+        "json.user.tier == 'gold' && json.amount > 100",
+        "json.user.tier == 'gold' || json.user.id % 3 == 0",
+        "json.event == 'login'",
+        "json.tags.includes('x')",
+        "json.user.name.length > 3",
+        "json.missing.x",
+        "json.missing.x || true",
+        "json.amount * 2 > json.user.id",
+        "!json.user.active",
+        "howdy == 'hiya' && json.amount",
+        "",
+        "1 +",
+        "(json.amount > 50) == true",
+        "json?.user?.tier == 'Silver'",
+        "json.length == 3",
+        "json.user.tier == 'gold' ? json.amount : 0",
+        "Math.max(json.amount, 1) > 10",
+        "Date.parse('2026-01-01') > json.amount",
+        "custom_err.x || json.event",
+        "json . event == 'logout'",
+        "json.amount === '75'",
+        "json.user.id + json.user.id == 18",
+        "json.event == 'login' && json.user.tier == 'gold'",
+        "json.amount == 150 && json.event",
+        "json.amount == '75' && true",
+        "(json.event == 'login' || json.event == 'e7' || 5 == json.event) && "
+            "json.amount",
+        "json.amount >= 75 && json.amount < 200",
+        "100 < json.amount && json.user",
+        "json.amount <= 20 && json.event != 'x'",
+        "8 >= json.amount && json.amount > -1",
+        "json.user.id === 9 && json.user.tier",
+        "json.user.tier == 'king'",
+        "json.user.tier === 'GOLD' && json.user.tier",
+        "json.amount == 0 && json.event",
+        "json.amount == '' && json.event",
+        "json.amount == '-0' || json.amount == '0x8'",
+        "json.user.id > 1e299",
+        "json.tags == 0 && json.user",
+        "json.tags == '5' && json.tags == 5",
+        "json.event == 'e7' || json.amount == 150",
+        "json.missing == 'x' && 1",
+        "json.user.tier == json.event",
+        "json.amount > 'x' && json.amount < NaN",
+    };
+    size_t nrules = sizeof(rules)/sizeof(rules[0]);
+    struct xv_env env = { .ref = eref };
+    match_rules(rules, nrules, &env);
+    env.no_case = true;
+    match_rules(rules, nrules, &env);
+    env.no_case = false;
+    env.int_math = true;
+    match_rules(rules, nrules, &env);
+
+    // many rules that share their reads
+    static char texts[1000][64];
+    const char *many[1000];
+    for (int i = 0; i < 1000; i++) {
+        sprintf(texts[i], "json.event == 'e%d' && json.amount > %d", i%10, 
+            i%50);
+        many[i] = texts[i];
+    }
+    env.int_math = false;
+    struct xv_ruleset_stats stats = match_rules(many, 1000, &env);
+    assert(stats.indexed == 1000);
+    assert(stats.paths == 1);
+    assert(stats.keys == 1000);
+    // only the 100 rules for 'e7' are evaluated, for one of the documents
+    assert(stats.evaluated == 100);
+
+    // bounds, and rules without guards
+    for (int i = 0; i < 1000; i++) {
+        const char *ops[] = { ">", "<=", "<", ">=" };
+        if (i%5 == 4) {
+            sprintf(texts[i], "json.amount + 0 > %d", i%200);
+        } else if (i%2 == 0) {
+            sprintf(texts[i], "json.amount %s %d", ops[i%4], i%200);
+        } else {
+            sprintf(texts[i], "%d %s json.amount", i%200, ops[i%4]);
+        }
+    }
+    stats = match_rules(many, 1000, &env);
+    assert(stats.indexed == 800);
+    assert(stats.paths == 1);
+    assert(stats.keys == 800);
+    assert(stats.evaluated < stats.calls*1000);
+    env.int_math = true;
+    match_rules(many, 1000, &env);
+    env.int_math = false;
+
+    // the nodes of a path and of a comparison are shared
+    const char *shared[] = { "a.b.c == 1", "a.b.c == 1 && a.b.d" };
+    struct xv_ruleset *rs = xv_ruleset_new(shared, 2, NULL);
+    assert(rs);
+    stats = xv_ruleset_stats(rs);
+    assert(stats.rules == 2);
+    assert(stats.nodes == 7);
+    assert(stats.shared == 7);
+    assert(stats.indexed == 2);
+
+    // a row of typed columns
+    double x[] = { 1, 5 };
+    struct xv_column cols[] = { 
+        { .name = "a", .type = XV_FLOAT64, .data = x },
+    };
+    uint8_t matches[1];
+    assert(xv_ruleset_match(rs, cols, 1, 1, matches));
+    assert(matches[0] == 0);
+    struct xv_column bad = { .name = "a", .type = XV_UTF8, .data = x };
+    assert(!xv_ruleset_match(rs, &bad, 1, 0, matches));
+    xv_ruleset_free(rs);
+
+    // members of values from an expression
+    const char *re[] = { "re.source == 'ab' && re.flags == 'i'", "re.x" };
+    rs = xv_ruleset_new(re, 2, NULL);
+    assert(rs);
+    struct xv rev = xv_eval("/ab/i", NULL);
+    struct xv_column recol = { .name = "re", .type = XV_VALUE, .data = &rev };
+    assert(xv_ruleset_match(rs, &recol, 1, 0, matches));
+    assert(matches[0] == 1);
+    xv_ruleset_free(rs);
+    xv_cleanup();
+
+    // no rules
+    rs = xv_ruleset_new(NULL, 0, NULL);
+    assert(rs);
+    assert(xv_ruleset_match(rs, NULL, 0, 0, matches));
+    xv_ruleset_free(rs);
+}
+
+void test_xv_ruleset_chaos(void) {
+    const char *rules[] = {
+        "json.user.tier == 'gold' && json.amount > 100",
+        "json.user.tier + json.event == 'goldlogin'",
+        "json.tags.includes('x')",
+    };
+    struct xv doc = xv_new_json(rules_docs[0]);
+    struct xv_column col = { .name = "json", .type = XV_VALUE, .data = &doc };
+    for (int i = 0; i < 100; i++) {
+        struct xv_ruleset *rs = xv_ruleset_new(rules, 3, NULL);
+        if (!rs) continue;
+        uint8_t matches[1];
+        if (xv_ruleset_match(rs, &col, 1, 0, matches)) {
+            assert((matches[0]&1) == 1);
+        }
+        xv_ruleset_free(rs);
+        xv_cleanup();
+    }
 }
 
 int main(int argc, char **argv) {
@@ -836,6 +2898,43 @@ int main(int argc, char **argv) {
     do_sysalloc_test(test_xv_various_sysalloc);
     do_chaos_test(test_xv_various_chaos);
     do_test(test_xv_maxdepth);
+    do_test(test_xv_numbers);
+    do_test(test_xv_int_math);
+    do_test(test_xv_string_compare);
+    do_test(test_xv_unicode_case);
+    do_test(test_xv_string_methods);
+    do_test(test_xv_regex);
+    do_chaos_test(test_xv_regex_chaos);
+    do_test(test_xv_glob);
+    do_chaos_test(test_xv_glob_chaos);
+    do_test(test_xv_literal_sets);
+    do_chaos_test(test_xv_literal_sets_chaos);
+    do_test(test_xv_math);
+    do_test(test_xv_aggregates);
+    do_chaos_test(test_xv_aggregates_chaos);
+    do_test(test_xv_builtin_host);
+    do_test(test_xv_lambdas);
+    do_chaos_test(test_xv_lambdas_chaos);
+    do_test(test_xv_hash);
+    do_chaos_test(test_xv_hash_chaos);
+    do_test(test_xv_dates);
+    do_test(test_xv_ip);
+    do_chaos_test(test_xv_ip_chaos);
+    do_test(test_xv_ip_large);
+    do_test(test_xv_geo);
+    do_chaos_test(test_xv_geo_chaos);
+    do_test(test_xv_geo_large);
+    do_test(test_xv_objects);
+    do_chaos_test(test_xv_objects_chaos);
+    do_test(test_xv_typed_arrays);
+    do_test(test_xv_eval_each);
+    do_test(test_xv_value_keys);
+    do_test(test_xv_batch);
+    do_test(test_xv_batch_filter);
+    do_chaos_test(test_xv_batch_chaos);
+    do_sysalloc_test(test_xv_parallel);
+    do_test(test_xv_ruleset);
+    do_chaos_test(test_xv_ruleset_chaos);
     return 0;
 }
 
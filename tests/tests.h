@@ -79,7 +79,7 @@ void seedrand(void) {
 }
 
 #define cleanup() { \
-    xv_cleanup(); \
+    xv_cleanup_thread(); \
     assert(nallocs == 0); \
     assert(ntotalsize == 0); \
     struct xv_memstats memstats = xv_memstats(); \
@@ -8,8 +8,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "ryu.h"
 #include "json.h"
 #include "xv.h"
@@ -22,9 +28,38 @@
 #define XV_MAXDEPTH 100
 #endif
 
+#ifndef XV_REGEX_CACHE_SIZE
+#define XV_REGEX_CACHE_SIZE 32    // compiled regexes cached per thread
+#endif
+
+#ifndef XV_REGEX_DFA_SIZE
+#define XV_REGEX_DFA_SIZE 131072  // bytes of DFA states per compiled regex
+#endif
+
+#ifndef XV_LITSET_CACHE_SIZE
+#define XV_LITSET_CACHE_SIZE 32   // literal sets cached per thread
+#endif
+
+#ifndef XV_BATCH_SIZE
+#define XV_BATCH_SIZE 1024        // rows per block, a multiple of 64
+#endif
+
+#ifndef XV_LITSET_MIN_SIZE
+#define XV_LITSET_MIN_SIZE 8      // fewest literals that are worth a set
+#endif
+
+#ifndef XV_CIDR_CACHE_SIZE
+#define XV_CIDR_CACHE_SIZE 8      // CIDR sets cached per thread
+#endif
+
+#ifndef XV_GEO_CACHE_SIZE
+#define XV_GEO_CACHE_SIZE 8       // polygon indexes cached per thread
+#endif
+
 enum kind {
     UNDEF_KIND, NULL_KIND, ERR_KIND, FLOAT_KIND, INT_KIND, UINT_KIND, 
     STR_KIND, BOOL_KIND, FUNC_KIND, JSON_KIND, OBJECT_KIND, ARRAY_KIND,
+    REGEX_KIND, MAP_KIND, TYPED_KIND,
 };
 
 enum flag {
@@ -36,8 +71,11 @@ enum flag {
     FLAG_EMSG          = 1<<6, // custom user message
     FLAG_GLOBAL        = 1<<7, // global variable (OBJECT_KIND)
     FLAG_EUNSUPKEYWORD = 1<<8, // unsupported keyword
+    FLAG_ELEMTYPE      = 3<<9, // element type (TYPED_KIND)
 };
 
+#define ELEMTYPE_SHIFT 9
+
 struct value {
     enum kind kind:4;   // value kind
     enum flag flag:12;  // extra flags
@@ -124,6 +162,33 @@ void xv_cleanup(void) {
     tallocs = NULL;
 }
 
+// struct mark is a position in the thread memory space, which everything
+// allocated after can be released back to.
+struct mark {
+    size_t used;
+    int count;
+    size_t numallocs;
+    size_t heapsize;
+    struct alloc *allocs;
+};
+
+static struct mark mark_memory(void) {
+    return (struct mark) { tmemused, tmemcount, tnumallocs, theapsize, 
+        tallocs };
+}
+
+static void release_memory(struct mark mark) {
+    while (tallocs != mark.allocs) {
+        struct alloc *next = tallocs->next;
+        efree0(tallocs);
+        tallocs = next;
+    }
+    tmemused = mark.used;
+    tmemcount = mark.count;
+    tnumallocs = mark.numallocs;
+    theapsize = mark.heapsize;
+}
+
 struct value to_value(struct xv value) {
     void *v = &value;
     return *(struct value*)v;
@@ -271,6 +336,41 @@ static struct value make_array(struct value *values, size_t nvalues) {
     };
 }
 
+// make_typed returns a typed array, which is a view over the caller's memory.
+static struct value make_typed(const void *ptr, size_t len, 
+    enum xv_elem_type type)
+{
+    return (struct value) { 
+        .kind = TYPED_KIND,
+        .flag = (enum flag)(type<<ELEMTYPE_SHIFT),
+        .len = len,
+        .obj = ptr,
+    };
+}
+
+static enum xv_elem_type typed_type(struct value arr) {
+    return (enum xv_elem_type)((arr.flag&FLAG_ELEMTYPE)>>ELEMTYPE_SHIFT);
+}
+
+// typed_at returns the element at index, which must be in range. Integers
+// are kept as int64 values with int_math.
+static struct value typed_at(struct value arr, size_t index, bool ints) {
+    int64_t x;
+    switch (typed_type(arr)) {
+    case XV_FLOAT64:
+        return make_float(((const double*)arr.obj)[index]);
+    case XV_FLOAT32:
+        return make_float(((const float*)arr.obj)[index]);
+    case XV_INT64:
+        x = ((const int64_t*)arr.obj)[index];
+        break;
+    default: // XV_INT32
+        x = ((const int32_t*)arr.obj)[index];
+        break;
+    }
+    return ints ? make_int(x) : make_float((double)x);
+}
+
 
 static bool isnum(struct value a) {
     switch (a.kind) {
@@ -308,6 +408,8 @@ static void write_bytes(struct writer *wr, const uint8_t *s, size_t len) {
     }
 }
 
+struct scope;
+
 struct eval_context {
     const uint8_t *expr;                     // original expression
     size_t len;                              // 
@@ -315,9 +417,41 @@ struct eval_context {
     void (*iter)(struct value, void *udata); // iterator, if any
     void *iter_udata;                        // iterator udata, if any
     struct xv_env *env;                      // user context
+    struct scope *scope;                     // arrow function parameters
 };
 
-static struct value make_json(const uint8_t *str, size_t len) {
+// int_math returns true when the environment asks for integer-preserving
+// arithmetic.
+static bool int_math(struct eval_context *ctx) {
+    return ctx && ctx->env && ctx->env->int_math;
+}
+
+/////////////////////////////////
+// JS native type conversions
+/////////////////////////////////
+
+static int64_t conv_ttoi(bool t);
+static uint64_t conv_ttou(bool t);
+static double conv_ttof(bool t);
+static bool conv_ftot(double f);
+static int64_t conv_ftoi(double f);
+static uint64_t conv_ftou(double f);
+static bool conv_itot(int64_t i);
+static double conv_itof(int64_t i);
+static uint64_t conv_itou(int64_t i);
+static bool conv_utot(uint64_t u);
+static double conv_utof(uint64_t u);
+static int64_t conv_utoi(uint64_t u);
+static bool conv_atot(const char *a, size_t alen);
+static double conv_atof(const char *a, size_t alen);
+static int64_t conv_atoi(const char *a, size_t alen);
+static uint64_t conv_atou(const char *a, size_t alen);
+
+static bool parse_exact_int(const uint8_t *s, size_t len, int64_t *x);
+
+// make_json returns the value for a JSON document. When ints is true, JSON
+// numbers that are exact integers are returned as int64 values.
+static struct value make_json(const uint8_t *str, size_t len, bool ints) {
     struct json json = json_parsen((char*)str, len);
     size_t rawlen;
     switch (json_type(json)) {
@@ -339,7 +473,14 @@ static struct value make_json(const uint8_t *str, size_t len) {
             return make_string((uint8_t*)raw+1, rawlen-2);
         }
     case JSON_NUMBER:
-        return make_float(json_double(json));
+        rawlen = json_raw_length(json);
+        if (ints) {
+            int64_t x;
+            if (parse_exact_int((uint8_t*)json_raw(json), rawlen, &x)) {
+                return make_int(x);
+            }
+        }
+        return make_float(conv_atof(json_raw(json), rawlen));
     case JSON_NULL:
         if (json_exists(json)) {
             return make_null();
@@ -360,27 +501,6 @@ static struct value make_json(const uint8_t *str, size_t len) {
     }
 }
 
-/////////////////////////////////
-// JS native type conversions
-/////////////////////////////////
-
-static int64_t conv_ttoi(bool t);
-static uint64_t conv_ttou(bool t);
-static double conv_ttof(bool t);
-static bool conv_ftot(double f);
-static int64_t conv_ftoi(double f);
-static uint64_t conv_ftou(double f);
-static bool conv_itot(int64_t i);
-static double conv_itof(int64_t i);
-static uint64_t conv_itou(int64_t i);
-static bool conv_utot(uint64_t u);
-static double conv_utof(uint64_t u);
-static int64_t conv_utoi(uint64_t u);
-static bool conv_atot(const char *a, size_t alen);
-static double conv_atof(const char *a, size_t alen);
-static int64_t conv_atoi(const char *a, size_t alen);
-static uint64_t conv_atou(const char *a, size_t alen);
-
 static double to_f64(struct value a) {
     if (a.kind == FLOAT_KIND) return a.f64;
     switch (a.kind) {
@@ -396,12 +516,13 @@ static double to_f64(struct value a) {
         return conv_utof(a.u64);
     case STR_KIND:
         return conv_atof((char*)a.str, a.len);
-    case ARRAY_KIND:
+    case ARRAY_KIND: case TYPED_KIND:
         if (a.len == 0) {
             return 0;
         }
         if (a.len == 1) {
-            return to_f64(a.arr[0]);
+            return to_f64(a.kind == ARRAY_KIND ? a.arr[0] : 
+                typed_at(a, 0, false));
         }
         return NAN;
     case JSON_KIND:
@@ -414,7 +535,7 @@ static double to_f64(struct value a) {
                 }
                 if (!json_exists(json_next(val))) {
                     return to_f64(make_json((uint8_t*)json_raw(val), 
-                        json_raw_length(val)));
+                        json_raw_length(val), false));
                 }
             }
             return NAN;
@@ -485,6 +606,7 @@ static void write_error(struct writer *wr, struct value value);
 static void write_double(struct writer *wr, double f);
 static void write_int(struct writer *wr, int64_t i);
 static void write_uint(struct writer *wr, uint64_t u);
+static void write_json(struct writer *wr, struct value value);
 
 static void write_value(struct writer *wr, struct value value) {
     switch (value.kind) {
@@ -529,6 +651,20 @@ static void write_value(struct writer *wr, struct value value) {
             write_value(wr, value.arr[i]);
         }
         break;
+    case TYPED_KIND:
+        for (size_t i = 0; i < value.len; i++) {
+            if (i > 0) {
+                write_char(wr, ',');
+            }
+            write_value(wr, typed_at(value, i, true));
+        }
+        break;
+    case REGEX_KIND:
+        write_bytes(wr, value.str, value.len);
+        break;
+    case MAP_KIND:
+        write_json(wr, value);
+        break;
     }
 }
 
@@ -588,25 +724,218 @@ static const uint8_t *trim(const uint8_t *s, size_t len, size_t *out_len) {
     return s;
 }
 
+// Numbers are parsed by hand rather than with strtod/strtoll/strtoull.
+// Those functions are locale-sensitive and require a null-terminated string,
+// but expressions are frequently slices of larger buffers, so every parser
+// below operates strictly on the provided (s, len) bytes. The only remaining
+// use of strtod is in parse_float_slow, on a locale-neutral local copy.
+
+static int hexval(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// parse_uint parses an unsigned base 10 or base 16 integer. All bytes must be
+// digits. Values too large for a uint64 saturate to UINT64_MAX.
 static uint64_t parse_uint(const uint8_t *s, size_t len, int base, bool *ok) {
-    char *end = NULL;
-    uint64_t x = strtoull((char*)s, &end, base);
-    *ok = (size_t)((uint8_t*)end - s) == len;
-    return x;
+    uint64_t x = 0;
+    bool overflow = false;
+    // Up to 19 decimal or 16 hex digits always fit, so only check for
+    // overflow beyond that.
+    size_t safe = base == 16 ? 16 : 19;
+    for (size_t i = 0; i < len; i++) {
+        int d = hexval(s[i]);
+        if (d < 0 || d >= base) {
+            *ok = false;
+            return 0;
+        }
+        if (i >= safe && x > (UINT64_MAX-(uint64_t)d)/(uint64_t)base) {
+            overflow = true;
+        }
+        x = x*(uint64_t)base + (uint64_t)d;
+    }
+    *ok = len > 0;
+    return overflow ? UINT64_MAX : x;
 }
 
+// parse_int parses a signed integer with an optional leading '+' or '-'.
+// Values out of range saturate to INT64_MIN or INT64_MAX.
 static int64_t parse_int(const uint8_t *s, size_t len, int base, bool *ok) {
-    char *end = NULL;
-    int64_t x = strtoll((char*)s, &end, base);
-    *ok = (size_t)((uint8_t*)end - s) == len;
-    return x;
+    bool neg = false;
+    if (len > 0 && (s[0] == '-' || s[0] == '+')) {
+        neg = s[0] == '-';
+        s++;
+        len--;
+    }
+    uint64_t x = parse_uint(s, len, base, ok);
+    if (neg) {
+        if (x > (uint64_t)INT64_MAX) return INT64_MIN;
+        return -(int64_t)x;
+    }
+    if (x > (uint64_t)INT64_MAX) return INT64_MAX;
+    return (int64_t)x;
+}
+
+// parse_exact_int parses a base 10 integer, such as '123' or '-45', that fits
+// in an int64 without saturating. Returns false for everything else.
+static bool parse_exact_int(const uint8_t *s, size_t len, int64_t *x) {
+    bool neg = len > 0 && s[0] == '-';
+    bool ok;
+    uint64_t u = parse_uint(s+neg, len-neg, 10, &ok);
+    if (!ok || u > (uint64_t)INT64_MAX + neg || (neg && u == 0)) {
+        // -0 is only a double
+        return false;
+    }
+    if (neg) {
+        *x = u > (uint64_t)INT64_MAX ? INT64_MIN : -(int64_t)u;
+    } else {
+        *x = (int64_t)u;
+    }
+    return true;
+}
+
+// Exactly representable powers of ten for the fast path in parse_float.
+static const double pow10_exact[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// parse_float_slow handles the rare numbers that are not exactly computable
+// by the parse_float fast path. The already validated input is rewritten as
+// plain significant digits followed by a decimal exponent, which contains no
+// radix character and is therefore immune to the current locale, and then
+// handed to strtod for correct rounding.
+static double parse_float_slow(const uint8_t *s, size_t len) {
+    // 767 significant digits are enough to round any double correctly, plus
+    // one sticky digit that marks nonzero digits that have been dropped.
+    char buf[800];
+    size_t n = 0;
+    size_t i = 0;
+    if (s[i] == '-' || s[i] == '+') {
+        buf[n++] = (char)s[i++];
+    }
+    size_t start = n;
+    int64_t exp10 = 0;
+    bool dot = false;
+    bool sticky = false;
+    for (; i < len && s[i] != 'e' && s[i] != 'E'; i++) {
+        if (s[i] == '.') {
+            dot = true;
+        } else if (s[i] == '0' && n == start) {
+            // leading zero
+            if (dot) exp10--;
+        } else if (n-start < 767) {
+            buf[n++] = (char)s[i];
+            if (dot) exp10--;
+        } else {
+            if (s[i] != '0') sticky = true;
+            if (!dot) exp10++;
+        }
+    }
+    if (sticky) {
+        buf[n++] = '1';
+        exp10--;
+    }
+    if (n == start) {
+        buf[n++] = '0';
+    }
+    if (i < len) {
+        i++;
+        bool neg = false;
+        if (s[i] == '-' || s[i] == '+') {
+            neg = s[i] == '-';
+            i++;
+        }
+        int64_t e = 0;
+        for (; i < len; i++) {
+            if (e < 100000) e = e*10 + (s[i]-'0');
+        }
+        exp10 += neg ? -e : e;
+    }
+    snprintf(buf+n, sizeof(buf)-n, "e%" PRId64, exp10);
+    return strtod(buf, NULL);
 }
 
+// parse_float parses a decimal floating point number using the Javascript
+// numeric literal syntax, such as '123', '-1.5', '.5', '5.' and '1e-10'.
+// Most numbers are computed exactly from a 64-bit mantissa and a power of
+// ten, following Clinger's fast path. Everything else uses parse_float_slow.
 static double parse_float(const uint8_t *s, size_t len, bool *ok) {
-    char *end = NULL;
-    double x = strtod((char*)s, &end);
-    *ok = (size_t)((uint8_t*)end - s) == len;
-    return x;
+    size_t i = 0;
+    bool neg = false;
+    if (i < len && (s[i] == '-' || s[i] == '+')) {
+        neg = s[i] == '-';
+        i++;
+    }
+    uint64_t mant = 0;
+    int nsig = 0;          // significant digits in mant
+    int64_t exp10 = 0;     // decimal exponent applied to mant
+    bool truncated = false;
+    size_t ndigits = 0;
+    bool dot = false;
+    for (; i < len; i++) {
+        if (s[i] == '.') {
+            if (dot) break;
+            dot = true;
+            continue;
+        }
+        if (s[i] < '0' || s[i] > '9') break;
+        ndigits++;
+        if (nsig < 19) {
+            mant = mant*10 + (uint64_t)(s[i]-'0');
+            if (mant > 0) nsig++;
+            if (dot) exp10--;
+        } else {
+            if (s[i] != '0') truncated = true;
+            if (!dot) exp10++;
+        }
+    }
+    if (ndigits == 0) {
+        *ok = false;
+        return 0;
+    }
+    if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        bool eneg = false;
+        if (i < len && (s[i] == '-' || s[i] == '+')) {
+            eneg = s[i] == '-';
+            i++;
+        }
+        size_t estart = i;
+        int64_t e = 0;
+        for (; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+            if (e < 100000) e = e*10 + (s[i]-'0');
+        }
+        if (i == estart) {
+            *ok = false;
+            return 0;
+        }
+        exp10 += eneg ? -e : e;
+    }
+    if (i != len) {
+        *ok = false;
+        return 0;
+    }
+    *ok = true;
+    double x;
+    if (mant == 0 && !truncated) {
+        x = 0;
+    } else if (!truncated && mant <= (1ULL<<53) && exp10 >= -22 && 
+        exp10 <= 22)
+    {
+        x = (double)mant;
+        x = exp10 < 0 ? x / pow10_exact[-exp10] : x * pow10_exact[exp10];
+    } else if (!truncated && exp10 > 22 && exp10 <= 22+15 &&
+        mant <= (1ULL<<53)/(uint64_t)pow10_exact[exp10-22])
+    {
+        // The mantissa has room to absorb part of the exponent exactly.
+        x = (double)(mant*(uint64_t)pow10_exact[exp10-22]) * pow10_exact[22];
+    } else {
+        return parse_float_slow(s, len);
+    }
+    return neg ? -x : x;
 }
 
 // Operator Precedence
@@ -680,6 +1009,14 @@ static struct value eval_auto(int step, const uint8_t *expr, size_t len,
 static const uint8_t *read_group(const uint8_t *data, size_t len, 
     size_t *len_out);
 
+static bool regex_start(const uint8_t *expr, size_t i);
+
+static bool eval_litset_or(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res);
+
+static bool eval_litset_terns(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res);
+
 static struct value eval_expr(const uint8_t *expr, size_t len, 
     struct eval_context *ctx, int depth);
 
@@ -705,6 +1042,9 @@ static struct value eval_comma(const uint8_t *expr, size_t len,
             if (ctx->iter) ctx->iter(res, ctx->iter_udata);
             s = i + 1;
             break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
         case '(': case '[': case '{': case '"': case '\'':
             g = read_group(expr+i, len-i, &glen);
             if (!g) return err_syntax();
@@ -712,7 +1052,11 @@ static struct value eval_comma(const uint8_t *expr, size_t len,
             break;
         }
     }
+    ctx->iter = NULL;
+    ctx->iter_udata = NULL;
     res = eval_auto(STEP_COMMA<<1, expr+s, len-s, ctx, depth); 
+    ctx->iter = iter;
+    ctx->iter_udata = iter_udata;
     if (is_err(res)) return res;
     if (ctx->iter) {
         ctx->iter(res, ctx->iter_udata);
@@ -741,6 +1085,11 @@ static struct value eval_terns(const uint8_t *expr, size_t len,
                 cond = expr;
                 condlen = i;
                 s = i + 1;
+                struct value res;
+                if (eval_litset_terns(expr, len, ctx, depth, &res)) {
+                    // t == 'a' ? 1 : t == 'b' ? 4 : ...
+                    return res;
+                }
             }
             tdepth++;
             break;
@@ -759,6 +1108,9 @@ static struct value eval_terns(const uint8_t *expr, size_t len,
                 return eval_expr(right, rightlen, ctx, depth);
             }
             break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
         case '(': case '[': case '{': case '"': case '\'':
             g = read_group(expr+i, len-i, &glen);
             if (!g) return err_syntax();
@@ -789,7 +1141,9 @@ static struct value vand(struct value a, struct value b) {
     return make_bool(to_bool(a) && to_bool(b));
 }
 
-static struct value vband(struct value a, struct value b) {
+static struct value vband(struct value a, struct value b, 
+    struct eval_context *ctx)
+{
     if (a.kind == b.kind) {
         switch (a.kind) {
         case INT_KIND:
@@ -800,10 +1154,15 @@ static struct value vband(struct value a, struct value b) {
             break;
         }
     }
+    if (int_math(ctx)) {
+        return make_int(to_i64(a) & to_i64(b));
+    }
     return make_float(conv_itof(to_i64(a) & to_i64(b)));
 }
 
-static struct value vbxor(struct value a, struct value b) {
+static struct value vbxor(struct value a, struct value b, 
+    struct eval_context *ctx)
+{
     if (a.kind == b.kind) {
         switch (a.kind) {
         case INT_KIND:
@@ -814,10 +1173,15 @@ static struct value vbxor(struct value a, struct value b) {
             break;
         }
     }
+    if (int_math(ctx)) {
+        return make_int(to_i64(a) ^ to_i64(b));
+    }
     return make_float(conv_itof(to_i64(a) ^ to_i64(b)));
 }
 
-static struct value vbor(struct value a, struct value b) {
+static struct value vbor(struct value a, struct value b, 
+    struct eval_context *ctx)
+{
     if (a.kind == b.kind) {
         switch (a.kind) {
         case INT_KIND:
@@ -828,81 +1192,389 @@ static struct value vbor(struct value a, struct value b) {
             break;
         }
     }
+    if (int_math(ctx)) {
+        return make_int(to_i64(a) | to_i64(b));
+    }
     return make_float(conv_itof(to_i64(a) | to_i64(b)));
 }
 
-static bool string_less(const uint8_t *a, size_t alen, 
-    const uint8_t *b, size_t blen)
+// fold returns the ASCII lowercase of a byte. Unlike tolower() it is not
+// affected by the current locale and is safe for bytes above 127.
+static uint8_t fold(uint8_t c) {
+    return c | (((uint8_t)(c-'A') < 26) << 5);
+}
+
+#if defined(__SSE2__)
+static __m128i fold16(__m128i x) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A'-1)),
+        _mm_cmplt_epi8(x, _mm_set1_epi8('Z'+1)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+#if defined(__AVX2__)
+static __m256i fold32(__m256i x) {
+    __m256i upper = _mm256_and_si256(
+        _mm256_cmpgt_epi8(x, _mm256_set1_epi8('A'-1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('Z'+1), x));
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+#endif
+
+// fold_mismatch returns the index of the first byte that differs between a
+// and b after ASCII case folding, or n if there are no differences.
+static size_t fold_mismatch(const uint8_t *a, const uint8_t *b, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i+32 <= n; i += 32) {
+        __m256i x = fold32(_mm256_loadu_si256((const __m256i*)(a+i)));
+        __m256i y = fold32(_mm256_loadu_si256((const __m256i*)(b+i)));
+        uint32_t neq = ~(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(x, y));
+        if (neq) return i + (size_t)__builtin_ctz(neq);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i+16 <= n; i += 16) {
+        __m128i x = fold16(_mm_loadu_si128((const __m128i*)(a+i)));
+        __m128i y = fold16(_mm_loadu_si128((const __m128i*)(b+i)));
+        uint32_t neq = 0xFFFF ^ (uint32_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(x, y));
+        if (neq) return i + (size_t)__builtin_ctz(neq);
+    }
+#endif
+    for (; i < n; i++) {
+        if (fold(a[i]) != fold(b[i])) return i;
+    }
+    return n;
+}
+
+// Unicode simple case folding (CaseFolding.txt status C and S) for non-ASCII
+// codepoints, stored as runs of codepoints that share the same delta. The
+// stride is 1 for contiguous runs and 2 for alternating upper/lower pairs.
+static const struct fold_range {
+    uint32_t lo;
+    uint8_t n;
+    uint8_t stride;
+    int32_t delta;
+} fold_ranges[] = {
+    { 0x00B5, 1, 1, 775 }, { 0x00C0, 23, 1, 32 }, { 0x00D8, 7, 1, 32 },
+    { 0x0100, 24, 2, 1 }, { 0x0132, 3, 2, 1 }, { 0x0139, 8, 2, 1 },
+    { 0x014A, 23, 2, 1 }, { 0x0178, 1, 1, -121 }, { 0x0179, 3, 2, 1 },
+    { 0x017F, 1, 1, -268 }, { 0x0181, 1, 1, 210 }, { 0x0182, 2, 2, 1 },
+    { 0x0186, 1, 1, 206 }, { 0x0187, 1, 1, 1 }, { 0x0189, 2, 1, 205 },
+    { 0x018B, 1, 1, 1 }, { 0x018E, 1, 1, 79 }, { 0x018F, 1, 1, 202 },
+    { 0x0190, 1, 1, 203 }, { 0x0191, 1, 1, 1 }, { 0x0193, 1, 1, 205 },
+    { 0x0194, 1, 1, 207 }, { 0x0196, 1, 1, 211 }, { 0x0197, 1, 1, 209 },
+    { 0x0198, 1, 1, 1 }, { 0x019C, 1, 1, 211 }, { 0x019D, 1, 1, 213 },
+    { 0x019F, 1, 1, 214 }, { 0x01A0, 3, 2, 1 }, { 0x01A6, 1, 1, 218 },
+    { 0x01A7, 1, 1, 1 }, { 0x01A9, 1, 1, 218 }, { 0x01AC, 1, 1, 1 },
+    { 0x01AE, 1, 1, 218 }, { 0x01AF, 1, 1, 1 }, { 0x01B1, 2, 1, 217 },
+    { 0x01B3, 2, 2, 1 }, { 0x01B7, 1, 1, 219 }, { 0x01B8, 1, 1, 1 },
+    { 0x01BC, 1, 1, 1 }, { 0x01C4, 1, 1, 2 }, { 0x01C5, 1, 1, 1 },
+    { 0x01C7, 1, 1, 2 }, { 0x01C8, 1, 1, 1 }, { 0x01CA, 1, 1, 2 },
+    { 0x01CB, 9, 2, 1 }, { 0x01DE, 9, 2, 1 }, { 0x01F1, 1, 1, 2 },
+    { 0x01F2, 2, 2, 1 }, { 0x01F6, 1, 1, -97 }, { 0x01F7, 1, 1, -56 },
+    { 0x01F8, 20, 2, 1 }, { 0x0220, 1, 1, -130 }, { 0x0222, 9, 2, 1 },
+    { 0x023A, 1, 1, 10795 }, { 0x023B, 1, 1, 1 }, { 0x023D, 1, 1, -163 },
+    { 0x023E, 1, 1, 10792 }, { 0x0241, 1, 1, 1 }, { 0x0243, 1, 1, -195 },
+    { 0x0244, 1, 1, 69 }, { 0x0245, 1, 1, 71 }, { 0x0246, 5, 2, 1 },
+    { 0x0345, 1, 1, 116 }, { 0x0370, 2, 2, 1 }, { 0x0376, 1, 1, 1 },
+    { 0x037F, 1, 1, 116 }, { 0x0386, 1, 1, 38 }, { 0x0388, 3, 1, 37 },
+    { 0x038C, 1, 1, 64 }, { 0x038E, 2, 1, 63 }, { 0x0391, 17, 1, 32 },
+    { 0x03A3, 9, 1, 32 }, { 0x03C2, 1, 1, 1 }, { 0x03CF, 1, 1, 8 },
+    { 0x03D0, 1, 1, -30 }, { 0x03D1, 1, 1, -25 }, { 0x03D5, 1, 1, -15 },
+    { 0x03D6, 1, 1, -22 }, { 0x03D8, 12, 2, 1 }, { 0x03F0, 1, 1, -54 },
+    { 0x03F1, 1, 1, -48 }, { 0x03F4, 1, 1, -60 }, { 0x03F5, 1, 1, -64 },
+    { 0x03F7, 1, 1, 1 }, { 0x03F9, 1, 1, -7 }, { 0x03FA, 1, 1, 1 },
+    { 0x03FD, 3, 1, -130 }, { 0x0400, 16, 1, 80 }, { 0x0410, 32, 1, 32 },
+    { 0x0460, 17, 2, 1 }, { 0x048A, 27, 2, 1 }, { 0x04C0, 1, 1, 15 },
+    { 0x04C1, 7, 2, 1 }, { 0x04D0, 48, 2, 1 }, { 0x0531, 38, 1, 48 },
+    { 0x10A0, 38, 1, 7264 }, { 0x10C7, 1, 1, 7264 }, { 0x10CD, 1, 1, 7264 },
+    { 0x13F8, 6, 1, -8 }, { 0x1C80, 1, 1, -6222 }, { 0x1C81, 1, 1, -6221 },
+    { 0x1C82, 1, 1, -6212 }, { 0x1C83, 2, 1, -6210 }, { 0x1C85, 1, 1, -6211 },
+    { 0x1C86, 1, 1, -6204 }, { 0x1C87, 1, 1, -6180 }, { 0x1C88, 1, 1, 35267 },
+    { 0x1C90, 43, 1, -3008 }, { 0x1CBD, 3, 1, -3008 }, { 0x1E00, 75, 2, 1 },
+    { 0x1E9B, 1, 1, -58 }, { 0x1E9E, 1, 1, -7615 }, { 0x1EA0, 48, 2, 1 },
+    { 0x1F08, 8, 1, -8 }, { 0x1F18, 6, 1, -8 }, { 0x1F28, 8, 1, -8 },
+    { 0x1F38, 8, 1, -8 }, { 0x1F48, 6, 1, -8 }, { 0x1F59, 4, 2, -8 },
+    { 0x1F68, 8, 1, -8 }, { 0x1F88, 8, 1, -8 }, { 0x1F98, 8, 1, -8 },
+    { 0x1FA8, 8, 1, -8 }, { 0x1FB8, 2, 1, -8 }, { 0x1FBA, 2, 1, -74 },
+    { 0x1FBC, 1, 1, -9 }, { 0x1FBE, 1, 1, -7173 }, { 0x1FC8, 4, 1, -86 },
+    { 0x1FCC, 1, 1, -9 }, { 0x1FD8, 2, 1, -8 }, { 0x1FDA, 2, 1, -100 },
+    { 0x1FE8, 2, 1, -8 }, { 0x1FEA, 2, 1, -112 }, { 0x1FEC, 1, 1, -7 },
+    { 0x1FF8, 2, 1, -128 }, { 0x1FFA, 2, 1, -126 }, { 0x1FFC, 1, 1, -9 },
+    { 0x2126, 1, 1, -7517 }, { 0x212A, 1, 1, -8383 }, { 0x212B, 1, 1, -8262 },
+    { 0x2132, 1, 1, 28 }, { 0x2160, 16, 1, 16 }, { 0x2183, 1, 1, 1 },
+    { 0x24B6, 26, 1, 26 }, { 0x2C00, 48, 1, 48 }, { 0x2C60, 1, 1, 1 },
+    { 0x2C62, 1, 1, -10743 }, { 0x2C63, 1, 1, -3814 },
+    { 0x2C64, 1, 1, -10727 }, { 0x2C67, 3, 2, 1 }, { 0x2C6D, 1, 1, -10780 },
+    { 0x2C6E, 1, 1, -10749 }, { 0x2C6F, 1, 1, -10783 },
+    { 0x2C70, 1, 1, -10782 }, { 0x2C72, 1, 1, 1 }, { 0x2C75, 1, 1, 1 },
+    { 0x2C7E, 2, 1, -10815 }, { 0x2C80, 50, 2, 1 }, { 0x2CEB, 2, 2, 1 },
+    { 0x2CF2, 1, 1, 1 }, { 0xA640, 23, 2, 1 }, { 0xA680, 14, 2, 1 },
+    { 0xA722, 7, 2, 1 }, { 0xA732, 31, 2, 1 }, { 0xA779, 2, 2, 1 },
+    { 0xA77D, 1, 1, -35332 }, { 0xA77E, 5, 2, 1 }, { 0xA78B, 1, 1, 1 },
+    { 0xA78D, 1, 1, -42280 }, { 0xA790, 2, 2, 1 }, { 0xA796, 10, 2, 1 },
+    { 0xA7AA, 1, 1, -42308 }, { 0xA7AB, 1, 1, -42319 },
+    { 0xA7AC, 1, 1, -42315 }, { 0xA7AD, 1, 1, -42305 },
+    { 0xA7AE, 1, 1, -42308 }, { 0xA7B0, 1, 1, -42258 },
+    { 0xA7B1, 1, 1, -42282 }, { 0xA7B2, 1, 1, -42261 }, { 0xA7B3, 1, 1, 928 },
+    { 0xA7B4, 8, 2, 1 }, { 0xA7C4, 1, 1, -48 }, { 0xA7C5, 1, 1, -42307 },
+    { 0xA7C6, 1, 1, -35384 }, { 0xA7C7, 2, 2, 1 }, { 0xA7D0, 1, 1, 1 },
+    { 0xA7D6, 2, 2, 1 }, { 0xA7F5, 1, 1, 1 }, { 0xAB70, 80, 1, -38864 },
+    { 0xFF21, 26, 1, 32 }, { 0x10400, 40, 1, 40 }, { 0x104B0, 36, 1, 40 },
+    { 0x10570, 11, 1, 39 }, { 0x1057C, 15, 1, 39 }, { 0x1058C, 7, 1, 39 },
+    { 0x10594, 2, 1, 39 }, { 0x10C80, 51, 1, 64 }, { 0x118A0, 32, 1, 32 },
+    { 0x16E40, 32, 1, 32 }, { 0x1E900, 34, 1, 34 },
+};
+
+// fold_codepoint returns the simple case folding of a codepoint.
+static uint32_t fold_codepoint(uint32_t cp) {
+    if (cp < 0x80) return fold((uint8_t)cp);
+    size_t i = 0;
+    size_t j = sizeof(fold_ranges)/sizeof(fold_ranges[0]);
+    while (i < j) {
+        size_t h = i + (j-i)/2;
+        if (cp < fold_ranges[h].lo) {
+            j = h;
+        } else {
+            i = h + 1;
+        }
+    }
+    if (i == 0) return cp;
+    const struct fold_range *r = &fold_ranges[i-1];
+    uint32_t off = cp - r->lo;
+    if (off < (uint32_t)r->n*r->stride && off%r->stride == 0) {
+        return (uint32_t)((int32_t)cp + r->delta);
+    }
+    return cp;
+}
+
+// lower_ranges are where the lowercase mapping differs from the simple case
+// folding, which are letters that are already lowercase and that fold to
+// another letter, and the Cherokee letters, which fold to uppercase.
+static const struct fold_range lower_ranges[] = {
+    { 0x00B5, 1, 1, 0 }, { 0x017F, 1, 1, 0 }, { 0x0345, 1, 1, 0 },
+    { 0x03C2, 1, 1, 0 }, { 0x03D0, 2, 1, 0 }, { 0x03D5, 2, 1, 0 },
+    { 0x03F0, 2, 1, 0 }, { 0x03F5, 1, 1, 0 }, { 0x13A0, 80, 1, 38864 },
+    { 0x13F0, 6, 1, 8 }, { 0x13F8, 6, 1, 0 }, { 0x1C80, 9, 1, 0 },
+    { 0x1E9B, 1, 1, 0 }, { 0x1FBE, 1, 1, 0 }, { 0xAB70, 80, 1, 0 },
+};
+
+// lower_codepoint returns the simple lowercase mapping of a codepoint.
+static uint32_t lower_codepoint(uint32_t cp) {
+    if (cp < 0x80) return fold((uint8_t)cp);
+    size_t i = 0;
+    size_t j = sizeof(lower_ranges)/sizeof(lower_ranges[0]);
+    while (i < j) {
+        size_t h = i + (j-i)/2;
+        if (cp < lower_ranges[h].lo) {
+            j = h;
+        } else {
+            i = h + 1;
+        }
+    }
+    if (i > 0 && cp - lower_ranges[i-1].lo < lower_ranges[i-1].n) {
+        return (uint32_t)((int32_t)cp + lower_ranges[i-1].delta);
+    }
+    return fold_codepoint(cp);
+}
+
+// cased returns true for a letter that has a case, which is one that is
+// changed by the lowercase mapping or the folding, or that is folded to.
+static bool cased(uint32_t cp) {
+    if (cp < 0x80) return (uint8_t)(fold((uint8_t)cp)-'a') < 26;
+    if (lower_codepoint(cp) != cp || fold_codepoint(cp) != cp) return true;
+    for (size_t i = 0; i < sizeof(fold_ranges)/sizeof(fold_ranges[0]); i++) {
+        const struct fold_range *r = &fold_ranges[i];
+        uint32_t off = cp - (uint32_t)((int32_t)r->lo + r->delta);
+        if (off < (uint32_t)r->n*r->stride && off%r->stride == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// case_ignorable returns true for the common codepoints that are skipped
+// when looking for the letters around a final sigma, which are apostrophes,
+// word joining punctuation, and combining diacritical marks.
+static bool case_ignorable(uint32_t cp) {
+    return cp == '\'' || cp == '.' || cp == ':' || cp == 0xB7 || 
+        cp == 0x2019 || (cp >= 0x0300 && cp <= 0x036F);
+}
+
+// utf8_next decodes the codepoint at the start of s, storing its size in n.
+// Invalid bytes are decoded one at a time as values above the Unicode range,
+// which keeps them distinct from every valid codepoint.
+static uint32_t utf8_next(const uint8_t *s, size_t len, size_t *n) {
+    uint8_t c = s[0];
+    uint32_t cp;
+    size_t need;
+    if (c < 0x80) {
+        *n = 1;
+        return c;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        cp = c & 0x1F;
+        need = 1;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        cp = c & 0x0F;
+        need = 2;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        cp = c & 0x07;
+        need = 3;
+    } else {
+        goto invalid;
+    }
+    if (len <= need) goto invalid;
+    for (size_t i = 1; i <= need; i++) {
+        if ((s[i] & 0xC0) != 0x80) goto invalid;
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    if ((need == 2 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) ||
+        (need == 3 && (cp < 0x10000 || cp > 0x10FFFF)))
+    {
+        goto invalid;
+    }
+    *n = need + 1;
+    return cp;
+invalid:
+    *n = 1;
+    return 0x110000 + c;
+}
+
+// utf8_fold_compare compares two UTF-8 strings codepoint by codepoint after
+// simple case folding.
+static int utf8_fold_compare(const uint8_t *a, size_t alen, const uint8_t *b,
+    size_t blen)
 {
-    size_t n = alen < blen ? alen : blen;
-    for (size_t i = 0; i < n; i++) {
-        if (a[i] < b[i]) return true;
-        if (a[i] > b[i]) return false;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < alen && j < blen) {
+        uint32_t acp, bcp;
+        size_t an, bn;
+        if (a[i] < 0x80 && b[j] < 0x80) {
+            // ASCII fast path
+            acp = fold(a[i]);
+            bcp = fold(b[j]);
+            an = 1;
+            bn = 1;
+        } else {
+            acp = fold_codepoint(utf8_next(a+i, alen-i, &an));
+            bcp = fold_codepoint(utf8_next(b+j, blen-j, &bn));
+        }
+        if (acp != bcp) return acp < bcp ? -1 : 1;
+        i += an;
+        j += bn;
     }
-    return alen < blen;
+    return i < alen ? 1 : j < blen ? -1 : 0;
 }
 
-static bool string_less_insensitive(const uint8_t *a, size_t alen, 
-    const uint8_t *b, size_t blen)
+// string_compare is the three-way comparison for all string operators.
+// Returns < 0, 0, > 0 for less-than, equal-to, greater-than.
+//
+// With no_case, the strings are compared by their Unicode simple case
+// folding. The common prefix is skipped using the vectorized ASCII folding,
+// and only the remainder is decoded and folded codepoint by codepoint.
+static int string_compare(const uint8_t *a, size_t alen, const uint8_t *b, 
+    size_t blen, bool no_case)
 {
     size_t n = alen < blen ? alen : blen;
-    for (size_t i = 0; i < n; i++) {
-        uint8_t ach = (uint8_t)tolower((char)a[i]);
-        uint8_t bch = (uint8_t)tolower((char)b[i]);
-        if (ach < bch) return true;
-        if (ach > bch) return false;
+    if (no_case) {
+        size_t i = fold_mismatch(a, b, n);
+        if (i < n) {
+            if (a[i] < 0x80 && b[i] < 0x80) {
+                return fold(a[i]) < fold(b[i]) ? -1 : 1;
+            }
+            // back up to the start of the codepoint
+            while (i > 0 && ((a[i]&0xC0) == 0x80 || (b[i]&0xC0) == 0x80)) {
+                i--;
+            }
+            return utf8_fold_compare(a+i, alen-i, b+i, blen-i);
+        }
+    } else if (n > 0) {
+        int cmp = memcmp(a, b, n);
+        if (cmp != 0) return cmp;
     }
-    return alen < blen;
+    return alen < blen ? -1 : alen > blen ? 1 : 0;
 }
 
-static struct value vlt(struct value a, struct value b, 
-    struct eval_context *ctx)
+// string_equal is the equality fast path of string_compare.
+static bool string_equal(const uint8_t *a, size_t alen, const uint8_t *b, 
+    size_t blen, bool no_case)
 {
+    if (no_case) {
+        // Folded strings may differ in byte length, such as 'K' (Kelvin
+        // sign) and 'k', so lengths can't be used to bail out early.
+        if (alen == blen && fold_mismatch(a, b, alen) == alen) return true;
+        return string_compare(a, alen, b, blen, true) == 0;
+    }
+    // Strings of different lengths are never equal, so only one pass is
+    // needed otherwise.
+    return alen == blen && (alen == 0 || memcmp(a, b, alen) == 0);
+}
+
+static bool no_case(struct eval_context *ctx) {
+    return ctx && ctx->env && ctx->env->no_case;
+}
+
+// CMP_UNORDERED is returned by vcompare when the values can't be ordered,
+// such as when either is NaN.
+#define CMP_UNORDERED 2
+
+static int fcompare(double a, double b) {
+    if (a < b) return -1;
+    if (a > b) return 1;
+    if (a == b) return 0;
+    return CMP_UNORDERED;
+}
+
+// vcompare performs a three-way comparison of two values, returning -1, 0,
+// 1 or CMP_UNORDERED.
+static int vcompare(struct value a, struct value b, struct eval_context *ctx) {
     if (a.kind == b.kind) {
-        bool less;
         switch (a.kind) {
         case FLOAT_KIND:
-            return make_bool(a.f64 < b.f64);
+            return fcompare(a.f64, b.f64);
         case INT_KIND:
-            return make_bool(a.i64 < b.i64);
+            return (a.i64 > b.i64) - (a.i64 < b.i64);
         case UINT_KIND:
-            return make_bool(a.u64 < b.u64);
-        case STR_KIND:
-            if (ctx && ctx->env && ctx->env->no_case) {
-                less = string_less_insensitive(a.str, a.len, b.str, b.len);
-            } else {
-                less = string_less(a.str, a.len, b.str, b.len);
-            }
-            return make_bool(less);
+            return (a.u64 > b.u64) - (a.u64 < b.u64);
+        case STR_KIND: {
+            int cmp = string_compare(a.str, a.len, b.str, b.len, no_case(ctx));
+            return (cmp > 0) - (cmp < 0);
+        }
         default:
             break;
         }
     }
-    return make_bool(to_f64(a) < to_f64(b));
+    return fcompare(to_f64(a), to_f64(b));
+}
+
+static struct value vlt(struct value a, struct value b, 
+    struct eval_context *ctx)
+{
+    return make_bool(vcompare(a, b, ctx) == -1);
 }
 
 static struct value vlte(struct value a, struct value b, 
     struct eval_context *ctx)
 {
-    struct value t = vlt(a, b, ctx);
-    if (t.t) return t;
-    t = vlt(b, a, ctx);
-    return make_bool(!t.t);
+    int cmp = vcompare(a, b, ctx);
+    return make_bool(cmp == -1 || cmp == 0);
 }
 
 static struct value vgt(struct value a, struct value b, 
     struct eval_context *ctx)
 {
-    return vlt(b, a, ctx);
+    return make_bool(vcompare(a, b, ctx) == 1);
 }
 
 static struct value vgte(struct value a, struct value b, 
     struct eval_context *ctx)
 {
-    struct value t = vgt(a, b, ctx);
-    if (t.t) return t;
-    t = vgt(b, a, ctx);
-    return make_bool(!t.t);
+    int cmp = vcompare(a, b, ctx);
+    return make_bool(cmp == 1 || cmp == 0);
 }
 
 static struct value veq(struct value a, struct value b, 
@@ -911,10 +1583,24 @@ static struct value veq(struct value a, struct value b,
     if (a.kind != b.kind) { // && a.kind != OBJ_KIND && b.kind != OBJ_KIND) {
         return make_bool(to_f64(a) == to_f64(b)); // MARK: float equality
     }
-    struct value t = vlt(a, b, ctx);
-    if (t.t) return make_bool(false);
-    t = vlt(b, a, ctx);
-    return make_bool(!t.t);
+    switch (a.kind) {
+    case STR_KIND:
+        return make_bool(string_equal(a.str, a.len, b.str, b.len, 
+            no_case(ctx)));
+    case FLOAT_KIND:
+        return make_bool(a.f64 == b.f64);
+    case INT_KIND:
+        return make_bool(a.i64 == b.i64);
+    case UINT_KIND:
+        return make_bool(a.u64 == b.u64);
+    case BOOL_KIND:
+        return make_bool(a.t == b.t);
+    default: {
+        // Other values of the same kind are equal unless they are ordered.
+        int cmp = vcompare(a, b, ctx);
+        return make_bool(cmp == 0 || cmp == CMP_UNORDERED);
+    }
+    }
 }
 
 static struct value vneq(struct value a, struct value b, 
@@ -924,12 +1610,20 @@ static struct value vneq(struct value a, struct value b,
     return make_bool(!t.t);
 }
 
-static struct value vseq(struct value a, struct value b, 
+static bool isnumkind(struct value a) {
+    return a.kind == FLOAT_KIND || a.kind == INT_KIND || a.kind == UINT_KIND;
+}
+
+static struct value vseq(struct value a, struct value b, 
     struct eval_context *ctx)
 {
     if (a.kind == b.kind) {
         return veq(a, b, ctx);
     }
+    if (int_math(ctx) && isnumkind(a) && isnumkind(b)) {
+        // int64 and double are both the Javascript number type.
+        return veq(a, b, ctx);
+    }
     return make_bool(false);
 }
 
@@ -981,12 +1675,21 @@ static struct value eval_logical_or(const uint8_t *expr, size_t len,
                 i++;
                 continue;
             }
+            if (op == 0 && expr[i] == '|' && 
+                eval_litset_or(expr, len, ctx, depth, &left))
+            {
+                // c == 'US' || c == 'CA' || ...
+                return left;
+            }
             left = logical_or(left, op, expr+s, i-s, ctx, depth);
             if (is_err(left)) return left;
             op = expr[i];
             i++;
             s = i + 1;
             break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
         case '(': case '[': case '{': case '"': case '\'':
             g = read_group(expr+i, len-i, &glen);
             if (!g) return err_syntax();
@@ -1036,6 +1739,9 @@ static struct value eval_logical_and(const uint8_t *expr, size_t len,
             i++;
             s = i + 1;
             break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
         case '(': case '[': case '{': case '"': case '\'':
             g = read_group(expr+i, len-i, &glen);
             if (!g) return err_syntax();
@@ -1055,7 +1761,7 @@ static struct value bitwise_or(struct value left, uint8_t op,
     if (is_err(right)) return right;
     switch (op) {
     case '|':
-        return vbor(left, right);
+        return vbor(left, right, ctx);
     default:
         return right;
     }
@@ -1077,6 +1783,9 @@ static struct value eval_bitwise_or(const uint8_t *expr, size_t len,
             op = expr[i];
             s = i + 1;
             break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
         case '(': case '[': case '{': case '"': case '\'':
             g = read_group(expr+i, len-i, &glen);
             unreachable(
@@ -1100,7 +1809,7 @@ static struct value bitwise_xor(struct value left, uint8_t op,
     if (is_err(right)) return right;
     switch (op) {
     case '^':
-        return vbxor(left, right);
+        return vbxor(left, right, ctx);
     default:
         return right;
     }
@@ -1122,6 +1831,9 @@ static struct value eval_bitwise_xor(const uint8_t *expr, size_t len,
             op = expr[i];
             s = i + 1;
             break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
         case '(': case '[': case '{': case '"': case '\'':
             g = read_group(expr+i, len-i, &glen);
             if (!g) return err_syntax();
@@ -1141,7 +1853,7 @@ static struct value bitwise_and(struct value left, uint8_t op,
     if (is_err(right)) return right;
     switch (op) {
     case '&':
-        return vband(left, right);
+        return vband(left, right, ctx);
     default:
         return right;
     }
@@ -1163,6 +1875,9 @@ static struct value eval_bitwise_and(const uint8_t *expr, size_t len,
             op = expr[i];
             s = i + 1;
             break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
         case '(': case '[': case '{': case '"': case '\'':
             g = read_group(expr+i, len-i, &glen);
             unreachable( 
@@ -1260,6 +1975,9 @@ static struct value eval_equality(const uint8_t *expr, size_t len,
             i = i + opsz - 1;
             s = i + 1;
             break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
         case '(': case '[': case '{': case '"': case '\'':
             g = read_group(expr+i, len-i, &glen);
             if (!g) return err_syntax();
@@ -1317,6 +2035,9 @@ static struct value eval_comps(const uint8_t *expr, size_t len,
             i = i + opsz - 1;
             s = i + 1;
             break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
         case '(': case '[': case '{': case '"': case '\'':
             g = read_group(expr+i, len-i, &glen);
             if (!g) return err_syntax();
@@ -1327,12 +2048,21 @@ static struct value eval_comps(const uint8_t *expr, size_t len,
     return comp(left, op, expr+s, len-s, ctx, depth);
 }
 
-static struct value vmul(struct value a, struct value b) {
+static struct value vmul(struct value a, struct value b, 
+    struct eval_context *ctx)
+{
+    int64_t x;
     if (a.kind == b.kind) {
         switch (a.kind) {
         case FLOAT_KIND:
             return make_float(a.f64 * b.f64);
         case INT_KIND:
+            if (int_math(ctx) && (__builtin_mul_overflow(a.i64, b.i64, &x) ||
+                (x == 0 && (a.i64 < 0 || b.i64 < 0))))
+            {
+                // overflowed, or is -0
+                return make_float(conv_itof(a.i64) * conv_itof(b.i64));
+            }
             return make_int(a.i64 * b.i64);
         case UINT_KIND:
             return make_uint(a.u64 * b.u64);
@@ -1343,12 +2073,24 @@ static struct value vmul(struct value a, struct value b) {
     return make_float(to_f64(a) * to_f64(b));
 }
 
-static struct value vdiv(struct value a, struct value b) {
+static struct value vdiv(struct value a, struct value b, 
+    struct eval_context *ctx)
+{
     if (a.kind == b.kind) {
         switch (a.kind) {
         case FLOAT_KIND:
             return make_float(a.f64 / b.f64);
         case INT_KIND:
+            if (int_math(ctx)) {
+                // Javascript division, which stays an integer only when the
+                // division is exact.
+                if (b.i64 != 0 && !(a.i64 == INT64_MIN && b.i64 == -1) &&
+                    a.i64 % b.i64 == 0 && !(a.i64 == 0 && b.i64 < 0))
+                {
+                    return make_int(a.i64 / b.i64);
+                }
+                return make_float(conv_itof(a.i64) / conv_itof(b.i64));
+            }
             if (b.i64 == 0) {
                 return make_float(NAN);
             }
@@ -1365,13 +2107,25 @@ static struct value vdiv(struct value a, struct value b) {
     return make_float(to_f64(a) / to_f64(b));
 }
 
-static struct value vmod(struct value a, struct value b) {
+static struct value vmod(struct value a, struct value b, 
+    struct eval_context *ctx)
+{
     if (a.kind == b.kind) {
         switch (a.kind) {
         case INT_KIND:
             if (b.i64 == 0) {
                 return make_float(NAN);
             }
+            if (int_math(ctx) && a.i64 < 0 && (b.i64 == -1 || 
+                a.i64 % b.i64 == 0))
+            {
+                // Javascript keeps the sign of the dividend, which is -0
+                return make_float(-0.0);
+            }
+            if (b.i64 == -1) {
+                // avoids overflow of INT64_MIN % -1
+                return make_int(0);
+            }
             return make_int(a.i64 % b.i64);
         case UINT_KIND:
             if (b.u64 == 0) {
@@ -1396,12 +2150,18 @@ static struct value string_concat(const uint8_t *astr, size_t alen,
     return make_string(str, alen+blen);
 }
 
-static struct value vadd(struct value a, struct value b) {
+static struct value vadd(struct value a, struct value b, 
+    struct eval_context *ctx)
+{
+    int64_t x;
     if (a.kind == b.kind) {
         switch (a.kind) {
         case FLOAT_KIND:
             return make_float(a.f64 + b.f64);
         case INT_KIND:
+            if (int_math(ctx) && __builtin_add_overflow(a.i64, b.i64, &x)) {
+                return make_float(conv_itof(a.i64) + conv_itof(b.i64));
+            }
             return make_int(a.i64 + b.i64);
         case UINT_KIND:
             return make_uint(a.u64 + b.u64);
@@ -1426,12 +2186,18 @@ static struct value vadd(struct value a, struct value b) {
     return string_concat(astr, alen, bstr, blen);
 }
 
-static struct value vsub(struct value a, struct value b) {
+static struct value vsub(struct value a, struct value b, 
+    struct eval_context *ctx)
+{
+    int64_t x;
     if (a.kind == b.kind) {
         switch (a.kind) {
         case FLOAT_KIND:
             return make_float(a.f64 - b.f64);
         case INT_KIND:
+            if (int_math(ctx) && __builtin_sub_overflow(a.i64, b.i64, &x)) {
+                return make_float(conv_itof(a.i64) - conv_itof(b.i64));
+            }
             return make_int(a.i64 - b.i64);
         case UINT_KIND:
             return make_uint(a.u64 - b.u64);
@@ -1442,6 +2208,17 @@ static struct value vsub(struct value a, struct value b) {
     return make_float(to_f64(a) - to_f64(b));
 }
 
+static struct value vneg(struct value a, struct eval_context *ctx) {
+    if (a.kind == INT_KIND) {
+        if (a.i64 == INT64_MIN || (a.i64 == 0 && int_math(ctx))) {
+            // overflowed, or is -0
+            return make_float(-conv_itof(a.i64));
+        }
+        return make_int(-a.i64);
+    }
+    return vmul(a, make_float(-1), NULL);
+}
+
 static struct value sum(struct value left, uint8_t op, const uint8_t *expr, 
     size_t len, bool neg, struct eval_context *ctx, int depth)
 {
@@ -1454,14 +2231,13 @@ static struct value sum(struct value left, uint8_t op, const uint8_t *expr,
     if (is_err(right)) return right;
     if (neg) {
         // make right negative
-        right = vmul(right, make_float(-1));
-        if (is_err(right)) return right;
+        right = vneg(right, ctx);
     }
     switch (op) {
     case '+':
-        return vadd(left, right);
+        return vadd(left, right, ctx);
     case '-':
-        return vsub(left, right);
+        return vsub(left, right, ctx);
     default:
         return right;
     }
@@ -1480,6 +2256,51 @@ static uint8_t closech(uint8_t open) {
     return open;
 }
 
+// read_regex reads a regular expression literal, such as /ab+c/i, returning
+// its length including the flags, or zero if it's not terminated.
+static size_t read_regex(const uint8_t *data, size_t len) {
+    bool inclass = false;
+    for (size_t i = 1; i < len; i++) {
+        switch (data[i]) {
+        case '\\':
+            i++;
+            break;
+        case '\n': case '\r':
+            return 0;
+        case '[':
+            inclass = true;
+            break;
+        case ']':
+            inclass = false;
+            break;
+        case '/':
+            if (inclass) break;
+            if (i == 1) return 0; // '//' is a comment in Javascript
+            i++;
+            while (i < len && (uint8_t)((data[i]|32)-'a') < 26) i++;
+            return i;
+        }
+    }
+    return 0;
+}
+
+// regex_start returns true if the '/' at expr[i] starts a regular expression
+// literal, rather than being the division operator. A division always
+// follows an operand, such as an identifier, a number or a closing bracket,
+// while a literal can only be where an operand is expected.
+static bool regex_start(const uint8_t *expr, size_t i) {
+    while (i > 0 && isws(expr[i-1])) i--;
+    if (i == 0) return true;
+    switch (expr[i-1]) {
+    case '(': case '[': case '{': case ',': case ';': case ':': case '?':
+    case '=': case '!': case '&': case '|': case '^': case '~': case '<':
+    case '>': case '+': case '-': case '*': case '%':
+        return true;
+    default:
+        return false;
+    }
+}
+
 static const uint8_t *squash(const uint8_t *data, size_t len, size_t *out_len) {
     // expects that the lead character is
     //   '[' or '{' or '(' or '"' or '\''
@@ -1535,6 +2356,13 @@ static const uint8_t *squash(const uint8_t *data, size_t len, size_t *out_len) {
                 return data;
             }
             break;
+        case '/':
+            if (regex_start(data, i)) {
+                s2 = read_regex(data+i, len-i);
+                if (s2 == 0) return NULL;
+                i += s2-1;
+            }
+            break;
         case '{': case '[': case '(':
             depth++;
             break;
@@ -1553,6 +2381,11 @@ static const uint8_t *squash(const uint8_t *data, size_t len, size_t *out_len) {
 static const uint8_t *read_group(const uint8_t *data, size_t len, 
     size_t *len_out)
 {
+    if (data[0] == '/') {
+        // regular expression literal
+        *len_out = read_regex(data, len);
+        return *len_out ? data : NULL;
+    }
     const uint8_t *g = squash(data, len, len_out);
     if (!g) return NULL;
     if (*len_out < 2 || g[*len_out-1] != closech(data[0])) return NULL;
@@ -1620,28 +2453,29 @@ static const uint8_t *read_ident(const uint8_t *expr, size_t len,
 static size_t read_codepoint(const uint8_t *expr, size_t len, uint8_t which, 
     uint32_t *cp)
 {
-    int x = 0;
+    bool ok;
     size_t n = 0;
+    uint64_t x = 0;
     if (which == 'x') {
-        x = strtol((char*)expr, NULL, 16);
         n = 2;
-    } else {
-        size_t s = 0;
-        if (expr[0] == '{') {
-            s = 1;
-            n = len;
-            for (size_t i = 0; i < len; i++) {
-                if (expr[i] == '}') {
-                    n = i + 1;
-                    break;
-                }
+        x = parse_uint(expr, n, 16, &ok);
+    } else if (expr[0] == '{') {
+        n = len;
+        for (size_t i = 0; i < len; i++) {
+            if (expr[i] == '}') {
+                n = i + 1;
+                break;
             }
-        } else {
-            n = 4;
         }
-        x = strtol((char*)expr+s, NULL, 16);
+        x = parse_uint(expr+1, n-2, 16, &ok);
+        if (x > 0x10FFFF) {
+            x = 0xFFFD;
+        }
+    } else {
+        n = 4;
+        x = parse_uint(expr, n, 16, &ok);
     }
-    *cp = x;
+    *cp = (uint32_t)x;
     return n;
 }
 
@@ -1825,10 +2659,16 @@ fail:
 // get_ref_value takes the value from an external reference. 
 // It's possible that the ref value is on the heap, and if so we need to 
 // steal it and place it in the allocs list.
+static struct value map_get(struct value map, const uint8_t *key, 
+    size_t klen);
+
 static struct value get_ref_value(bool chain, struct value left, 
     const uint8_t *ident, size_t ilen, bool opt_chain, 
     struct eval_context *ctx)
 {
+    if (left.kind == MAP_KIND) {
+        return map_get(left, ident, ilen);
+    }
     if (left.kind == JSON_KIND) {
         struct json json = json_parsen((char*)left.str, left.len);
         struct json key;
@@ -1841,7 +2681,7 @@ static struct value get_ref_value(bool chain, struct value left,
                 val = json_next(key);
                 if (json_string_comparen(key, (char*)ident, ilen) == 0) {
                     return make_json((uint8_t*)json_raw(val), 
-                        json_raw_length(val));
+                        json_raw_length(val), int_math(ctx));
                 }
                 key = json_next(val);
             }
@@ -1852,7 +2692,7 @@ static struct value get_ref_value(bool chain, struct value left,
                 while (json_exists(val)) {
                     if (index == 0) {
                         return make_json((uint8_t*)json_raw(val), 
-                            json_raw_length(val));
+                            json_raw_length(val), int_math(ctx));
                     }
                     index--;
                     val = json_next(val);
@@ -1861,6 +2701,20 @@ static struct value get_ref_value(bool chain, struct value left,
         }
         return make_undefined();
     }
+    if (left.kind == ARRAY_KIND || left.kind == TYPED_KIND) {
+        // arrays, such as the results of match(), and typed arrays are
+        // indexed natively
+        if (ilen == 6 && memcmp(ident, "length", 6) == 0) {
+            return make_float((double)left.len);
+        }
+        bool ok = false;
+        uint64_t index = parse_uint(ident, ilen, 10, &ok);
+        if (ok && index < left.len) {
+            return left.kind == ARRAY_KIND ? left.arr[index] : 
+                typed_at(left, index, int_math(ctx));
+        }
+        return make_undefined();
+    }
     if (!ctx->env || !ctx->env->ref) {
         return err_undefined(ident, ilen, chain);
     }
@@ -1884,8 +2738,8 @@ static struct value get_ref_value(bool chain, struct value left,
 }
 
 static struct value eval_foreach(const uint8_t *expr, size_t len, 
-    struct xv_env *env, void (*iter)(struct value, void *udata), void *udata,
-    int depth);
+    struct xv_env *env, struct scope *scope, 
+    void (*iter)(struct value, void *udata), void *udata, int depth);
 
 struct multi_iter_context {
     struct array *arr;
@@ -1906,221 +2760,5534 @@ static struct value multi_exprs_to_array(const uint8_t *expr, size_t len,
     if (!arr) return err_oom();
     memset(arr, 0, sizeof(struct array));
     struct multi_iter_context ictx = { .arr = arr };
-    struct value last = eval_foreach(expr, len, ctx->env, multi_iter, &ictx, 
-        depth);
+    struct value last = eval_foreach(expr, len, ctx->env, ctx->scope, 
+        multi_iter, &ictx, depth);
     if (is_err(last)) return last;
     if (ictx.oom) return err_oom();
     struct value v = make_array(arr->items, arr->len);
     return v;
 }
 
-static struct value eval_atom(const uint8_t *expr, size_t len,
-    struct eval_context *ctx, int depth)
-{
-    expr = trim(expr, len, &len);
-    if (len == 0) {
-        return err_syntax();
+///////////////////////////////////////////
+// Regular expressions
+///////////////////////////////////////////
+
+// Regular expression literals, such as /^Mozilla.*Chrome\/(\d+)/i, are
+// compiled into a Thompson NFA and matched in time linear to the input.
+// Nothing backtracks, so a pattern like /(a+)+$/ can't blow up on hostile
+// input. Backreferences and lookaround need backtracking and are not
+// supported.
+//
+// test() runs a lazily built DFA, whose states are sets of NFA instructions
+// that are created the first time they're reached. match(), exec() and
+// search() run a Pike VM, which finds the leftmost match and its capture
+// groups in a single pass. Both step over whole codepoints, as if the 'u'
+// flag was always used.
+//
+// Compiled patterns are kept in a small per-thread cache that's keyed by the
+// pattern and flags, so each pattern is compiled once per thread rather than
+// on every evaluation.
+
+static const uint8_t *find_bytes(const uint8_t *h, size_t hlen,
+    const uint8_t *n, size_t nlen);
+
+#define RE_INF UINT32_MAX     // unbounded repeat
+#define RE_END UINT32_MAX     // end of input
+#define RE_MAXCP 0x1100FF     // largest codepoint, including invalid bytes
+#define RE_MAXINSTS 10000     // largest compiled program
+#define RE_MAXREPEAT 100000   // largest {n,m} count
+
+enum re_flag {
+    RE_GLOBAL    = 1<<0, // g
+    RE_ICASE     = 1<<1, // i
+    RE_MULTILINE = 1<<2, // m
+    RE_DOTALL    = 1<<3, // s
+    RE_UNICODE   = 1<<4, // u
+    RE_STICKY    = 1<<5, // y
+};
+
+static const char re_flag_chars[] = "gimsuy";
+
+enum re_op {
+    RE_CHAR, RE_ANY, RE_ANYNL, RE_CLASS, RE_MATCH, RE_JMP, RE_SPLIT, RE_SAVE,
+    RE_BOL, RE_EOL, RE_WORDB, RE_NWORDB,
+};
+
+struct re_inst {
+    uint8_t op;
+    uint32_t x; // codepoint, class, jump target, or capture slot
+    uint32_t y; // second split target
+};
+
+struct re_range {
+    uint32_t lo;
+    uint32_t hi;
+};
+
+struct re_class {
+    uint64_t ascii[2]; // membership of codepoints 0-127, after negation
+    uint32_t start;    // first range
+    uint32_t n;        // number of ranges
+    bool neg;
+};
+
+// The context flags describe the character before the current position,
+// which is what the ^, $, \b and \B assertions depend on.
+enum re_ctx {
+    RS_START = 1<<0, // at the start of the input
+    RS_WORD  = 1<<1, // after a word character
+    RS_NL    = 1<<2, // after a line terminator
+};
+
+struct re_dstate {
+    struct re_dstate *next[128]; // cached transitions on ASCII characters
+    struct re_dstate *hnext;     // hashtable chain
+    uint32_t hash;
+    uint8_t ctx;
+    int8_t endmatch;             // -1 unknown, 0 no match, 1 match
+    uint32_t npcs;
+    uint32_t pcs[];
+};
+
+#define RE_DSTATE_BUCKETS 64
+
+struct regex {
+    uint32_t hash;
+    int flags;
+    uint8_t *pattern;
+    size_t plen;
+    struct re_inst *insts;
+    uint32_t ninsts;
+    struct re_class *classes;
+    struct re_range *ranges;
+    uint32_t ncaps;         // capture groups, including the whole match
+    bool anchored;          // can only match at the start of the input
+    uint8_t ctxmask;        // context flags that the assertions depend on
+    uint8_t *lit;           // the pattern is this plain string
+    size_t litlen;
+    // lazy DFA and scratch space
+    struct re_dstate *buckets[RE_DSTATE_BUCKETS];
+    size_t dfasize;
+    struct re_dstate *start;
+    uint32_t *marks;
+    uint32_t gen;
+    uint32_t *stack;
+    uint32_t *pcs;
+};
+
+// re_matched is the DFA transition taken when a match has been found.
+static struct re_dstate re_matched;
+
+static bool re_is_word(uint32_t c) {
+    return (c|32)-'a' < 26 || c-'0' < 10 || c == '_';
+}
+
+static bool re_is_nl(uint32_t c) {
+    return c == '\n' || c == '\r' || c == 0x2028 || c == 0x2029;
+}
+
+static void *re_grow(void *ptr, size_t len, size_t *cap, size_t elsize) {
+    size_t cap2 = *cap ? *cap*2 : 16;
+    void *mem = emalloc0(cap2*elsize);
+    if (!mem) return NULL;
+    if (ptr) {
+        memcpy(mem, ptr, len*elsize);
+        efree0(ptr);
     }
-    struct value left = { 0 };
-    bool left_ready = false;
-    size_t glen;
-    const uint8_t *g;
-    size_t slen;
-    size_t rlen;
+    *cap = cap2;
+    return mem;
+}
+
+enum re_node_type {
+    RN_EMPTY, RN_CHAR, RN_ANY, RN_CLASS, RN_CAT, RN_ALT, RN_REP, RN_GROUP,
+    RN_ASSERT,
+};
+
+// Concatenations and alternations are chained through their right child,
+// so that long patterns can be compiled without deep recursion.
+struct re_node {
+    uint8_t type;
+    bool greedy;
+    uint32_t a;     // codepoint, class, assertion, group, or min repeat
+    uint32_t b;     // max repeat
+    int32_t left;
+    int32_t right;
+};
+
+struct re_parser {
+    const uint8_t *p;
+    size_t len;
+    size_t i;
+    int flags;
+    int depth;
     bool oom;
-    const uint8_t *str;
+    uint32_t ncaps;
+    struct re_node *nodes;
+    size_t nnodes;
+    size_t nodescap;
+    struct re_range *ranges;
+    size_t nranges;
+    size_t rangescap;
+    struct re_class *classes;
+    size_t nclasses;
+    size_t classescap;
+};
 
-    // first look for non-chainable atoms
-    switch (expr[0]) {
-    case '0':
-        if (len > 1 && (expr[1] == 'x' || expr[1] == 'X')) {
-            // hexadecimal
-            bool ok = false;
-            uint64_t x = parse_uint(expr+2, len-2, 16, &ok);
-            if (!ok) {
-                return err_syntax();
-            }
-            return make_float((double)x);
+static int32_t re_node(struct re_parser *p, uint8_t type, uint32_t a,
+    uint32_t b, int32_t left, int32_t right)
+{
+    if (p->nnodes == p->nodescap) {
+        void *mem = re_grow(p->nodes, p->nnodes, &p->nodescap,
+            sizeof(struct re_node));
+        if (!mem) {
+            p->oom = true;
+            return -1;
         }
-        // fall through
-    case '-': case'.': case '1': case '2': case '3': case '4': case '5': 
-    case '6': case '7': case '8': case '9':
-        if (len > 3 && has_suffix(expr, len, "64")) {
-            if (expr[len-3] == 'u') {
-                bool ok = false;
-                uint64_t x = parse_uint(expr, len-3, 10, &ok);
-                if (!ok) {
-                    return err_syntax();
-                }
-                return make_uint(x);
-            }
-            if (expr[len-3] == 'i') {
-                bool ok = false;
-                int64_t x = parse_int(expr, len-3, 10, &ok);
-                if (!ok) {
-                    return err_syntax();
-                }
-                return make_int(x);
+        p->nodes = mem;
+    }
+    p->nodes[p->nnodes] = (struct re_node){
+        .type = type, .greedy = true, .a = a, .b = b, .left = left,
+        .right = right,
+    };
+    return (int32_t)p->nnodes++;
+}
+
+static bool re_add_range(struct re_parser *p, uint32_t lo, uint32_t hi) {
+    if (p->nranges == p->rangescap) {
+        void *mem = re_grow(p->ranges, p->nranges, &p->rangescap,
+            sizeof(struct re_range));
+        if (!mem) {
+            p->oom = true;
+            return false;
+        }
+        p->ranges = mem;
+    }
+    p->ranges[p->nranges++] = (struct re_range){ lo, hi };
+    return true;
+}
+
+static const struct re_range re_digit_ranges[] = {
+    { '0', '9' },
+};
+
+static const struct re_range re_word_ranges[] = {
+    { '0', '9' }, { 'A', 'Z' }, { '_', '_' }, { 'a', 'z' },
+};
+
+static const struct re_range re_space_ranges[] = {
+    { 0x09, 0x0D }, { 0x20, 0x20 }, { 0xA0, 0xA0 }, { 0x1680, 0x1680 },
+    { 0x2000, 0x200A }, { 0x2028, 0x2029 }, { 0x202F, 0x202F },
+    { 0x205F, 0x205F }, { 0x3000, 0x3000 }, { 0xFEFF, 0xFEFF },
+};
+
+// re_add_escape_ranges adds the ranges of a \d, \w or \s class escape, or
+// of their negations \D, \W and \S.
+static bool re_add_escape_ranges(struct re_parser *p, int kind) {
+    const struct re_range *r;
+    size_t n;
+    switch (kind|32) {
+    case 'd':
+        r = re_digit_ranges;
+        n = sizeof(re_digit_ranges)/sizeof(re_digit_ranges[0]);
+        break;
+    case 'w':
+        r = re_word_ranges;
+        n = sizeof(re_word_ranges)/sizeof(re_word_ranges[0]);
+        break;
+    default:
+        r = re_space_ranges;
+        n = sizeof(re_space_ranges)/sizeof(re_space_ranges[0]);
+        break;
+    }
+    if (kind >= 'a') {
+        for (size_t i = 0; i < n; i++) {
+            if (!re_add_range(p, r[i].lo, r[i].hi)) return false;
+        }
+        return true;
+    }
+    uint32_t lo = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (r[i].lo > lo && !re_add_range(p, lo, r[i].lo-1)) return false;
+        lo = r[i].hi+1;
+    }
+    return re_add_range(p, lo, RE_MAXCP);
+}
+
+// re_add_folds adds the case folding of every codepoint in a range.
+static bool re_add_folds(struct re_parser *p, uint32_t lo, uint32_t hi) {
+    uint32_t a = lo > 'A' ? lo : 'A';
+    uint32_t b = hi < 'Z' ? hi : 'Z';
+    if (a <= b && !re_add_range(p, a+32, b+32)) return false;
+    if (hi < fold_ranges[0].lo) return true;
+    for (size_t i = 0; i < sizeof(fold_ranges)/sizeof(fold_ranges[0]); i++) {
+        const struct fold_range *r = &fold_ranges[i];
+        if (r->lo > hi) break;
+        for (uint32_t j = 0; j < r->n; j++) {
+            uint32_t cp = r->lo + j*r->stride;
+            if (cp >= lo && cp <= hi) {
+                uint32_t f = (uint32_t)((int32_t)cp + r->delta);
+                if (!re_add_range(p, f, f)) return false;
             }
         }
-        bool ok = false;
-        double x = parse_float(expr, len, &ok);
-        if (!ok) {
-            return err_syntax();
+    }
+    return true;
+}
+
+static int re_range_cmp(const void *a, const void *b) {
+    const struct re_range *ra = a;
+    const struct re_range *rb = b;
+    return (ra->lo > rb->lo) - (ra->lo < rb->lo);
+}
+
+static bool re_ranges_has(const struct re_range *r, uint32_t n, uint32_t c) {
+    uint32_t i = 0;
+    uint32_t j = n;
+    while (i < j) {
+        uint32_t h = i + (j-i)/2;
+        if (c < r[h].lo) {
+            j = h;
+        } else if (c > r[h].hi) {
+            i = h + 1;
+        } else {
+            return true;
         }
-        return make_float(x);
-    case '"': case '\'':
-        str = parse_string(expr, len, &slen, &rlen, &oom);
-        if (!str) {
-            return oom ? err_oom() : err_syntax();
+    }
+    return false;
+}
+
+// re_make_class turns the ranges added since start into a class node. The
+// ranges are sorted and merged, and with the 'i' flag the case foldings of
+// the ranges are added too, so that a codepoint is in the class when it or
+// its case folding is in the ranges.
+static int32_t re_make_class(struct re_parser *p, size_t start, bool neg) {
+    if (p->flags & RE_ICASE) {
+        size_t end = p->nranges;
+        for (size_t i = start; i < end; i++) {
+            if (!re_add_folds(p, p->ranges[i].lo, p->ranges[i].hi)) return -1;
         }
-        left = make_string(str, slen);
-        left_ready = true;
-        expr = expr+rlen;
-        len -= rlen;
-        break;
-    case '(': case '{': case '[':
-        g = read_group(expr, len, &glen);
-        if (!g) return err_syntax();
-        if (g[0] == '(') {
-            // paren groups can be evaluated and used as the leading value.
-            left = eval_expr(g+1, len-2, ctx, depth);
-            if (is_err(left)) return left;
-            left_ready = true;
-            expr += glen;
-            len -= glen;
-        } else if (g[0] == '[') {
-            left = multi_exprs_to_array(g+1, glen-2, ctx, depth);
-            if (is_err(left)) return left;
-            left_ready = true;
-            expr += glen;
-            len -= glen;
+    }
+    struct re_range *r = p->ranges+start;
+    size_t n = p->nranges-start;
+    qsort(r, n, sizeof(struct re_range), re_range_cmp);
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (m > 0 && r[i].lo <= r[m-1].hi+1) {
+            if (r[i].hi > r[m-1].hi) r[m-1].hi = r[i].hi;
         } else {
-            // '{' is not currently allowed as a leading value
-            // Perhaps in the future.
-            return err_syntax();
+            r[m++] = r[i];
         }
-        break;
     }
-    const uint8_t *left_ident = NULL;
-    size_t left_ident_len = 0;
-    if (!left_ready) {
-        // probably a chainable identifier
-        size_t ilen;
-        const uint8_t *ident = read_ident(expr, len, &ilen);
-        if (!ident) return err_syntax();
+    p->nranges = start+m;
+    struct re_class cls = { .start = (uint32_t)start, .n = (uint32_t)m,
+        .neg = neg };
+    for (uint32_t c = 0; c < 128; c++) {
+        bool in = re_ranges_has(r, cls.n, c) || ((p->flags & RE_ICASE) &&
+            re_ranges_has(r, cls.n, fold((uint8_t)c)));
+        if (in != neg) cls.ascii[c>>6] |= (uint64_t)1 << (c&63);
+    }
+    if (p->nclasses == p->classescap) {
+        void *mem = re_grow(p->classes, p->nclasses, &p->classescap,
+            sizeof(struct re_class));
+        if (!mem) {
+            p->oom = true;
+            return -1;
+        }
+        p->classes = mem;
+    }
+    p->classes[p->nclasses] = cls;
+    return re_node(p, RN_CLASS, (uint32_t)p->nclasses++, 0, -1, -1);
+}
 
-        // TODO: maybe use a tiny hashtable
-        if (ilen == 4 && memcmp(ident, "true", 4) == 0) {
-            left = make_bool(true);
-        } else if (ilen == 5 && memcmp(ident, "false", 5) == 0) {
-            left = make_bool(false);
-        } else if (ilen == 4 && memcmp(ident, "null", 4) == 0) {
-            left = make_null();
-        } else if (ilen == 9 && memcmp(ident, "undefined", 9) == 0) {
-            left = make_undefined();
-        } else if (ilen == 3 && memcmp(ident, "NaN", 3) == 0) {
-            left = make_float(NAN);
-        } else if (ilen == 8 && memcmp(ident, "Infinity", 8) == 0) {
-            left = make_float(INFINITY);
-        } else if ((ilen == 2 && memcmp(ident, "in", 2) == 0) ||
-                   (ilen == 3 && memcmp(ident, "new", 3) == 0) ||
-                   (ilen == 4 && memcmp(ident, "void", 4) == 0) ||
-                   (ilen == 5 && memcmp(ident, "await", 5) == 0) ||
-                   (ilen == 5 && memcmp(ident, "yield", 5) == 0) ||
-                   (ilen == 6 && memcmp(ident, "typeof", 6) == 0) ||
-                   (ilen == 8 && memcmp(ident, "function", 8) == 0) ||
-                   (ilen == 10 && memcmp(ident, "instanceof", 10) == 0))
+static bool re_peek(struct re_parser *p, uint8_t c) {
+    return p->i < p->len && p->p[p->i] == c;
+}
+
+static bool re_read_hex(struct re_parser *p, size_t n, uint32_t *cp) {
+    if (p->len-p->i < n) return false;
+    uint32_t x = 0;
+    for (size_t j = 0; j < n; j++) {
+        int v = hexval(p->p[p->i+j]);
+        if (v < 0) return false;
+        x = (x << 4) | (uint32_t)v;
+    }
+    p->i += n;
+    *cp = x;
+    return true;
+}
+
+// re_parse_escape parses what follows a backslash. Returns zero with the
+// codepoint stored in cp, or one of 'd', 'D', 'w', 'W', 's', 'S' for a
+// class escape, 'b' or 'B' for a word boundary assertion, or -1 for a
+// syntax error.
+static int re_parse_escape(struct re_parser *p, bool inclass, uint32_t *cp) {
+    if (p->i == p->len) return -1;
+    uint8_t c = p->p[p->i];
+    switch (c) {
+    case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+        p->i++;
+        return c;
+    case 'b':
+        p->i++;
+        if (inclass) {
+            *cp = '\b';
+            return 0;
+        }
+        return c;
+    case 'B':
+        if (inclass) break;
+        p->i++;
+        return c;
+    case 'n':
+        p->i++;
+        *cp = '\n';
+        return 0;
+    case 'r':
+        p->i++;
+        *cp = '\r';
+        return 0;
+    case 't':
+        p->i++;
+        *cp = '\t';
+        return 0;
+    case 'v':
+        p->i++;
+        *cp = '\v';
+        return 0;
+    case 'f':
+        p->i++;
+        *cp = '\f';
+        return 0;
+    case '0':
+        p->i++;
+        if (p->i < p->len && p->p[p->i] >= '0' && p->p[p->i] <= '9') {
+            // octal escapes are not supported
+            return -1;
+        }
+        *cp = 0;
+        return 0;
+    case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+    case '8': case '9': case 'k':
+        // backreferences are not supported
+        return -1;
+    case 'c':
+        if (p->i+1 < p->len && (uint8_t)((p->p[p->i+1]|32)-'a') < 26) {
+            *cp = p->p[p->i+1] & 31;
+            p->i += 2;
+            return 0;
+        }
+        return -1;
+    case 'x':
+        p->i++;
+        if (re_read_hex(p, 2, cp)) return 0;
+        *cp = c;
+        return 0;
+    case 'u':
+        p->i++;
+        if (re_peek(p, '{')) {
+            size_t j = p->i+1;
+            uint32_t x = 0;
+            while (j < p->len && hexval(p->p[j]) >= 0 && x <= 0x10FFFF) {
+                x = (x << 4) | (uint32_t)hexval(p->p[j]);
+                j++;
+            }
+            if (j == p->i+1 || j == p->len || p->p[j] != '}' || x > 0x10FFFF) {
+                return -1;
+            }
+            p->i = j+1;
+            *cp = x;
+            return 0;
+        }
+        if (!re_read_hex(p, 4, cp)) {
+            *cp = c;
+            return 0;
+        }
+        if (*cp >= 0xD800 && *cp <= 0xDBFF && p->i+1 < p->len &&
+            p->p[p->i] == '\\' && p->p[p->i+1] == 'u')
         {
-            // unsupported keyword
-            return err_unsupported_keyword(ident, ilen);
+            // surrogate pair
+            size_t i = p->i;
+            uint32_t lo;
+            p->i += 2;
+            if (re_read_hex(p, 4, &lo) && lo >= 0xDC00 && lo <= 0xDFFF) {
+                *cp = 0x10000 + ((*cp - 0xD800) << 10) + (lo - 0xDC00);
+            } else {
+                p->i = i;
+            }
+        }
+        return 0;
+    }
+    // identity escape
+    size_t n;
+    *cp = utf8_next(p->p+p->i, p->len-p->i, &n);
+    p->i += n;
+    return 0;
+}
+
+static int re_parse_class_atom(struct re_parser *p, uint32_t *cp) {
+    if (p->p[p->i] == '\\') {
+        p->i++;
+        return re_parse_escape(p, true, cp);
+    }
+    size_t n;
+    *cp = utf8_next(p->p+p->i, p->len-p->i, &n);
+    p->i += n;
+    return 0;
+}
+
+static int32_t re_parse_class(struct re_parser *p) {
+    // the '[' has been consumed
+    size_t start = p->nranges;
+    bool neg = false;
+    if (re_peek(p, '^')) {
+        neg = true;
+        p->i++;
+    }
+    while (1) {
+        if (p->i == p->len) return -1;
+        if (p->p[p->i] == ']') {
+            p->i++;
+            break;
+        }
+        uint32_t lo, hi;
+        int kind = re_parse_class_atom(p, &lo);
+        if (kind < 0) return -1;
+        if (kind > 0) {
+            if (!re_add_escape_ranges(p, kind)) return -1;
+            continue;
+        }
+        if (p->i+1 < p->len && p->p[p->i] == '-' && p->p[p->i+1] != ']') {
+            p->i++;
+            kind = re_parse_class_atom(p, &hi);
+            if (kind < 0) return -1;
+            if (kind > 0) {
+                // a class escape can't end a range, so the '-' is literal
+                if (!re_add_range(p, lo, lo) || !re_add_range(p, '-', '-') ||
+                    !re_add_escape_ranges(p, kind))
+                {
+                    return -1;
+                }
+                continue;
+            }
+            if (hi < lo) return -1;
         } else {
-            left = get_ref_value(false, make_undefined(), ident, ilen, false, 
-                ctx);
-            if (is_err(left)) return left;
+            hi = lo;
         }
-        left_ready = true;
-        expr = expr+ilen;
-        len -= ilen;
-        left_ident = ident;
-        left_ident_len = ilen;
+        if (!re_add_range(p, lo, hi)) return -1;
+    }
+    return re_make_class(p, start, neg);
+}
+
+static bool re_parse_count(struct re_parser *p, uint32_t *x) {
+    size_t s = p->i;
+    uint32_t n = 0;
+    while (p->i < p->len && p->p[p->i] >= '0' && p->p[p->i] <= '9') {
+        n = n*10 + (p->p[p->i] - '0');
+        if (n > RE_MAXREPEAT) n = RE_MAXREPEAT;
+        p->i++;
     }
+    *x = n;
+    return p->i > s;
+}
 
-    struct value left_left = { 0 };
-    bool has_left_left = false;
+// re_parse_quant parses a quantifier. Returns 1 if one was read, 0 if there
+// is none, or -1 for a syntax error. A '{' that doesn't begin a well-formed
+// {n}, {n,} or {n,m} is not a quantifier.
+static int re_parse_quant(struct re_parser *p, uint32_t *min, uint32_t *max) {
+    if (p->i == p->len) return 0;
+    switch (p->p[p->i]) {
+    case '*':
+        *min = 0;
+        *max = RE_INF;
+        break;
+    case '+':
+        *min = 1;
+        *max = RE_INF;
+        break;
+    case '?':
+        *min = 0;
+        *max = 1;
+        break;
+    case '{': {
+        size_t s = p->i;
+        p->i++;
+        if (!re_parse_count(p, min)) goto literal;
+        *max = *min;
+        if (re_peek(p, ',')) {
+            p->i++;
+            if (!re_parse_count(p, max)) *max = RE_INF;
+        }
+        if (!re_peek(p, '}')) goto literal;
+        if (*max < *min) return -1;
+        break;
+    literal:
+        p->i = s;
+        return 0;
+    }
+    default:
+        return 0;
+    }
+    p->i++;
+    return 1;
+}
 
-    // read each chained component
-    bool opt_chain = false;
+static int32_t re_parse_alt(struct re_parser *p);
 
-    const uint8_t *ident;
-    size_t ilen;
-    struct value val;
-    struct value last;
-    char nbuf[32];
-    while (1) {
-        // There are more components to read
-        expr = trim(expr, len, &len);
-        if (len == 0) break;
-        switch (expr[0]) {
-        case '?':
-            // Optional chaining
-            unreachable(
-                if (len == 1 || expr[1] != '.') {
-                    // Unreachable due to the condition being checked in a 
-                    // previous eval_logical_or step
-                    return err_syntax(); 
+static int32_t re_parse_atom(struct re_parser *p, bool *quantifiable) {
+    uint32_t cp;
+    uint32_t min, max;
+    int kind;
+    size_t n;
+    switch (p->p[p->i]) {
+    case '(': {
+        p->i++;
+        if (++p->depth > XV_MAXDEPTH) return -1;
+        bool capture = true;
+        if (re_peek(p, '?')) {
+            if (p->i+1 < p->len && p->p[p->i+1] == ':') {
+                capture = false;
+                p->i += 2;
+            } else if (p->i+2 < p->len && p->p[p->i+1] == '<' &&
+                p->p[p->i+2] != '=' && p->p[p->i+2] != '!')
+            {
+                // named group, which is captured like any other group
+                size_t j = p->i+2;
+                while (j < p->len && p->p[j] != '>') j++;
+                if (j == p->len || j == p->i+2) return -1;
+                p->i = j+1;
+            } else {
+                // lookaround is not supported
+                return -1;
+            }
+        }
+        uint32_t cap = capture ? ++p->ncaps : 0;
+        int32_t e = re_parse_alt(p);
+        if (e < 0 || !re_peek(p, ')')) return -1;
+        p->i++;
+        p->depth--;
+        if (!capture) return e;
+        return re_node(p, RN_GROUP, cap, 0, e, -1);
+    }
+    case '[':
+        p->i++;
+        return re_parse_class(p);
+    case '.':
+        p->i++;
+        return re_node(p, RN_ANY, 0, 0, -1, -1);
+    case '^':
+        p->i++;
+        *quantifiable = false;
+        return re_node(p, RN_ASSERT, RE_BOL, 0, -1, -1);
+    case '$':
+        p->i++;
+        *quantifiable = false;
+        return re_node(p, RN_ASSERT, RE_EOL, 0, -1, -1);
+    case '\\':
+        p->i++;
+        kind = re_parse_escape(p, false, &cp);
+        if (kind < 0) return -1;
+        if (kind == 'b' || kind == 'B') {
+            *quantifiable = false;
+            return re_node(p, RN_ASSERT, kind == 'b' ? RE_WORDB : RE_NWORDB,
+                0, -1, -1);
+        }
+        if (kind > 0) {
+            size_t start = p->nranges;
+            if (!re_add_escape_ranges(p, kind)) return -1;
+            return re_make_class(p, start, false);
+        }
+        break;
+    case '*': case '+': case '?':
+        // nothing to repeat
+        return -1;
+    case '{':
+        if (re_parse_quant(p, &min, &max) != 0) return -1;
+        p->i++;
+        cp = '{';
+        break;
+    default:
+        cp = utf8_next(p->p+p->i, p->len-p->i, &n);
+        p->i += n;
+        break;
+    }
+    if (p->flags & RE_ICASE) cp = fold_codepoint(cp);
+    return re_node(p, RN_CHAR, cp, 0, -1, -1);
+}
+
+static int32_t re_parse_cat(struct re_parser *p) {
+    int32_t first = -1;
+    int32_t tail = -1;
+    while (p->i < p->len && p->p[p->i] != '|' && p->p[p->i] != ')') {
+        bool quantifiable = true;
+        int32_t e = re_parse_atom(p, &quantifiable);
+        if (e < 0) return -1;
+        uint32_t min, max;
+        int q = re_parse_quant(p, &min, &max);
+        if (q < 0) return -1;
+        if (q > 0) {
+            if (!quantifiable) return -1;
+            bool greedy = true;
+            if (re_peek(p, '?')) {
+                greedy = false;
+                p->i++;
+            }
+            e = re_node(p, RN_REP, min, max, e, -1);
+            if (e < 0) return -1;
+            p->nodes[e].greedy = greedy;
+            if (re_parse_quant(p, &min, &max) != 0) {
+                // nothing to repeat
+                return -1;
+            }
+        }
+        if (first < 0) {
+            first = e;
+        } else if (tail < 0) {
+            first = tail = re_node(p, RN_CAT, 0, 0, first, e);
+        } else {
+            int32_t cat = re_node(p, RN_CAT, 0, 0, p->nodes[tail].right, e);
+            if (cat < 0) return -1;
+            p->nodes[tail].right = cat;
+            tail = cat;
+        }
+        if (first < 0) return -1;
+    }
+    if (first < 0) return re_node(p, RN_EMPTY, 0, 0, -1, -1);
+    return first;
+}
+
+static int32_t re_parse_alt(struct re_parser *p) {
+    int32_t first = re_parse_cat(p);
+    int32_t tail = -1;
+    while (first >= 0 && re_peek(p, '|')) {
+        p->i++;
+        int32_t e = re_parse_cat(p);
+        if (e < 0) return -1;
+        if (tail < 0) {
+            first = tail = re_node(p, RN_ALT, 0, 0, first, e);
+        } else {
+            int32_t alt = re_node(p, RN_ALT, 0, 0, p->nodes[tail].right, e);
+            if (alt < 0) return -1;
+            p->nodes[tail].right = alt;
+            tail = alt;
+        }
+    }
+    return first;
+}
+
+struct re_compiler {
+    const struct re_parser *p;
+    struct re_inst *insts;
+    size_t ninsts;
+    size_t cap;
+    bool oom;
+    bool toolarge;
+};
+
+static uint32_t re_emit(struct re_compiler *c, uint8_t op, uint32_t x,
+    uint32_t y)
+{
+    if (c->oom || c->toolarge) return 0;
+    if (c->ninsts == RE_MAXINSTS) {
+        c->toolarge = true;
+        return 0;
+    }
+    if (c->ninsts == c->cap) {
+        void *mem = re_grow(c->insts, c->ninsts, &c->cap,
+            sizeof(struct re_inst));
+        if (!mem) {
+            c->oom = true;
+            return 0;
+        }
+        c->insts = mem;
+    }
+    c->insts[c->ninsts] = (struct re_inst){ .op = op, .x = x, .y = y };
+    return (uint32_t)c->ninsts++;
+}
+
+// re_patch sets the targets of a jump or split. A non-greedy split prefers
+// its second target.
+static void re_patch(struct re_compiler *c, uint32_t pc, uint32_t x,
+    uint32_t y, bool greedy)
+{
+    if (c->oom || c->toolarge) return;
+    c->insts[pc].x = greedy ? x : y;
+    c->insts[pc].y = greedy ? y : x;
+}
+
+static void re_compile_node(struct re_compiler *c, int32_t n) {
+    while (!c->oom && !c->toolarge) {
+        const struct re_node *node = &c->p->nodes[n];
+        uint32_t pc, k;
+        switch (node->type) {
+        case RN_CHAR:
+            re_emit(c, RE_CHAR, node->a, 0);
+            return;
+        case RN_ANY:
+            re_emit(c, (c->p->flags & RE_DOTALL) ? RE_ANYNL : RE_ANY, 0, 0);
+            return;
+        case RN_CLASS:
+            re_emit(c, RE_CLASS, node->a, 0);
+            return;
+        case RN_ASSERT:
+            re_emit(c, (uint8_t)node->a, 0, 0);
+            return;
+        case RN_GROUP:
+            re_emit(c, RE_SAVE, node->a*2, 0);
+            re_compile_node(c, node->left);
+            re_emit(c, RE_SAVE, node->a*2+1, 0);
+            return;
+        case RN_CAT:
+            re_compile_node(c, node->left);
+            n = node->right;
+            continue;
+        case RN_ALT: {
+            // The jumps out of each alternative are linked through their
+            // targets until the end is known.
+            uint32_t jmps = UINT32_MAX;
+            while (c->p->nodes[n].type == RN_ALT && !c->oom && !c->toolarge) {
+                node = &c->p->nodes[n];
+                pc = re_emit(c, RE_SPLIT, 0, 0);
+                re_compile_node(c, node->left);
+                uint32_t jmp = re_emit(c, RE_JMP, jmps, 0);
+                re_patch(c, pc, pc+1, (uint32_t)c->ninsts, true);
+                jmps = jmp;
+                n = node->right;
+            }
+            re_compile_node(c, n);
+            while (!c->oom && !c->toolarge && jmps != UINT32_MAX) {
+                uint32_t next = c->insts[jmps].x;
+                c->insts[jmps].x = (uint32_t)c->ninsts;
+                jmps = next;
+            }
+            return;
+        }
+        case RN_REP:
+            if (node->b == RE_INF && node->a > 0) {
+                // e{n,} is e{n-1} followed by e+
+                for (k = 1; k < node->a && !c->oom && !c->toolarge; k++) {
+                    re_compile_node(c, node->left);
                 }
-            )
-            expr++;
-            len--;
-            opt_chain = true;
-            // fall through
-        case '.':
-            // Member Access
-            expr++;
-            len--;
-            expr = trim(expr, len, &len);
-            ident = read_ident(expr, len, &ilen);
-            if (!ident) return err_syntax();
-            val = get_ref_value(true, left, ident, ilen, opt_chain, ctx);
-            if (is_err(val)) return val;
-            left_left = left;
-            has_left_left = true;
-            left = val;
-            expr = expr+ilen;
-            len -= ilen;
-            left_ident = ident;
-            left_ident_len = ilen;
+                uint32_t start = (uint32_t)c->ninsts;
+                re_compile_node(c, node->left);
+                pc = re_emit(c, RE_SPLIT, 0, 0);
+                re_patch(c, pc, start, pc+1, node->greedy);
+                return;
+            }
+            for (k = 0; k < node->a && !c->oom && !c->toolarge; k++) {
+                re_compile_node(c, node->left);
+            }
+            if (node->b == RE_INF) {
+                pc = re_emit(c, RE_SPLIT, 0, 0);
+                re_compile_node(c, node->left);
+                re_emit(c, RE_JMP, pc, 0);
+                re_patch(c, pc, pc+1, (uint32_t)c->ninsts, node->greedy);
+                return;
+            }
+            for (k = node->a; k < node->b && !c->oom && !c->toolarge; k++) {
+                pc = re_emit(c, RE_SPLIT, 0, 0);
+                re_compile_node(c, node->left);
+                re_patch(c, pc, pc+1, (uint32_t)c->ninsts, node->greedy);
+            }
+            return;
+        default: // RN_EMPTY
+            return;
+        }
+    }
+}
+
+static void regex_free(struct regex *re) {
+    for (size_t i = 0; i < RE_DSTATE_BUCKETS; i++) {
+        struct re_dstate *s = re->buckets[i];
+        while (s) {
+            struct re_dstate *next = s->hnext;
+            efree0(s);
+            s = next;
+        }
+    }
+    if (re->pattern) efree0(re->pattern);
+    if (re->insts) efree0(re->insts);
+    if (re->classes) efree0(re->classes);
+    if (re->ranges) efree0(re->ranges);
+    if (re->lit) efree0(re->lit);
+    if (re->marks) efree0(re->marks);
+    if (re->stack) efree0(re->stack);
+    if (re->pcs) efree0(re->pcs);
+    efree0(re);
+}
+
+// re_literal returns true if the parsed pattern is a plain string, which
+// can be matched with a substring search.
+static bool re_literal(const struct re_parser *p, int32_t n) {
+    if (p->flags & (RE_ICASE|RE_STICKY)) return false;
+    while (p->nodes[n].type == RN_CAT) {
+        const struct re_node *e = &p->nodes[p->nodes[n].left];
+        if (e->type != RN_CHAR || e->a > 0x10FFFF) return false;
+        n = p->nodes[n].right;
+    }
+    return p->nodes[n].type == RN_CHAR && p->nodes[n].a <= 0x10FFFF;
+}
+
+// regex_compile compiles a pattern. Returns NULL if the pattern has a syntax
+// error or is too large, or with oom set if out of memory.
+static struct regex *regex_compile(const uint8_t *pat, size_t plen, int flags,
+    bool *oom)
+{
+    *oom = false;
+    struct re_parser p = { .p = pat, .len = plen, .flags = flags };
+    struct re_compiler c = { .p = &p };
+    struct regex *re = NULL;
+    bool nomem = true;
+    int32_t root = re_parse_alt(&p);
+    if (root < 0 || p.i < p.len) {
+        nomem = false;
+        goto fail;
+    }
+    re_emit(&c, RE_SAVE, 0, 0);
+    re_compile_node(&c, root);
+    re_emit(&c, RE_SAVE, 1, 0);
+    re_emit(&c, RE_MATCH, 0, 0);
+    if (c.toolarge) nomem = false;
+    if (c.oom || c.toolarge) goto fail;
+    re = emalloc0(sizeof(struct regex));
+    if (!re) goto fail;
+    memset(re, 0, sizeof(struct regex));
+    re->flags = flags;
+    re->insts = c.insts;
+    re->ninsts = (uint32_t)c.ninsts;
+    c.insts = NULL;
+    re->classes = p.classes;
+    re->ranges = p.ranges;
+    p.classes = NULL;
+    p.ranges = NULL;
+    re->ncaps = p.ncaps+1;
+    re->pattern = emalloc0(plen+1);
+    re->marks = emalloc0(re->ninsts*sizeof(uint32_t));
+    re->stack = emalloc0((re->ninsts*3+1)*sizeof(uint32_t));
+    re->pcs = emalloc0((re->ninsts+1)*sizeof(uint32_t));
+    if (!re->pattern || !re->marks || !re->stack || !re->pcs) goto fail;
+    memcpy(re->pattern, pat, plen);
+    re->plen = plen;
+    memset(re->marks, 0, re->ninsts*sizeof(uint32_t));
+    re->ctxmask = RS_START;
+    for (uint32_t i = 0; i < re->ninsts; i++) {
+        switch (re->insts[i].op) {
+        case RE_WORDB: case RE_NWORDB:
+            re->ctxmask |= RS_WORD;
             break;
-        case '(':
-            // Function call
-            g = read_group(expr, len, &glen);
-            if (!g) return err_syntax();
-            if (left.kind != FUNC_KIND) {
-                return err_notfunc(left_ident, left_ident_len);
+        case RE_BOL:
+            if (flags & RE_MULTILINE) re->ctxmask |= RS_NL;
+            break;
+        }
+    }
+    int32_t first = root;
+    while (p.nodes[first].type == RN_CAT) first = p.nodes[first].left;
+    re->anchored = (flags & RE_STICKY) || (p.nodes[first].type == RN_ASSERT &&
+        p.nodes[first].a == RE_BOL && !(flags & RE_MULTILINE));
+    if (re_literal(&p, root)) {
+        struct writer wr = { 0 };
+        for (int pass = 0; pass < 2; pass++) {
+            if (pass == 1) {
+                re->lit = emalloc0(wr.count+1);
+                if (!re->lit) goto fail;
+                wr = (struct writer){ .dst = (char*)re->lit, .n = wr.count+1 };
             }
-            (void)has_left_left;
-            struct value args = multi_exprs_to_array(g+1, glen-2, ctx, depth);
-            if (is_err(args)) return args;
+            int32_t n = root;
+            while (p.nodes[n].type == RN_CAT) {
+                write_codepoint(&wr, p.nodes[p.nodes[n].left].a);
+                n = p.nodes[n].right;
+            }
+            write_codepoint(&wr, p.nodes[n].a);
+        }
+        re->litlen = wr.count;
+    }
+    if (p.nodes) efree0(p.nodes);
+    return re;
+fail:
+    *oom = p.oom || c.oom || nomem;
+    if (p.nodes) efree0(p.nodes);
+    if (p.ranges) efree0(p.ranges);
+    if (p.classes) efree0(p.classes);
+    if (c.insts) efree0(c.insts);
+    if (re) regex_free(re);
+    return NULL;
+}
 
-            val = to_value(left.func(from_value(left_left), 
-                from_value(args), 
-                ctx->env?ctx->env->udata:NULL));
-            if (is_err(val)) return val;
-            left_left = left;
-            has_left_left = true;
-            left = val;
-            expr += glen;
-            len -= glen;
+static bool re_assert(const struct regex *re, uint8_t op, uint8_t ctx,
+    uint32_t c)
+{
+    switch (op) {
+    case RE_BOL:
+        return (ctx & (RS_START|RS_NL)) != 0;
+    case RE_EOL:
+        return c == RE_END || ((re->flags & RE_MULTILINE) && re_is_nl(c));
+    case RE_WORDB:
+        return ((ctx & RS_WORD) != 0) != (c != RE_END && re_is_word(c));
+    default: // RE_NWORDB
+        return ((ctx & RS_WORD) != 0) == (c != RE_END && re_is_word(c));
+    }
+}
+
+static bool re_class_has(const struct regex *re, const struct re_class *cls,
+    uint32_t c)
+{
+    if (c < 128) return (cls->ascii[c>>6] >> (c&63)) & 1;
+    const struct re_range *r = re->ranges+cls->start;
+    bool in = re_ranges_has(r, cls->n, c) || ((re->flags & RE_ICASE) &&
+        re_ranges_has(r, cls->n, fold_codepoint(c)));
+    return in != cls->neg;
+}
+
+// re_consumes returns true if the instruction matches the codepoint.
+static bool re_consumes(const struct regex *re, const struct re_inst *inst,
+    uint32_t c)
+{
+    switch (inst->op) {
+    case RE_CHAR:
+        return c == inst->x ||
+            ((re->flags & RE_ICASE) && fold_codepoint(c) == inst->x);
+    case RE_ANY:
+        return !re_is_nl(c);
+    case RE_ANYNL:
+        return true;
+    case RE_CLASS:
+        return re_class_has(re, &re->classes[inst->x], c);
+    default:
+        return false;
+    }
+}
+
+// re_ctx_after returns the context flags for the position after c.
+static uint8_t re_ctx_after(const struct regex *re, uint32_t c) {
+    return ((re_is_word(c) ? RS_WORD : 0) | (re_is_nl(c) ? RS_NL : 0)) &
+        re->ctxmask;
+}
+
+static uint32_t re_next_gen(struct regex *re) {
+    if (++re->gen == 0) {
+        memset(re->marks, 0, re->ninsts*sizeof(uint32_t));
+        re->gen = 1;
+    }
+    return re->gen;
+}
+
+static uint32_t re_hash_pcs(const uint32_t *pcs, uint32_t n, uint8_t ctx) {
+    uint32_t h = 2166136261u ^ ctx;
+    for (uint32_t i = 0; i < n; i++) {
+        h = (h ^ pcs[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void re_dfa_reset(struct regex *re) {
+    for (size_t i = 0; i < RE_DSTATE_BUCKETS; i++) {
+        struct re_dstate *s = re->buckets[i];
+        while (s) {
+            struct re_dstate *next = s->hnext;
+            efree0(s);
+            s = next;
+        }
+        re->buckets[i] = NULL;
+    }
+    re->dfasize = 0;
+    re->start = NULL;
+}
+
+// re_dfa_state returns the DFA state for a sorted set of instructions,
+// creating it if needed. When the DFA has outgrown XV_REGEX_DFA_SIZE all of
+// its states are thrown away first, which is reported in flushed.
+static struct re_dstate *re_dfa_state(struct regex *re, const uint32_t *pcs,
+    uint32_t n, uint8_t ctx, bool *flushed)
+{
+    uint32_t hash = re_hash_pcs(pcs, n, ctx);
+    struct re_dstate *s = re->buckets[hash%RE_DSTATE_BUCKETS];
+    for (; s; s = s->hnext) {
+        if (s->hash == hash && s->ctx == ctx && s->npcs == n &&
+            memcmp(s->pcs, pcs, n*sizeof(uint32_t)) == 0)
+        {
+            return s;
+        }
+    }
+    size_t size = sizeof(struct re_dstate)+n*sizeof(uint32_t);
+    if (re->dfasize > 0 && re->dfasize+size > XV_REGEX_DFA_SIZE) {
+        re_dfa_reset(re);
+        *flushed = true;
+    }
+    s = emalloc0(size);
+    if (!s) return NULL;
+    memset(s, 0, sizeof(struct re_dstate));
+    s->hash = hash;
+    s->ctx = ctx;
+    s->endmatch = -1;
+    s->npcs = n;
+    memcpy(s->pcs, pcs, n*sizeof(uint32_t));
+    s->hnext = re->buckets[hash%RE_DSTATE_BUCKETS];
+    re->buckets[hash%RE_DSTATE_BUCKETS] = s;
+    re->dfasize += size;
+    return s;
+}
+
+static struct re_dstate *re_dfa_start(struct regex *re) {
+    if (!re->start) {
+        uint32_t pc = 0;
+        bool flushed = false;
+        re->start = re_dfa_state(re, &pc, 1, RS_START, &flushed);
+    }
+    return re->start;
+}
+
+static int re_pc_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// re_dfa_next returns the state that follows s on c, which is a codepoint
+// or RE_END. Returns &re_matched if a match ends before c, or NULL if out
+// of memory or if c is RE_END and there is no match.
+static struct re_dstate *re_dfa_next(struct regex *re, struct re_dstate *s,
+    uint32_t c)
+{
+    uint32_t gen = re_next_gen(re);
+    uint32_t sp = 0;
+    uint32_t n = 0;
+    for (uint32_t i = s->npcs; i > 0; i--) {
+        re->stack[sp++] = s->pcs[i-1];
+    }
+    while (sp > 0) {
+        uint32_t pc = re->stack[--sp];
+        if (re->marks[pc] == gen) continue;
+        re->marks[pc] = gen;
+        const struct re_inst *inst = &re->insts[pc];
+        switch (inst->op) {
+        case RE_MATCH:
+            return &re_matched;
+        case RE_JMP:
+            re->stack[sp++] = inst->x;
             break;
-        case '[':
-            // Computed Member Access
+        case RE_SPLIT:
+            re->stack[sp++] = inst->y;
+            re->stack[sp++] = inst->x;
+            break;
+        case RE_SAVE:
+            re->stack[sp++] = pc+1;
+            break;
+        case RE_BOL: case RE_EOL: case RE_WORDB: case RE_NWORDB:
+            if (re_assert(re, inst->op, s->ctx, c)) re->stack[sp++] = pc+1;
+            break;
+        default:
+            if (c != RE_END && re_consumes(re, inst, c)) re->pcs[n++] = pc+1;
+            break;
+        }
+    }
+    if (c == RE_END) return NULL;
+    if (!re->anchored) {
+        // unanchored search, so a match may also start at the next position
+        re->pcs[n++] = 0;
+    }
+    qsort(re->pcs, n, sizeof(uint32_t), re_pc_cmp);
+    bool flushed = false;
+    struct re_dstate *next = re_dfa_state(re, re->pcs, n, re_ctx_after(re, c),
+        &flushed);
+    if (next && !flushed && c < 128) s->next[c] = next;
+    return next;
+}
+
+// regex_test returns 1 if the regex matches anywhere in the string, 0 if it
+// doesn't, or -1 if out of memory.
+static int regex_test(struct regex *re, const uint8_t *s, size_t len) {
+    if (re->lit) return find_bytes(s, len, re->lit, re->litlen) != NULL;
+    struct re_dstate *d = re_dfa_start(re);
+    if (!d) return -1;
+    size_t i = 0;
+    while (i < len) {
+        struct re_dstate *next;
+        size_t n = 1;
+        if (s[i] < 0x80) {
+            next = d->next[s[i]];
+            if (!next) next = re_dfa_next(re, d, s[i]);
+        } else {
+            next = re_dfa_next(re, d, utf8_next(s+i, len-i, &n));
+        }
+        if (!next) return -1;
+        if (next == &re_matched) return 1;
+        if (next->npcs == 0) return 0;
+        d = next;
+        i += n;
+    }
+    if (d->endmatch < 0) {
+        d->endmatch = re_dfa_next(re, d, RE_END) == &re_matched;
+    }
+    return d->endmatch;
+}
+
+struct re_frame {
+    uint32_t pc;
+    uint32_t slot; // UINT32_MAX, or the capture slot to restore
+    size_t val;
+};
+
+struct re_threads {
+    uint32_t n;
+    uint32_t *pcs;
+    size_t *caps;
+};
+
+// re_pike_add adds the thread at pc to the list, following jumps, splits,
+// saves and assertions in priority order. The caps are the thread's
+// captures, which are modified while following saves and restored after.
+static void re_pike_add(struct regex *re, struct re_frame *stack,
+    struct re_threads *l, uint32_t pc, size_t *caps, uint8_t ctx, uint32_t c,
+    size_t pos)
+{
+    size_t ncap = re->ncaps*2;
+    uint32_t sp = 0;
+    stack[sp++] = (struct re_frame){ .pc = pc, .slot = UINT32_MAX };
+    while (sp > 0) {
+        struct re_frame f = stack[--sp];
+        if (f.slot != UINT32_MAX) {
+            caps[f.slot] = f.val;
+            continue;
+        }
+        if (re->marks[f.pc] == re->gen) continue;
+        re->marks[f.pc] = re->gen;
+        const struct re_inst *inst = &re->insts[f.pc];
+        switch (inst->op) {
+        case RE_JMP:
+            stack[sp++] = (struct re_frame){ .pc = inst->x,
+                .slot = UINT32_MAX };
+            break;
+        case RE_SPLIT:
+            stack[sp++] = (struct re_frame){ .pc = inst->y,
+                .slot = UINT32_MAX };
+            stack[sp++] = (struct re_frame){ .pc = inst->x,
+                .slot = UINT32_MAX };
+            break;
+        case RE_SAVE:
+            stack[sp++] = (struct re_frame){ .slot = inst->x,
+                .val = caps[inst->x] };
+            caps[inst->x] = pos;
+            stack[sp++] = (struct re_frame){ .pc = f.pc+1,
+                .slot = UINT32_MAX };
+            break;
+        case RE_BOL: case RE_EOL: case RE_WORDB: case RE_NWORDB:
+            if (re_assert(re, inst->op, ctx, c)) {
+                stack[sp++] = (struct re_frame){ .pc = f.pc+1,
+                    .slot = UINT32_MAX };
+            }
+            break;
+        default:
+            l->pcs[l->n] = f.pc;
+            memcpy(l->caps+l->n*ncap, caps, ncap*sizeof(size_t));
+            l->n++;
+            break;
+        }
+    }
+}
+
+static uint32_t re_char_at(const uint8_t *s, size_t len, size_t i,
+    size_t *n)
+{
+    if (i == len) {
+        *n = 0;
+        return RE_END;
+    }
+    return utf8_next(s+i, len-i, n);
+}
+
+// re_char_before returns the character before s[i], which is only exact
+// for the characters that the assertions look at.
+static uint32_t re_char_before(const uint8_t *s, size_t i) {
+    if (s[i-1] < 0x80) return s[i-1];
+    if (i >= 3 && s[i-3] == 0xE2 && s[i-2] == 0x80 &&
+        (s[i-1] == 0xA8 || s[i-1] == 0xA9))
+    {
+        return 0x2000 + (s[i-1] - 0x80);
+    }
+    return 0x80;
+}
+
+// regex_exec finds the leftmost match at or after start. Returns 1 with the
+// byte offsets of the match and its capture groups stored in caps, 0 if
+// there's no match, or -1 if out of memory. Captures that didn't
+// participate in the match are SIZE_MAX.
+static int regex_exec(struct regex *re, const uint8_t *s, size_t len,
+    size_t start, size_t *caps)
+{
+    size_t ncap = re->ncaps*2;
+    if (re->lit) {
+        const uint8_t *p = find_bytes(s+start, len-start, re->lit, re->litlen);
+        if (!p) return 0;
+        caps[0] = (size_t)(p-s);
+        caps[1] = caps[0]+re->litlen;
+        return 1;
+    }
+    if (start == 0) {
+        // the DFA quickly rejects strings that don't match at all
+        int ret = regex_test(re, s, len);
+        if (ret <= 0) return ret;
+    }
+    size_t nthreads = re->ninsts;
+    size_t size = 2*nthreads*(sizeof(uint32_t)+ncap*sizeof(size_t)) +
+        ncap*sizeof(size_t) + (re->ninsts*3+1)*sizeof(struct re_frame);
+    uint8_t *mem = emalloc0(size);
+    if (!mem) return -1;
+    struct re_frame *stack = (struct re_frame*)mem;
+    size_t *scratch = (size_t*)(stack+re->ninsts*3+1);
+    struct re_threads lists[2];
+    size_t *tcaps = scratch+ncap;
+    for (int i = 0; i < 2; i++) {
+        lists[i].n = 0;
+        lists[i].caps = tcaps;
+        tcaps += nthreads*ncap;
+    }
+    uint32_t *tpcs = (uint32_t*)tcaps;
+    lists[0].pcs = tpcs;
+    lists[1].pcs = tpcs+nthreads;
+    struct re_threads *clist = &lists[0];
+    struct re_threads *nlist = &lists[1];
+
+    bool matched = false;
+    size_t pos = start;
+    size_t n;
+    uint32_t c = re_char_at(s, len, pos, &n);
+    uint8_t ctx = start == 0 ? RS_START :
+        re_ctx_after(re, re_char_before(s, start));
+    re_next_gen(re);
+    while (1) {
+        if (!matched && (pos == start || !re->anchored)) {
+            for (size_t i = 0; i < ncap; i++) scratch[i] = SIZE_MAX;
+            re_pike_add(re, stack, clist, 0, scratch, ctx, c, pos);
+        }
+        if (clist->n == 0 && (matched || re->anchored)) break;
+        size_t npos = pos+n;
+        size_t nn = 0;
+        uint32_t nc = c == RE_END ? RE_END : re_char_at(s, len, npos, &nn);
+        uint8_t nctx = c == RE_END ? 0 : re_ctx_after(re, c);
+        re_next_gen(re);
+        nlist->n = 0;
+        for (uint32_t i = 0; i < clist->n; i++) {
+            const struct re_inst *inst = &re->insts[clist->pcs[i]];
+            size_t *tc = clist->caps+i*ncap;
+            if (inst->op == RE_MATCH) {
+                // lower priority threads are cut off
+                matched = true;
+                memcpy(caps, tc, ncap*sizeof(size_t));
+                break;
+            }
+            if (c != RE_END && re_consumes(re, inst, c)) {
+                memcpy(scratch, tc, ncap*sizeof(size_t));
+                re_pike_add(re, stack, nlist, clist->pcs[i]+1, scratch, nctx,
+                    nc, npos);
+            }
+        }
+        if (c == RE_END) break;
+        struct re_threads *t = clist;
+        clist = nlist;
+        nlist = t;
+        pos = npos;
+        n = nn;
+        c = nc;
+        ctx = nctx;
+    }
+    efree0(mem);
+    return matched;
+}
+
+static __thread struct regex *tregexes[XV_REGEX_CACHE_SIZE];
+static __thread size_t tregexnext = 0;
+
+// regex_get returns the compiled regex for a pattern and flags from the
+// thread's cache, compiling it on a miss. The least recently compiled
+// pattern is evicted when the cache is full. Returns NULL if the pattern is
+// invalid, or with oom set if out of memory.
+//
+// The returned regex is only valid until the next call to regex_get.
+static struct regex *regex_get(const uint8_t *pat, size_t plen, int flags,
+    bool *oom)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t)flags;
+    for (size_t i = 0; i < plen; i++) {
+        hash = (hash ^ pat[i]) * 16777619u;
+    }
+    for (size_t i = 0; i < XV_REGEX_CACHE_SIZE; i++) {
+        struct regex *re = tregexes[i];
+        if (re && re->hash == hash && re->flags == flags && re->plen == plen &&
+            memcmp(re->pattern, pat, plen) == 0)
+        {
+            *oom = false;
+            return re;
+        }
+    }
+    struct regex *re = regex_compile(pat, plen, flags, oom);
+    if (!re) return NULL;
+    re->hash = hash;
+    if (tregexes[tregexnext]) regex_free(tregexes[tregexnext]);
+    tregexes[tregexnext] = re;
+    tregexnext = (tregexnext+1)%XV_REGEX_CACHE_SIZE;
+    return re;
+}
+
+static struct value make_regex(const uint8_t *lit, size_t len) {
+    return (struct value) {
+        .kind = REGEX_KIND,
+        .len = len,
+        .str = lit,
+    };
+}
+
+// regex_parts splits a regular expression literal into its pattern and
+// flags. Returns false if the flags are invalid.
+static bool regex_parts(struct value re, const uint8_t **pat, size_t *plen,
+    int *flags)
+{
+    size_t i = re.len;
+    while (re.str[i-1] != '/') i--;
+    *pat = re.str+1;
+    *plen = i-2;
+    *flags = 0;
+    for (; i < re.len; i++) {
+        const char *f = memchr(re_flag_chars, re.str[i],
+            sizeof(re_flag_chars)-1);
+        if (!f || (*flags & (1<<(f-re_flag_chars)))) return false;
+        *flags |= 1<<(f-re_flag_chars);
+    }
+    return true;
+}
+
+// to_regex returns the compiled regex for a value. Regular expression
+// values use their own pattern and flags, while anything else is converted
+// to a string and used as a pattern without flags, like 'new RegExp(value)'
+// in Javascript. Returns undefined on success.
+static struct value to_regex(struct value value, struct regex **re) {
+    const uint8_t *pat = (const uint8_t*)"";
+    size_t plen = 0;
+    int flags = 0;
+    char buf[32];
+    if (value.kind == REGEX_KIND) {
+        if (!regex_parts(value, &pat, &plen, &flags)) return err_syntax();
+    } else if (value.kind != UNDEF_KIND) {
+        pat = to_str(value, &plen, buf, sizeof(buf));
+        if (!pat) return err_oom();
+    }
+    bool oom;
+    *re = regex_get(pat, plen, flags, &oom);
+    if (!*re) return oom ? err_oom() : err_syntax();
+    return undefined();
+}
+
+// regex_match returns the result of match() or exec(), which is an array of
+// the matched string followed by its capture groups, or null if there's no
+// match. With the 'g' flag and all set, the array has every match instead.
+static struct value regex_match(struct regex *re, const uint8_t *s,
+    size_t len, bool all)
+{
+    size_t ncap = re->ncaps*2;
+    size_t *caps = emalloc(ncap*sizeof(size_t));
+    if (!caps) return err_oom();
+    all = all && (re->flags & RE_GLOBAL);
+    struct array arr = { 0 };
+    size_t pos = 0;
+    while (pos <= len) {
+        int ret = regex_exec(re, s, len, pos, caps);
+        if (ret < 0) return err_oom();
+        if (ret == 0) break;
+        if (!all) {
+            struct value *vals = emalloc(re->ncaps*sizeof(struct value));
+            if (!vals) return err_oom();
+            for (size_t i = 0; i < re->ncaps; i++) {
+                vals[i] = caps[i*2] == SIZE_MAX ? make_undefined() :
+                    make_string(s+caps[i*2], caps[i*2+1]-caps[i*2]);
+            }
+            return make_array(vals, re->ncaps);
+        }
+        if (!array_push_back(&arr, make_string(s+caps[0], caps[1]-caps[0]))) {
+            return err_oom();
+        }
+        pos = caps[1];
+        if (caps[1] == caps[0]) {
+            // step over an empty match
+            if (pos == len) break;
+            size_t n;
+            utf8_next(s+pos, len-pos, &n);
+            pos += n;
+        }
+    }
+    if (arr.len == 0) return make_null();
+    return make_array(arr.items, arr.len);
+}
+
+///////////////////////////////////////////
+// String methods
+///////////////////////////////////////////
+
+// find_bytes returns the first occurrence of the needle in the haystack, or
+// NULL if not found.
+//
+// The vectorized loops compare the first and last byte of the needle against
+// 32 or 16 candidate positions at a time, and only candidates that match
+// both are verified with memcmp.
+static const uint8_t *find_bytes(const uint8_t *h, size_t hlen, 
+    const uint8_t *n, size_t nlen)
+{
+    if (nlen == 0) return h;
+    if (nlen > hlen) return NULL;
+    if (nlen == 1) return memchr(h, n[0], hlen);
+    size_t i = 0;
+    size_t end = hlen - nlen + 1; // number of candidate positions
+#if defined(__AVX2__)
+    __m256i first32 = _mm256_set1_epi8((char)n[0]);
+    __m256i last32 = _mm256_set1_epi8((char)n[nlen-1]);
+    for (; i+32 <= end; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(h+i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(h+i+nlen-1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(a, first32), _mm256_cmpeq_epi8(b, last32)));
+        while (mask) {
+            size_t j = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(h+j+1, n+1, nlen-2) == 0) return h+j;
+            mask &= mask - 1;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i first16 = _mm_set1_epi8((char)n[0]);
+    __m128i last16 = _mm_set1_epi8((char)n[nlen-1]);
+    for (; i+16 <= end; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(h+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(h+i+nlen-1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, first16), _mm_cmpeq_epi8(b, last16)));
+        while (mask) {
+            size_t j = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(h+j+1, n+1, nlen-2) == 0) return h+j;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        if (h[i] == n[0] && h[i+nlen-1] == n[nlen-1] && 
+            memcmp(h+i, n, nlen) == 0)
+        {
+            return h+i;
+        }
+    }
+    return NULL;
+}
+
+// find_bytes_last returns the last occurrence of the needle in the haystack,
+// or NULL if not found.
+static const uint8_t *find_bytes_last(const uint8_t *h, size_t hlen, 
+    const uint8_t *n, size_t nlen)
+{
+    if (nlen > hlen) return NULL;
+    for (size_t i = hlen-nlen+1; i > 0; i--) {
+        if (memcmp(h+i-1, n, nlen) == 0) return h+i-1;
+    }
+    return NULL;
+}
+
+// Javascript string lengths and indexes count UTF-16 code units, while xv
+// strings are UTF-8. For ASCII, which is the common case, both are the same.
+
+// utf16_index converts a byte offset into a Javascript string index.
+static size_t utf16_index(const uint8_t *s, size_t len, size_t off) {
+    size_t i = 0;
+    size_t n = 0;
+    while (i < off) {
+        if (s[i] < 0x80) {
+            i++;
+            n++;
+        } else {
+            size_t cn;
+            utf8_next(s+i, len-i, &cn);
+            i += cn;
+            n += cn == 4 ? 2 : 1;
+        }
+    }
+    return n;
+}
+
+// utf16_offset converts a Javascript string index into a byte offset.
+static size_t utf16_offset(const uint8_t *s, size_t len, double index) {
+    size_t i = 0;
+    double n = 0;
+    while (i < len && n < index) {
+        if (s[i] < 0x80) {
+            i++;
+            n++;
+        } else {
+            size_t cn;
+            utf8_next(s+i, len-i, &cn);
+            i += cn;
+            n += cn == 4 ? 2 : 1;
+        }
+    }
+    return i;
+}
+
+// to_index converts a value into a Javascript integer, truncating toward
+// zero. NaN becomes zero.
+static double to_index(struct value value) {
+    double x = to_f64(value);
+    if (isnan(x)) return 0;
+    return trunc(x);
+}
+
+// final_sigma returns true when the capital sigma at s[i] ends a word, which
+// is when a cased letter comes before it and none comes after it.
+static bool final_sigma(uint32_t last, const uint8_t *s, size_t len, size_t i) {
+    if (!cased(last)) return false;
+    while (i < len) {
+        size_t cn;
+        uint32_t cp = utf8_next(s+i, len-i, &cn);
+        if (!case_ignorable(cp)) return !cased(cp);
+        i += cn;
+    }
+    return true;
+}
+
+// string_lower returns the Unicode lowercase of a string, such as 'Σ' and
+// 'ς' for the final sigma, and 'İ' to 'i' with a combining dot above.
+static struct value string_lower(struct value str) {
+    size_t i = 0;
+    while (i < str.len && str.str[i] < 0x80 && fold(str.str[i]) == str.str[i]) {
+        i++;
+    }
+    if (i == str.len) {
+        // nothing to change
+        return str;
+    }
+    struct writer wr = { 0 };
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            char *mem = emalloc(wr.count+1);
+            if (!mem) return err_oom();
+            wr = (struct writer){ .dst = mem, .n = wr.count+1 };
+        }
+        uint32_t last = 0; // the last codepoint that isn't case ignorable
+        for (size_t j = 0; j < str.len; ) {
+            if (str.str[j] < 0x80) {
+                write_char(&wr, (char)fold(str.str[j]));
+                if (!case_ignorable(str.str[j])) last = str.str[j];
+                j++;
+                continue;
+            }
+            size_t cn;
+            uint32_t cp = utf8_next(str.str+j, str.len-j, &cn);
+            if (cp > 0x10FFFF) {
+                // invalid utf8 is copied as is
+                write_char(&wr, (char)str.str[j]);
+            } else if (cp == 0x0130) {
+                write_char(&wr, 'i');
+                write_codepoint(&wr, 0x0307);
+            } else if (cp == 0x03A3 && final_sigma(last, str.str, str.len, 
+                j+cn))
+            {
+                write_codepoint(&wr, 0x03C2);
+            } else {
+                write_codepoint(&wr, lower_codepoint(cp));
+            }
+            if (!case_ignorable(cp)) last = cp;
+            j += cn;
+        }
+    }
+    write_nullterm(&wr);
+    return make_string((uint8_t*)wr.dst, wr.count);
+}
+
+enum string_method {
+    STRM_NONE, STRM_STARTS_WITH, STRM_ENDS_WITH, STRM_INCLUDES, 
+    STRM_INDEX_OF, STRM_LAST_INDEX_OF, STRM_SLICE, STRM_SUBSTRING, 
+    STRM_TO_LOWER_CASE, STRM_TRIM, STRM_MATCH, STRM_SEARCH,
+};
+
+static enum string_method string_method(const uint8_t *ident, size_t ilen) {
+    static const struct { const char *name; enum string_method m; } 
+    methods[] = {
+        { "startsWith", STRM_STARTS_WITH },
+        { "endsWith", STRM_ENDS_WITH },
+        { "includes", STRM_INCLUDES },
+        { "indexOf", STRM_INDEX_OF },
+        { "lastIndexOf", STRM_LAST_INDEX_OF },
+        { "slice", STRM_SLICE },
+        { "substring", STRM_SUBSTRING },
+        { "toLowerCase", STRM_TO_LOWER_CASE },
+        { "trim", STRM_TRIM },
+        { "match", STRM_MATCH },
+        { "search", STRM_SEARCH },
+    };
+    for (size_t i = 0; i < sizeof(methods)/sizeof(methods[0]); i++) {
+        if (strlen(methods[i].name) == ilen && 
+            memcmp(methods[i].name, ident, ilen) == 0)
+        {
+            return methods[i].m;
+        }
+    }
+    return STRM_NONE;
+}
+
+// args_iter_context collects a fixed number of function arguments without
+// allocating an array.
+struct args_iter_context {
+    struct value args[3];
+    size_t nargs;
+};
+
+static void args_iter(struct value value, void *udata) {
+    struct args_iter_context *actx = udata;
+    if (actx->nargs < sizeof(actx->args)/sizeof(actx->args[0])) {
+        actx->args[actx->nargs] = value;
+    }
+    actx->nargs++;
+}
+
+// eval_call_iter evaluates the arguments of a built-in method call, passing
+// each one to the iter. The expr is what follows the method name. Returns
+// false if it's not a call. Otherwise the number of expr bytes consumed is
+// stored in n, and res is set to undefined, or to an error if the arguments
+// can't be evaluated.
+static bool eval_call_iter(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, 
+    void (*iter)(struct value, void *udata), void *udata,
+    struct value *res, size_t *n)
+{
+    size_t tlen;
+    const uint8_t *tail = trim(expr, len, &tlen);
+    if (tlen == 0 || tail[0] != '(') return false;
+    size_t glen;
+    const uint8_t *g = read_group(tail, tlen, &glen);
+    if (!g) {
+        *res = err_syntax();
+        return true;
+    }
+    *n = (size_t)(tail-expr) + glen;
+    struct value last = eval_foreach(g+1, glen-2, ctx->env, ctx->scope, iter,
+        udata, depth);
+    *res = is_err(last) ? last : undefined();
+    return true;
+}
+
+// eval_call_args is eval_call_iter that collects the first arguments.
+static bool eval_call_args(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct args_iter_context *actx,
+    struct value *res, size_t *n)
+{
+    return eval_call_iter(expr, len, ctx, depth, args_iter, actx, res, n);
+}
+
+// eval_string_member evaluates a built-in string property or method, such
+// as s.length or s.startsWith('api/'). The expr is what follows the member
+// name. Returns false if the member is not a built-in. Otherwise the result
+// is stored in res and the number of expr bytes consumed by the method call
+// arguments is stored in n.
+static bool eval_string_member(struct value str, const uint8_t *ident, 
+    size_t ilen, const uint8_t *expr, size_t len, struct eval_context *ctx,
+    int depth, struct value *res, size_t *n)
+{
+    if (ilen == 6 && memcmp(ident, "length", 6) == 0) {
+        *res = make_float((double)utf16_index(str.str, str.len, str.len));
+        *n = 0;
+        return true;
+    }
+    enum string_method m = string_method(ident, ilen);
+    if (m == STRM_NONE) return false;
+    struct args_iter_context actx = { 0 };
+    if (!eval_call_args(expr, len, ctx, depth, &actx, res, n)) return false;
+    if (is_err(*res)) return true;
+    struct value arg0 = actx.nargs > 0 ? actx.args[0] : make_undefined();
+    struct value arg1 = actx.nargs > 1 ? actx.args[1] : make_undefined();
+    const uint8_t *s = str.str;
+    size_t slen = str.len;
+    char buf[32];
+    const uint8_t *sub = NULL;
+    size_t sublen = 0;
+    switch (m) {
+    case STRM_STARTS_WITH: case STRM_ENDS_WITH: case STRM_INCLUDES: 
+    case STRM_INDEX_OF: case STRM_LAST_INDEX_OF:
+        sub = to_str(arg0, &sublen, buf, sizeof(buf));
+        if (!sub) {
+            *res = err_oom();
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    size_t start = 0;
+    size_t end = slen;
+    const uint8_t *p;
+    double a, b, jslen;
+    struct regex *re;
+    size_t *caps;
+    int ret;
+    switch (m) {
+    case STRM_STARTS_WITH:
+        if (arg1.kind != UNDEF_KIND) start = utf16_offset(s, slen, 
+            to_index(arg1));
+        *res = make_bool(slen-start >= sublen && 
+            memcmp(s+start, sub, sublen) == 0);
+        break;
+    case STRM_ENDS_WITH:
+        if (arg1.kind != UNDEF_KIND) end = utf16_offset(s, slen, 
+            to_index(arg1));
+        *res = make_bool(end >= sublen && memcmp(s+end-sublen, sub, 
+            sublen) == 0);
+        break;
+    case STRM_INCLUDES: case STRM_INDEX_OF:
+        if (arg1.kind != UNDEF_KIND) start = utf16_offset(s, slen, 
+            to_index(arg1));
+        p = find_bytes(s+start, slen-start, sub, sublen);
+        if (m == STRM_INCLUDES) {
+            *res = make_bool(p != NULL);
+        } else {
+            *res = make_float(p ? (double)utf16_index(s, slen, 
+                (size_t)(p-s)) : -1);
+        }
+        break;
+    case STRM_LAST_INDEX_OF:
+        // matches start at or before fromIndex, where NaN is the end
+        a = to_f64(arg1);
+        if (!isnan(a)) {
+            end = utf16_offset(s, slen, trunc(a)) + sublen;
+            if (end > slen) end = slen;
+        }
+        p = find_bytes_last(s, end, sub, sublen);
+        *res = make_float(p ? (double)utf16_index(s, slen, (size_t)(p-s)) : 
+            -1);
+        break;
+    case STRM_SLICE: case STRM_SUBSTRING:
+        // Returns a view into the original string bytes, without copying.
+        jslen = (double)utf16_index(s, slen, slen);
+        a = to_index(arg0);
+        b = arg1.kind == UNDEF_KIND ? jslen : to_index(arg1);
+        if (m == STRM_SLICE) {
+            if (a < 0) a += jslen;
+            if (b < 0) b += jslen;
+        } else if (a > b) {
+            double t = a;
+            a = b;
+            b = t;
+        }
+        a = a < 0 ? 0 : a > jslen ? jslen : a;
+        b = b < 0 ? 0 : b > jslen ? jslen : b;
+        if (a >= b) {
+            *res = make_string(s, 0);
+        } else {
+            start = utf16_offset(s, slen, a);
+            end = start + utf16_offset(s+start, slen-start, b-a);
+            *res = make_string(s+start, end-start);
+        }
+        break;
+    case STRM_TO_LOWER_CASE:
+        *res = string_lower(str);
+        break;
+    case STRM_MATCH:
+        *res = to_regex(arg0, &re);
+        if (!is_err(*res)) *res = regex_match(re, s, slen, true);
+        break;
+    case STRM_SEARCH:
+        *res = to_regex(arg0, &re);
+        if (is_err(*res)) break;
+        caps = emalloc(re->ncaps*2*sizeof(size_t));
+        if (!caps) {
+            *res = err_oom();
+            break;
+        }
+        ret = regex_exec(re, s, slen, 0, caps);
+        if (ret < 0) {
+            *res = err_oom();
+        } else {
+            *res = make_float(ret ? (double)utf16_index(s, slen, caps[0]) : 
+                -1);
+        }
+        break;
+    default: // STRM_TRIM
+        p = trim(s, slen, &sublen);
+        *res = make_string(p, sublen);
+        break;
+    }
+    return true;
+}
+
+// eval_regex_member evaluates a built-in regular expression property or
+// method, such as re.source or re.test(s), in the same way as
+// eval_string_member.
+static bool eval_regex_member(struct value rev, const uint8_t *ident, 
+    size_t ilen, const uint8_t *expr, size_t len, struct eval_context *ctx,
+    int depth, struct value *res, size_t *n)
+{
+    const uint8_t *pat;
+    size_t plen;
+    int flags;
+    regex_parts(rev, &pat, &plen, &flags);
+    if (ilen == 6 && memcmp(ident, "source", 6) == 0) {
+        *res = make_string(pat, plen);
+        *n = 0;
+        return true;
+    }
+    if (ilen == 5 && memcmp(ident, "flags", 5) == 0) {
+        // flags are always listed in the same order
+        uint8_t *mem = emalloc(sizeof(re_flag_chars));
+        if (!mem) {
+            *res = err_oom();
+            return true;
+        }
+        size_t mlen = 0;
+        for (size_t i = 0; i < sizeof(re_flag_chars)-1; i++) {
+            if (flags & (1<<i)) mem[mlen++] = (uint8_t)re_flag_chars[i];
+        }
+        *res = make_string(mem, mlen);
+        *n = 0;
+        return true;
+    }
+    bool test = ilen == 4 && memcmp(ident, "test", 4) == 0;
+    bool exec = ilen == 4 && memcmp(ident, "exec", 4) == 0;
+    if (!test && !exec) return false;
+    struct args_iter_context actx = { 0 };
+    if (!eval_call_args(expr, len, ctx, depth, &actx, res, n)) return false;
+    if (is_err(*res)) return true;
+    char buf[32];
+    size_t slen;
+    const uint8_t *s = to_str(actx.nargs > 0 ? actx.args[0] : 
+        make_undefined(), &slen, buf, sizeof(buf));
+    if (!s) {
+        *res = err_oom();
+        return true;
+    }
+    struct regex *re;
+    *res = to_regex(rev, &re);
+    if (is_err(*res)) return true;
+    if (exec) {
+        // exec() is stateless, so it returns the first match like match()
+        // without the 'g' flag.
+        *res = regex_match(re, s, slen, false);
+        return true;
+    }
+    int ret = regex_test(re, s, slen);
+    *res = ret < 0 ? err_oom() : make_bool(ret);
+    return true;
+}
+
+///////////////////////////////////////////
+// Array methods
+///////////////////////////////////////////
+
+// struct elems iterates over the elements of an array, a typed array, or a
+// JSON array.
+struct elems {
+    struct value arr;
+    size_t index;
+    struct json next;   // next JSON element
+    bool ints;          // int_math for JSON numbers
+};
+
+static bool elems_init(struct elems *it, struct value arr, bool ints) {
+    memset(it, 0, sizeof(struct elems));
+    it->arr = arr;
+    it->ints = ints;
+    if (arr.kind == ARRAY_KIND || arr.kind == TYPED_KIND) return true;
+    if (arr.kind != JSON_KIND) return false;
+    struct json json = json_parsen((char*)arr.str, arr.len);
+    if (json_type(json) != JSON_ARRAY) return false;
+    it->next = json_first(json);
+    return true;
+}
+
+// elems_next reads the next element into val, which may be an error if out
+// of memory. Returns false when there are no more elements.
+static bool elems_next(struct elems *it, struct value *val) {
+    if (it->arr.kind == ARRAY_KIND) {
+        if (it->index == it->arr.len) return false;
+        *val = it->arr.arr[it->index++];
+        return true;
+    }
+    if (it->arr.kind == TYPED_KIND) {
+        if (it->index == it->arr.len) return false;
+        *val = typed_at(it->arr, it->index++, it->ints);
+        return true;
+    }
+    if (!json_exists(it->next)) return false;
+    *val = make_json((uint8_t*)json_raw(it->next), json_raw_length(it->next),
+        it->ints);
+    it->next = json_next(it->next);
+    it->index++;
+    return true;
+}
+
+// array_includes returns true if the array has an element that is strictly
+// equal to the value, or if both are NaN.
+static struct value array_includes(struct value arr, struct value x, 
+    struct eval_context *ctx)
+{
+    struct elems it;
+    elems_init(&it, arr, int_math(ctx));
+    struct value v;
+    while (elems_next(&it, &v)) {
+        if (is_err(v)) return v;
+        if (vseq(v, x, ctx).t) return make_bool(true);
+        if (isnumkind(v) && isnumkind(x) && isnan(to_f64(v)) && 
+            isnan(to_f64(x)))
+        {
+            return make_bool(true);
+        }
+    }
+    return make_bool(false);
+}
+
+// struct scope binds the parameters of an arrow function while its body is
+// evaluated.
+struct scope {
+    const uint8_t *name;
+    size_t len;
+    struct value value;
+    struct scope *parent;
+};
+
+static bool scope_lookup(const struct scope *scope, const uint8_t *ident, 
+    size_t ilen, struct value *val)
+{
+    for (; scope; scope = scope->parent) {
+        if (scope->len == ilen && memcmp(scope->name, ident, ilen) == 0) {
+            *val = scope->value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// read_arg reads the length of the call argument at the start of s, which
+// ends at the first top-level comma.
+static bool read_arg(const uint8_t *s, size_t len, size_t *n) {
+    size_t i = 0;
+    size_t glen;
+    for (; i < len && s[i] != ','; i++) {
+        switch (s[i]) {
+        case '/':
+            if (!regex_start(s, i)) break;
+            // fall through
+        case '(': case '[': case '{': case '"': case '\'':
+            if (!read_group(s+i, len-i, &glen)) return false;
+            i = i + glen - 1;
+            break;
+        }
+    }
+    *n = i;
+    return true;
+}
+
+// read_args reads up to max call arguments from the contents of the call
+// parens. Any that follow are not read.
+static bool read_args(const uint8_t *s, size_t len, const uint8_t *args[],
+    size_t lens[], size_t max, size_t *nargs)
+{
+    *nargs = 0;
+    size_t tlen;
+    trim(s, len, &tlen);
+    size_t i = 0;
+    while (tlen > 0 && *nargs < max) {
+        size_t alen;
+        if (!read_arg(s+i, len-i, &alen)) return false;
+        args[*nargs] = s+i;
+        lens[*nargs] = alen;
+        (*nargs)++;
+        if (i+alen == len) break;
+        i += alen+1;
+    }
+    return true;
+}
+
+// eval_arg evaluates a call argument that was read with read_arg. The value
+// is not passed to the iterator of the expression that the call is part of.
+static struct value eval_arg(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth)
+{
+    void (*iter)(struct value, void *udata) = ctx->iter;
+    void *iter_udata = ctx->iter_udata;
+    ctx->iter = NULL;
+    ctx->iter_udata = NULL;
+    struct value res = eval_expr(expr, len, ctx, depth);
+    ctx->iter = iter;
+    ctx->iter_udata = iter_udata;
+    return res;
+}
+
+// struct lambda is an arrow function, such as x => x.qty > 10 or
+// (acc, x) => acc + x.
+struct lambda {
+    const uint8_t *params[3];
+    size_t plens[3];
+    size_t nparams;
+    const uint8_t *body;
+    size_t bodylen;
+};
+
+static bool read_lambda_param(struct lambda *fn, const uint8_t *s, 
+    size_t len)
+{
+    s = trim(s, len, &len);
+    size_t ilen;
+    const uint8_t *ident = read_ident(s, len, &ilen);
+    if (!ident || ilen != len || fn->nparams == 3) return false;
+    fn->params[fn->nparams] = ident;
+    fn->plens[fn->nparams] = ilen;
+    fn->nparams++;
+    return true;
+}
+
+// read_lambda reads the arrow function at the start of expr. Its body ends at
+// the first top-level comma, and the number of bytes read is stored in n.
+static bool read_lambda(const uint8_t *expr, size_t len, struct lambda *fn,
+    size_t *n)
+{
+    memset(fn, 0, sizeof(struct lambda));
+    size_t tlen;
+    const uint8_t *s = trim(expr, len, &tlen);
+    if (tlen == 0) return false;
+    size_t i;
+    if (s[0] == '(') {
+        size_t glen;
+        const uint8_t *g = read_group(s, tlen, &glen);
+        if (!g) return false;
+        size_t start = 1;
+        for (size_t j = 1; j < glen-1; j++) {
+            if (g[j] == ',') {
+                if (!read_lambda_param(fn, g+start, j-start)) return false;
+                start = j + 1;
+            }
+        }
+        size_t plen;
+        trim(g+start, glen-1-start, &plen);
+        if ((fn->nparams > 0 || plen > 0) && 
+            !read_lambda_param(fn, g+start, glen-1-start))
+        {
+            return false;
+        }
+        i = glen;
+    } else {
+        size_t ilen;
+        if (!read_ident(s, tlen, &ilen)) return false;
+        read_lambda_param(fn, s, ilen);
+        i = ilen;
+    }
+    while (i < tlen && isws(s[i])) i++;
+    if (tlen-i < 2 || s[i] != '=' || s[i+1] != '>') return false;
+    i += 2;
+    size_t blen;
+    if (!read_arg(s+i, tlen-i, &blen)) return false;
+    fn->body = s+i;
+    fn->bodylen = blen;
+    *n = (size_t)(s-expr) + i + blen;
+    return true;
+}
+
+// call_lambda evaluates the body of the arrow function with its parameters
+// bound to the arguments.
+static struct value call_lambda(const struct lambda *fn, 
+    const struct value *args, struct eval_context *ctx, int depth)
+{
+    struct scope vars[3];
+    struct scope *parent = ctx->scope;
+    for (size_t i = 0; i < fn->nparams; i++) {
+        vars[i] = (struct scope) {
+            .name = fn->params[i],
+            .len = fn->plens[i],
+            .value = args[i],
+            .parent = parent,
+        };
+        parent = &vars[i];
+    }
+    struct scope *scope = ctx->scope;
+    ctx->scope = parent;
+    struct value res = eval_arg(fn->body, fn->bodylen, ctx, depth);
+    ctx->scope = scope;
+    return res;
+}
+
+enum array_method {
+    ARRM_NONE, ARRM_INCLUDES, ARRM_SOME, ARRM_EVERY, ARRM_FILTER, ARRM_MAP, 
+    ARRM_FIND, ARRM_REDUCE,
+};
+
+static enum array_method array_method(const uint8_t *ident, size_t ilen) {
+    static const struct { const char *name; enum array_method m; } 
+    methods[] = {
+        { "includes", ARRM_INCLUDES },
+        { "some", ARRM_SOME },
+        { "every", ARRM_EVERY },
+        { "filter", ARRM_FILTER },
+        { "map", ARRM_MAP },
+        { "find", ARRM_FIND },
+        { "reduce", ARRM_REDUCE },
+    };
+    for (size_t i = 0; i < sizeof(methods)/sizeof(methods[0]); i++) {
+        if (strlen(methods[i].name) == ilen && 
+            memcmp(methods[i].name, ident, ilen) == 0)
+        {
+            return methods[i].m;
+        }
+    }
+    return ARRM_NONE;
+}
+
+// array_lambda runs an array method that takes an arrow function, such as
+// arr.some(x => x.qty > 10). The args are the contents of the call parens.
+// some(), every(), and find() stop at the first element that decides the
+// result.
+static struct value array_lambda(struct value arr, enum array_method m,
+    const uint8_t *args, size_t alen, struct eval_context *ctx, int depth)
+{
+    struct lambda fn;
+    size_t flen;
+    if (!read_lambda(args, alen, &fn, &flen)) {
+        const uint8_t *arg = trim(args, alen, &alen);
+        return alen == 0 ? err_notfunc((uint8_t*)"undefined", 9) : 
+            err_notfunc(arg, alen);
+    }
+    struct value acc = { 0 };
+    bool hasacc = false;
+    if (m == ARRM_REDUCE && flen < alen) {
+        // initial value
+        acc = eval_arg(args+flen+1, alen-flen-1, ctx, depth);
+        if (is_err(acc)) return acc;
+        hasacc = true;
+    }
+    struct array out = { 0 };
+    struct elems it;
+    elems_init(&it, arr, int_math(ctx));
+    struct value fargs[3];
+    struct value v;
+    while (elems_next(&it, &v)) {
+        if (is_err(v)) return v;
+        double index = (double)(it.index-1);
+        if (m == ARRM_REDUCE) {
+            if (!hasacc) {
+                acc = v;
+                hasacc = true;
+                continue;
+            }
+            fargs[0] = acc;
+            fargs[1] = v;
+            fargs[2] = make_float(index);
+        } else {
+            fargs[0] = v;
+            fargs[1] = make_float(index);
+        }
+        struct value res = call_lambda(&fn, fargs, ctx, depth);
+        if (is_err(res)) return res;
+        switch (m) {
+        case ARRM_SOME:
+            if (to_bool(res)) return make_bool(true);
+            break;
+        case ARRM_EVERY:
+            if (!to_bool(res)) return make_bool(false);
+            break;
+        case ARRM_FIND:
+            if (to_bool(res)) return v;
+            break;
+        case ARRM_FILTER:
+            if (to_bool(res) && !array_push_back(&out, v)) return err_oom();
+            break;
+        case ARRM_MAP:
+            if (!array_push_back(&out, res)) return err_oom();
+            break;
+        default: // ARRM_REDUCE
+            acc = res;
+            break;
+        }
+    }
+    switch (m) {
+    case ARRM_SOME: return make_bool(false);
+    case ARRM_EVERY: return make_bool(true);
+    case ARRM_FIND: return make_undefined();
+    case ARRM_REDUCE:
+        if (!hasacc) {
+            return err_msg("TypeError: Reduce of empty array with no initial "
+                "value");
+        }
+        return acc;
+    default: return make_array(out.items, out.len);
+    }
+}
+
+// eval_array_member evaluates a built-in method of an array or JSON array,
+// such as arr.includes(x) or arr.some(x => x.qty > 10), in the same way as
+// eval_string_member.
+static bool eval_array_member(struct value arr, const uint8_t *ident, 
+    size_t ilen, const uint8_t *expr, size_t len, struct eval_context *ctx,
+    int depth, struct value *res, size_t *n)
+{
+    enum array_method m = array_method(ident, ilen);
+    if (m == ARRM_NONE) return false;
+    struct elems it;
+    if (!elems_init(&it, arr, false)) return false;
+    if (m == ARRM_INCLUDES) {
+        struct args_iter_context actx = { 0 };
+        if (!eval_call_args(expr, len, ctx, depth, &actx, res, n)) {
+            return false;
+        }
+        if (is_err(*res)) return true;
+        *res = array_includes(arr, actx.nargs > 0 ? actx.args[0] : 
+            make_undefined(), ctx);
+        return true;
+    }
+    size_t tlen;
+    const uint8_t *tail = trim(expr, len, &tlen);
+    if (tlen == 0 || tail[0] != '(') return false;
+    size_t glen;
+    const uint8_t *g = read_group(tail, tlen, &glen);
+    if (!g) {
+        *res = err_syntax();
+        return true;
+    }
+    *n = (size_t)(tail-expr) + glen;
+    *res = array_lambda(arr, m, g+1, glen-2, ctx, depth);
+    return true;
+}
+
+///////////////////////////////////////////
+// Literal sets
+///////////////////////////////////////////
+
+// Long chains of equality tests against literals, such as
+// c == 'US' || c == 'CA' || c == 'MX' || ..., includes() on array literals,
+// such as [1,5,9,...].includes(x), and ternary ladders, such as
+// t == 'a' ? 1 : t == 'b' ? 4 : ... : 0, are turned into a hash set of the
+// literals. The subject is then evaluated once and looked up in the set,
+// rather than being compared to each literal in turn. For ladders, each
+// literal maps to the arm that's evaluated when it matches.
+//
+// Sets are kept in a small per-thread cache that's keyed by the expression
+// text, along with a record of the texts that don't have the right shape, so
+// each one is only parsed once.
+
+#define LITSET_MAXSAFE 9007199254740992.0 // 2^53
+
+enum litset_type {
+    LITSET_OR,       // c == 'US' || c == 'CA' || ...
+    LITSET_INCLUDES, // [1,5,9,...].includes(x)
+    LITSET_TERNS,    // t == 'a' ? 1 : t == 'b' ? 4 : ... : 0
+};
+
+struct litset_slot {
+    bool used;
+    size_t len;         // string length
+    const uint8_t *str; // string literal
+    double num;         // number literal
+    size_t arm;         // offset of the ternary arm in the text
+    size_t armlen;      //
+};
+
+struct litset {
+    uint32_t hash;      // hash of the expression text
+    uint8_t type;       // enum litset_type
+    const uint8_t *text;// copy of the expression text
+    size_t len;         //
+    bool ok;            // false if the text is not a literal set
+    bool cached;        // held by the thread's cache
+    int refs;           // callers that are using the set
+    bool strict;        // compares with '===' 
+    bool strs;          // string literals, otherwise numbers
+    size_t subj;        // offset of the subject in the text
+    size_t subjlen;     //
+    size_t def;         // offset of the default ternary arm in the text
+    size_t deflen;      //
+    size_t nslots;      // power of two
+    struct litset_slot *slots;
+};
+
+static uint32_t litset_hash_str(const uint8_t *s, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ s[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t litset_hash_num(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, 8);
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// litset_find returns the slot for a literal, which is unused if the literal
+// is not in the set.
+static struct litset_slot *litset_find(const struct litset *set, 
+    struct value lit)
+{
+    size_t mask = set->nslots-1;
+    size_t i = (set->strs ? litset_hash_str(lit.str, lit.len) : 
+        litset_hash_num(lit.f64)) & mask;
+    while (1) {
+        struct litset_slot *slot = &set->slots[i];
+        if (!slot->used) return slot;
+        if (set->strs ? slot->len == lit.len && 
+            memcmp(slot->str, lit.str, lit.len) == 0 : slot->num == lit.f64)
+        {
+            return slot;
+        }
+        i = (i+1) & mask;
+    }
+}
+
+static bool litset_subj_char(uint8_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || 
+        (c >= '0' && c <= '9') || c == '_' || c == '$' || c == '.' || 
+        c >= 0x80;
+}
+
+// litset_read_lit reads the string or number literal that makes up all of s.
+static bool litset_read_lit(const uint8_t *s, size_t len, struct value *lit,
+    bool *oom)
+{
+    if (len == 0) return false;
+    if (s[0] == '"' || s[0] == '\'') {
+        size_t slen, rlen;
+        const uint8_t *str = parse_string(s, len, &slen, &rlen, oom);
+        if (!str || rlen != len) return false;
+        *lit = make_string(str, slen);
+        return true;
+    }
+    if (!((s[0] >= '0' && s[0] <= '9') || s[0] == '-' || s[0] == '.')) {
+        return false;
+    }
+    bool ok = false;
+    double x = parse_float(s, len, &ok);
+    if (!ok || !(x >= -LITSET_MAXSAFE && x <= LITSET_MAXSAFE)) return false;
+    *lit = make_float(x == 0 ? 0 : x);
+    return true;
+}
+
+// litset_read_alt reads an OR-chain alternative, such as c == 'US' or
+// 'US' == c, into its subject and literal.
+static bool litset_read_alt(const uint8_t *s, size_t len, 
+    const uint8_t **subj, size_t *subjlen, const uint8_t **lit, 
+    size_t *litlen, bool *strict)
+{
+    s = trim(s, len, &len);
+    if (len == 0) return false;
+    bool litfirst = !litset_subj_char(s[0]) || (s[0] >= '0' && s[0] <= '9') ||
+        s[0] == '.';
+    size_t i = 0;
+    if (!litfirst) {
+        while (i < len && litset_subj_char(s[i])) i++;
+    } else if (s[0] == '"' || s[0] == '\'') {
+        if (!read_group(s, len, &i)) return false;
+    } else {
+        while (i < len && s[i] != '=' && !isws(s[i])) i++;
+    }
+    size_t llen = i;
+    while (i < len && isws(s[i])) i++;
+    if (len-i < 3 || s[i] != '=' || s[i+1] != '=') return false;
+    i += 2;
+    *strict = s[i] == '=';
+    if (*strict) i++;
+    size_t rlen;
+    const uint8_t *r = trim(s+i, len-i, &rlen);
+    if (rlen == 0 || r[0] == '=') return false;
+    if (litfirst) {
+        for (size_t j = 0; j < rlen; j++) {
+            if (!litset_subj_char(r[j])) return false;
+        }
+        if ((r[0] >= '0' && r[0] <= '9') || r[0] == '.') return false;
+        *lit = s;
+        *litlen = llen;
+        *subj = r;
+        *subjlen = rlen;
+    } else {
+        *subj = s;
+        *subjlen = llen;
+        *lit = r;
+        *litlen = rlen;
+    }
+    return true;
+}
+
+// litset_add adds a literal to the set if it has slots, along with its arm
+// for a ternary ladder. Returns false if the literal is not a string or
+// number, or if it's not the same type as the other literals.
+static bool litset_add(struct litset *set, size_t count, const uint8_t *lit,
+    size_t litlen, size_t arm, size_t armlen, size_t *strbytes, bool *oom)
+{
+    lit = trim(lit, litlen, &litlen);
+    struct value val;
+    if (!litset_read_lit(lit, litlen, &val, oom)) return false;
+    bool strs = val.kind == STR_KIND;
+    if (count == 0) {
+        set->strs = strs;
+    } else if (strs != set->strs) {
+        return false;
+    }
+    if (strs) *strbytes += val.len;
+    if (!set->slots) return true;
+    struct litset_slot *slot = litset_find(set, val);
+    if (slot->used) {
+        // the first of any duplicates wins
+        return true;
+    }
+    slot->used = true;
+    slot->arm = arm;
+    slot->armlen = armlen;
+    if (strs) {
+        // copy the string into the space after the slots
+        uint8_t *str = (uint8_t*)(set->slots+set->nslots) + *strbytes - 
+            val.len;
+        memcpy(str, val.str, val.len);
+        slot->str = str;
+        slot->len = val.len;
+    } else {
+        slot->num = val.f64;
+    }
+    return true;
+}
+
+// litset_add_alt adds the literal of an OR-chain or ternary ladder 
+// alternative, which must test the same subject in the same way as the 
+// alternatives before it.
+static bool litset_add_alt(struct litset *set, size_t count, 
+    const uint8_t *alt, size_t altlen, size_t arm, size_t armlen, 
+    size_t *strbytes, bool *oom)
+{
+    const uint8_t *subj, *lit;
+    size_t subjlen, litlen;
+    bool strict;
+    if (!litset_read_alt(alt, altlen, &subj, &subjlen, &lit, &litlen, 
+        &strict))
+    {
+        return false;
+    }
+    if (count == 0) {
+        set->subj = (size_t)(subj-set->text);
+        set->subjlen = subjlen;
+        set->strict = strict;
+    } else if (subjlen != set->subjlen || strict != set->strict ||
+        memcmp(subj, set->text+set->subj, subjlen) != 0)
+    {
+        return false;
+    }
+    return litset_add(set, count, lit, litlen, arm, armlen, strbytes, oom);
+}
+
+// litset_scan_list reads the literals of an OR-chain or the contents of an
+// array literal.
+static size_t litset_scan_list(struct litset *set, size_t *strbytes, 
+    bool *oom)
+{
+    const uint8_t *text = set->text;
+    size_t len = set->len;
+    uint8_t sep = set->type == LITSET_INCLUDES ? ',' : '|';
+    size_t count = 0;
+    size_t s = 0;
+    size_t glen;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len) {
+            switch (text[i]) {
+            case '"': case '\'':
+                if (!read_group(text+i, len-i, &glen)) return 0;
+                i = i + glen - 1;
+                continue;
+            case '(': case '[': case '{': case '/': case '?': case ',': 
+            case '|':
+                if (text[i] != sep) return 0;
+                if (sep == '|') {
+                    if (i+1 == len || text[i+1] != '|') return 0;
+                    i++;
+                }
+                break;
+            default:
+                continue;
+            }
+        }
+        size_t end = sep == '|' && i < len ? i-1 : i;
+        if (sep == ',' ? 
+            !litset_add(set, count, text+s, end-s, 0, 0, strbytes, oom) :
+            !litset_add_alt(set, count, text+s, end-s, 0, 0, strbytes, oom))
+        {
+            return 0;
+        }
+        count++;
+        s = i + 1;
+    }
+    return count;
+}
+
+// litset_scan_terns reads the arms of a ternary ladder, such as
+// t == 'a' ? 1 : t == 'b' ? 4 : 0. The ladder ends at the first condition
+// that doesn't test the same subject, and the rest of the text becomes the
+// default arm.
+static size_t litset_scan_terns(struct litset *set, size_t *strbytes, 
+    bool *oom)
+{
+    const uint8_t *text = set->text;
+    size_t len = set->len;
+    size_t count = 0;
+    size_t s = 0;
+    size_t glen;
+    while (1) {
+        // find the '?' that ends the condition
+        size_t q = s;
+        while (q < len) {
+            if (text[q] == '"' || text[q] == '\'') {
+                if (!read_group(text+q, len-q, &glen)) return 0;
+                q += glen;
+                continue;
+            }
+            if (text[q] == '?' && (q+1 == len || 
+                (text[q+1] != '?' && text[q+1] != '.')))
+            {
+                break;
+            }
+            if (!litset_subj_char(text[q]) && !isws(text[q]) && 
+                text[q] != '=' && text[q] != '-' && text[q] != '+')
+            {
+                // can't be an alternative
+                q = len;
+                break;
+            }
+            q++;
+        }
+        if (q == len) break;
+        // find the ':' that ends the arm
+        size_t c = q + 1;
+        size_t tdepth = 1;
+        for (; c < len; c++) {
+            switch (text[c]) {
+            case '?':
+                if (c+1 < len && (text[c+1] == '?' || text[c+1] == '.')) {
+                    c++;
+                } else {
+                    tdepth++;
+                }
+                continue;
+            case ':':
+                tdepth--;
+                break;
+            case '/':
+                if (!regex_start(text, c)) continue;
+                // fall through
+            case '(': case '[': case '{': case '"': case '\'':
+                if (!read_group(text+c, len-c, &glen)) return 0;
+                c = c + glen - 1;
+                continue;
+            default:
+                continue;
+            }
+            if (tdepth == 0) break;
+        }
+        if (c == len) return 0;
+        if (!litset_add_alt(set, count, text+s, q-s, q+1, c-(q+1), strbytes,
+            oom))
+        {
+            if (*oom) return 0;
+            break;
+        }
+        count++;
+        s = c + 1;
+    }
+    size_t deflen;
+    trim(text+s, len-s, &deflen);
+    if (deflen == 0) return 0;
+    set->def = s;
+    set->deflen = len-s;
+    return count;
+}
+
+// litset_scan reads the literals of the set's text, adding them to the set
+// if it has slots. Returns the number of literals, or zero if the text is not
+// a literal set or if out of memory.
+static size_t litset_scan(struct litset *set, size_t *strbytes, bool *oom) {
+    if (set->type == LITSET_TERNS) return litset_scan_terns(set, strbytes, oom);
+    return litset_scan_list(set, strbytes, oom);
+}
+
+static __thread struct litset *tlitsets[XV_LITSET_CACHE_SIZE];
+static __thread size_t tlitsetnext = 0;
+
+// litset_get returns the literal set for the text from the thread's cache,
+// building it on a miss. Returns NULL if out of memory.
+//
+// The returned set must be released with litset_put. Sets that are in use,
+// such as those of enclosing expressions, are never evicted. When all of the
+// cached sets are in use the new set is not cached, and is freed by its last
+// litset_put.
+static struct litset *litset_get(const uint8_t *text, size_t len, 
+    enum litset_type type)
+{
+    uint32_t hash = litset_hash_str(text, len) ^ type;
+    for (size_t i = 0; i < XV_LITSET_CACHE_SIZE; i++) {
+        struct litset *set = tlitsets[i];
+        if (set && set->hash == hash && set->type == type && 
+            set->len == len && memcmp(set->text, text, len) == 0)
+        {
+            set->refs++;
+            return set;
+        }
+    }
+    // The text is scanned once to size the set, then again to fill it.
+    // includes() compares with '===', like array_includes.
+    struct litset tmp = { .text = text, .len = len, .type = type,
+        .strict = type == LITSET_INCLUDES };
+    size_t strbytes = 0;
+    bool oom = false;
+    size_t count = litset_scan(&tmp, &strbytes, &oom);
+    if (oom) return NULL;
+    size_t nslots = 0;
+    if (count >= XV_LITSET_MIN_SIZE) {
+        nslots = 16;
+        while (nslots < count*2) nslots *= 2;
+    }
+    size_t size = sizeof(struct litset) + nslots*sizeof(struct litset_slot) + 
+        strbytes + len;
+    struct litset *set = emalloc0(size);
+    if (!set) return NULL;
+    *set = tmp;
+    set->hash = hash;
+    set->slots = (struct litset_slot*)(set+1);
+    memset(set->slots, 0, nslots*sizeof(struct litset_slot));
+    uint8_t *copy = (uint8_t*)(set->slots+nslots) + strbytes;
+    memcpy(copy, text, len);
+    set->text = copy;
+    set->nslots = nslots;
+    if (nslots > 0) {
+        strbytes = 0;
+        if (litset_scan(set, &strbytes, &oom) != count) {
+            efree0(set);
+            return NULL;
+        }
+        set->ok = true;
+    }
+    set->refs = 1;
+    for (size_t i = 0; i < XV_LITSET_CACHE_SIZE; i++) {
+        size_t j = (tlitsetnext+i)%XV_LITSET_CACHE_SIZE;
+        if (!tlitsets[j] || tlitsets[j]->refs == 0) {
+            if (tlitsets[j]) efree0(tlitsets[j]);
+            tlitsets[j] = set;
+            set->cached = true;
+            tlitsetnext = (j+1)%XV_LITSET_CACHE_SIZE;
+            break;
+        }
+    }
+    return set;
+}
+
+// litset_put releases a set that was returned by litset_get.
+static void litset_put(struct litset *set) {
+    set->refs--;
+    if (set->refs == 0 && !set->cached) efree0(set);
+}
+
+// litset_has returns 1 if the value equals one of the literals in the set,
+// 0 if it does not, or -1 if it needs to be compared the regular way. The
+// slot of the matching literal is stored in slot.
+static int litset_has(const struct litset *set, struct value x, 
+    struct eval_context *ctx, const struct litset_slot **slot)
+{
+    if (set->strs) {
+        if (x.kind != STR_KIND) return set->strict ? 0 : -1;
+        if (no_case(ctx)) return -1;
+        *slot = litset_find(set, x);
+        return (*slot)->used;
+    }
+    if (set->strict && (!isnumkind(x) || 
+        (!int_math(ctx) && x.kind != FLOAT_KIND)))
+    {
+        return 0;
+    }
+    if ((x.kind == INT_KIND && (x.i64 > (int64_t)LITSET_MAXSAFE || 
+        x.i64 < -(int64_t)LITSET_MAXSAFE)) || 
+        (x.kind == UINT_KIND && x.u64 > (uint64_t)LITSET_MAXSAFE))
+    {
+        // might not be exactly representable as a double
+        return -1;
+    }
+    double f = to_f64(x);
+    if (isnan(f)) return 0;
+    *slot = litset_find(set, make_float(f == 0 ? 0 : f));
+    return (*slot)->used;
+}
+
+// eval_litset_or evaluates an OR-chain of equality tests against literals
+// using a literal set. Returns false if the expression is not such a chain.
+static bool eval_litset_or(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res)
+{
+    // Cheaply rule out other expressions before looking in the cache.
+    const uint8_t *p = find_bytes(expr, len, (uint8_t*)"||", 2);
+    const uint8_t *subj, *lit;
+    size_t subjlen, litlen;
+    bool strict;
+    if (!p || !litset_read_alt(expr, (size_t)(p-expr), &subj, &subjlen, &lit,
+        &litlen, &strict))
+    {
+        return false;
+    }
+    size_t n = 0;
+    p = expr;
+    while (n < XV_LITSET_MIN_SIZE-1) {
+        p = find_bytes(p, len-(size_t)(p-expr), (uint8_t*)"||", 2);
+        if (!p) return false;
+        p += 2;
+        n++;
+    }
+    struct litset *set = litset_get(expr, len, LITSET_OR);
+    if (!set) return false;
+    if (!set->ok) {
+        litset_put(set);
+        return false;
+    }
+    struct value x = eval_expr(expr+set->subj, set->subjlen, ctx, depth);
+    if (is_err(x)) {
+        litset_put(set);
+        *res = x;
+        return true;
+    }
+    const struct litset_slot *slot;
+    int has = litset_has(set, x, ctx, &slot);
+    litset_put(set);
+    if (has < 0) return false;
+    *res = make_bool(has);
+    return true;
+}
+
+// eval_litset_terns evaluates a ternary ladder that tests one subject
+// against literals, such as t == 'a' ? 1 : t == 'b' ? 4 : 0, by looking up
+// the arm to evaluate. Returns false if the expression is not such a ladder.
+static bool eval_litset_terns(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res)
+{
+    // Cheaply rule out other expressions before looking in the cache.
+    const uint8_t *p = memchr(expr, '?', len);
+    const uint8_t *subj, *lit;
+    size_t subjlen, litlen;
+    bool strict;
+    if (!p || !litset_read_alt(expr, (size_t)(p-expr), &subj, &subjlen, &lit,
+        &litlen, &strict))
+    {
+        return false;
+    }
+    size_t n = 0;
+    p = expr;
+    while (n < XV_LITSET_MIN_SIZE) {
+        p = memchr(p, '?', len-(size_t)(p-expr));
+        if (!p) return false;
+        p++;
+        n++;
+    }
+    struct litset *set = litset_get(expr, len, LITSET_TERNS);
+    if (!set) return false;
+    if (!set->ok) {
+        litset_put(set);
+        return false;
+    }
+    struct value x = eval_expr(expr+set->subj, set->subjlen, ctx, depth);
+    if (is_err(x)) {
+        litset_put(set);
+        *res = x;
+        return true;
+    }
+    const struct litset_slot *slot;
+    int has = litset_has(set, x, ctx, &slot);
+    size_t arm = has > 0 ? slot->arm : set->def;
+    size_t armlen = has > 0 ? slot->armlen : set->deflen;
+    litset_put(set);
+    if (has < 0) return false;
+    *res = eval_expr(expr+arm, armlen, ctx, depth);
+    return true;
+}
+
+// eval_litset_includes evaluates arr.includes(x) where arr is an array
+// literal of strings or numbers, using a literal set. The group is the array
+// literal and the expr is what follows it. Returns false if it's not such a
+// call, otherwise the number of expr bytes consumed is stored in n.
+static bool eval_litset_includes(const uint8_t *group, size_t glen, 
+    const uint8_t *expr, size_t len, struct eval_context *ctx, int depth,
+    struct value *res, size_t *n)
+{
+    size_t tlen;
+    const uint8_t *tail = trim(expr, len, &tlen);
+    if (tlen < 9 || tail[0] != '.') return false;
+    size_t ilen;
+    const uint8_t *ident = read_ident(tail+1, tlen-1, &ilen);
+    if (!ident || ilen != 8 || memcmp(ident, "includes", 8) != 0) return false;
+    size_t plen;
+    const uint8_t *paren = trim(ident+ilen, tlen-(size_t)(ident+ilen-tail), 
+        &plen);
+    if (plen == 0 || paren[0] != '(') return false;
+    // Only worth it for more than a handful of elements.
+    size_t ncommas = 0;
+    for (size_t i = 1; i < glen-1 && ncommas < XV_LITSET_MIN_SIZE-1; i++) {
+        if (group[i] == ',') ncommas++;
+    }
+    if (ncommas < XV_LITSET_MIN_SIZE-1) return false;
+    struct litset *set = litset_get(group+1, glen-2, LITSET_INCLUDES);
+    if (!set) return false;
+    if (!set->ok) {
+        litset_put(set);
+        return false;
+    }
+    struct args_iter_context actx = { 0 };
+    size_t alen;
+    if (!eval_call_args(ident+ilen, tlen-(size_t)(ident+ilen-tail), ctx, depth,
+        &actx, res, &alen))
+    {
+        litset_put(set);
+        return false;
+    }
+    *n = (size_t)(ident+ilen-expr) + alen;
+    if (is_err(*res)) {
+        litset_put(set);
+        return true;
+    }
+    struct value x = actx.nargs > 0 ? actx.args[0] : make_undefined();
+    const struct litset_slot *slot;
+    int has = litset_has(set, x, ctx, &slot);
+    litset_put(set);
+    if (has < 0) {
+        struct value arr = multi_exprs_to_array(group+1, glen-2, ctx, depth);
+        *res = is_err(arr) ? arr : array_includes(arr, x, ctx);
+        return true;
+    }
+    *res = make_bool(has);
+    return true;
+}
+
+///////////////////////////////////////////
+// IP addresses
+///////////////////////////////////////////
+
+// The cidrMatch(ip, cidrs) built-in tests an IPv4 or IPv6 address against a
+// CIDR block or an array of them. Lists that are array literals of strings,
+// or JSON arrays from the environment, are compiled into a prefix trie that
+// is cached per thread, keyed on the list's text. The trie has 16-way nodes,
+// so a lookup is at most 8 node reads for IPv4 and 32 for IPv6. Shorter
+// prefixes are expanded into whole nodes, and a lookup stops at the first
+// covering entry, because only membership matters.
+
+#define CIDR_FULL UINT32_MAX // entry covered by a block
+
+enum cidrset_type { CIDRSET_TEXT, CIDRSET_JSON };
+
+struct cidrset {
+    enum cidrset_type type; // 
+    const uint8_t *key;     // array literal text or raw JSON
+    size_t len;             // length of key
+    bool ok;                // all entries are valid CIDR strings
+    uint32_t (*nodes)[16];  // node 0 is the IPv4 root, node 1 is IPv6
+    size_t nnodes;          // 
+    size_t cap;             // 
+};
+
+static __thread struct cidrset *tcidrsets[XV_CIDR_CACHE_SIZE];
+static __thread size_t tcidrsetnext = 0;
+
+static bool parse_ipv4(const uint8_t *s, size_t len, uint8_t ip[4]) {
+    size_t i = 0;
+    for (int j = 0; j < 4; j++) {
+        if (j > 0 && (i == len || s[i++] != '.')) return false;
+        size_t start = i;
+        int x = 0;
+        for (; i < len && i-start < 4 && s[i] >= '0' && s[i] <= '9'; i++) {
+            x = x*10 + (s[i]-'0');
+        }
+        if (i == start || x > 255 || (s[start] == '0' && i-start > 1)) {
+            // empty, too large, or a leading zero
+            return false;
+        }
+        ip[j] = (uint8_t)x;
+    }
+    return i == len;
+}
+
+static bool parse_ipv6(const uint8_t *s, size_t len, uint8_t ip[16]) {
+    uint8_t groups[16] = { 0 };
+    int n = 0;      // bytes read
+    int gap = -1;   // position of '::'
+    size_t i = 0;
+    if (len >= 2 && s[0] == ':' && s[1] == ':') {
+        gap = 0;
+        i = 2;
+    }
+    while (i < len) {
+        if (n == 16) return false;
+        size_t start = i;
+        int x = 0;
+        for (; i < len && i-start < 5 && hexval(s[i]) >= 0; i++) {
+            x = x*16 + hexval(s[i]);
+        }
+        if (i < len && s[i] == '.') {
+            // trailing IPv4 address
+            if (n > 12 || !parse_ipv4(s+start, len-start, groups+n)) {
+                return false;
+            }
+            n += 4;
+            break;
+        }
+        if (i == start || i-start > 4) return false;
+        groups[n++] = (uint8_t)(x>>8);
+        groups[n++] = (uint8_t)x;
+        if (i == len) break;
+        if (s[i++] != ':' || i == len) return false;
+        if (s[i] == ':') {
+            if (gap >= 0) return false;
+            gap = n;
+            i++;
+        }
+    }
+    if (gap < 0) {
+        if (n != 16) return false;
+        memcpy(ip, groups, 16);
+    } else {
+        if (n > 14) return false;
+        memset(ip, 0, 16);
+        memcpy(ip, groups, (size_t)gap);
+        memcpy(ip+16-(n-gap), groups+gap, (size_t)(n-gap));
+    }
+    return true;
+}
+
+// parse_ip parses an IPv4 or IPv6 address in place and returns its version,
+// or zero if it's not valid. IPv4-mapped IPv6 addresses are returned as
+// IPv4.
+static int parse_ip(const uint8_t *s, size_t len, uint8_t ip[16]) {
+    if (parse_ipv4(s, len, ip)) return 4;
+    if (!parse_ipv6(s, len, ip)) return 0;
+    static const uint8_t mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+    if (memcmp(ip, mapped, 12) == 0) {
+        memmove(ip, ip+12, 4);
+        return 4;
+    }
+    return 6;
+}
+
+// parse_cidr parses a CIDR block, such as 10.0.0.0/8 or 2001:db8::/32, or a
+// single address.
+static int parse_cidr(const uint8_t *s, size_t len, uint8_t ip[16], 
+    int *bits)
+{
+    size_t alen = 0;
+    while (alen < len && s[alen] != '/') alen++;
+    int v = parse_ip(s, alen, ip);
+    if (!v) return 0;
+    int max = v == 4 ? 32 : 128;
+    if (alen == len) {
+        *bits = max;
+        return v;
+    }
+    size_t i = alen+1;
+    if (i == len || len-i > 3 || (s[i] == '0' && len-i > 1)) return 0;
+    int x = 0;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return 0;
+        x = x*10 + (s[i]-'0');
+    }
+    if (v == 4 && alen > 0 && s[0] == ':') {
+        // IPv4-mapped block, such as ::ffff:10.0.0.0/104
+        if (x < 96 || x > 128) return 0;
+        x -= 96;
+    }
+    if (x > max) return 0;
+    *bits = x;
+    return v;
+}
+
+static int ip_nibble(const uint8_t ip[16], int i) {
+    return (ip[i>>3] >> ((i&4) ? 0 : 4)) & 15;
+}
+
+static bool cidrset_insert(struct cidrset *set, const uint8_t ip[16], int v,
+    int bits)
+{
+    uint32_t node = v == 4 ? 0 : 1;
+    for (int i = 0; ; i += 4) {
+        int nib = ip_nibble(ip, i);
+        if (bits-i <= 4) {
+            // expand the remaining bits into whole entries
+            int span = 1 << (4-(bits-i));
+            for (int j = nib&~(span-1); j < (nib&~(span-1))+span; j++) {
+                set->nodes[node][j] = CIDR_FULL;
+            }
+            return true;
+        }
+        uint32_t next = set->nodes[node][nib];
+        if (next == CIDR_FULL) return true;
+        if (next == 0) {
+            if (set->nnodes == set->cap) {
+                size_t cap = set->cap*2;
+                uint32_t (*nodes)[16] = emalloc0(cap*sizeof(*nodes));
+                if (!nodes) return false;
+                memcpy(nodes, set->nodes, set->nnodes*sizeof(*nodes));
+                efree0(set->nodes);
+                set->nodes = nodes;
+                set->cap = cap;
+            }
+            next = (uint32_t)set->nnodes++;
+            memset(set->nodes[next], 0, sizeof(*set->nodes));
+            set->nodes[node][nib] = next;
+        }
+        node = next;
+    }
+}
+
+static bool cidrset_has(const struct cidrset *set, const uint8_t ip[16], 
+    int v)
+{
+    uint32_t node = v == 4 ? 0 : 1;
+    for (int i = 0; i < (v == 4 ? 32 : 128); i += 4) {
+        node = set->nodes[node][ip_nibble(ip, i)];
+        if (node == CIDR_FULL) return true;
+        if (node == 0) return false;
+    }
+    return false;
+}
+
+static bool cidrset_add(struct cidrset *set, struct value v, bool *oom) {
+    uint8_t ip[16];
+    int bits;
+    int ver;
+    if (v.kind != STR_KIND || !(ver = parse_cidr(v.str, v.len, ip, &bits))) {
+        return false;
+    }
+    if (!cidrset_insert(set, ip, ver, bits)) {
+        *oom = true;
+        return false;
+    }
+    return true;
+}
+
+// cidrset_fill adds each entry in the key to the set, and returns false if
+// one of them is not a CIDR string.
+static bool cidrset_fill(struct cidrset *set, bool ints, bool *oom) {
+    if (set->type == CIDRSET_JSON) {
+        struct elems it;
+        elems_init(&it, (struct value) { .kind = JSON_KIND, 
+            .str = set->key, .len = set->len }, ints);
+        struct value v;
+        while (elems_next(&it, &v)) {
+            if (is_err(v)) {
+                *oom = true;
+                return false;
+            }
+            if (!cidrset_add(set, v, oom)) return false;
+        }
+        return true;
+    }
+    size_t len;
+    const uint8_t *s = trim(set->key+1, set->len-2, &len);
+    if (len == 0) return true;
+    size_t i = 0;
+    while (1) {
+        size_t alen;
+        read_arg(s+i, len-i, &alen);
+        size_t tlen;
+        const uint8_t *t = trim(s+i, alen, &tlen);
+        size_t slen, rlen;
+        const uint8_t *str = tlen > 0 ? 
+            parse_string(t, tlen, &slen, &rlen, oom) : NULL;
+        if (!str || rlen != tlen || 
+            !cidrset_add(set, make_string(str, slen), oom))
+        {
+            return false;
+        }
+        if (i+alen == len) return true;
+        i += alen+1;
+    }
+}
+
+static void cidrset_free(struct cidrset *set) {
+    efree0(set->nodes);
+    efree0(set);
+}
+
+// cidrset_get returns the cached CIDR set for the key, building it if needed,
+// or NULL if out of memory.
+static struct cidrset *cidrset_get(const uint8_t *key, size_t len, 
+    enum cidrset_type type, bool ints)
+{
+    for (size_t i = 0; i < XV_CIDR_CACHE_SIZE; i++) {
+        struct cidrset *set = tcidrsets[i];
+        if (set && set->type == type && set->len == len && 
+            memcmp(set->key, key, len) == 0)
+        {
+            return set;
+        }
+    }
+    struct cidrset *set = emalloc0(sizeof(struct cidrset)+len);
+    if (!set) return NULL;
+    memset(set, 0, sizeof(struct cidrset));
+    set->type = type;
+    set->len = len;
+    set->key = (uint8_t*)(set+1);
+    memcpy((uint8_t*)(set+1), key, len);
+    set->cap = 16;
+    set->nnodes = 2;
+    set->nodes = emalloc0(set->cap*sizeof(*set->nodes));
+    if (!set->nodes) {
+        efree0(set);
+        return NULL;
+    }
+    memset(set->nodes, 0, set->nnodes*sizeof(*set->nodes));
+    bool oom = false;
+    set->ok = cidrset_fill(set, ints, &oom);
+    if (oom) {
+        cidrset_free(set);
+        return NULL;
+    }
+    if (tcidrsets[tcidrsetnext]) cidrset_free(tcidrsets[tcidrsetnext]);
+    tcidrsets[tcidrsetnext] = set;
+    tcidrsetnext = (tcidrsetnext+1)%XV_CIDR_CACHE_SIZE;
+    return set;
+}
+
+// cidr_match tests an address against a CIDR string, or against each entry
+// of an array, without a set. It's used for single blocks and for arrays
+// that can't be cached.
+static struct value cidr_match(const uint8_t ip[16], int ver, 
+    struct value cidrs, struct eval_context *ctx)
+{
+    struct elems it;
+    bool list = elems_init(&it, cidrs, int_math(ctx));
+    struct value v = cidrs;
+    while (!list || elems_next(&it, &v)) {
+        if (is_err(v)) return v;
+        uint8_t block[16];
+        int bits;
+        int bver;
+        if (v.kind != STR_KIND || 
+            !(bver = parse_cidr(v.str, v.len, block, &bits)))
+        {
+            return err_msg("TypeError: Invalid CIDR block");
+        }
+        int full = bits/8;
+        int rem = bits%8;
+        if (bver == ver && memcmp(ip, block, (size_t)full) == 0 && 
+            (rem == 0 || ((ip[full] ^ block[full]) >> (8-rem)) == 0))
+        {
+            return make_bool(true);
+        }
+        if (!list) break;
+    }
+    return make_bool(false);
+}
+
+// eval_cidr_match evaluates cidrMatch(ip, cidrs), where cidrs is a CIDR
+// string, an array, or a JSON array. An address that isn't valid never
+// matches, while a list entry that isn't valid is an error.
+static bool eval_cidr_match(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res, size_t *n)
+{
+    size_t tlen;
+    const uint8_t *tail = trim(expr, len, &tlen);
+    if (tlen == 0 || tail[0] != '(') return false;
+    size_t glen;
+    const uint8_t *g = read_group(tail, tlen, &glen);
+    size_t alen;
+    if (!g || !read_arg(g+1, glen-2, &alen)) {
+        *res = err_syntax();
+        return true;
+    }
+    *n = (size_t)(tail-expr) + glen;
+    struct value addr = eval_arg(g+1, alen, ctx, depth);
+    if (is_err(addr)) {
+        *res = addr;
+        return true;
+    }
+    size_t arglen = alen < glen-2 ? glen-2-alen-1 : 0;
+    const uint8_t *arg = trim(g+1+alen+1, arglen, &arglen);
+    uint8_t ip[16];
+    int ver = addr.kind == STR_KIND ? parse_ip(addr.str, addr.len, ip) : 0;
+    struct cidrset *set = NULL;
+    size_t llen = 0;
+    if (arglen > 0 && arg[0] == '[') {
+        // the argument is an array literal if only a comma follows it
+        if (!read_group(arg, arglen, &llen)) {
+            *res = err_syntax();
+            return true;
+        }
+        size_t i = llen;
+        while (i < arglen && isws(arg[i])) i++;
+        if (i < arglen && arg[i] != ',') llen = 0;
+        else arglen = llen;
+    }
+    if (llen == 0 && arglen > 0 && !read_arg(arg, arglen, &arglen)) {
+        *res = err_syntax();
+        return true;
+    }
+    if (llen > 0) {
+        // array literal
+        set = cidrset_get(arg, arglen, CIDRSET_TEXT, int_math(ctx));
+        if (set && set->ok) {
+            *res = make_bool(ver && cidrset_has(set, ip, ver));
+            return true;
+        }
+    }
+    struct value cidrs = arglen > 0 ? eval_arg(arg, arglen, ctx, depth) : 
+        make_undefined();
+    if (is_err(cidrs)) {
+        *res = cidrs;
+        return true;
+    }
+    if (cidrs.kind == JSON_KIND) {
+        struct json json = json_parsen((char*)cidrs.str, cidrs.len);
+        if (json_type(json) == JSON_ARRAY) {
+            set = cidrset_get(cidrs.str, cidrs.len, CIDRSET_JSON, 
+                int_math(ctx));
+            if (set && set->ok) {
+                *res = make_bool(ver && cidrset_has(set, ip, ver));
+                return true;
+            }
+        } else {
+            cidrs = make_json(cidrs.str, cidrs.len, int_math(ctx));
+        }
+    }
+    *res = cidr_match(ip, ver, cidrs, ctx);
+    if (!ver && !is_err(*res)) *res = make_bool(false);
+    return true;
+}
+
+// eval_is_ip evaluates isIP(str), which returns 4 or 6 for an IPv4 or IPv6
+// address, or 0.
+static bool eval_is_ip(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res, size_t *n)
+{
+    struct args_iter_context actx = { 0 };
+    if (!eval_call_args(expr, len, ctx, depth, &actx, res, n)) return false;
+    if (is_err(*res)) return true;
+    uint8_t ip[16];
+    int ver = actx.nargs > 0 && actx.args[0].kind == STR_KIND ? 
+        parse_ip(actx.args[0].str, actx.args[0].len, ip) : 0;
+    *res = int_math(ctx) ? make_int(ver) : make_float(ver);
+    return true;
+}
+
+///////////////////////////////////////////
+// Geo predicates
+///////////////////////////////////////////
+
+// The Geo namespace has Geo.distance(), Geo.withinBBox(), and 
+// Geo.withinPolygon(). Points are (lat, lon) pairs in degrees. Polygons are
+// arrays of [lat, lon] points, or arrays of such rings for polygons with
+// holes, and a point is inside when it's inside an odd number of rings.
+//
+// A polygon is indexed by splitting its latitude range into bands, each
+// listing the edges that overlap it. A point is then only tested against the
+// edges of its own band. Polygons that are numeric array literals, or JSON
+// arrays from the environment, are indexed once and cached per thread.
+
+#define GEO_EARTH_RADIUS 6371e3 // meters
+#define GEO_MAX_BANDS 1024
+
+struct geo_edge {
+    double lat1, lon1;
+    double lat2, lon2;
+};
+
+enum geopoly_type { GEOPOLY_TEXT, GEOPOLY_JSON, GEOPOLY_VALUE };
+
+struct geopoly {
+    enum geopoly_type type; // 
+    const uint8_t *key;     // array literal text or raw JSON
+    size_t len;             // length of key
+    bool ok;                // the polygon is valid
+    double minlat, maxlat;  // bounding box
+    double minlon, maxlon;  // 
+    struct geo_edge *edges; // 
+    size_t nedges;          // 
+    size_t cap;             // 
+    double bandh;           // height of a band
+    size_t nbands;          // 
+    uint32_t *bands;        // start of each band in bandedges, plus the end
+    uint32_t *bandedges;    // edge indexes, grouped by band
+};
+
+static __thread struct geopoly *tgeopolys[XV_GEO_CACHE_SIZE];
+static __thread size_t tgeopolynext = 0;
+
+static void geopoly_free(struct geopoly *poly) {
+    if (poly->edges) efree0(poly->edges);
+    if (poly->bands) efree0(poly->bands);
+    if (poly->bandedges) efree0(poly->bandedges);
+    efree0(poly);
+}
+
+static bool geopoly_push(struct geopoly *poly, struct geo_edge edge) {
+    if (poly->nedges == poly->cap) {
+        size_t cap = poly->cap ? poly->cap*2 : 16;
+        struct geo_edge *edges = emalloc0(cap*sizeof(struct geo_edge));
+        if (!edges) return false;
+        if (poly->edges) {
+            memcpy(edges, poly->edges, poly->nedges*sizeof(struct geo_edge));
+            efree0(poly->edges);
+        }
+        poly->edges = edges;
+        poly->cap = cap;
+    }
+    poly->edges[poly->nedges++] = edge;
+    return true;
+}
+
+// geopoint reads a [lat, lon] pair.
+static bool geopoint(struct value v, bool ints, double *lat, double *lon) {
+    struct elems it;
+    if (!elems_init(&it, v, ints)) return false;
+    struct value x, y, z;
+    if (!elems_next(&it, &x) || !elems_next(&it, &y) || 
+        elems_next(&it, &z) || !isnumkind(x) || !isnumkind(y))
+    {
+        return false;
+    }
+    *lat = to_f64(x);
+    *lon = to_f64(y);
+    return !isnan(*lat) && !isnan(*lon);
+}
+
+// geopoly_add_ring adds the edges of a ring, closing it if needed.
+static bool geopoly_add_ring(struct geopoly *poly, struct value ring, 
+    bool ints, bool *oom)
+{
+    struct elems it;
+    if (!elems_init(&it, ring, ints)) return false;
+    double lat0, lon0, lat, lon, plat = 0, plon = 0;
+    size_t npoints = 0;
+    struct value v;
+    while (elems_next(&it, &v)) {
+        if (is_err(v)) {
+            *oom = true;
+            return false;
+        }
+        if (!geopoint(v, ints, &lat, &lon)) return false;
+        if (npoints == 0) {
+            lat0 = lat;
+            lon0 = lon;
+        } else if (!geopoly_push(poly, (struct geo_edge){ 
+            plat, plon, lat, lon }))
+        {
+            *oom = true;
+            return false;
+        }
+        plat = lat;
+        plon = lon;
+        npoints++;
+    }
+    if (npoints < 3) return false;
+    if ((plat != lat0 || plon != lon0) && 
+        !geopoly_push(poly, (struct geo_edge){ plat, plon, lat0, lon0 }))
+    {
+        *oom = true;
+        return false;
+    }
+    return true;
+}
+
+static bool geopoly_add(struct geopoly *poly, struct value polygon, 
+    bool ints, bool *oom)
+{
+    struct elems it;
+    if (!elems_init(&it, polygon, ints)) return false;
+    struct value first;
+    if (!elems_next(&it, &first)) return false;
+    if (is_err(first)) {
+        *oom = true;
+        return false;
+    }
+    struct elems it2;
+    struct value point;
+    if (!elems_init(&it2, first, ints) || !elems_next(&it2, &point)) {
+        return false;
+    }
+    if (is_err(point)) {
+        *oom = true;
+        return false;
+    }
+    struct elems it3;
+    if (!elems_init(&it3, point, ints)) {
+        // a single ring of points
+        return geopoly_add_ring(poly, polygon, ints, oom);
+    }
+    // rings
+    struct value ring = first;
+    do {
+        if (is_err(ring)) {
+            *oom = true;
+            return false;
+        }
+        if (!geopoly_add_ring(poly, ring, ints, oom)) return false;
+    } while (elems_next(&it, &ring));
+    return true;
+}
+
+static size_t geopoly_band(const struct geopoly *poly, double lat) {
+    double b = (lat - poly->minlat) / poly->bandh;
+    if (!(b > 0)) return 0;
+    if (b >= (double)poly->nbands) return poly->nbands-1;
+    return (size_t)b;
+}
+
+// geopoly_index builds the bounding box and the latitude bands.
+static bool geopoly_index(struct geopoly *poly) {
+    poly->minlat = poly->minlon = INFINITY;
+    poly->maxlat = poly->maxlon = -INFINITY;
+    for (size_t i = 0; i < poly->nedges; i++) {
+        struct geo_edge *e = &poly->edges[i];
+        poly->minlat = fmin(poly->minlat, e->lat1);
+        poly->maxlat = fmax(poly->maxlat, e->lat1);
+        poly->minlon = fmin(poly->minlon, e->lon1);
+        poly->maxlon = fmax(poly->maxlon, e->lon1);
+    }
+    poly->nbands = poly->nedges < GEO_MAX_BANDS ? poly->nedges : 
+        GEO_MAX_BANDS;
+    poly->bandh = (poly->maxlat - poly->minlat) / (double)poly->nbands;
+    if (!(poly->bandh > 0)) {
+        poly->nbands = 1;
+        poly->bandh = 1;
+    }
+    poly->bands = emalloc0((poly->nbands+1)*sizeof(uint32_t));
+    if (!poly->bands) return false;
+    memset(poly->bands, 0, (poly->nbands+1)*sizeof(uint32_t));
+    // count the edges in each band, then fill the bands
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < poly->nedges; i++) {
+            struct geo_edge *e = &poly->edges[i];
+            size_t b0 = geopoly_band(poly, fmin(e->lat1, e->lat2));
+            size_t b1 = geopoly_band(poly, fmax(e->lat1, e->lat2));
+            for (size_t b = b0; b <= b1; b++) {
+                if (pass == 0) poly->bands[b+1]++;
+                else poly->bandedges[poly->bands[b]++] = (uint32_t)i;
+            }
+        }
+        if (pass == 0) {
+            for (size_t b = 0; b < poly->nbands; b++) {
+                poly->bands[b+1] += poly->bands[b];
+            }
+            size_t total = poly->bands[poly->nbands];
+            poly->bandedges = emalloc0((total ? total : 1)*sizeof(uint32_t));
+            if (!poly->bandedges) return false;
+        } else {
+            // each band start was moved to the next band's start
+            memmove(poly->bands+1, poly->bands, 
+                poly->nbands*sizeof(uint32_t));
+            poly->bands[0] = 0;
+        }
+    }
+    return true;
+}
+
+static bool geopoly_has(const struct geopoly *poly, double lat, double lon) {
+    if (!(lat >= poly->minlat && lat <= poly->maxlat && 
+        lon >= poly->minlon && lon <= poly->maxlon))
+    {
+        return false;
+    }
+    size_t b = geopoly_band(poly, lat);
+    bool inside = false;
+    for (uint32_t i = poly->bands[b]; i < poly->bands[b+1]; i++) {
+        const struct geo_edge *e = &poly->edges[poly->bandedges[i]];
+        if ((e->lat1 > lat) != (e->lat2 > lat) && 
+            lon < (e->lon2-e->lon1) * (lat-e->lat1) / (e->lat2-e->lat1) + 
+                e->lon1)
+        {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+// geopoly_new builds a polygon index. Returns NULL if out of memory.
+static struct geopoly *geopoly_new(enum geopoly_type type, 
+    const uint8_t *key, size_t len, struct value polygon, bool ints)
+{
+    struct geopoly *poly = emalloc0(sizeof(struct geopoly)+len);
+    if (!poly) return NULL;
+    memset(poly, 0, sizeof(struct geopoly));
+    poly->type = type;
+    poly->len = len;
+    poly->key = (uint8_t*)(poly+1);
+    if (len > 0) memcpy((uint8_t*)(poly+1), key, len);
+    bool oom = false;
+    poly->ok = geopoly_add(poly, polygon, ints, &oom);
+    if (!oom && poly->ok && !geopoly_index(poly)) oom = true;
+    if (oom) {
+        geopoly_free(poly);
+        return NULL;
+    }
+    return poly;
+}
+
+// geopoly_get returns the cached polygon for the key, or NULL.
+static struct geopoly *geopoly_get(enum geopoly_type type, 
+    const uint8_t *key, size_t len)
+{
+    for (size_t i = 0; i < XV_GEO_CACHE_SIZE; i++) {
+        struct geopoly *poly = tgeopolys[i];
+        if (poly && poly->type == type && poly->len == len && 
+            memcmp(poly->key, key, len) == 0)
+        {
+            return poly;
+        }
+    }
+    return NULL;
+}
+
+static void geopoly_put(struct geopoly *poly) {
+    if (tgeopolys[tgeopolynext]) geopoly_free(tgeopolys[tgeopolynext]);
+    tgeopolys[tgeopolynext] = poly;
+    tgeopolynext = (tgeopolynext+1)%XV_GEO_CACHE_SIZE;
+}
+
+// geo_numeric_literal returns true if the text only has numbers, brackets,
+// and commas, so that it evaluates to the same polygon every time.
+static bool geo_numeric_literal(const uint8_t *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = s[i];
+        if ((c >= '0' && c <= '9') || c == '[' || c == ']' || c == ',' || 
+            c == '.' || c == '-' || c == '+' || isws(c))
+        {
+            continue;
+        }
+        if ((c == 'e' || c == 'E') && i > 0 && 
+            ((s[i-1] >= '0' && s[i-1] <= '9') || s[i-1] == '.'))
+        {
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+static double geo_radians(double deg) {
+    return deg * (3.141592653589793 / 180);
+}
+
+// geo_distance is the haversine distance of two points, in meters.
+static double geo_distance(double lat1, double lon1, double lat2, 
+    double lon2)
+{
+    double phi1 = geo_radians(lat1);
+    double phi2 = geo_radians(lat2);
+    double sdphi = sin((phi2 - phi1) / 2);
+    double sdlambda = sin(geo_radians(lon2 - lon1) / 2);
+    double haver = sdphi*sdphi + cos(phi1)*cos(phi2)*sdlambda*sdlambda;
+    return GEO_EARTH_RADIUS * 2 * asin(sqrt(haver > 1 ? 1 : haver));
+}
+
+// geo_within_bbox tests a point against a bounding box, which crosses the
+// antimeridian if minlon is greater than maxlon.
+static bool geo_within_bbox(double lat, double lon, double minlat, 
+    double minlon, double maxlat, double maxlon)
+{
+    if (!(lat >= minlat && lat <= maxlat)) return false;
+    if (minlon <= maxlon) return lon >= minlon && lon <= maxlon;
+    if (minlon > maxlon) return lon >= minlon || lon <= maxlon;
+    return false;
+}
+
+struct geo_iter_context {
+    double args[6];
+    size_t nargs;
+};
+
+static void geo_iter(struct value value, void *udata) {
+    struct geo_iter_context *gctx = udata;
+    if (gctx->nargs < sizeof(gctx->args)/sizeof(gctx->args[0])) {
+        gctx->args[gctx->nargs] = to_f64(value);
+    }
+    gctx->nargs++;
+}
+
+// eval_geo_polygon evaluates Geo.withinPolygon(lat, lon, polygon). The expr
+// is what follows the member name.
+static bool eval_geo_polygon(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res, size_t *n)
+{
+    size_t tlen;
+    const uint8_t *tail = trim(expr, len, &tlen);
+    if (tlen == 0 || tail[0] != '(') return false;
+    size_t glen;
+    const uint8_t *g = read_group(tail, tlen, &glen);
+    if (!g) {
+        *res = err_syntax();
+        return true;
+    }
+    *n = (size_t)(tail-expr) + glen;
+    const uint8_t *args[2];
+    size_t lens[2];
+    size_t nargs;
+    if (!read_args(g+1, glen-2, args, lens, 2, &nargs)) {
+        *res = err_syntax();
+        return true;
+    }
+    double point[2] = { NAN, NAN };
+    for (size_t i = 0; i < 2 && i < nargs; i++) {
+        struct value v = eval_arg(args[i], lens[i], ctx, depth);
+        if (is_err(v)) {
+            *res = v;
+            return true;
+        }
+        point[i] = to_f64(v);
+    }
+    // the polygon follows the second argument
+    const uint8_t *end = g+glen-1;
+    const uint8_t *arg = nargs == 2 && args[1]+lens[1] < end ? 
+        args[1]+lens[1]+1 : end;
+    size_t arglen;
+    arg = trim(arg, (size_t)(end-arg), &arglen);
+    size_t llen = 0;
+    if (arglen > 0 && arg[0] == '[') {
+        // the argument is an array literal if only a comma follows it
+        if (!read_group(arg, arglen, &llen)) {
+            *res = err_syntax();
+            return true;
+        }
+        size_t i = llen;
+        while (i < arglen && isws(arg[i])) i++;
+        if (i < arglen && arg[i] != ',') llen = 0;
+        else arglen = llen;
+    }
+    if (llen == 0 && arglen > 0 && !read_arg(arg, arglen, &arglen)) {
+        *res = err_syntax();
+        return true;
+    }
+    bool ints = int_math(ctx);
+    struct geopoly *poly = NULL;
+    struct geopoly *tmp = NULL;
+    if (llen > 0) {
+        // only numeric literals are cached by their text
+        poly = geopoly_get(GEOPOLY_TEXT, arg, arglen);
+    }
+    if (!poly) {
+        struct value v = arglen > 0 ? eval_arg(arg, arglen, ctx, depth) :
+            make_undefined();
+        if (is_err(v)) {
+            *res = v;
+            return true;
+        }
+        if (llen > 0 && geo_numeric_literal(arg, arglen)) {
+            poly = geopoly_new(GEOPOLY_TEXT, arg, arglen, v, ints);
+            if (poly) geopoly_put(poly);
+        } else if (v.kind == JSON_KIND) {
+            poly = geopoly_get(GEOPOLY_JSON, v.str, v.len);
+            if (!poly) {
+                poly = geopoly_new(GEOPOLY_JSON, v.str, v.len, v, ints);
+                if (poly) geopoly_put(poly);
+            }
+        } else {
+            poly = tmp = geopoly_new(GEOPOLY_VALUE, NULL, 0, v, ints);
+        }
+        if (!poly) {
+            *res = err_oom();
+            return true;
+        }
+    }
+    if (!poly->ok) {
+        *res = err_msg("TypeError: Invalid polygon");
+    } else {
+        *res = make_bool(geopoly_has(poly, point[0], point[1]));
+    }
+    if (tmp) geopoly_free(tmp);
+    return true;
+}
+
+// eval_geo evaluates a member of the built-in Geo namespace, in the same way
+// as eval_math.
+static bool eval_geo(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res, size_t *n)
+{
+    size_t tlen;
+    const uint8_t *tail = trim(expr, len, &tlen);
+    if (tlen < 2 || tail[0] != '.') return false;
+    size_t ilen;
+    const uint8_t *ident = read_ident(tail+1, tlen-1, &ilen);
+    if (!ident) return false;
+    bool distance = ilen == 8 && memcmp(ident, "distance", 8) == 0;
+    bool bbox = ilen == 10 && memcmp(ident, "withinBBox", 10) == 0;
+    bool polygon = ilen == 13 && memcmp(ident, "withinPolygon", 13) == 0;
+    if (!distance && !bbox && !polygon) return false;
+    size_t mlen = (size_t)(ident+ilen-expr);
+    size_t alen = 0;
+    if (polygon) {
+        if (!eval_geo_polygon(expr+mlen, len-mlen, ctx, depth, res, &alen)) {
+            return false;
+        }
+        *n = mlen + alen;
+        return true;
+    }
+    struct geo_iter_context gctx = { 0 };
+    for (size_t i = 0; i < sizeof(gctx.args)/sizeof(gctx.args[0]); i++) {
+        gctx.args[i] = NAN;
+    }
+    if (!eval_call_iter(expr+mlen, len-mlen, ctx, depth, geo_iter, &gctx, 
+        res, &alen))
+    {
+        return false;
+    }
+    *n = mlen + alen;
+    if (is_err(*res)) return true;
+    double *a = gctx.args;
+    if (distance) {
+        *res = make_float(geo_distance(a[0], a[1], a[2], a[3]));
+    } else {
+        *res = make_bool(geo_within_bbox(a[0], a[1], a[2], a[3], a[4], a[5]));
+    }
+    return true;
+}
+
+// the parallel evaluation pool of this thread, see "Batch evaluation"
+struct pool;
+static __thread struct pool *tpool = NULL;
+static void pool_free(struct pool *pool);
+
+void xv_cleanup_thread(void) {
+    xv_cleanup();
+    if (tpool) {
+        pool_free(tpool);
+        tpool = NULL;
+    }
+    for (size_t i = 0; i < XV_REGEX_CACHE_SIZE; i++) {
+        if (tregexes[i]) {
+            regex_free(tregexes[i]);
+            tregexes[i] = NULL;
+        }
+    }
+    tregexnext = 0;
+    for (size_t i = 0; i < XV_LITSET_CACHE_SIZE; i++) {
+        if (tlitsets[i]) {
+            efree0(tlitsets[i]);
+            tlitsets[i] = NULL;
+        }
+    }
+    tlitsetnext = 0;
+    for (size_t i = 0; i < XV_CIDR_CACHE_SIZE; i++) {
+        if (tcidrsets[i]) {
+            cidrset_free(tcidrsets[i]);
+            tcidrsets[i] = NULL;
+        }
+    }
+    tcidrsetnext = 0;
+    for (size_t i = 0; i < XV_GEO_CACHE_SIZE; i++) {
+        if (tgeopolys[i]) {
+            geopoly_free(tgeopolys[i]);
+            tgeopolys[i] = NULL;
+        }
+    }
+    tgeopolynext = 0;
+}
+
+///////////////////////////////////////////
+// Glob matching
+///////////////////////////////////////////
+
+// The match(str, pattern) built-in tests a string against a wildcard pattern,
+// where '*' matches any number of characters, '?' matches exactly one
+// character, and '\' escapes the character that follows.
+//
+// The pattern is read as segments split on '*'. Every segment matches a fixed
+// number of characters, so the first segment must match at the start of the
+// string, the last segment at the end, and each middle segment at its leftmost
+// position after the previous one. Middle segments with no wildcards are found
+// with find_bytes. Nothing backtracks and nothing is allocated.
+
+struct glob_seg {
+    const uint8_t *pat; // segment pattern, which does not include a '*'
+    size_t len;         // 
+    size_t nchars;      // number of characters it matches
+    bool literal;       // true if it has no '?' or '\'
+};
+
+// glob_read_seg reads the segment at the start of the pattern, up to but not
+// including the next unescaped '*'.
+static struct glob_seg glob_read_seg(const uint8_t *pat, size_t len) {
+    struct glob_seg seg = { .pat = pat, .literal = true };
+    size_t i = 0;
+    size_t n;
+    while (i < len && pat[i] != '*') {
+        if (pat[i] == '?') {
+            seg.literal = false;
+            i++;
+        } else {
+            if (pat[i] == '\\' && i+1 < len) {
+                seg.literal = false;
+                i++;
+            }
+            utf8_next(pat+i, len-i, &n);
+            i += n;
+        }
+        seg.nchars++;
+    }
+    seg.len = i;
+    return seg;
+}
+
+// glob_seg_at returns true if the segment matches at the start of s, storing
+// the number of bytes matched in n.
+static bool glob_seg_at(struct glob_seg seg, const uint8_t *s, size_t len,
+    bool nocase, size_t *n)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t pn, sn;
+    while (i < seg.len) {
+        if (j == len) return false;
+        uint32_t c = utf8_next(s+j, len-j, &sn);
+        if (seg.pat[i] == '?') {
+            i++;
+        } else {
+            if (seg.pat[i] == '\\' && i+1 < seg.len) i++;
+            uint32_t pc = utf8_next(seg.pat+i, seg.len-i, &pn);
+            i += pn;
+            if (c != pc && (!nocase || fold_codepoint(c) != fold_codepoint(pc)))
+            {
+                return false;
+            }
+        }
+        j += sn;
+    }
+    *n = j;
+    return true;
+}
+
+// glob_find_seg finds the leftmost match of the segment in s, storing the
+// offset just past the match in end.
+static bool glob_find_seg(struct glob_seg seg, const uint8_t *s, size_t len,
+    bool nocase, size_t *end)
+{
+    size_t n;
+    if (seg.literal && !nocase) {
+        const uint8_t *p = find_bytes(s, len, seg.pat, seg.len);
+        if (!p) return false;
+        *end = (size_t)(p-s) + seg.len;
+        return true;
+    }
+    size_t i = 0;
+    while (1) {
+        if (glob_seg_at(seg, s+i, len-i, nocase, &n)) {
+            *end = i + n;
+            return true;
+        }
+        if (i == len) return false;
+        utf8_next(s+i, len-i, &n);
+        i += n;
+    }
+}
+
+static bool glob_match(const uint8_t *s, size_t len, const uint8_t *pat,
+    size_t plen, bool nocase)
+{
+    size_t n;
+    struct glob_seg seg = glob_read_seg(pat, plen);
+    if (!glob_seg_at(seg, s, len, nocase, &n)) return false;
+    if (seg.len == plen) {
+        // no wildcards
+        return n == len;
+    }
+    size_t start = n;
+    size_t i = seg.len + 1;
+    while (1) {
+        seg = glob_read_seg(pat+i, plen-i);
+        if (i + seg.len == plen) break;
+        if (seg.len > 0) {
+            if (!glob_find_seg(seg, s+start, len-start, nocase, &n)) {
+                return false;
+            }
+            start += n;
+        }
+        i += seg.len + 1;
+    }
+    // The last segment matches the last seg.nchars characters of the string.
+    size_t count = 0;
+    for (size_t j = start; j < len; j += n) {
+        utf8_next(s+j, len-j, &n);
+        count++;
+    }
+    if (count < seg.nchars) return false;
+    for (; count > seg.nchars; count--) {
+        utf8_next(s+start, len-start, &n);
+        start += n;
+    }
+    return glob_seg_at(seg, s+start, len-start, nocase, &n);
+}
+
+///////////////////////////////////////////
+// Hashing
+///////////////////////////////////////////
+
+// The hash64() and bucket() built-ins use a wyhash-style hash that reads
+// its input as little-endian, so a value has the same hash on every
+// platform. Changing it would move users between sampling buckets.
+
+static const uint64_t wyp[4] = {
+    0x2d358dccaa6c78a5, 0x8bb84b93962eacc9, 
+    0x4b33a62ed433d4a3, 0x4d5a2da51de1aa47,
+};
+
+// mul128 multiplies a by b and returns the high 64 bits in hi.
+static uint64_t mul128(uint64_t a, uint64_t b, uint64_t *hi) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)a * b;
+    *hi = (uint64_t)(r >> 64);
+    return (uint64_t)r;
+#else
+    uint64_t ha = a >> 32, hb = b >> 32;
+    uint64_t la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    return lo;
+#endif
+}
+
+static uint64_t wymix(uint64_t a, uint64_t b) {
+    uint64_t hi;
+    uint64_t lo = mul128(a, b, &hi);
+    return lo ^ hi;
+}
+
+static uint64_t wyr8(const uint8_t *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | 
+        (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | 
+        (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint64_t wyr4(const uint8_t *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | 
+        (uint64_t)p[3] << 24;
+}
+
+static uint64_t wyhash(const uint8_t *p, size_t len, uint64_t seed) {
+    seed ^= wymix(seed^wyp[0], wyp[1]);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = wyr4(p) << 32 | wyr4(p+((len>>3)<<2));
+            b = wyr4(p+len-4) << 32 | wyr4(p+len-4-((len>>3)<<2));
+        } else if (len > 0) {
+            a = (uint64_t)p[0] << 16 | (uint64_t)p[len>>1] << 8 | p[len-1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p)^wyp[1], wyr8(p+8)^seed);
+                see1 = wymix(wyr8(p+16)^wyp[2], wyr8(p+24)^see1);
+                see2 = wymix(wyr8(p+32)^wyp[3], wyr8(p+40)^see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p)^wyp[1], wyr8(p+8)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p+i-16);
+        b = wyr8(p+i-8);
+    }
+    a ^= wyp[1];
+    b ^= seed;
+    a = mul128(a, b, &b);
+    return wymix(a^wyp[0]^len, b^wyp[1]);
+}
+
+// hash_value hashes the string form of a value, so that 42 and '42' have the
+// same hash. Strings, including JSON strings, are hashed in place.
+static bool hash_value(struct value v, uint64_t seed, uint64_t *hash) {
+    char buf[32];
+    size_t len;
+    const uint8_t *s = to_str(v, &len, buf, sizeof(buf));
+    if (!s) return false;
+    *hash = wyhash(s, len, seed);
+    return true;
+}
+
+// hash_seed returns the seed for a seed or salt argument. Integral numbers
+// are used as their 64-bit two's complement, whether they're int64, uint64,
+// or double values, so -1 and -1i64 are the same seed with or without
+// int_math. Other numbers use the bits of the double, and everything else is
+// hashed.
+static bool hash_seed(struct value v, uint64_t *seed) {
+    double f;
+    switch (v.kind) {
+    case UNDEF_KIND:
+        *seed = 0;
+        return true;
+    case INT_KIND:
+        *seed = (uint64_t)v.i64;
+        return true;
+    case UINT_KIND:
+        *seed = v.u64;
+        return true;
+    case FLOAT_KIND:
+        f = v.f64;
+        if (f == floor(f) && f >= -9223372036854775808.0 && 
+            f < 9223372036854775808.0)
+        {
+            *seed = (uint64_t)(int64_t)f;
+        } else if (f == floor(f) && f >= 0 && f < 18446744073709551616.0) {
+            *seed = (uint64_t)f;
+        } else {
+            memcpy(seed, &f, 8);
+        }
+        return true;
+    default:
+        return hash_value(v, 0, seed);
+    }
+}
+
+// eval_hash evaluates hash64(value, seed), which returns an unsigned 64-bit
+// hash, or bucket(value, salt, n), which returns a number from 0 to n-1 for
+// consistent sampling, such as bucket(user.id, 'exp42', 100) < 5.
+static bool eval_hash(bool bucket, const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res, size_t *n)
+{
+    struct args_iter_context actx = { 0 };
+    if (!eval_call_args(expr, len, ctx, depth, &actx, res, n)) return false;
+    if (is_err(*res)) return true;
+    uint64_t seed, hash;
+    if (!hash_seed(actx.nargs > 1 ? actx.args[1] : make_undefined(), &seed) ||
+        !hash_value(actx.nargs > 0 ? actx.args[0] : make_undefined(), seed, 
+            &hash))
+    {
+        *res = err_oom();
+        return true;
+    }
+    if (!bucket) {
+        *res = make_uint(hash);
+        return true;
+    }
+    double x = to_f64(actx.nargs > 2 ? actx.args[2] : make_undefined());
+    if (!(x >= 1 && x < 18446744073709551616.0)) {
+        *res = make_float(NAN);
+        return true;
+    }
+    // Multiply-shift maps the hash onto 0..n-1 without the bias of modulo.
+    uint64_t b;
+    mul128(hash, (uint64_t)x, &b);
+    *res = int_math(ctx) ? make_int((int64_t)b) : make_float((double)b);
+    return true;
+}
+
+///////////////////////////////////////////
+// Object literals
+///////////////////////////////////////////
+
+// An object literal, such as {score: s, reason: r}, evaluates to a map that
+// lives in the eval arena with a single allocation. Entries are kept in
+// insertion order and the slots are an open addressing index over them.
+
+struct map_entry {
+    const uint8_t *key;
+    size_t klen;
+    struct value value;
+};
+
+struct map {
+    size_t len;                 // number of entries
+    size_t mask;                // number of slots minus one
+    struct map_entry *entries;  // entries in insertion order
+    uint32_t *slots;            // entry index plus one, or zero if empty
+};
+
+// map_slot returns the slot for the key, which is empty if the key is not
+// in the map.
+static uint32_t *map_slot(const struct map *map, const uint8_t *key, 
+    size_t klen)
+{
+    size_t i = wyhash(key, klen, 0) & map->mask;
+    while (map->slots[i]) {
+        const struct map_entry *entry = &map->entries[map->slots[i]-1];
+        if (entry->klen == klen && memcmp(entry->key, key, klen) == 0) {
+            break;
+        }
+        i = (i+1) & map->mask;
+    }
+    return &map->slots[i];
+}
+
+static struct value map_get(struct value map, const uint8_t *key, 
+    size_t klen)
+{
+    const struct map *m = map.obj;
+    uint32_t *slot = map_slot(m, key, klen);
+    return *slot ? m->entries[*slot-1].value : make_undefined();
+}
+
+// map_set adds an entry to the map. A duplicate key replaces the value and
+// keeps its original position, like in JS.
+static void map_set(struct map *map, const uint8_t *key, size_t klen, 
+    struct value value)
+{
+    uint32_t *slot = map_slot(map, key, klen);
+    if (*slot) {
+        map->entries[*slot-1].value = value;
+        return;
+    }
+    map->entries[map->len] = (struct map_entry) { key, klen, value };
+    *slot = (uint32_t)++map->len;
+}
+
+// eval_map_entry evaluates a single 'key: value' entry. The key may be an
+// identifier, a string, a non-negative integer, or a computed [expr]. An
+// identifier by itself is shorthand for 'ident: ident'.
+static struct value eval_map_entry(struct map *map, const uint8_t *s, 
+    size_t len, struct eval_context *ctx, int depth)
+{
+    s = trim(s, len, &len);
+    if (len == 0) return err_syntax();
+    const uint8_t *key;
+    size_t klen;
+    size_t rlen;
+    bool ident = false;
+    bool oom = false;
+    if (s[0] == '"' || s[0] == '\'') {
+        key = parse_string(s, len, &klen, &rlen, &oom);
+        if (!key) return oom ? err_oom() : err_syntax();
+    } else if (s[0] == '[') {
+        const uint8_t *g = read_group(s, len, &rlen);
+        if (!g) return err_syntax();
+        struct value k = eval_arg(g+1, rlen-2, ctx, depth);
+        if (is_err(k)) return k;
+        key = to_str(k, &klen, NULL, 0);
+        if (!key) return err_oom();
+    } else if (isdigit(s[0])) {
+        rlen = 1;
+        while (rlen < len && isdigit(s[rlen])) rlen++;
+        bool ok = false;
+        uint64_t x = parse_uint(s, rlen, 10, &ok);
+        if (!ok) return err_syntax();
+        // numeric keys are stored in their canonical form, so {007: x}
+        // is the same as {7: x}
+        key = to_str(make_uint(x), &klen, NULL, 0);
+        if (!key) return err_oom();
+    } else {
+        key = read_ident(s, len, &klen);
+        if (!key) return err_syntax();
+        rlen = klen;
+        ident = true;
+    }
+    const uint8_t *rest = trim(s+rlen, len-rlen, &len);
+    struct value value;
+    if (len == 0) {
+        if (!ident) return err_syntax();
+        value = eval_arg(key, klen, ctx, depth);
+    } else {
+        if (rest[0] != ':') return err_syntax();
+        rest = trim(rest+1, len-1, &len);
+        if (len == 0) return err_syntax();
+        value = eval_arg(rest, len, ctx, depth);
+    }
+    if (is_err(value)) return value;
+    map_set(map, key, klen, value);
+    return value;
+}
+
+// eval_map evaluates the contents of an object literal braces.
+static struct value eval_map(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth)
+{
+    expr = trim(expr, len, &len);
+    // Count the entries first so that the map, its entries, and its slots
+    // can share one arena allocation.
+    size_t n = 0;
+    size_t alen;
+    for (size_t i = 0; len > 0; i++) {
+        if (!read_arg(expr+i, len-i, &alen)) return err_syntax();
+        n++;
+        i += alen;
+        if (i == len) break;
+    }
+    size_t nslots = 1;
+    while (nslots < n*2) nslots *= 2;
+    struct map *map = emalloc(sizeof(struct map) + 
+        n*sizeof(struct map_entry) + nslots*sizeof(uint32_t));
+    if (!map) return err_oom();
+    map->len = 0;
+    map->mask = nslots-1;
+    map->entries = (struct map_entry*)(map+1);
+    map->slots = (uint32_t*)(map->entries+n);
+    memset(map->slots, 0, nslots*sizeof(uint32_t));
+    for (size_t i = 0; len > 0; i++) {
+        read_arg(expr+i, len-i, &alen);
+        struct value res = eval_map_entry(map, expr+i, alen, ctx, depth);
+        if (is_err(res)) return res;
+        i += alen;
+        if (i == len) break;
+    }
+    return (struct value) {
+        .kind = MAP_KIND,
+        .len = map->len,
+        .obj = map,
+    };
+}
+
+static void write_json_string(struct writer *wr, const uint8_t *s, 
+    size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    write_char(wr, '"');
+    for (size_t i = 0; i < len; i++) {
+        switch (s[i]) {
+        case '"': write_cstr(wr, "\\\""); break;
+        case '\\': write_cstr(wr, "\\\\"); break;
+        case '\n': write_cstr(wr, "\\n"); break;
+        case '\r': write_cstr(wr, "\\r"); break;
+        case '\t': write_cstr(wr, "\\t"); break;
+        default:
+            if (s[i] < ' ') {
+                write_cstr(wr, "\\u00");
+                write_char(wr, hex[s[i]>>4]);
+                write_char(wr, hex[s[i]&15]);
+            } else {
+                write_char(wr, (char)s[i]);
+            }
+        }
+    }
+    write_char(wr, '"');
+}
+
+// write_json writes a value as JSON, which is how maps are serialized.
+// As with JSON.stringify, undefined and function values are left out of
+// maps and are null in arrays, and NaN and Infinity are null.
+static void write_json(struct writer *wr, struct value value) {
+    switch (value.kind) {
+    case FLOAT_KIND:
+        if (isfinite(value.f64)) {
+            write_double(wr, value.f64);
+        } else {
+            write_cstr(wr, "null");
+        }
+        break;
+    case INT_KIND: case UINT_KIND: case BOOL_KIND: case NULL_KIND: 
+    case JSON_KIND:
+        write_value(wr, value);
+        break;
+    case STR_KIND:
+        write_json_string(wr, value.str, value.len);
+        break;
+    case REGEX_KIND:
+        write_cstr(wr, "{}");
+        break;
+    case ARRAY_KIND: case TYPED_KIND:
+        write_char(wr, '[');
+        for (size_t i = 0; i < value.len; i++) {
+            if (i > 0) {
+                write_char(wr, ',');
+            }
+            write_json(wr, value.kind == ARRAY_KIND ? value.arr[i] : 
+                typed_at(value, i, true));
+        }
+        write_char(wr, ']');
+        break;
+    case MAP_KIND: {
+        const struct map *map = value.obj;
+        bool comma = false;
+        write_char(wr, '{');
+        for (size_t i = 0; i < map->len; i++) {
+            const struct map_entry *entry = &map->entries[i];
+            if (entry->value.kind == UNDEF_KIND || 
+                entry->value.kind == FUNC_KIND)
+            {
+                continue;
+            }
+            if (comma) {
+                write_char(wr, ',');
+            }
+            write_json_string(wr, entry->key, entry->klen);
+            write_char(wr, ':');
+            write_json(wr, entry->value);
+            comma = true;
+        }
+        write_char(wr, '}');
+        break;
+    }
+    default:
+        // undefined, functions, errors, and host objects
+        write_cstr(wr, "null");
+        break;
+    }
+}
+
+///////////////////////////////////////////
+// Built-in functions
+///////////////////////////////////////////
+
+// Math functions take numbers, and with int_math the ones that can't change
+// an integer, like Math.floor() and Math.max(), keep int64 arguments as they
+// are.
+
+enum math_func {
+    MATH_NONE, MATH_ABS, MATH_FLOOR, MATH_CEIL, MATH_ROUND, MATH_TRUNC, 
+    MATH_SIGN, MATH_SQRT, MATH_CBRT, MATH_EXP, MATH_LOG, MATH_LOG2, 
+    MATH_LOG10, MATH_POW, MATH_MIN, MATH_MAX,
+};
+
+static enum math_func math_func(const uint8_t *ident, size_t ilen) {
+    static const struct { const char *name; enum math_func f; } funcs[] = {
+        { "abs", MATH_ABS },
+        { "floor", MATH_FLOOR },
+        { "ceil", MATH_CEIL },
+        { "round", MATH_ROUND },
+        { "trunc", MATH_TRUNC },
+        { "sign", MATH_SIGN },
+        { "sqrt", MATH_SQRT },
+        { "cbrt", MATH_CBRT },
+        { "exp", MATH_EXP },
+        { "log", MATH_LOG },
+        { "log2", MATH_LOG2 },
+        { "log10", MATH_LOG10 },
+        { "pow", MATH_POW },
+        { "min", MATH_MIN },
+        { "max", MATH_MAX },
+    };
+    for (size_t i = 0; i < sizeof(funcs)/sizeof(funcs[0]); i++) {
+        if (strlen(funcs[i].name) == ilen && 
+            memcmp(funcs[i].name, ident, ilen) == 0)
+        {
+            return funcs[i].f;
+        }
+    }
+    return MATH_NONE;
+}
+
+// math_round rounds half up, like Javascript's Math.round().
+static double math_round(double x) {
+    double r = floor(x);
+    if (x - r >= 0.5) r += 1;
+    return r == 0 ? copysign(0, x) : r;
+}
+
+// math_pow is pow() with the Javascript results for a NaN exponent and for
+// 1 to an infinite power, which are NaN.
+static double math_pow(double x, double y) {
+    if (isnan(y) || (fabs(x) == 1 && isinf(y))) return NAN;
+    return pow(x, y);
+}
+
+struct minmax_iter_context {
+    bool max;
+    bool ints;          // all arguments are int64
+    int64_t i64;
+    double f64;
+};
+
+static void minmax_iter(struct value value, void *udata) {
+    struct minmax_iter_context *mctx = udata;
+    if (mctx->ints && value.kind == INT_KIND) {
+        if (mctx->max ? value.i64 > mctx->i64 : value.i64 < mctx->i64) {
+            mctx->i64 = value.i64;
+        }
+    } else {
+        mctx->ints = false;
+    }
+    double x = to_f64(value);
+    if (isnan(x) || isnan(mctx->f64)) {
+        mctx->f64 = NAN;
+    } else if (mctx->max ? x > mctx->f64 : x < mctx->f64) {
+        mctx->f64 = x;
+    } else if (x == 0 && mctx->f64 == 0 && (bool)signbit(x) != mctx->max) {
+        // +0 is greater than -0
+        mctx->f64 = x;
+    }
+}
+
+// eval_math evaluates a member of the built-in Math namespace, such as 
+// Math.PI or Math.max(a, b). The expr is what follows the 'Math' identifier.
+// The arguments are evaluated straight into numbers, without building an
+// array or calling the environment's ref.
+static bool eval_math(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res, size_t *n)
+{
+    size_t tlen;
+    const uint8_t *tail = trim(expr, len, &tlen);
+    if (tlen < 2 || tail[0] != '.') return false;
+    size_t ilen;
+    const uint8_t *ident = read_ident(tail+1, tlen-1, &ilen);
+    if (!ident) return false;
+    size_t mlen = (size_t)(ident+ilen-expr);
+    if (ilen == 2 && memcmp(ident, "PI", 2) == 0) {
+        *res = make_float(3.141592653589793);
+        *n = mlen;
+        return true;
+    }
+    if (ilen == 1 && ident[0] == 'E') {
+        *res = make_float(2.718281828459045);
+        *n = mlen;
+        return true;
+    }
+    enum math_func f = math_func(ident, ilen);
+    if (f == MATH_NONE) return false;
+    size_t alen;
+    if (f == MATH_MIN || f == MATH_MAX) {
+        struct minmax_iter_context mctx = {
+            .max = f == MATH_MAX,
+            .ints = int_math(ctx),
+            .i64 = f == MATH_MAX ? INT64_MIN : INT64_MAX,
+            .f64 = f == MATH_MAX ? -INFINITY : INFINITY,
+        };
+        if (!eval_call_iter(expr+mlen, len-mlen, ctx, depth, minmax_iter, 
+            &mctx, res, &alen))
+        {
+            return false;
+        }
+        *n = mlen + alen;
+        if (is_err(*res)) return true;
+        bool any = mctx.i64 != (f == MATH_MAX ? INT64_MIN : INT64_MAX) ||
+            !isinf(mctx.f64);
+        *res = mctx.ints && any ? make_int(mctx.i64) : make_float(mctx.f64);
+        return true;
+    }
+    struct args_iter_context actx = { 0 };
+    if (!eval_call_args(expr+mlen, len-mlen, ctx, depth, &actx, res, &alen)) {
+        return false;
+    }
+    *n = mlen + alen;
+    if (is_err(*res)) return true;
+    struct value a = actx.nargs > 0 ? actx.args[0] : make_undefined();
+    struct value b = actx.nargs > 1 ? actx.args[1] : make_undefined();
+    if (a.kind == INT_KIND && int_math(ctx)) {
+        switch (f) {
+        case MATH_ABS:
+            if (a.i64 == INT64_MIN) break;
+            *res = make_int(a.i64 < 0 ? -a.i64 : a.i64);
+            return true;
+        case MATH_FLOOR: case MATH_CEIL: case MATH_ROUND: case MATH_TRUNC:
+            *res = a;
+            return true;
+        case MATH_SIGN:
+            *res = make_int(a.i64 < 0 ? -1 : a.i64 > 0);
+            return true;
+        default:
+            break;
+        }
+    }
+    double x = to_f64(a);
+    switch (f) {
+    case MATH_ABS: x = fabs(x); break;
+    case MATH_FLOOR: x = floor(x); break;
+    case MATH_CEIL: x = ceil(x); break;
+    case MATH_ROUND: x = math_round(x); break;
+    case MATH_TRUNC: x = trunc(x); break;
+    case MATH_SIGN: x = x > 0 ? 1 : x < 0 ? -1 : x; break;
+    case MATH_SQRT: x = sqrt(x); break;
+    case MATH_CBRT: x = cbrt(x); break;
+    case MATH_EXP: x = exp(x); break;
+    case MATH_LOG: x = log(x); break;
+    case MATH_LOG2: x = log2(x); break;
+    case MATH_LOG10: x = log10(x); break;
+    default: x = math_pow(x, to_f64(b)); break; // MATH_POW
+    }
+    *res = make_float(x);
+    return true;
+}
+
+// The sum(), min(), max(), avg(), and count() built-ins reduce an array, a
+// typed array, a JSON array, or their arguments when there's more than one.
+// Elements are converted to numbers into a small buffer, which is reduced
+// with vector instructions whenever it fills up. The elements of a JSON array
+// are parsed and reduced in a single pass over the document, and typed arrays
+// of doubles are reduced where they are.
+//
+// Sums are accumulated in four lanes, with element i going to lane i%4, and
+// the lanes are added together at the end. That's done the same way with or
+// without vector instructions, so every build gets the same result.
+
+#define AGG_BUFSIZE 256
+
+enum agg_func { AGG_NONE, AGG_SUM, AGG_MIN, AGG_MAX, AGG_AVG, AGG_COUNT };
+
+struct agg {
+    enum agg_func func;
+    size_t count;
+    double lanes[4];    // partial sums, mins, or maxes
+    bool nan;           // some element is NaN
+    bool negzero;       // some element is -0
+    bool poszero;       // some element is +0
+    bool ints;          // every element is an int64, with int_math
+    bool overflow;      // the int64 sum overflowed
+    int64_t isum;
+    int64_t imin;
+    int64_t imax;
+    size_t nbuf;
+    double buf[AGG_BUFSIZE];
+    struct value pending; // first argument, which may be the array
+    size_t nargs;
+    struct value err;
+};
+
+// agg_reduce_f64s reduces n numbers into the lanes, with element i going to
+// lane i%4.
+static void agg_reduce_f64s(struct agg *agg, const double *x, size_t n) {
+    size_t i = 0;
+    double *l = agg->lanes;
+    if (agg->func == AGG_MIN || agg->func == AGG_MAX) {
+        // NaN and the sign of zero are tracked separately, so the order of
+        // the operands doesn't matter.
+        bool max = agg->func == AGG_MAX;
+#if defined(__AVX2__)
+        __m256d a = _mm256_loadu_pd(l);
+        __m256d u = _mm256_setzero_pd();
+        for (; i+4 <= n; i += 4) {
+            __m256d b = _mm256_loadu_pd(x+i);
+            a = max ? _mm256_max_pd(a, b) : _mm256_min_pd(a, b);
+            u = _mm256_or_pd(u, _mm256_cmp_pd(b, b, _CMP_UNORD_Q));
+        }
+        _mm256_storeu_pd(l, a);
+        if (_mm256_movemask_pd(u)) agg->nan = true;
+#elif defined(__SSE2__)
+        __m128d a = _mm_loadu_pd(l);
+        __m128d b = _mm_loadu_pd(l+2);
+        __m128d u = _mm_setzero_pd();
+        for (; i+4 <= n; i += 4) {
+            __m128d c = _mm_loadu_pd(x+i);
+            __m128d d = _mm_loadu_pd(x+i+2);
+            a = max ? _mm_max_pd(a, c) : _mm_min_pd(a, c);
+            b = max ? _mm_max_pd(b, d) : _mm_min_pd(b, d);
+            u = _mm_or_pd(u, _mm_cmpunord_pd(c, d));
+        }
+        _mm_storeu_pd(l, a);
+        _mm_storeu_pd(l+2, b);
+        if (_mm_movemask_pd(u)) agg->nan = true;
+#endif
+        for (; i < n; i++) {
+            if (isnan(x[i])) agg->nan = true;
+            if (max ? x[i] > l[i%4] : x[i] < l[i%4]) l[i%4] = x[i];
+        }
+    } else {
+#if defined(__AVX2__)
+        __m256d a = _mm256_loadu_pd(l);
+        for (; i+4 <= n; i += 4) {
+            a = _mm256_add_pd(a, _mm256_loadu_pd(x+i));
+        }
+        _mm256_storeu_pd(l, a);
+#elif defined(__SSE2__)
+        __m128d a = _mm_loadu_pd(l);
+        __m128d b = _mm_loadu_pd(l+2);
+        for (; i+4 <= n; i += 4) {
+            a = _mm_add_pd(a, _mm_loadu_pd(x+i));
+            b = _mm_add_pd(b, _mm_loadu_pd(x+i+2));
+        }
+        _mm_storeu_pd(l, a);
+        _mm_storeu_pd(l+2, b);
+#endif
+        for (; i+4 <= n; i += 4) {
+            l[0] += x[i];
+            l[1] += x[i+1];
+            l[2] += x[i+2];
+            l[3] += x[i+3];
+        }
+        // i is a multiple of four, so the rest go to the first lanes
+        for (size_t j = 0; j < n-i; j++) {
+            l[j] += x[i+j];
+        }
+    }
+}
+
+// agg_reduce reduces the buffered numbers into the lanes. 
+static void agg_reduce(struct agg *agg) {
+    agg_reduce_f64s(agg, agg->buf, agg->nbuf);
+    agg->nbuf = 0;
+}
+
+static void agg_push_f64(struct agg *agg, double x) {
+    agg->count++;
+    if (agg->func == AGG_COUNT) return;
+    if (x == 0) {
+        if (signbit(x)) {
+            agg->negzero = true;
+        } else {
+            agg->poszero = true;
+        }
+    }
+    agg->buf[agg->nbuf++] = x;
+    if (agg->nbuf == AGG_BUFSIZE) agg_reduce(agg);
+}
+
+static void agg_push_int(struct agg *agg, int64_t x) {
+    if (agg->ints) {
+        if (__builtin_add_overflow(agg->isum, x, &agg->isum)) {
+            agg->overflow = true;
+        }
+        if (x < agg->imin) agg->imin = x;
+        if (x > agg->imax) agg->imax = x;
+    }
+    agg_push_f64(agg, conv_itof(x));
+}
+
+static void agg_push(struct agg *agg, struct value value) {
+    if (value.kind == INT_KIND) {
+        agg_push_int(agg, value.i64);
+    } else {
+        agg->ints = false;
+        agg_push_f64(agg, to_f64(value));
+    }
+}
+
+// agg_push_json pushes the elements of a JSON array, parsing numbers as they
+// are read.
+static void agg_push_json(struct agg *agg, struct json json, bool ints) {
+    struct json val = json_first(json);
+    while (json_exists(val)) {
+        const uint8_t *raw = (uint8_t*)json_raw(val);
+        size_t rawlen = json_raw_length(val);
+        if (agg->func == AGG_COUNT) {
+            agg->count++;
+        } else if (json_type(val) == JSON_NUMBER) {
+            int64_t x;
+            if (ints && agg->ints && parse_exact_int(raw, rawlen, &x)) {
+                agg_push_int(agg, x);
+            } else {
+                agg->ints = false;
+                agg_push_f64(agg, conv_atof((char*)raw, rawlen));
+            }
+        } else {
+            struct value v = make_json(raw, rawlen, ints);
+            if (is_err(v)) {
+                agg->err = v;
+                return;
+            }
+            agg_push(agg, v);
+        }
+        val = json_next(val);
+    }
+}
+
+// agg_push_f64s pushes n numbers, which are reduced where they are rather
+// than being copied into the buffer.
+static void agg_push_f64s(struct agg *agg, const double *x, size_t n) {
+    agg->count += n;
+    if (agg->func == AGG_COUNT) return;
+    agg_reduce(agg);
+    agg_reduce_f64s(agg, x, n);
+    if (agg->func == AGG_SUM || agg->func == AGG_AVG) return;
+    double *l = agg->lanes;
+    if (l[0] == 0 || l[1] == 0 || l[2] == 0 || l[3] == 0) {
+        // a zero result takes its sign from the zeros that were seen
+        for (size_t i = 0; i < n; i++) {
+            if (x[i] == 0) {
+                if (signbit(x[i])) {
+                    agg->negzero = true;
+                } else {
+                    agg->poszero = true;
+                }
+            }
+        }
+    }
+}
+
+// agg_push_typed pushes the elements of a typed array. Doubles are reduced
+// directly from the caller's memory, and the other types are converted a
+// block at a time. Integers go through the int64 path with int_math.
+static void agg_push_typed(struct agg *agg, struct value arr, bool ints) {
+    enum xv_elem_type type = typed_type(arr);
+    if (ints && (type == XV_INT64 || type == XV_INT32)) {
+        for (size_t i = 0; i < arr.len; i++) {
+            agg_push_int(agg, typed_at(arr, i, true).i64);
+        }
+        return;
+    }
+    agg->ints = false;
+    if (type == XV_FLOAT64) {
+        agg_push_f64s(agg, arr.obj, arr.len);
+        return;
+    }
+    double buf[AGG_BUFSIZE];
+    for (size_t i = 0; i < arr.len; i += AGG_BUFSIZE) {
+        size_t n = arr.len-i < AGG_BUFSIZE ? arr.len-i : AGG_BUFSIZE;
+        if (type == XV_FLOAT32) {
+            const float *x = (const float*)arr.obj+i;
+            for (size_t j = 0; j < n; j++) buf[j] = x[j];
+        } else if (type == XV_INT64) {
+            const int64_t *x = (const int64_t*)arr.obj+i;
+            for (size_t j = 0; j < n; j++) buf[j] = (double)x[j];
+        } else {
+            const int32_t *x = (const int32_t*)arr.obj+i;
+            for (size_t j = 0; j < n; j++) buf[j] = x[j];
+        }
+        agg_push_f64s(agg, buf, n);
+    }
+}
+
+// agg_push_all pushes the elements of an array or JSON array, or the value
+// itself if it's not an array.
+static void agg_push_all(struct agg *agg, struct value value, bool ints) {
+    if (value.kind == ARRAY_KIND) {
+        for (size_t i = 0; i < value.len; i++) {
+            agg_push(agg, value.arr[i]);
+        }
+    } else if (value.kind == TYPED_KIND) {
+        agg_push_typed(agg, value, ints);
+    } else if (value.kind == JSON_KIND) {
+        struct json json = json_parsen((char*)value.str, value.len);
+        if (json_type(json) == JSON_ARRAY) {
+            agg_push_json(agg, json, ints);
+        } else {
+            agg_push(agg, value);
+        }
+    } else {
+        agg_push(agg, value);
+    }
+}
+
+static void agg_iter(struct value value, void *udata) {
+    struct agg *agg = udata;
+    if (agg->nargs == 0) {
+        agg->pending = value;
+    } else {
+        if (agg->nargs == 1) agg_push(agg, agg->pending);
+        agg_push(agg, value);
+    }
+    agg->nargs++;
+}
+
+static struct value agg_result(struct agg *agg) {
+    agg_reduce(agg);
+    double *l = agg->lanes;
+    double x;
+    switch (agg->func) {
+    case AGG_COUNT:
+        return make_float((double)agg->count);
+    case AGG_SUM: case AGG_AVG:
+        if (agg->func == AGG_SUM && agg->ints && !agg->overflow) {
+            return make_int(agg->isum);
+        }
+        x = (l[0]+l[1])+(l[2]+l[3]);
+        if (agg->func == AGG_AVG) x = agg->count ? x/(double)agg->count : NAN;
+        return make_float(x);
+    default: // AGG_MIN, AGG_MAX
+        if (agg->nan) return make_float(NAN);
+        if (agg->ints && agg->count > 0) {
+            return make_int(agg->func == AGG_MIN ? agg->imin : agg->imax);
+        }
+        if (agg->func == AGG_MIN) {
+            x = fmin(fmin(l[0], l[1]), fmin(l[2], l[3]));
+            if (x == 0) x = agg->negzero ? -0.0 : 0.0;
+        } else {
+            x = fmax(fmax(l[0], l[1]), fmax(l[2], l[3]));
+            if (x == 0) x = agg->poszero ? 0.0 : -0.0;
+        }
+        return make_float(x);
+    }
+}
+
+static enum agg_func agg_func(const uint8_t *ident, size_t ilen) {
+    if (ilen == 3) {
+        if (memcmp(ident, "sum", 3) == 0) return AGG_SUM;
+        if (memcmp(ident, "min", 3) == 0) return AGG_MIN;
+        if (memcmp(ident, "max", 3) == 0) return AGG_MAX;
+        if (memcmp(ident, "avg", 3) == 0) return AGG_AVG;
+    } else if (ilen == 5 && memcmp(ident, "count", 5) == 0) {
+        return AGG_COUNT;
+    }
+    return AGG_NONE;
+}
+
+// eval_aggregate evaluates a call to one of the aggregate built-ins, such as
+// sum(json.prices).
+static bool eval_aggregate(enum agg_func func, const uint8_t *expr, 
+    size_t len, struct eval_context *ctx, int depth, struct value *res, 
+    size_t *n)
+{
+    struct agg agg = { 
+        .func = func,
+        .lanes = { 
+            func == AGG_MIN ? INFINITY : func == AGG_MAX ? -INFINITY : 0,
+            func == AGG_MIN ? INFINITY : func == AGG_MAX ? -INFINITY : 0,
+            func == AGG_MIN ? INFINITY : func == AGG_MAX ? -INFINITY : 0,
+            func == AGG_MIN ? INFINITY : func == AGG_MAX ? -INFINITY : 0,
+        },
+        .ints = int_math(ctx),
+        .imin = INT64_MAX,
+        .imax = INT64_MIN,
+    };
+    if (!eval_call_iter(expr, len, ctx, depth, agg_iter, &agg, res, n)) {
+        return false;
+    }
+    if (is_err(*res)) return true;
+    if (agg.nargs == 1) agg_push_all(&agg, agg.pending, int_math(ctx));
+    *res = is_err(agg.err) ? agg.err : agg_result(&agg);
+    return true;
+}
+
+// dot_reduce adds the products of x and y into four lanes, with product i
+// going to lane i%4, like sum().
+static void dot_reduce(double lanes[4], const double *x, const double *y, 
+    size_t n)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256d a = _mm256_loadu_pd(lanes);
+    for (; i+4 <= n; i += 4) {
+        a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_loadu_pd(x+i), 
+            _mm256_loadu_pd(y+i)));
+    }
+    _mm256_storeu_pd(lanes, a);
+#elif defined(__SSE2__)
+    __m128d a = _mm_loadu_pd(lanes);
+    __m128d b = _mm_loadu_pd(lanes+2);
+    for (; i+4 <= n; i += 4) {
+        a = _mm_add_pd(a, _mm_mul_pd(_mm_loadu_pd(x+i), _mm_loadu_pd(y+i)));
+        b = _mm_add_pd(b, _mm_mul_pd(_mm_loadu_pd(x+i+2), 
+            _mm_loadu_pd(y+i+2)));
+    }
+    _mm_storeu_pd(lanes, a);
+    _mm_storeu_pd(lanes+2, b);
+#endif
+    for (; i < n; i++) {
+        double p = x[i] * y[i];
+        lanes[i%4] += p;
+    }
+}
+
+// elems_f64s reads up to max elements as numbers into buf.
+static size_t elems_f64s(struct elems *it, double *buf, size_t max, 
+    struct value *err)
+{
+    size_t n = 0;
+    struct value v;
+    while (n < max && elems_next(it, &v)) {
+        if (is_err(v)) {
+            *err = v;
+            return 0;
+        }
+        buf[n++] = to_f64(v);
+    }
+    return n;
+}
+
+// eval_dot evaluates dot(a, b), the dot product of two arrays of numbers,
+// which is NaN if their lengths differ. Typed arrays of doubles are reduced
+// directly from the caller's memory.
+static bool eval_dot(const uint8_t *expr, size_t len, struct eval_context *ctx,
+    int depth, struct value *res, size_t *n)
+{
+    struct args_iter_context actx = { 0 };
+    if (!eval_call_args(expr, len, ctx, depth, &actx, res, n)) return false;
+    if (is_err(*res)) return true;
+    struct value a = actx.args[0];
+    struct value b = actx.args[1];
+    double l[4] = { 0 };
+    if (a.kind == TYPED_KIND && b.kind == TYPED_KIND && 
+        typed_type(a) == XV_FLOAT64 && typed_type(b) == XV_FLOAT64)
+    {
+        if (a.len != b.len) {
+            *res = make_float(NAN);
+            return true;
+        }
+        dot_reduce(l, a.obj, b.obj, a.len);
+        *res = make_float((l[0]+l[1])+(l[2]+l[3]));
+        return true;
+    }
+    struct elems ita, itb;
+    if (actx.nargs < 2 || !elems_init(&ita, a, false) || 
+        !elems_init(&itb, b, false))
+    {
+        *res = make_float(NAN);
+        return true;
+    }
+    double x[AGG_BUFSIZE], y[AGG_BUFSIZE];
+    struct value err = { 0 };
+    while (1) {
+        size_t nx = elems_f64s(&ita, x, AGG_BUFSIZE, &err);
+        size_t ny = elems_f64s(&itb, y, AGG_BUFSIZE, &err);
+        if (is_err(err)) {
+            *res = err;
+            return true;
+        }
+        if (nx != ny) {
+            *res = make_float(NAN);
+            return true;
+        }
+        if (nx == 0) break;
+        dot_reduce(l, x, y, nx);
+    }
+    *res = make_float((l[0]+l[1])+(l[2]+l[3]));
+    return true;
+}
+
+// Date.parse() reads RFC 3339 and ISO 8601 timestamps, such as 2026-01-01,
+// 2026-01-01T08:30:00Z, and 2026-01-01 08:30:00.250+02:00, into epoch
+// milliseconds without allocating. Unlike Javascript, a timestamp without an
+// offset is UTC, because expressions don't have a local time zone.
+
+static bool read_digits(const uint8_t *s, size_t len, size_t *i, int ndigits,
+    int *x)
+{
+    if (len-*i < (size_t)ndigits) return false;
+    int v = 0;
+    for (int j = 0; j < ndigits; j++) {
+        uint8_t c = s[*i+j];
+        if (c < '0' || c > '9') return false;
+        v = v*10 + (c-'0');
+    }
+    *i += ndigits;
+    *x = v;
+    return true;
+}
+
+// days_from_civil returns the number of days since 1970-01-01.
+static int64_t days_from_civil(int64_t y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y-399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d-1;
+    int64_t doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static bool parse_date(const uint8_t *s, size_t len, int64_t *ms) {
+    static const int mdays[] = { 31,29,31,30,31,30,31,31,30,31,30,31 };
+    size_t i = 0;
+    int year, month, day;
+    if (!read_digits(s, len, &i, 4, &year) || i == len || s[i++] != '-' ||
+        !read_digits(s, len, &i, 2, &month) || i == len || s[i++] != '-' ||
+        !read_digits(s, len, &i, 2, &day))
+    {
+        return false;
+    }
+    bool leap = (year%4 == 0 && year%100 != 0) || year%400 == 0;
+    if (month < 1 || month > 12 || day < 1 || day > mdays[month-1] || 
+        (month == 2 && day == 29 && !leap))
+    {
+        return false;
+    }
+    int64_t t = days_from_civil(year, month, day) * 86400000;
+    if (i == len) {
+        *ms = t;
+        return true;
+    }
+    int hour, min, sec = 0, frac = 0;
+    if ((s[i] != 'T' && s[i] != 't' && s[i] != ' ') || 
+        (i++, !read_digits(s, len, &i, 2, &hour)) || i == len || 
+        s[i++] != ':' || !read_digits(s, len, &i, 2, &min) || 
+        hour > 23 || min > 59)
+    {
+        return false;
+    }
+    if (i < len && s[i] == ':') {
+        i++;
+        if (!read_digits(s, len, &i, 2, &sec) || sec > 59) return false;
+        if (i < len && (s[i] == '.' || s[i] == ',')) {
+            // fraction of a second, truncated to milliseconds
+            i++;
+            size_t start = i;
+            for (; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+                if (i-start < 3) frac = frac*10 + (s[i]-'0');
+            }
+            if (i == start) return false;
+            for (size_t j = i-start; j < 3; j++) frac *= 10;
+        }
+    }
+    t += ((int64_t)hour*3600 + min*60 + sec) * 1000 + frac;
+    if (i == len) {
+        *ms = t;
+        return true;
+    }
+    if (s[i] == 'Z' || s[i] == 'z') {
+        *ms = t;
+        return i+1 == len;
+    }
+    if (s[i] != '+' && s[i] != '-') return false;
+    int sign = s[i++] == '-' ? -1 : 1;
+    int ohour, omin;
+    if (!read_digits(s, len, &i, 2, &ohour)) return false;
+    if (i < len && s[i] == ':') i++;
+    if (!read_digits(s, len, &i, 2, &omin) || i != len || ohour > 23 || 
+        omin > 59)
+    {
+        return false;
+    }
+    *ms = t - sign * ((int64_t)ohour*60 + omin) * 60000;
+    return true;
+}
+
+static struct value make_time(int64_t ms, struct eval_context *ctx) {
+    return int_math(ctx) ? make_int(ms) : make_float((double)ms);
+}
+
+// eval_date evaluates the Date.parse(str) and Date.now() members, in the
+// same way as eval_math.
+static bool eval_date(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res, size_t *n)
+{
+    size_t tlen;
+    const uint8_t *tail = trim(expr, len, &tlen);
+    if (tlen < 2 || tail[0] != '.') return false;
+    size_t ilen;
+    const uint8_t *ident = read_ident(tail+1, tlen-1, &ilen);
+    if (!ident) return false;
+    bool parse = ilen == 5 && memcmp(ident, "parse", 5) == 0;
+    bool now = ilen == 3 && memcmp(ident, "now", 3) == 0;
+    if (!parse && !now) return false;
+    size_t mlen = (size_t)(ident+ilen-expr);
+    struct args_iter_context actx = { 0 };
+    size_t alen;
+    if (!eval_call_args(expr+mlen, len-mlen, ctx, depth, &actx, res, &alen)) {
+        return false;
+    }
+    *n = mlen + alen;
+    if (is_err(*res)) return true;
+    if (now) {
+        struct timespec ts;
+        if (timespec_get(&ts, TIME_UTC) != TIME_UTC) {
+            *res = make_float(NAN);
+            return true;
+        }
+        *res = make_time((int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000, ctx);
+        return true;
+    }
+    struct value a = actx.nargs > 0 ? actx.args[0] : make_undefined();
+    int64_t ms;
+    if (a.kind != STR_KIND || !parse_date(a.str, a.len, &ms)) {
+        *res = make_float(NAN);
+    } else {
+        *res = make_time(ms, ctx);
+    }
+    return true;
+}
+
+// eval_glob evaluates the match(str, pattern) and matchNoCase(str, pattern)
+// calls, in the same way as eval_string_member.
+static bool eval_glob(bool nocase, const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth, struct value *res, size_t *n)
+{
+    struct args_iter_context actx = { 0 };
+    if (!eval_call_args(expr, len, ctx, depth, &actx, res, n)) return false;
+    if (is_err(*res)) return true;
+    char sbuf[32], pbuf[32];
+    size_t slen, plen;
+    const uint8_t *s = to_str(actx.nargs > 0 ? actx.args[0] : 
+        make_undefined(), &slen, sbuf, sizeof(sbuf));
+    const uint8_t *pat = to_str(actx.nargs > 1 ? actx.args[1] : 
+        make_undefined(), &plen, pbuf, sizeof(pbuf));
+    if (!s || !pat) {
+        *res = err_oom();
+        return true;
+    }
+    *res = make_bool(glob_match(s, slen, pat, plen, nocase || no_case(ctx)));
+    return true;
+}
+
+// builtin_ident returns true for the identifiers that eval_builtin reads, 
+// which may read more than an identifier.
+static bool builtin_ident(const uint8_t *ident, size_t ilen) {
+    static const char *names[] = { 
+        "Math", "Date", "Geo", "dot", "cidrMatch", "isIP", "hash64", "bucket",
+        "match", "matchNoCase",
+    };
+    for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); i++) {
+        if (strlen(names[i]) == ilen && memcmp(names[i], ident, ilen) == 0) {
+            return true;
+        }
+    }
+    return agg_func(ident, ilen) != AGG_NONE;
+}
+
+// env_global returns the environment's value for a global name, which is
+// undefined when the environment doesn't define it.
+static struct value env_global(struct xv_env *env, const uint8_t *ident, 
+    size_t ilen)
+{
+    if (!env || !env->ref) return make_undefined();
+    return to_value(env->ref(from_value(make_global()), 
+        xv_new_stringn((char*)ident, ilen), env->udata));
+}
+
+// eval_builtin evaluates a global built-in, such as the function calls
+// match(path, '/v1/*/orders/?'), sum(json.prices), and bucket(id, 'exp', 5),
+// or the Math.sqrt(x) and Date.parse(s) namespace members, in the same way as
+// eval_string_member.
+//
+// The environment's ref callback is asked for the name first, and a value
+// other than undefined is used in place of the built-in, with nothing after
+// the name consumed. This keeps host functions that were defined before the
+// built-in existed, such as a host's own sum() or bucket().
+static bool eval_builtin(const uint8_t *ident, size_t ilen, 
+    const uint8_t *expr, size_t len, struct eval_context *ctx, int depth, 
+    struct value *res, size_t *n)
+{
+    if (!builtin_ident(ident, ilen)) return false;
+    struct value val = env_global(ctx->env, ident, ilen);
+    if (val.kind != UNDEF_KIND) {
+        *res = val;
+        *n = 0;
+        return true;
+    }
+    if (ilen == 4 && memcmp(ident, "Math", 4) == 0) {
+        return eval_math(expr, len, ctx, depth, res, n);
+    }
+    if (ilen == 4 && memcmp(ident, "Date", 4) == 0) {
+        return eval_date(expr, len, ctx, depth, res, n);
+    }
+    if (ilen == 3 && memcmp(ident, "Geo", 3) == 0) {
+        return eval_geo(expr, len, ctx, depth, res, n);
+    }
+    enum agg_func af = agg_func(ident, ilen);
+    if (af != AGG_NONE) {
+        return eval_aggregate(af, expr, len, ctx, depth, res, n);
+    }
+    if (ilen == 3 && memcmp(ident, "dot", 3) == 0) {
+        return eval_dot(expr, len, ctx, depth, res, n);
+    }
+    if (ilen == 9 && memcmp(ident, "cidrMatch", 9) == 0) {
+        return eval_cidr_match(expr, len, ctx, depth, res, n);
+    }
+    if (ilen == 4 && memcmp(ident, "isIP", 4) == 0) {
+        return eval_is_ip(expr, len, ctx, depth, res, n);
+    }
+    bool hash64 = ilen == 6 && memcmp(ident, "hash64", 6) == 0;
+    bool bucket = ilen == 6 && memcmp(ident, "bucket", 6) == 0;
+    if (hash64 || bucket) {
+        return eval_hash(bucket, expr, len, ctx, depth, res, n);
+    }
+    bool match = ilen == 5 && memcmp(ident, "match", 5) == 0;
+    bool imatch = ilen == 11 && memcmp(ident, "matchNoCase", 11) == 0;
+    if (match || imatch) {
+        return eval_glob(imatch, expr, len, ctx, depth, res, n);
+    }
+    return false;
+}
+
+// parse_duration reads a duration literal, such as 500ms, 30s, 15m, 24h, or
+// 7d, into milliseconds.
+static bool parse_duration(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, struct value *res)
+{
+    static const struct { const char *unit; int64_t ms; } units[] = {
+        { "ms", 1 }, { "s", 1000 }, { "m", 60000 }, { "h", 3600000 }, 
+        { "d", 86400000 },
+    };
+    for (size_t i = 0; i < sizeof(units)/sizeof(units[0]); i++) {
+        size_t ulen = strlen(units[i].unit);
+        if (len <= ulen || !has_suffix(expr, len, units[i].unit) ||
+            isalpha(expr[len-ulen-1]))
+        {
+            continue;
+        }
+        int64_t x;
+        if (int_math(ctx) && parse_exact_int(expr, len-ulen, &x) &&
+            !__builtin_mul_overflow(x, units[i].ms, &x))
+        {
+            *res = make_int(x);
+            return true;
+        }
+        bool ok = false;
+        double f = parse_float(expr, len-ulen, &ok);
+        if (!ok) return false;
+        *res = make_float(f * (double)units[i].ms);
+        return true;
+    }
+    return false;
+}
+
+static struct value eval_atom(const uint8_t *expr, size_t len,
+    struct eval_context *ctx, int depth)
+{
+    expr = trim(expr, len, &len);
+    if (len == 0) {
+        return err_syntax();
+    }
+    struct value left = { 0 };
+    bool left_ready = false;
+    size_t glen;
+    const uint8_t *g;
+    size_t slen;
+    size_t rlen;
+    bool oom;
+    const uint8_t *str;
+    size_t mlen;
+
+    // first look for non-chainable atoms
+    switch (expr[0]) {
+    case '0':
+        if (len > 1 && (expr[1] == 'x' || expr[1] == 'X')) {
+            // hexadecimal
+            bool ok = false;
+            uint64_t x = parse_uint(expr+2, len-2, 16, &ok);
+            if (!ok) {
+                return err_syntax();
+            }
+            if (int_math(ctx) && x <= (uint64_t)INT64_MAX) {
+                return make_int((int64_t)x);
+            }
+            return make_float((double)x);
+        }
+        // fall through
+    case '-': case'.': case '1': case '2': case '3': case '4': case '5': 
+    case '6': case '7': case '8': case '9':
+        if (len > 3 && has_suffix(expr, len, "64")) {
+            if (expr[len-3] == 'u') {
+                bool ok = false;
+                uint64_t x = parse_uint(expr, len-3, 10, &ok);
+                if (!ok) {
+                    return err_syntax();
+                }
+                return make_uint(x);
+            }
+            if (expr[len-3] == 'i') {
+                bool ok = false;
+                int64_t x = parse_int(expr, len-3, 10, &ok);
+                if (!ok) {
+                    return err_syntax();
+                }
+                return make_int(x);
+            }
+        }
+        if (int_math(ctx)) {
+            int64_t x;
+            if (parse_exact_int(expr, len, &x)) {
+                return make_int(x);
+            }
+        }
+        if (isalpha(expr[len-1])) {
+            struct value dur;
+            if (parse_duration(expr, len, ctx, &dur)) {
+                return dur;
+            }
+        }
+        bool ok = false;
+        double x = parse_float(expr, len, &ok);
+        if (!ok) {
+            return err_syntax();
+        }
+        return make_float(x);
+    case '"': case '\'':
+        str = parse_string(expr, len, &slen, &rlen, &oom);
+        if (!str) {
+            return oom ? err_oom() : err_syntax();
+        }
+        left = make_string(str, slen);
+        left_ready = true;
+        expr = expr+rlen;
+        len -= rlen;
+        break;
+    case '/': {
+        // regular expression literal, which is compiled up front so that
+        // syntax errors are reported even if it's never used.
+        glen = read_regex(expr, len);
+        if (glen == 0) return err_syntax();
+        left = make_regex(expr, glen);
+        struct regex *re;
+        struct value err = to_regex(left, &re);
+        if (is_err(err)) return err;
+        left_ready = true;
+        expr += glen;
+        len -= glen;
+        break;
+    }
+    case '(': case '{': case '[':
+        g = read_group(expr, len, &glen);
+        if (!g) return err_syntax();
+        if (g[0] == '(') {
+            // paren groups can be evaluated and used as the leading value.
+            left = eval_arg(g+1, glen-2, ctx, depth);
+            if (is_err(left)) return left;
+            left_ready = true;
+            expr += glen;
+            len -= glen;
+        } else if (g[0] == '[') {
+            if (eval_litset_includes(g, glen, expr+glen, len-glen, ctx, depth,
+                &left, &mlen))
+            {
+                if (is_err(left)) return left;
+                expr += mlen;
+                len -= mlen;
+            } else {
+                left = multi_exprs_to_array(g+1, glen-2, ctx, depth);
+                if (is_err(left)) return left;
+            }
+            left_ready = true;
+            expr += glen;
+            len -= glen;
+        } else {
+            left = eval_map(g+1, glen-2, ctx, depth);
+            if (is_err(left)) return left;
+            left_ready = true;
+            expr += glen;
+            len -= glen;
+        }
+        break;
+    }
+    const uint8_t *left_ident = NULL;
+    size_t left_ident_len = 0;
+    if (!left_ready) {
+        // probably a chainable identifier
+        size_t ilen;
+        const uint8_t *ident = read_ident(expr, len, &ilen);
+        if (!ident) return err_syntax();
+
+        // TODO: maybe use a tiny hashtable
+        if (ilen == 4 && memcmp(ident, "true", 4) == 0) {
+            left = make_bool(true);
+        } else if (ilen == 5 && memcmp(ident, "false", 5) == 0) {
+            left = make_bool(false);
+        } else if (ilen == 4 && memcmp(ident, "null", 4) == 0) {
+            left = make_null();
+        } else if (ilen == 9 && memcmp(ident, "undefined", 9) == 0) {
+            left = make_undefined();
+        } else if (ilen == 3 && memcmp(ident, "NaN", 3) == 0) {
+            left = make_float(NAN);
+        } else if (ilen == 8 && memcmp(ident, "Infinity", 8) == 0) {
+            left = make_float(INFINITY);
+        } else if ((ilen == 2 && memcmp(ident, "in", 2) == 0) ||
+                   (ilen == 3 && memcmp(ident, "new", 3) == 0) ||
+                   (ilen == 4 && memcmp(ident, "void", 4) == 0) ||
+                   (ilen == 5 && memcmp(ident, "await", 5) == 0) ||
+                   (ilen == 5 && memcmp(ident, "yield", 5) == 0) ||
+                   (ilen == 6 && memcmp(ident, "typeof", 6) == 0) ||
+                   (ilen == 8 && memcmp(ident, "function", 8) == 0) ||
+                   (ilen == 10 && memcmp(ident, "instanceof", 10) == 0))
+        {
+            // unsupported keyword
+            return err_unsupported_keyword(ident, ilen);
+        } else if (scope_lookup(ctx->scope, ident, ilen, &left)) {
+            // arrow function parameter
+        } else if (eval_builtin(ident, ilen, expr+ilen, len-ilen, ctx, depth,
+            &left, &mlen))
+        {
+            if (is_err(left)) return left;
+            expr += mlen;
+            len -= mlen;
+        } else {
+            left = get_ref_value(false, make_undefined(), ident, ilen, false, 
+                ctx);
+            if (is_err(left)) return left;
+        }
+        left_ready = true;
+        expr = expr+ilen;
+        len -= ilen;
+        left_ident = ident;
+        left_ident_len = ilen;
+    }
+
+    struct value left_left = { 0 };
+    bool has_left_left = false;
+
+    // read each chained component
+    bool opt_chain = false;
+
+    const uint8_t *ident;
+    size_t ilen;
+    struct value val;
+    struct value last;
+    char nbuf[32];
+    while (1) {
+        // There are more components to read
+        expr = trim(expr, len, &len);
+        if (len == 0) break;
+        switch (expr[0]) {
+        case '?':
+            // Optional chaining
+            unreachable(
+                if (len == 1 || expr[1] != '.') {
+                    // Unreachable due to the condition being checked in a 
+                    // previous eval_logical_or step
+                    return err_syntax(); 
+                }
+            )
+            expr++;
+            len--;
+            opt_chain = true;
+            // fall through
+        case '.':
+            // Member Access
+            expr++;
+            len--;
+            expr = trim(expr, len, &len);
+            ident = read_ident(expr, len, &ilen);
+            if (!ident) return err_syntax();
+            if (left.kind == STR_KIND && eval_string_member(left, ident, ilen,
+                expr+ilen, len-ilen, ctx, depth, &val, &mlen))
+            {
+                if (is_err(val)) return val;
+                left_left = left;
+                has_left_left = true;
+                left = val;
+                expr = expr+ilen+mlen;
+                len -= ilen+mlen;
+                left_ident = ident;
+                left_ident_len = ilen;
+                break;
+            }
+            if (left.kind == REGEX_KIND && eval_regex_member(left, ident, ilen,
+                expr+ilen, len-ilen, ctx, depth, &val, &mlen))
+            {
+                if (is_err(val)) return val;
+                left_left = left;
+                has_left_left = true;
+                left = val;
+                expr = expr+ilen+mlen;
+                len -= ilen+mlen;
+                left_ident = ident;
+                left_ident_len = ilen;
+                break;
+            }
+            if ((left.kind == ARRAY_KIND || left.kind == JSON_KIND || 
+                left.kind == TYPED_KIND) && 
+                eval_array_member(left, ident, ilen, expr+ilen, len-ilen, ctx,
+                depth, &val, &mlen))
+            {
+                if (is_err(val)) return val;
+                left_left = left;
+                has_left_left = true;
+                left = val;
+                expr = expr+ilen+mlen;
+                len -= ilen+mlen;
+                left_ident = ident;
+                left_ident_len = ilen;
+                break;
+            }
+            val = get_ref_value(true, left, ident, ilen, opt_chain, ctx);
+            if (is_err(val)) return val;
+            left_left = left;
+            has_left_left = true;
+            left = val;
+            expr = expr+ilen;
+            len -= ilen;
+            left_ident = ident;
+            left_ident_len = ilen;
+            break;
+        case '(':
+            // Function call
+            g = read_group(expr, len, &glen);
+            if (!g) return err_syntax();
+            if (left.kind != FUNC_KIND) {
+                return err_notfunc(left_ident, left_ident_len);
+            }
+            (void)has_left_left;
+            struct value args = multi_exprs_to_array(g+1, glen-2, ctx, depth);
+            if (is_err(args)) return args;
+
+            val = to_value(left.func(from_value(left_left), 
+                from_value(args), 
+                ctx->env?ctx->env->udata:NULL));
+            if (is_err(val)) return val;
+            left_left = left;
+            has_left_left = true;
+            left = val;
+            expr += glen;
+            len -= glen;
+            break;
+        case '[':
+            // Computed Member Access
             g = read_group(expr, len, &glen);
             if (!g) return err_syntax();
-            last = eval_expr(g+1, glen-2, ctx, depth);
+            last = eval_arg(g+1, glen-2, ctx, depth);
             if (is_err(last)) return last;
             ident = to_str(last, &ilen, nbuf, sizeof(nbuf));
             val = get_ref_value(true, left, ident, ilen, opt_chain, ctx);
+            if (is_err(val) && val.str == (uint8_t*)nbuf) {
+                // the error outlives the key on the stack
+                uint8_t *key = emalloc(ilen);
+                if (!key) return err_oom();
+                memcpy(key, nbuf, ilen);
+                val.str = key;
+            }
             if (is_err(val)) return val;
             left_left = left;
             has_left_left = true;
@@ -2128,323 +8295,2635 @@ static struct value eval_atom(const uint8_t *expr, size_t len,
             expr += glen;
             len -= glen;
             break;
-        default:
-            return err_syntax();
+        default:
+            return err_syntax();
+        }
+    }
+    return left;
+}
+
+static struct value eval_sums(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth)
+{
+    size_t s = 0;
+    struct value left = { 0 };
+    uint8_t op = 0;
+    bool fill = false;
+    bool neg = false;
+    size_t glen;
+    const uint8_t *g;
+    for (size_t i = 0; i < len; i++) {
+        switch (expr[i]) {
+        case '-': case '+':
+            if (!fill) {
+                if (i > 0 && expr[i-1] == expr[i]) {
+                    // -- not allowed
+                    return err_syntax();
+                }
+                if (expr[i] == '-') {
+                    neg = !neg;
+                }
+                s = i + 1;
+                continue;
+            }
+            if (i > 0 && (expr[i-1] == 'e' || expr[i-1] == 'E')) {
+                // scientific notation
+                continue;
+            }
+            if (neg) {
+                if (s > 0 && s < len && expr[s-1] == '-' &&
+                    expr[s] >= '0' && expr[s] <= '9')
+                {
+                    s--;
+                    neg = false;
+                }
+            }
+            left = sum(left, op, expr+s, i-s, neg, ctx, depth);
+            if (is_err(left)) {
+                return left;
+            }
+            op = expr[i];
+            s = i + 1;
+            fill = false;
+            neg = false;
+            break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
+        case '(': case '[': case '{': case '"': case '\'':
+            g = read_group(expr+i, len-i, &glen);
+            if (!g) return err_syntax();
+            i = i + glen - 1;
+            fill = true;
+            break;
+        default:
+            if (!fill && !isws(expr[i])) {
+                fill = true;
+            }
+        }
+    }
+    if (neg) {
+        if (s > 0 && s < len && expr[s-1] == '-' &&
+            expr[s] >= '0' && expr[s] <= '9')
+        {
+            s--;
+            neg = false;
+        }
+    }
+    return sum(left, op, expr+s, len-s, neg, ctx, depth);
+}
+
+static struct value fact(struct value left, uint8_t op, const uint8_t *expr, 
+    size_t len, struct eval_context *ctx, int depth)
+{
+    expr = trim(expr, len, &len);
+    if (len == 0) return err_syntax();
+    struct value right = eval_atom(expr, len, ctx, depth);
+    if (is_err(right)) return right;
+    switch (op) {
+    case '*':
+        return vmul(left, right, ctx);
+    case '/':
+        return vdiv(left, right, ctx);
+    case '%':
+        return vmod(left, right, ctx);
+    default:
+        return right;
+    }
+}
+
+static struct value eval_facts(const uint8_t *expr, size_t len,
+    struct eval_context *ctx, int depth)
+{
+    size_t s = 0;
+    struct value left = { 0 };
+    uint8_t op = 0;
+    size_t glen;
+    const uint8_t *g;
+    for (size_t i = 0; i < len; i++) {
+        switch (expr[i]) {
+        case '*': case '/': case '%':
+            if (expr[i] == '/' && regex_start(expr, i)) {
+                g = read_group(expr+i, len-i, &glen);
+                if (!g) return err_syntax();
+                i = i + glen - 1;
+                break;
+            }
+            left = fact(left, op, expr+s, i-s, ctx, depth);
+            if (is_err(left)) return left;
+            op = expr[i];
+            s = i + 1;
+            break;
+        case '(': case '[': case '{': case '"': case '\'':
+            g = read_group(expr+i, len-i, &glen);
+            if (!g) return err_syntax();
+            i = i + glen - 1;
+            break;
+        }
+    }
+    return fact(left, op, expr+s, len-s, ctx, depth);
+}
+
+static struct value eval_auto(int step, const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth)
+{
+    if (depth-1 > XV_MAXDEPTH) {
+        return err_msg("MaxDepthError");
+    }
+    switch (step) {
+    case STEP_COMMA:
+        if ((ctx->steps & STEP_COMMA) == STEP_COMMA) {
+            return eval_comma(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_TERNS:
+        if ((ctx->steps & STEP_TERNS) == STEP_TERNS) {
+            return eval_terns(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_LOGICAL_OR:
+        if ((ctx->steps & STEP_LOGICAL_OR) == STEP_LOGICAL_OR) {
+            return eval_logical_or(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_LOGICAL_AND:
+        if ((ctx->steps & STEP_LOGICAL_AND) == STEP_LOGICAL_AND) {
+            return eval_logical_and(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_BITWISE_OR:
+        if ((ctx->steps & STEP_BITWISE_OR) == STEP_BITWISE_OR) {
+            return eval_bitwise_or(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_BITWISE_XOR:
+        if ((ctx->steps & STEP_BITWISE_XOR) == STEP_BITWISE_XOR) {
+            return eval_bitwise_xor(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_BITWISE_AND:
+        if ((ctx->steps & STEP_BITWISE_AND) == STEP_BITWISE_AND) {
+            return eval_bitwise_and(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_EQUALITY:
+        if ((ctx->steps & STEP_EQUALITY) == STEP_EQUALITY) {
+            return eval_equality(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_COMPS:
+        if ((ctx->steps & STEP_COMPS) == STEP_COMPS) {
+            return eval_comps(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_SUMS:
+        if ((ctx->steps & STEP_SUMS) == STEP_SUMS) {
+            return eval_sums(expr, len, ctx, depth);
+        }
+        // fall through
+    case STEP_FACTS:
+        if ((ctx->steps & STEP_FACTS) == STEP_FACTS) {
+            return eval_facts(expr, len, ctx, depth);
+        }
+        // fall through
+    default:
+        return eval_atom(expr, len, ctx, depth);
+    }
+}
+
+static struct value eval_expr(const uint8_t *expr, size_t len, 
+    struct eval_context *ctx, int depth)
+{
+    // the only place where the depth is increased
+    return eval_auto(STEP_COMMA, expr, len, ctx, depth+1);
+}
+
+static struct value eval_foreach(const uint8_t *expr, size_t len, 
+    struct xv_env *env, struct scope *scope, 
+    void (*iter)(struct value, void *udata), void *udata, int depth)
+{
+    expr = trim(expr, len, &len);
+    if (len == 0) return undefined();
+
+    // Determine which steps are (possibly) needed by scanning every byte in
+    // the input expression and looking for potential candidate characters.
+    int steps = 0;
+    for (size_t i = 0; i < len; i++) {
+        steps |= (int)op_steps[expr[i]];
+    }
+
+    if (iter) {
+        // require the comma step when using an iterator.
+        steps |= STEP_COMMA;
+    }
+
+    struct eval_context ctx = {
+        .expr = (uint8_t*)expr, 
+        .len = len, 
+        .steps = steps, 
+        .iter = iter,
+        .iter_udata = udata,
+        .env = env,
+        .scope = scope,
+    };
+    return eval_expr(expr, len, &ctx, depth);
+}
+
+static struct value eval(const uint8_t *expr, size_t len, 
+    struct xv_env *env, int depth)
+{
+    return eval_foreach(expr, len, env, NULL, NULL, NULL, depth);
+}
+
+struct each_context {
+    void (*cb)(struct xv value, void *udata);
+    void *udata;
+    struct mark mark;
+};
+
+static void each_iter(struct value value, void *udata) {
+    struct each_context *ectx = udata;
+    ectx->cb(from_value(value), ectx->udata);
+    release_memory(ectx->mark);
+}
+
+struct xv xv_eval_each(const char *expr, size_t len, struct xv_env *env,
+    void (*cb)(struct xv value, void *udata), void *udata)
+{
+    struct each_context ectx = { 
+        .cb = cb, 
+        .udata = udata, 
+        .mark = mark_memory(),
+    };
+    struct value value = eval_foreach((uint8_t*)expr, len, env, NULL, 
+        each_iter, &ectx, 0);
+    // Only an error outlives the memory of the last result.
+    return from_value(is_err(value) ? value : make_undefined());
+}
+
+struct xv xv_eval(const char *expr, struct xv_env *env) {
+    return xv_evaln(expr, strlen(expr), env);
+}
+
+struct xv xv_evaln(const char *expr, size_t len, 
+    struct xv_env *env)
+{
+    assert(sizeof(struct value) == sizeof(struct xv)); // static_assert?
+    struct value value = eval((uint8_t*)expr, len, env, 0);
+    struct xv fvalue;
+    memcpy(&fvalue, &value, sizeof(struct xv));
+    return fvalue;
+}
+
+static void write_error(struct writer *wr, struct value value) {
+    if ((value.flag&FLAG_ENOTFUNC) == FLAG_ENOTFUNC) {
+        write_cstr(wr, "TypeError: ");
+        write_bytes(wr, value.str, value.len);
+        write_cstr(wr, " is not a function");
+    } else if ((value.flag&FLAG_ESYNTAX) == FLAG_ESYNTAX) {
+        write_cstr(wr, "SyntaxError");
+        if ((value.flag&FLAG_EUNSUPKEYWORD) == FLAG_EUNSUPKEYWORD) {
+            write_cstr(wr, ": Unsupported keyword '");
+            write_bytes(wr, value.str, value.len);
+            write_cstr(wr, "'");
+        }
+    } else if ((value.flag&FLAG_EUNDEFINED) == FLAG_EUNDEFINED) {
+        if ((value.flag&FLAG_CHAIN) == FLAG_CHAIN) {
+            write_cstr(wr, "TypeError: Cannot read properties of undefined "
+                "(reading '");
+            write_bytes(wr, value.str, value.len);
+            write_cstr(wr, "')");
+        } else {
+            write_cstr(wr, "ReferenceError: Can't find variable: '");
+            write_bytes(wr, value.str, value.len);
+            write_cstr(wr, "'");
+        }
+    } else if ((value.flag&FLAG_EOOM) == FLAG_EOOM) {
+        write_cstr(wr, "MemoryError: Out of memory");
+    } else { // if ((value.flag&FLAG_EMSG) == FLAG_EMSG) {
+        if (value.len == 0) {
+            write_cstr(wr, "");
+        } else {
+            write_bytes(wr, value.str, value.len);
+        }
+    }
+}
+
+size_t xv_string_copy(struct xv value, char *dst, size_t n) {
+    struct value fvalue = to_value(value);
+    struct writer wr = { .dst = dst, .n = n };    
+    write_value(&wr, fvalue);
+    write_nullterm(&wr);
+    return wr.count;
+}
+
+double xv_double(struct xv value) {
+    return to_f64(to_value(value));
+}
+
+int64_t xv_int64(struct xv value) {
+    return to_i64(to_value(value));
+}
+
+uint64_t xv_uint64(struct xv value) {
+    return to_u64(to_value(value));
+}
+
+bool xv_bool(struct xv value) {
+    return to_bool(to_value(value));
+}
+
+enum xv_type xv_type(struct xv value) {
+    switch (to_value(value).kind) {
+    case UNDEF_KIND:
+        return XV_UNDEFINED;
+    case BOOL_KIND:
+        return XV_BOOLEAN;
+    case FLOAT_KIND: case INT_KIND: case UINT_KIND:
+        return XV_NUMBER;
+    case FUNC_KIND:
+        return XV_FUNCTION;
+    case STR_KIND:
+        return XV_STRING;
+    default:
+        return XV_OBJECT;
+    }
+}
+
+///////////////////////////////////////////
+// Batch evaluation
+///////////////////////////////////////////
+
+// A program is an expression that is compiled once by xv_program_new, and
+// then evaluated over columns of rows by xv_program_eval_batch, a block of
+// XV_BATCH_SIZE rows at a time.
+//
+// The compiler makes the same precedence scans as the evaluator, through the
+// ||, &&, equality, comparison, sum, and factor levels, and builds a tree of
+// nodes. An identifier that names a column reads the column, a path such as
+// a.b.c reads each member from the one before, and numbers, plain strings, and
+// keywords are constants. Anything else, such as a call, a computed member, or
+// a ternary, is an island. The text of an island is
+// evaluated row by row, from the same step that the evaluator would have used,
+// with the columns that it names bound as scope variables.
+//
+// Each node fills a vector for the block. Numbers and bools have their own
+// vectors, and the operators over them are plain loops that the compiler can
+// vectorize. Nulls in a number vector are zeros, which is what a null converts
+// to, and a bitmap tells them apart for '==='. Any other mix goes through the
+// evaluator's operators row by row, so the results are the same as calling
+// xv_eval for each row.
+
+enum prog_op {
+    PROG_CONST, PROG_COLUMN, PROG_ISLAND, PROG_MEMBER, 
+    PROG_TRUTHY, PROG_NOT, PROG_NEG,
+    PROG_ADD, PROG_SUB, PROG_MUL, PROG_DIV, PROG_MOD,
+    PROG_LT, PROG_LTE, PROG_GT, PROG_GTE,
+    PROG_EQ, PROG_NEQ, PROG_SEQ, PROG_SNEQ,
+    PROG_AND, PROG_OR,
+};
+
+#define PROG_NONE -2 // no left operand yet, while -1 is out of memory
+
+struct prog_node {
+    enum prog_op op;
+    int a, b;            // operand nodes
+    const uint8_t *text; // column name, island expression, member name, or
+    size_t len;          // the text of a constant
+    int step;            // step that an island is evaluated from
+    int steps;           // island steps, as in eval_foreach
+    int depth;           // island depth
+    struct value value;  // constant, or the value of a folded island
+    bool folded;         // island with a value when it reads no columns
+};
+
+struct xv_program {
+    struct xv_env env;
+    uint8_t *expr;
+    size_t len;
+    struct prog_node *nodes;
+    int nnodes;
+    int cap;
+    int root;
+    int *dedup;          // node slots by content, when sharing nodes
+    int ndedup;          // number of slots, a power of two
+    int nshared;         // nodes that were shared rather than added
+};
+
+static uint64_t prog_node_hash(const struct prog_node *node) {
+    uint64_t h = wyhash(node->text, node->len, (uint64_t)node->op);
+    h = wymix(h^(uint32_t)node->a, (uint64_t)(uint32_t)node->b<<32 ^ 
+        (uint32_t)node->step);
+    return wymix(h, (uint64_t)(uint32_t)node->depth ^ wyp[0]);
+}
+
+static bool prog_node_equal(const struct prog_node *a, 
+    const struct prog_node *b)
+{
+    return a->op == b->op && a->a == b->a && a->b == b->b && 
+        a->step == b->step && a->depth == b->depth && a->len == b->len && 
+        (a->len == 0 || memcmp(a->text, b->text, a->len) == 0);
+}
+
+// prog_dedup returns the dedup slot of a node, which either has the node's
+// index plus one, or is empty.
+static int *prog_dedup(struct xv_program *prog, const struct prog_node *node) {
+    size_t mask = (size_t)prog->ndedup-1;
+    size_t i = (size_t)prog_node_hash(node) & mask;
+    while (prog->dedup[i] && 
+        !prog_node_equal(&prog->nodes[prog->dedup[i]-1], node))
+    {
+        i = (i+1) & mask;
+    }
+    return &prog->dedup[i];
+}
+
+static bool prog_grow_dedup(struct xv_program *prog) {
+    int ndedup = prog->ndedup*2;
+    int *dedup = emalloc0(sizeof(int)*(size_t)ndedup);
+    if (!dedup) return false;
+    memset(dedup, 0, sizeof(int)*(size_t)ndedup);
+    efree0(prog->dedup);
+    prog->dedup = dedup;
+    prog->ndedup = ndedup;
+    for (int i = 0; i < prog->nnodes; i++) {
+        *prog_dedup(prog, &prog->nodes[i]) = i+1;
+    }
+    return true;
+}
+
+// prog_add adds a node, or returns an equal node that was already added when
+// the program shares nodes. The operands of a node are always added first,
+// so nodes are in the order that they can be evaluated.
+static int prog_add(struct xv_program *prog, struct prog_node node) {
+    int *slot = NULL;
+    if (prog->dedup) {
+        if (prog->nnodes*2 >= prog->ndedup && !prog_grow_dedup(prog)) {
+            return -1;
+        }
+        slot = prog_dedup(prog, &node);
+        if (*slot) {
+            prog->nshared++;
+            return *slot-1;
+        }
+    }
+    if (prog->nnodes == prog->cap) {
+        int cap = prog->cap == 0 ? 16 : prog->cap*2;
+        struct prog_node *nodes = emalloc0(sizeof(struct prog_node)*cap);
+        if (!nodes) return -1;
+        if (prog->nodes) {
+            memcpy(nodes, prog->nodes, sizeof(struct prog_node)*prog->nnodes);
+            efree0(prog->nodes);
+        }
+        prog->nodes = nodes;
+        prog->cap = cap;
+    }
+    prog->nodes[prog->nnodes] = node;
+    if (slot) *slot = prog->nnodes+1;
+    return prog->nnodes++;
+}
+
+static int prog_const(struct xv_program *prog, struct value value,
+    const uint8_t *expr, size_t len)
+{
+    return prog_add(prog, (struct prog_node){ 
+        .op = PROG_CONST, 
+        .text = expr,
+        .len = len,
+        .value = value,
+    });
+}
+
+// prog_island adds a node that evaluates expr from step, or a column when
+// op is PROG_COLUMN, which is evaluated the same way when no column has its
+// name.
+static int prog_island(struct xv_program *prog, enum prog_op op, 
+    const uint8_t *expr, size_t len, int step, int depth)
+{
+    int steps = 0;
+    for (size_t i = 0; i < len; i++) {
+        steps |= (int)op_steps[expr[i]];
+    }
+    return prog_add(prog, (struct prog_node){ 
+        .op = op, 
+        .text = expr, 
+        .len = len, 
+        .step = step, 
+        .steps = steps, 
+        .depth = depth,
+    });
+}
+
+static int prog_unary(struct xv_program *prog, enum prog_op op, int a) {
+    if (a < 0) return -1;
+    return prog_add(prog, (struct prog_node){ .op = op, .a = a });
+}
+
+static int prog_join(struct xv_program *prog, enum prog_op op, int left, 
+    int right)
+{
+    if (left == -1 || right == -1) return -1;
+    if (left == PROG_NONE) return right;
+    return prog_add(prog, (struct prog_node){ .op = op, .a = left, .b = right });
+}
+
+static int prog_expr(struct xv_program *prog, const uint8_t *expr, size_t len,
+    int depth);
+
+static int prog_atom(struct xv_program *prog, const uint8_t *expr, size_t len,
+    int depth);
+
+// prog_path compiles a path, such as json.user.tier, as a member node for each
+// name after the first. Returns PROG_NONE if expr is not a path.
+static int prog_path(struct xv_program *prog, const uint8_t *expr, size_t len,
+    size_t ilen, int depth)
+{
+    if (builtin_ident(expr, ilen)) {
+        return PROG_NONE;
+    }
+    for (size_t i = ilen; i < len; ) {
+        size_t mlen;
+        if (expr[i] != '.' || !read_ident(expr+i+1, len-i-1, &mlen)) {
+            return PROG_NONE;
+        }
+        i += 1+mlen;
+    }
+    int node = prog_atom(prog, expr, ilen, depth);
+    for (size_t i = ilen; i < len && node >= 0; ) {
+        size_t mlen;
+        read_ident(expr+i+1, len-i-1, &mlen);
+        node = prog_add(prog, (struct prog_node){ 
+            .op = PROG_MEMBER, 
+            .a = node,
+            .text = expr+i+1, 
+            .len = mlen, 
+            .depth = depth,
+        });
+        i += 1+mlen;
+    }
+    return node;
+}
+
+// prog_date compiles Date.parse('...') with a string literal as an island
+// that's folded to the parsed time, which is used for every row unless the
+// island reads a column. Returns PROG_NONE if expr is not such a call, or if
+// the environment defines Date.
+static int prog_date(struct xv_program *prog, const uint8_t *expr, size_t len,
+    int depth)
+{
+    if (len < 13 || memcmp(expr, "Date.parse(", 11) != 0 || 
+        expr[len-1] != ')')
+    {
+        return PROG_NONE;
+    }
+    size_t alen;
+    const uint8_t *arg = trim(expr+11, len-12, &alen);
+    if (alen == 0 || (arg[0] != '"' && arg[0] != '\'') || 
+        memchr(arg, '\\', alen))
+    {
+        return PROG_NONE;
+    }
+    size_t slen, rlen;
+    bool oom;
+    const uint8_t *str = parse_string(arg, alen, &slen, &rlen, &oom);
+    if (!str || rlen != alen) return PROG_NONE;
+    struct value val = env_global(&prog->env, expr, 4);
+    if (val.kind != UNDEF_KIND) return PROG_NONE;
+    struct eval_context ctx = { .expr = expr, .len = len, .env = &prog->env };
+    int64_t ms;
+    val = parse_date(str, slen, &ms) ? make_time(ms, &ctx) : make_float(NAN);
+    int node = prog_island(prog, PROG_ISLAND, expr, len, STEP_FACTS<<1, depth);
+    if (node >= 0) {
+        prog->nodes[node].value = val;
+        prog->nodes[node].folded = true;
+    }
+    return node;
+}
+
+// prog_math compiles a member of Math with constant arguments, such as
+// Math.PI or Math.pow(2, 10), as an island that's folded to its value, in the
+// same way as prog_date. The arguments may have numbers and operators, but no
+// names. Returns PROG_NONE if expr is not such a member, if it's not a number,
+// or if the environment defines Math.
+static int prog_math(struct xv_program *prog, const uint8_t *expr, size_t len,
+    int depth)
+{
+    size_t ilen;
+    if (len < 6 || memcmp(expr, "Math.", 5) != 0 || 
+        !read_ident(expr+5, len-5, &ilen))
+    {
+        return PROG_NONE;
+    }
+    for (size_t i = 5+ilen; i < len; i++) {
+        uint8_t c = expr[i];
+        bool digit = c >= '0' && c <= '9';
+        bool exp = (c == 'e' || c == 'E') && expr[i-1] >= '0' && 
+            expr[i-1] <= '9';
+        if (!digit && !exp && (c == 0 || !strchr(" \t\r\n.,()+-*/%", c))) {
+            return PROG_NONE;
+        }
+    }
+    if (env_global(&prog->env, expr, 4).kind != UNDEF_KIND) return PROG_NONE;
+    struct eval_context ctx = { .expr = expr, .len = len, .env = &prog->env };
+    struct value val = eval_atom(expr, len, &ctx, depth);
+    if (!isnumkind(val)) return PROG_NONE;
+    int node = prog_island(prog, PROG_ISLAND, expr, len, STEP_FACTS<<1, depth);
+    if (node >= 0) {
+        prog->nodes[node].value = val;
+        prog->nodes[node].folded = true;
+    }
+    return node;
+}
+
+static int prog_atom(struct xv_program *prog, const uint8_t *expr, size_t len,
+    int depth)
+{
+    expr = trim(expr, len, &len);
+    size_t glen;
+    size_t slen;
+    size_t rlen;
+    bool oom;
+    const uint8_t *str;
+    struct value value;
+    if (len == 0) goto island;
+    switch (expr[0]) {
+    case '(':
+        if (read_group(expr, len, &glen) && glen == len && 
+            depth <= XV_MAXDEPTH)
+        {
+            return prog_expr(prog, expr+1, len-2, depth+1);
+        }
+        break;
+    case '"': case '\'':
+        if (memchr(expr, '\\', len)) break;
+        str = parse_string(expr, len, &slen, &rlen, &oom);
+        if (str && rlen == len) {
+            return prog_const(prog, make_string(str, slen), expr, len);
+        }
+        break;
+    case '-': case '.': case '0': case '1': case '2': case '3': case '4': 
+    case '5': case '6': case '7': case '8': case '9': {
+        // numbers never read identifiers, so they can be evaluated now.
+        struct eval_context ctx = { 
+            .expr = expr, 
+            .len = len, 
+            .env = &prog->env,
+        };
+        value = eval_atom(expr, len, &ctx, depth);
+        if (isnumkind(value)) {
+            return prog_const(prog, value, expr, len);
+        }
+        break;
+    }
+    default:
+        str = read_ident(expr, len, &slen);
+        if (!str) break;
+        if (slen != len) {
+            if (slen == 4 && memcmp(expr, "Date", 4) == 0) {
+                int node = prog_date(prog, expr, len, depth);
+                if (node != PROG_NONE) return node;
+            }
+            if (slen == 4 && memcmp(expr, "Math", 4) == 0) {
+                int node = prog_math(prog, expr, len, depth);
+                if (node != PROG_NONE) return node;
+            }
+            int node = prog_path(prog, expr, len, slen, depth);
+            if (node == PROG_NONE) break;
+            return node;
+        }
+        if (len == 4 && memcmp(expr, "true", 4) == 0) {
+            return prog_const(prog, make_bool(true), expr, len);
+        } else if (len == 5 && memcmp(expr, "false", 5) == 0) {
+            return prog_const(prog, make_bool(false), expr, len);
+        } else if (len == 4 && memcmp(expr, "null", 4) == 0) {
+            return prog_const(prog, make_null(), expr, len);
+        } else if (len == 9 && memcmp(expr, "undefined", 9) == 0) {
+            return prog_const(prog, make_undefined(), expr, len);
+        } else if (len == 3 && memcmp(expr, "NaN", 3) == 0) {
+            return prog_const(prog, make_float(NAN), expr, len);
+        } else if (len == 8 && memcmp(expr, "Infinity", 8) == 0) {
+            return prog_const(prog, make_float(INFINITY), expr, len);
+        }
+        return prog_island(prog, PROG_COLUMN, expr, len, STEP_FACTS<<1, 
+            depth);
+    }
+island:
+    return prog_island(prog, PROG_ISLAND, expr, len, STEP_FACTS<<1, depth);
+}
+
+static int prog_facts(struct xv_program *prog, const uint8_t *expr, 
+    size_t len, int depth)
+{
+    expr = trim(expr, len, &len);
+    if (len == 0) {
+        return prog_island(prog, PROG_ISLAND, expr, len, STEP_FACTS, depth);
+    }
+    size_t s = 0;
+    int left = PROG_NONE;
+    enum prog_op op = 0;
+    size_t glen;
+    const uint8_t *g;
+    for (size_t i = 0; i < len; i++) {
+        switch (expr[i]) {
+        case '*': case '/': case '%':
+            if (expr[i] == '/' && regex_start(expr, i)) {
+                g = read_group(expr+i, len-i, &glen);
+                unreachable(
+                    // unreachable due to prog_expr already checking this 
+                    // group.
+                    if (!g) goto island;
+                )
+                i = i + glen - 1;
+                break;
+            }
+            left = prog_join(prog, op, left, 
+                prog_atom(prog, expr+s, i-s, depth));
+            op = expr[i] == '*' ? PROG_MUL : expr[i] == '/' ? PROG_DIV : 
+                PROG_MOD;
+            s = i + 1;
+            break;
+        case '(': case '[': case '{': case '"': case '\'':
+            g = read_group(expr+i, len-i, &glen);
+            unreachable(
+                // unreachable due to prog_expr already checking this group.
+                if (!g) goto island;
+            )
+            i = i + glen - 1;
+            break;
+        }
+    }
+    return prog_join(prog, op, left, prog_atom(prog, expr+s, len-s, depth));
+island:
+    return prog_island(prog, PROG_ISLAND, expr, len, STEP_FACTS, depth);
+}
+
+static int prog_sums(struct xv_program *prog, const uint8_t *expr, 
+    size_t len, int depth)
+{
+    expr = trim(expr, len, &len);
+    size_t s = 0;
+    int left = PROG_NONE;
+    enum prog_op op = 0;
+    bool fill = false;
+    bool neg = false;
+    size_t glen;
+    const uint8_t *g;
+    int right;
+    for (size_t i = 0; i < len; i++) {
+        switch (expr[i]) {
+        case '-': case '+':
+            if (!fill) {
+                if (i > 0 && expr[i-1] == expr[i]) {
+                    // -- not allowed
+                    goto island;
+                }
+                if (expr[i] == '-') {
+                    neg = !neg;
+                }
+                s = i + 1;
+                continue;
+            }
+            if (i > 0 && (expr[i-1] == 'e' || expr[i-1] == 'E')) {
+                // scientific notation
+                continue;
+            }
+            if (neg) {
+                if (s > 0 && s < len && expr[s-1] == '-' &&
+                    expr[s] >= '0' && expr[s] <= '9')
+                {
+                    s--;
+                    neg = false;
+                }
+            }
+            right = prog_facts(prog, expr+s, i-s, depth);
+            if (neg) right = prog_unary(prog, PROG_NEG, right);
+            left = prog_join(prog, op, left, right);
+            op = expr[i] == '+' ? PROG_ADD : PROG_SUB;
+            s = i + 1;
+            fill = false;
+            neg = false;
+            break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
+        case '(': case '[': case '{': case '"': case '\'':
+            g = read_group(expr+i, len-i, &glen);
+            unreachable(
+                // unreachable due to prog_expr already checking this group.
+                if (!g) goto island;
+            )
+            i = i + glen - 1;
+            fill = true;
+            break;
+        default:
+            if (!fill && !isws(expr[i])) {
+                fill = true;
+            }
+        }
+    }
+    if (neg) {
+        if (s > 0 && s < len && expr[s-1] == '-' &&
+            expr[s] >= '0' && expr[s] <= '9')
+        {
+            s--;
+            neg = false;
+        }
+    }
+    right = prog_facts(prog, expr+s, len-s, depth);
+    if (neg) right = prog_unary(prog, PROG_NEG, right);
+    return prog_join(prog, op, left, right);
+island:
+    return prog_island(prog, PROG_ISLAND, expr, len, STEP_SUMS, depth);
+}
+
+static int prog_comps(struct xv_program *prog, const uint8_t *expr, 
+    size_t len, int depth)
+{
+    expr = trim(expr, len, &len);
+    size_t s = 0;
+    int left = PROG_NONE;
+    enum prog_op op = 0;
+    size_t glen;
+    const uint8_t *g;
+    for (size_t i = 0; i < len; i++) {
+        switch (expr[i]) {
+        case '<': case '>':
+            left = prog_join(prog, op, left, 
+                prog_sums(prog, expr+s, i-s, depth));
+            op = expr[i] == '<' ? PROG_LT : PROG_GT;
+            if (i < len-1 && expr[i+1] == '=') {
+                op = op == PROG_LT ? PROG_LTE : PROG_GTE;
+                i++;
+            }
+            s = i + 1;
+            break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
+        case '(': case '[': case '{': case '"': case '\'':
+            g = read_group(expr+i, len-i, &glen);
+            unreachable(
+                // unreachable due to prog_expr already checking this group.
+                if (!g) {
+                    return prog_island(prog, PROG_ISLAND, expr, len, 
+                        STEP_COMPS, depth);
+                }
+            )
+            i = i + glen - 1;
+            break;
+        }
+    }
+    return prog_join(prog, op, left, prog_sums(prog, expr+s, len-s, depth));
+}
+
+// prog_equal compiles an operand of an equality, which may have leading '!'
+// operators.
+static int prog_equal(struct xv_program *prog, const uint8_t *expr, 
+    size_t len, int depth)
+{
+    const uint8_t *operand = expr;
+    size_t olen = len;
+    bool neg = false;
+    bool boolit = false;
+    expr = trim(expr, len, &len);
+    while (1) {
+        if (len == 0) {
+            return prog_island(prog, PROG_ISLAND, operand, olen, 
+                STEP_EQUALITY, depth);
+        }
+        if (expr[0] != '!') break;
+        neg = !neg;
+        boolit = true;
+        expr++;
+        len--;
+        expr = trim(expr, len, &len);
+    }
+    int node = prog_comps(prog, expr, len, depth);
+    if (boolit) {
+        node = prog_unary(prog, neg ? PROG_NOT : PROG_TRUTHY, node);
+    }
+    return node;
+}
+
+static int prog_equality(struct xv_program *prog, const uint8_t *expr, 
+    size_t len, int depth)
+{
+    expr = trim(expr, len, &len);
+    size_t s = 0;
+    int left = PROG_NONE;
+    enum prog_op op = 0;
+    enum prog_op opnext;
+    size_t glen;
+    const uint8_t *g;
+    size_t opsz;
+    for (size_t i = 0; i < len; i++) {
+        switch (expr[i]) {
+        case '=': case '!':
+            if (expr[i] == '=') {
+                if (i > 0 && (expr[i-1] == '>' || expr[i-1] == '<')) {
+                    continue;
+                }
+                if (i == len-1 || expr[i+1] != '=') {
+                    goto island;
+                }
+                opnext = PROG_EQ;
+            } else {
+                if (i == len-1 || expr[i+1] != '=') {
+                    continue;
+                }
+                opnext = PROG_NEQ;
+            }
+            opsz = 2;
+            if (i+2 < len && expr[i+2] == '=') {
+                // strict
+                opnext = opnext == PROG_EQ ? PROG_SEQ : PROG_SNEQ;
+                opsz++;
+            }
+            left = prog_join(prog, op, left, 
+                prog_equal(prog, expr+s, i-s, depth));
+            op = opnext;
+            i = i + opsz - 1;
+            s = i + 1;
+            break;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
+        case '(': case '[': case '{': case '"': case '\'':
+            g = read_group(expr+i, len-i, &glen);
+            unreachable(
+                // unreachable due to prog_expr already checking this group.
+                if (!g) goto island;
+            )
+            i = i + glen - 1;
+            break;
+        }
+    }
+    return prog_join(prog, op, left, prog_equal(prog, expr+s, len-s, depth));
+island:
+    return prog_island(prog, PROG_ISLAND, expr, len, STEP_BITWISE_OR, depth);
+}
+
+// prog_logical compiles the '||' level, when op is PROG_OR, or the '&&'
+// level. The groups were already checked by prog_expr.
+static int prog_logical(struct xv_program *prog, enum prog_op op, 
+    const uint8_t *expr, size_t len, int depth)
+{
+    expr = trim(expr, len, &len);
+    if (len == 0) {
+        return prog_island(prog, PROG_ISLAND, expr, len, 
+            op == PROG_OR ? STEP_LOGICAL_OR : STEP_LOGICAL_AND, depth);
+    }
+    uint8_t opch = op == PROG_OR ? '|' : '&';
+    size_t s = 0;
+    int left = PROG_NONE;
+    size_t glen;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && expr[i] != opch) {
+            if (expr[i] == '/' && !regex_start(expr, i)) continue;
+            switch (expr[i]) {
+            case '/': case '(': case '[': case '{': case '"': case '\'':
+                read_group(expr+i, len-i, &glen);
+                i = i + glen - 1;
+                break;
+            }
+            continue;
+        }
+        int right = op == PROG_OR ? 
+            prog_logical(prog, PROG_AND, expr+s, i-s, depth) :
+            prog_equality(prog, expr+s, i-s, depth);
+        left = prog_join(prog, op, left, right);
+        i++;
+        s = i + 1;
+    }
+    return left;
+}
+
+static int prog_expr(struct xv_program *prog, const uint8_t *expr, size_t len,
+    int depth)
+{
+    expr = trim(expr, len, &len);
+    size_t glen;
+    for (size_t i = 0; i < len; i++) {
+        switch (expr[i]) {
+        case '?':
+            if (i+1 < len && expr[i+1] == '.') {
+                // '?.' operator
+                i++;
+                continue;
+            }
+            // fall through
+        case ',': case ':': case '^':
+            goto island;
+        case '|': case '&':
+            if (i+1 < len && expr[i+1] == expr[i]) {
+                i++;
+                continue;
+            }
+            goto island;
+        case '/':
+            if (!regex_start(expr, i)) break;
+            // fall through
+        case '(': case '[': case '{': case '"': case '\'':
+            if (!read_group(expr+i, len-i, &glen)) goto island;
+            i = i + glen - 1;
+            break;
+        }
+    }
+    return prog_logical(prog, PROG_OR, expr, len, depth);
+island:
+    return prog_island(prog, PROG_ISLAND, expr, len, STEP_COMMA, depth);
+}
+
+struct xv_program *xv_program_new(const char *expr, size_t len, 
+    struct xv_env *env)
+{
+    struct xv_program *prog = emalloc0(sizeof(struct xv_program)+len);
+    if (!prog) return NULL;
+    memset(prog, 0, sizeof(struct xv_program));
+    if (env) prog->env = *env;
+    prog->expr = (uint8_t*)(prog+1);
+    prog->len = len;
+    if (len > 0) memcpy(prog->expr, expr, len);
+    const uint8_t *text = trim(prog->expr, len, &len);
+    if (len == 0) {
+        prog->root = prog_const(prog, make_undefined(), text, 0);
+    } else {
+        prog->root = prog_expr(prog, text, len, 1);
+    }
+    if (prog->root < 0) {
+        xv_program_free(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+void xv_program_free(struct xv_program *prog) {
+    if (!prog) return;
+    if (prog->nodes) efree0(prog->nodes);
+    efree0(prog);
+}
+
+enum vec_kind { VEC_F64, VEC_BOOL, VEC_VALUE };
+
+// struct vec is the block of values that a node fills.
+struct vec {
+    enum vec_kind kind;
+    const double *f64;           // VEC_F64
+    const uint8_t *t;            // VEC_BOOL
+    const struct value *vals;    // VEC_VALUE
+    const uint64_t *nulls;       // VEC_F64 rows that are null, or NULL
+    void *buf;                   // storage for a block
+    uint64_t *nullbuf;           // storage for nulls
+    const struct xv_column *col; // column that the node reads
+    struct bound *bound;         // columns bound for an island
+    size_t nbound;               //
+};
+
+// struct bound is a column that is bound as a scope variable.
+struct bound {
+    struct scope scope;
+    const struct xv_column *col;
+};
+
+struct batch {
+    const struct xv_program *prog;
+    struct xv_env env;
+    struct eval_context ctx;    // for the operators
+    struct vec *vecs;           // one for each node
+    double *tmp;                // two blocks for converted operands
+    size_t cap;                 // rows in a full block
+    size_t row;                 // first row of the block
+    size_t n;                   // number of rows in the block
+    char *mem;                  // all of the above
+};
+
+// selected returns true when row i is in the selection, where no selection
+// is all rows.
+static bool selected(const uint64_t *sel, size_t i) {
+    return !sel || ((sel[i>>6]>>(i&63))&1);
+}
+
+static bool column_null(const struct xv_column *col, size_t i) {
+    return col->validity && ((col->validity[i>>3]>>(i&7))&1) == 0;
+}
+
+static struct value column_value(const struct xv_column *col, size_t i, 
+    bool ints)
+{
+    if (column_null(col, i)) {
+        return make_null();
+    }
+    if (col->type == XV_VALUE) {
+        return to_value(((const struct xv*)col->data)[i]);
+    }
+    if (col->type == XV_UTF8) {
+        const uint8_t *data = col->data;
+        return make_string(data+col->offsets[i], 
+            col->offsets[i+1]-col->offsets[i]);
+    }
+    return typed_at(make_typed(col->data, 0, col->type), i, ints);
+}
+
+static struct value vec_value(const struct vec *v, size_t i) {
+    switch (v->kind) {
+    case VEC_F64:
+        if (v->nulls && ((v->nulls[i>>6]>>(i&63))&1)) {
+            return make_null();
+        }
+        return make_float(v->f64[i]);
+    case VEC_BOOL:
+        return make_bool(v->t[i]);
+    default:
+        return v->vals[i];
+    }
+}
+
+static bool vec_null(const struct vec *v, size_t i) {
+    return v->nulls && ((v->nulls[i>>6]>>(i&63))&1);
+}
+
+// vec_f64s returns the numbers of a number or bool vector, using tmp for
+// the bools.
+static const double *vec_f64s(const struct vec *v, double *tmp, size_t n) {
+    if (v->kind == VEC_F64) return v->f64;
+    for (size_t i = 0; i < n; i++) {
+        tmp[i] = v->t[i];
+    }
+    return tmp;
+}
+
+// vec_truths returns the truthiness of a number or bool vector, using tmp
+// for the numbers.
+static const uint8_t *vec_truths(const struct vec *v, uint8_t *tmp, size_t n)
+{
+    if (v->kind == VEC_BOOL) return v->t;
+    const double *x = v->f64;
+    for (size_t i = 0; i < n; i++) {
+        tmp[i] = x[i] < 0 || x[i] > 0;
+    }
+    return tmp;
+}
+
+static void batch_column(struct batch *b, struct vec *v) {
+    const struct xv_column *col = v->col;
+    size_t row = b->row;
+    size_t n = b->n;
+    bool ints = b->env.int_math;
+    if (col->type == XV_UTF8 || col->type == XV_VALUE ||
+        (ints && (col->type == XV_INT64 || col->type == XV_INT32)))
+    {
+        struct value *vals = v->buf;
+        for (size_t i = 0; i < n; i++) {
+            vals[i] = column_value(col, row+i, ints);
+        }
+        v->kind = VEC_VALUE;
+        v->vals = vals;
+        return;
+    }
+    v->kind = VEC_F64;
+    v->nulls = NULL;
+    if (col->type == XV_FLOAT64 && !col->validity) {
+        // read in place
+        v->f64 = (const double*)col->data + row;
+        return;
+    }
+    double *x = v->buf;
+    switch (col->type) {
+    case XV_FLOAT64: {
+        const double *data = (const double*)col->data + row;
+        for (size_t i = 0; i < n; i++) x[i] = data[i];
+        break;
+    }
+    case XV_FLOAT32: {
+        const float *data = (const float*)col->data + row;
+        for (size_t i = 0; i < n; i++) x[i] = data[i];
+        break;
+    }
+    case XV_INT64: {
+        const int64_t *data = (const int64_t*)col->data + row;
+        for (size_t i = 0; i < n; i++) x[i] = (double)data[i];
+        break;
+    }
+    default: { // XV_INT32
+        const int32_t *data = (const int32_t*)col->data + row;
+        for (size_t i = 0; i < n; i++) x[i] = data[i];
+        break;
+    }
+    }
+    if (col->validity) {
+        memset(v->nullbuf, 0, ((n+63)/64)*sizeof(uint64_t));
+        for (size_t i = 0; i < n; i++) {
+            if (column_null(col, row+i)) {
+                x[i] = 0;
+                v->nullbuf[i>>6] |= (uint64_t)1<<(i&63);
+            }
+        }
+        v->nulls = v->nullbuf;
+    }
+    v->f64 = x;
+}
+
+static void batch_island(struct batch *b, const struct prog_node *node, 
+    struct vec *v, const uint64_t *sel)
+{
+    struct value *vals = v->buf;
+    struct eval_context ctx = {
+        .expr = node->text,
+        .len = node->len,
+        .steps = node->steps,
+        .env = &b->env,
+        .scope = v->nbound > 0 ? &v->bound[v->nbound-1].scope : NULL,
+    };
+    for (size_t i = 0; i < b->n; i++) {
+        if (!selected(sel, i)) {
+            vals[i] = make_undefined();
+            continue;
+        }
+        for (size_t j = 0; j < v->nbound; j++) {
+            v->bound[j].scope.value = column_value(v->bound[j].col, b->row+i,
+                b->env.int_math);
+        }
+        vals[i] = eval_auto(node->step, node->text, node->len, &ctx, 
+            node->depth);
+    }
+    v->kind = VEC_VALUE;
+    v->vals = vals;
+}
+
+// prog_member reads a member of a value, as the evaluator does for a '.' that
+// is not followed by a call.
+static struct value prog_member(struct value left, const struct prog_node *node,
+    struct eval_context *ctx)
+{
+    if (is_err(left)) return left;
+    const uint8_t *ident = node->text;
+    size_t ilen = node->len;
+    const uint8_t *rest = ident+ilen;
+    struct value val;
+    size_t n;
+    if (left.kind == STR_KIND && eval_string_member(left, ident, ilen, rest, 0,
+        ctx, node->depth, &val, &n))
+    {
+        return val;
+    }
+    if (left.kind == REGEX_KIND && eval_regex_member(left, ident, ilen, rest, 
+        0, ctx, node->depth, &val, &n))
+    {
+        return val;
+    }
+    // array methods are always calls, so they are never members here
+    return get_ref_value(true, left, ident, ilen, false, ctx);
+}
+
+static void batch_member(struct batch *b, const struct prog_node *node, 
+    struct vec *v, const uint64_t *sel)
+{
+    const struct vec *x = &b->vecs[node->a];
+    struct value *vals = v->buf;
+    for (size_t i = 0; i < b->n; i++) {
+        vals[i] = selected(sel, i) ? 
+            prog_member(vec_value(x, i), node, &b->ctx) : make_undefined();
+    }
+    v->kind = VEC_VALUE;
+    v->vals = vals;
+}
+
+// batch_op applies an operator to the values of one row, where an error in
+// either operand is the result.
+static struct value batch_op(enum prog_op op, struct value a, struct value b,
+    struct eval_context *ctx)
+{
+    if (is_err(a)) return a;
+    if (is_err(b)) return b;
+    switch (op) {
+    case PROG_TRUTHY:
+        return a.kind == BOOL_KIND ? a : make_bool(to_bool(a));
+    case PROG_NOT:
+        return make_bool(!to_bool(a));
+    case PROG_NEG:
+        return vneg(a, ctx);
+    case PROG_ADD:
+        return vadd(a, b, ctx);
+    case PROG_SUB:
+        return vsub(a, b, ctx);
+    case PROG_MUL:
+        return vmul(a, b, ctx);
+    case PROG_DIV:
+        return vdiv(a, b, ctx);
+    case PROG_MOD:
+        return vmod(a, b, ctx);
+    case PROG_LT:
+        return vlt(a, b, ctx);
+    case PROG_LTE:
+        return vlte(a, b, ctx);
+    case PROG_GT:
+        return vgt(a, b, ctx);
+    case PROG_GTE:
+        return vgte(a, b, ctx);
+    case PROG_EQ:
+        return veq(a, b, ctx);
+    case PROG_NEQ:
+        return vneq(a, b, ctx);
+    case PROG_SEQ:
+        return vseq(a, b, ctx);
+    case PROG_SNEQ:
+        return vsneq(a, b, ctx);
+    case PROG_AND:
+        return vand(a, b);
+    default: // PROG_OR
+        return vor(a, b);
+    }
+}
+
+// batch_numbers applies an operator to number and bool vectors.
+static void batch_numbers(struct batch *b, enum prog_op op, 
+    const struct vec *x, const struct vec *y, struct vec *v)
+{
+    size_t n = b->n;
+    double *z = v->buf;
+    uint8_t *t = v->buf;
+    const double *p;
+    const double *q;
+    const uint8_t *r;
+    const uint8_t *s;
+    switch (op) {
+    case PROG_TRUTHY: case PROG_NOT:
+        r = vec_truths(x, (uint8_t*)b->tmp, n);
+        for (size_t i = 0; i < n; i++) t[i] = r[i] ^ (op == PROG_NOT);
+        break;
+    case PROG_AND: case PROG_OR:
+        r = vec_truths(x, (uint8_t*)b->tmp, n);
+        s = vec_truths(y, (uint8_t*)(b->tmp+XV_BATCH_SIZE), n);
+        if (op == PROG_AND) {
+            for (size_t i = 0; i < n; i++) t[i] = r[i] & s[i];
+        } else {
+            for (size_t i = 0; i < n; i++) t[i] = r[i] | s[i];
+        }
+        break;
+    case PROG_SEQ: case PROG_SNEQ:
+        if (x->kind != y->kind) {
+            // a number is never strictly equal to a bool
+            memset(t, op == PROG_SNEQ, n);
+        } else if (x->kind == VEC_BOOL) {
+            for (size_t i = 0; i < n; i++) {
+                t[i] = (x->t[i] == y->t[i]) ^ (op == PROG_SNEQ);
+            }
+        } else if (x->nulls || y->nulls) {
+            for (size_t i = 0; i < n; i++) {
+                bool xn = vec_null(x, i);
+                bool yn = vec_null(y, i);
+                bool eq = xn || yn ? xn == yn : x->f64[i] == y->f64[i];
+                t[i] = eq ^ (op == PROG_SNEQ);
+            }
+        } else {
+            p = x->f64;
+            q = y->f64;
+            for (size_t i = 0; i < n; i++) {
+                t[i] = (p[i] == q[i]) ^ (op == PROG_SNEQ);
+            }
+        }
+        break;
+    default:
+        p = vec_f64s(x, b->tmp, n);
+        q = op == PROG_NEG ? NULL : vec_f64s(y, b->tmp+XV_BATCH_SIZE, n);
+        switch (op) {
+        case PROG_NEG:
+            for (size_t i = 0; i < n; i++) z[i] = p[i] * -1.0;
+            break;
+        case PROG_ADD:
+            for (size_t i = 0; i < n; i++) z[i] = p[i] + q[i];
+            break;
+        case PROG_SUB:
+            for (size_t i = 0; i < n; i++) z[i] = p[i] - q[i];
+            break;
+        case PROG_MUL:
+            for (size_t i = 0; i < n; i++) z[i] = p[i] * q[i];
+            break;
+        case PROG_DIV:
+            for (size_t i = 0; i < n; i++) z[i] = p[i] / q[i];
+            break;
+        case PROG_MOD:
+            for (size_t i = 0; i < n; i++) z[i] = fmod(p[i], q[i]);
+            break;
+        case PROG_LT:
+            for (size_t i = 0; i < n; i++) t[i] = p[i] < q[i];
+            break;
+        case PROG_LTE:
+            for (size_t i = 0; i < n; i++) t[i] = p[i] <= q[i];
+            break;
+        case PROG_GT:
+            for (size_t i = 0; i < n; i++) t[i] = p[i] > q[i];
+            break;
+        case PROG_GTE:
+            for (size_t i = 0; i < n; i++) t[i] = p[i] >= q[i];
+            break;
+        case PROG_EQ:
+            for (size_t i = 0; i < n; i++) t[i] = p[i] == q[i];
+            break;
+        default: // PROG_NEQ
+            for (size_t i = 0; i < n; i++) t[i] = p[i] != q[i];
+            break;
+        }
+        if (op <= PROG_MOD) {
+            v->kind = VEC_F64;
+            v->f64 = z;
+            v->nulls = NULL;
+            return;
         }
     }
-    return left;
+    v->kind = VEC_BOOL;
+    v->t = t;
+}
+
+// batch_eval fills the vector of a node for the rows of the block that are
+// selected. Other rows may be left undefined.
+static void batch_eval(struct batch *b, int index, const uint64_t *sel) {
+    const struct prog_node *node = &b->prog->nodes[index];
+    struct vec *v = &b->vecs[index];
+    switch (node->op) {
+    case PROG_CONST:
+        // filled once for all blocks
+        return;
+    case PROG_COLUMN:
+        if (v->col) {
+            batch_column(b, v);
+            return;
+        }
+        // fall through
+    case PROG_ISLAND:
+        if (node->folded && v->nbound == 0) {
+            // filled once for all blocks
+            return;
+        }
+        batch_island(b, node, v, sel);
+        return;
+    case PROG_MEMBER:
+        batch_eval(b, node->a, sel);
+        batch_member(b, node, v, sel);
+        return;
+    default:
+        break;
+    }
+    bool unary = node->op == PROG_TRUTHY || node->op == PROG_NOT || 
+        node->op == PROG_NEG;
+    batch_eval(b, node->a, sel);
+    if (!unary) batch_eval(b, node->b, sel);
+    const struct vec *x = &b->vecs[node->a];
+    const struct vec *y = unary ? x : &b->vecs[node->b];
+    if (x->kind != VEC_VALUE && y->kind != VEC_VALUE) {
+        batch_numbers(b, node->op, x, y, v);
+        return;
+    }
+    struct value *vals = v->buf;
+    for (size_t i = 0; i < b->n; i++) {
+        if (!selected(sel, i)) {
+            vals[i] = make_undefined();
+            continue;
+        }
+        vals[i] = batch_op(node->op, vec_value(x, i), 
+            unary ? make_undefined() : vec_value(y, i), &b->ctx);
+    }
+    v->kind = VEC_VALUE;
+    v->vals = vals;
 }
 
-static struct value eval_sums(const uint8_t *expr, size_t len, 
-    struct eval_context *ctx, int depth)
+static bool isidentch(uint8_t c) {
+    return isalnum(c) || c == '_' || c == '$' || c >= 0x80;
+}
+
+// names returns true when expr has name as a whole identifier.
+static bool names(const uint8_t *expr, size_t len, const char *name) {
+    size_t nlen = strlen(name);
+    for (size_t i = 0; nlen > 0 && i+nlen <= len; i++) {
+        if (memcmp(expr+i, name, nlen) == 0 && 
+            (i == 0 || !isidentch(expr[i-1])) &&
+            (i+nlen == len || !isidentch(expr[i+nlen])))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// reads_columns returns true when the text of a node names any of the
+// columns.
+static bool reads_columns(const struct prog_node *node, 
+    const struct xv_column *columns, size_t ncolumns)
 {
-    size_t s = 0;
-    struct value left = { 0 };
-    uint8_t op = 0;
-    bool fill = false;
-    bool neg = false;
-    size_t glen;
-    const uint8_t *g;
-    for (size_t i = 0; i < len; i++) {
-        switch (expr[i]) {
-        case '-': case '+':
-            if (!fill) {
-                if (i > 0 && expr[i-1] == expr[i]) {
-                    // -- not allowed
-                    return err_syntax();
-                }
-                if (expr[i] == '-') {
-                    neg = !neg;
-                }
-                s = i + 1;
-                continue;
-            }
-            if (i > 0 && (expr[i-1] == 'e' || expr[i-1] == 'E')) {
-                // scientific notation
-                continue;
-            }
-            if (neg) {
-                if (s > 0 && s < len && expr[s-1] == '-' &&
-                    expr[s] >= '0' && expr[s] <= '9')
-                {
-                    s--;
-                    neg = false;
+    for (size_t i = 0; i < ncolumns; i++) {
+        if (names(node->text, node->len, columns[i].name)) return true;
+    }
+    return false;
+}
+
+static const struct xv_column *find_column(const struct xv_column *columns,
+    size_t ncolumns, const uint8_t *name, size_t len)
+{
+    for (size_t i = 0; i < ncolumns; i++) {
+        if (strlen(columns[i].name) == len && 
+            memcmp(columns[i].name, name, len) == 0)
+        {
+            return &columns[i];
+        }
+    }
+    return NULL;
+}
+
+// vec_fill fills a vector with a constant for every row of a block.
+static void vec_fill(struct vec *v, struct value value, size_t cap) {
+    if (value.kind == FLOAT_KIND || value.kind == NULL_KIND) {
+        double *x = v->buf;
+        double f = value.kind == FLOAT_KIND ? value.f64 : 0;
+        for (size_t j = 0; j < cap; j++) x[j] = f;
+        v->kind = VEC_F64;
+        v->f64 = x;
+        if (value.kind == NULL_KIND) {
+            memset(v->nullbuf, 0xFF, cap/8);
+            v->nulls = v->nullbuf;
+        }
+    } else if (value.kind == BOOL_KIND) {
+        memset(v->buf, value.t, cap);
+        v->kind = VEC_BOOL;
+        v->t = v->buf;
+    } else {
+        struct value *vals = v->buf;
+        for (size_t j = 0; j < cap; j++) vals[j] = value;
+        v->kind = VEC_VALUE;
+        v->vals = vals;
+    }
+}
+
+// batch_setup fills the constants, finds the columns of the nodes, and binds
+// the columns of the islands. Folded islands that read no columns are filled
+// as constants.
+static void batch_setup(struct batch *b, const struct xv_column *columns, 
+    size_t ncolumns, size_t cap, struct bound *bound)
+{
+    const struct xv_program *prog = b->prog;
+    for (int i = 0; i < prog->nnodes; i++) {
+        const struct prog_node *node = &prog->nodes[i];
+        struct vec *v = &b->vecs[i];
+        if (node->op == PROG_CONST) {
+            vec_fill(v, node->value, cap);
+        } else if (node->op == PROG_COLUMN) {
+            v->col = find_column(columns, ncolumns, node->text, node->len);
+        } else if (node->op == PROG_ISLAND) {
+            v->bound = bound;
+            for (size_t j = 0; j < ncolumns; j++) {
+                if (names(node->text, node->len, columns[j].name)) {
+                    struct bound *bd = &v->bound[v->nbound];
+                    bd->scope.name = (const uint8_t*)columns[j].name;
+                    bd->scope.len = strlen(columns[j].name);
+                    bd->scope.parent = v->nbound > 0 ? &bd[-1].scope : NULL;
+                    bd->col = &columns[j];
+                    v->nbound++;
                 }
             }
-            left = sum(left, op, expr+s, i-s, neg, ctx, depth);
-            if (is_err(left)) {
-                return left;
-            }
-            op = expr[i];
-            s = i + 1;
-            fill = false;
-            neg = false;
-            break;
-        case '(': case '[': case '{': case '"': case '\'':
-            g = read_group(expr+i, len-i, &glen);
-            if (!g) return err_syntax();
-            i = i + glen - 1;
-            fill = true;
-            break;
-        default:
-            if (!fill && !isws(expr[i])) {
-                fill = true;
-            }
+            bound += v->nbound;
+            if (node->folded && v->nbound == 0) vec_fill(v, node->value, cap);
         }
     }
-    if (neg) {
-        if (s > 0 && s < len && expr[s-1] == '-' &&
-            expr[s] >= '0' && expr[s] <= '9')
+}
+
+static bool columns_valid(const struct xv_column *columns, size_t ncolumns,
+    size_t nrows)
+{
+    for (size_t i = 0; i < ncolumns; i++) {
+        const struct xv_column *col = &columns[i];
+        if (!col->name || col->type < XV_FLOAT64 || col->type > XV_VALUE ||
+            (nrows > 0 && (!col->data || 
+            (col->type == XV_UTF8 && !col->offsets))))
         {
-            s--;
-            neg = false;
+            return false;
         }
     }
-    return sum(left, op, expr+s, len-s, neg, ctx, depth);
+    return true;
 }
 
-static struct value fact(struct value left, uint8_t op, const uint8_t *expr, 
-    size_t len, struct eval_context *ctx, int depth)
+// batch_open checks the columns and allocates the vectors for a batch.
+static bool batch_open(struct batch *b, const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows)
 {
-    expr = trim(expr, len, &len);
-    if (len == 0) return err_syntax();
-    struct value right = eval_atom(expr, len, ctx, depth);
-    if (is_err(right)) return right;
-    switch (op) {
-    case '*':
-        return vmul(left, right);
-    case '/':
-        return vdiv(left, right);
-    case '%':
-        return vmod(left, right);
-    default:
-        return right;
+    if (!columns_valid(columns, ncolumns, nrows)) {
+        return false;
+    }
+    // a block is rounded up to whole words of the bitmaps
+    size_t cap = nrows < XV_BATCH_SIZE ? (nrows+63)&~(size_t)63 : 
+        XV_BATCH_SIZE;
+    size_t nnodes = prog->nnodes;
+    size_t nislands = 0;
+    for (size_t i = 0; i < nnodes; i++) {
+        nislands += prog->nodes[i].op == PROG_ISLAND;
     }
+    size_t vsize = cap*sizeof(struct value) + cap/8;
+    size_t size = nnodes*(sizeof(struct vec)+vsize) + 
+        2*XV_BATCH_SIZE*sizeof(double) + 
+        nislands*ncolumns*sizeof(struct bound);
+    char *mem = emalloc0(size);
+    if (!mem) {
+        return false;
+    }
+    memset(mem, 0, nnodes*sizeof(struct vec));
+    *b = (struct batch) { 
+        .prog = prog, 
+        .env = prog->env,
+        .vecs = (struct vec*)mem,
+        .cap = cap,
+        .mem = mem,
+    };
+    b->ctx.env = &b->env;
+    char *p = mem + nnodes*sizeof(struct vec);
+    for (size_t i = 0; i < nnodes; i++) {
+        b->vecs[i].buf = p;
+        b->vecs[i].nullbuf = (uint64_t*)(p+cap*sizeof(struct value));
+        p += vsize;
+    }
+    b->tmp = (double*)p;
+    p += 2*XV_BATCH_SIZE*sizeof(double);
+    batch_setup(b, columns, ncolumns, cap, (struct bound*)p);
+    return true;
 }
 
-static struct value eval_facts(const uint8_t *expr, size_t len,
-    struct eval_context *ctx, int depth)
+bool xv_program_eval_batch(const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows, 
+    struct xv *out)
 {
-    size_t s = 0;
-    struct value left = { 0 };
-    uint8_t op = 0;
-    size_t glen;
-    const uint8_t *g;
-    for (size_t i = 0; i < len; i++) {
-        switch (expr[i]) {
-        case '*': case '/': case '%':
-            left = fact(left, op, expr+s, i-s, ctx, depth);
-            if (is_err(left)) return left;
-            op = expr[i];
-            s = i + 1;
-            break;
-        case '(': case '[': case '{': case '"': case '\'':
-            g = read_group(expr+i, len-i, &glen);
-            if (!g) return err_syntax();
-            i = i + glen - 1;
-            break;
+    struct batch b;
+    if (!batch_open(&b, prog, columns, ncolumns, nrows)) {
+        return false;
+    }
+    const struct vec *root = &b.vecs[prog->root];
+    for (size_t row = 0; row < nrows; row += b.cap) {
+        b.row = row;
+        b.n = nrows-row < b.cap ? nrows-row : b.cap;
+        batch_eval(&b, prog->root, NULL);
+        for (size_t i = 0; i < b.n; i++) {
+            out[row+i] = from_value(vec_value(root, i));
         }
     }
-    return fact(left, op, expr+s, len-s, ctx, depth);
+    efree0(b.mem);
+    return true;
 }
 
-static struct value eval_auto(int step, const uint8_t *expr, size_t len, 
-    struct eval_context *ctx, int depth)
+// vec_masks sets the bits of the selected rows that are truthy, and of the
+// ones that are errors.
+static void vec_masks(const struct vec *v, const uint64_t *sel, size_t n, 
+    uint64_t *truths, uint64_t *errs)
 {
-    if (depth-1 > XV_MAXDEPTH) {
-        return err_msg("MaxDepthError");
+    for (size_t w = 0; w*64 < n; w++) {
+        size_t m = n-w*64 < 64 ? n-w*64 : 64;
+        uint64_t t = 0;
+        uint64_t e = 0;
+        if (v->kind == VEC_F64) {
+            const double *x = v->f64+w*64;
+            for (size_t j = 0; j < m; j++) {
+                t |= (uint64_t)(x[j] < 0 || x[j] > 0) << j;
+            }
+        } else if (v->kind == VEC_BOOL) {
+            const uint8_t *x = v->t+w*64;
+            for (size_t j = 0; j < m; j++) {
+                t |= (uint64_t)(x[j] != 0) << j;
+            }
+        } else if (sel[w]) {
+            const struct value *x = v->vals+w*64;
+            for (size_t j = 0; j < m; j++) {
+                e |= (uint64_t)is_err(x[j]) << j;
+                t |= (uint64_t)to_bool(x[j]) << j;
+            }
+        }
+        truths[w] = t & ~e & sel[w];
+        errs[w] = e & sel[w];
     }
-    switch (step) {
-    case STEP_COMMA:
-        if ((ctx->steps & STEP_COMMA) == STEP_COMMA) {
-            return eval_comma(expr, len, ctx, depth);
+}
+
+// batch_pred evaluates a node as a predicate for the selected rows. The right
+// operand of '&&' is only evaluated for rows where the left is truthy, and the
+// right of '||' only where the left is falsy, as in Javascript.
+static void batch_pred(struct batch *b, int index, const uint64_t *sel, 
+    uint64_t *truths, uint64_t *errs)
+{
+    const struct prog_node *node = &b->prog->nodes[index];
+    size_t nw = (b->n+63)/64;
+    uint64_t rsel[XV_BATCH_SIZE/64];
+    uint64_t rtruths[XV_BATCH_SIZE/64];
+    uint64_t rerrs[XV_BATCH_SIZE/64];
+    bool any = false;
+    switch (node->op) {
+    case PROG_AND: case PROG_OR:
+        batch_pred(b, node->a, sel, truths, errs);
+        for (size_t w = 0; w < nw; w++) {
+            rsel[w] = node->op == PROG_AND ? truths[w] : 
+                sel[w] & ~truths[w] & ~errs[w];
+            any = any || rsel[w];
         }
-        // fall through
-    case STEP_TERNS:
-        if ((ctx->steps & STEP_TERNS) == STEP_TERNS) {
-            return eval_terns(expr, len, ctx, depth);
+        if (!any) return;
+        batch_pred(b, node->b, rsel, rtruths, rerrs);
+        for (size_t w = 0; w < nw; w++) {
+            truths[w] = node->op == PROG_AND ? rtruths[w] : 
+                truths[w] | rtruths[w];
+            errs[w] |= rerrs[w];
         }
-        // fall through
-    case STEP_LOGICAL_OR:
-        if ((ctx->steps & STEP_LOGICAL_OR) == STEP_LOGICAL_OR) {
-            return eval_logical_or(expr, len, ctx, depth);
+        return;
+    case PROG_TRUTHY: case PROG_NOT:
+        batch_pred(b, node->a, sel, truths, errs);
+        if (node->op == PROG_NOT) {
+            for (size_t w = 0; w < nw; w++) {
+                truths[w] = sel[w] & ~truths[w] & ~errs[w];
+            }
         }
-        // fall through
-    case STEP_LOGICAL_AND:
-        if ((ctx->steps & STEP_LOGICAL_AND) == STEP_LOGICAL_AND) {
-            return eval_logical_and(expr, len, ctx, depth);
+        return;
+    default:
+        batch_eval(b, index, sel);
+        vec_masks(&b->vecs[index], sel, b->n, truths, errs);
+    }
+}
+
+// program_filter evaluates a program as a predicate, calling emit with the
+// bitmap of the rows that are truthy for each block.
+static bool program_filter(const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows,
+    void (*emit)(size_t row, size_t n, const uint64_t *truths, void *udata),
+    void *udata)
+{
+    struct batch b;
+    if (!batch_open(&b, prog, columns, ncolumns, nrows)) {
+        return false;
+    }
+    uint64_t sel[XV_BATCH_SIZE/64];
+    uint64_t truths[XV_BATCH_SIZE/64];
+    uint64_t errs[XV_BATCH_SIZE/64];
+    struct mark mark = mark_memory();
+    for (size_t row = 0; row < nrows; row += b.cap) {
+        b.row = row;
+        b.n = nrows-row < b.cap ? nrows-row : b.cap;
+        for (size_t w = 0; w*64 < b.n; w++) {
+            size_t m = b.n-w*64;
+            sel[w] = m < 64 ? ((uint64_t)1<<m)-1 : UINT64_MAX;
         }
-        // fall through
-    case STEP_BITWISE_OR:
-        if ((ctx->steps & STEP_BITWISE_OR) == STEP_BITWISE_OR) {
-            return eval_bitwise_or(expr, len, ctx, depth);
+        batch_pred(&b, prog->root, sel, truths, errs);
+        emit(row, b.n, truths, udata);
+        // only the bitmap outlives the block
+        release_memory(mark);
+    }
+    efree0(b.mem);
+    return true;
+}
+
+static void emit_bitmap(size_t row, size_t n, const uint64_t *truths, 
+    void *udata)
+{
+    uint8_t *bitmap = (uint8_t*)udata + row/8;
+    for (size_t i = 0; i < (n+7)/8; i++) {
+        bitmap[i] = (uint8_t)(truths[i/8]>>(i%8*8));
+    }
+}
+
+bool xv_program_bitmap(const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows, 
+    uint8_t *bitmap)
+{
+    return program_filter(prog, columns, ncolumns, nrows, emit_bitmap, 
+        bitmap);
+}
+
+struct select_context {
+    size_t *sel;
+    size_t nsel;
+};
+
+static void emit_select(size_t row, size_t n, const uint64_t *truths, 
+    void *udata)
+{
+    struct select_context *sctx = udata;
+    for (size_t w = 0; w*64 < n; w++) {
+        uint64_t t = truths[w];
+        while (t) {
+            sctx->sel[sctx->nsel++] = row + w*64 + (size_t)__builtin_ctzll(t);
+            t &= t-1;
         }
-        // fall through
-    case STEP_BITWISE_XOR:
-        if ((ctx->steps & STEP_BITWISE_XOR) == STEP_BITWISE_XOR) {
-            return eval_bitwise_xor(expr, len, ctx, depth);
+    }
+}
+
+bool xv_program_select(const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows, 
+    size_t *sel, size_t *nsel)
+{
+    struct select_context sctx = { .sel = sel };
+    bool ok = program_filter(prog, columns, ncolumns, nrows, emit_select, 
+        &sctx);
+    *nsel = sctx.nsel;
+    return ok;
+}
+
+// Parallel evaluation splits the rows into chunks of one block each. Every
+// participant, which is the calling thread and the threads of its pool, starts
+// with an even share of the chunks in its deque. A participant takes chunks
+// from the front of its own deque, and when it runs out it steals the back
+// half of another participant's deque. A deque is a range of chunks packed
+// into one word, so that taking and stealing are each one compare-and-swap.
+//
+// The pool belongs to the calling thread and is kept until xv_cleanup_thread,
+// so its threads keep their memory and caches warm between calls. A pool
+// thread resets its memory when it starts the next job.
+
+struct pool_deque {
+    uint64_t range;  // first chunk << 32 | end chunk
+    uint8_t pad[56]; // one per cache line
+};
+
+struct pool_job {
+    const struct xv_program *prog;
+    const struct xv_column *columns;
+    size_t ncolumns;
+    size_t nrows;
+    struct xv *out;
+    int nworkers;               // participants, including the caller
+    struct pool_deque *deques;  // one for each participant
+    bool failed;                // a participant ran out of memory
+};
+
+struct pool_thread {
+    struct pool *pool;
+    int index;                  // participant index, the caller being zero
+    pthread_t thread;
+};
+
+struct pool {
+    pthread_mutex_t mu;
+    pthread_cond_t start;       // a job was posted, or the pool is stopping
+    pthread_cond_t done;        // all threads finished the job
+    struct pool_thread *threads;
+    int nthreads;
+    uint64_t gen;               // job generation
+    int active;                 // threads still on the job
+    bool stop;
+    struct pool_job *job;
+};
+
+static uint64_t deque_range(uint64_t first, uint64_t end) {
+    return first<<32 | end;
+}
+
+// deque_take takes the chunk at the front of a participant's own deque.
+static bool deque_take(struct pool_deque *dq, size_t *chunk) {
+    uint64_t r = __atomic_load_n(&dq->range, __ATOMIC_ACQUIRE);
+    while (1) {
+        uint64_t first = r>>32;
+        uint64_t end = r&UINT32_MAX;
+        if (first >= end) {
+            return false;
         }
-        // fall through
-    case STEP_BITWISE_AND:
-        if ((ctx->steps & STEP_BITWISE_AND) == STEP_BITWISE_AND) {
-            return eval_bitwise_and(expr, len, ctx, depth);
+        if (__atomic_compare_exchange_n(&dq->range, &r, 
+            deque_range(first+1, end), false, __ATOMIC_ACQ_REL, 
+            __ATOMIC_ACQUIRE))
+        {
+            *chunk = first;
+            return true;
         }
-        // fall through
-    case STEP_EQUALITY:
-        if ((ctx->steps & STEP_EQUALITY) == STEP_EQUALITY) {
-            return eval_equality(expr, len, ctx, depth);
+    }
+}
+
+// deque_steal moves the back half of another participant's deque to the
+// thief's own deque, which is empty, and takes the first chunk of it.
+static bool deque_steal(struct pool_job *job, int thief, size_t *chunk) {
+    for (int i = 1; i < job->nworkers; i++) {
+        struct pool_deque *dq = &job->deques[(thief+i)%job->nworkers];
+        uint64_t r = __atomic_load_n(&dq->range, __ATOMIC_ACQUIRE);
+        while (1) {
+            uint64_t first = r>>32;
+            uint64_t end = r&UINT32_MAX;
+            if (first >= end) {
+                break;
+            }
+            uint64_t mid = first + (end-first)/2;
+            if (__atomic_compare_exchange_n(&dq->range, &r, 
+                deque_range(first, mid), false, __ATOMIC_ACQ_REL, 
+                __ATOMIC_ACQUIRE))
+            {
+                __atomic_store_n(&job->deques[thief].range, 
+                    deque_range(mid+1, end), __ATOMIC_RELEASE);
+                *chunk = mid;
+                return true;
+            }
         }
-        // fall through
-    case STEP_COMPS:
-        if ((ctx->steps & STEP_COMPS) == STEP_COMPS) {
-            return eval_comps(expr, len, ctx, depth);
+    }
+    return false;
+}
+
+static void pool_work(struct pool_job *job, int index) {
+    struct batch b;
+    if (!batch_open(&b, job->prog, job->columns, job->ncolumns, job->nrows)) {
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+    const struct vec *root = &b.vecs[job->prog->root];
+    size_t chunk;
+    while (deque_take(&job->deques[index], &chunk) ||
+        deque_steal(job, index, &chunk))
+    {
+        b.row = chunk*b.cap;
+        b.n = job->nrows-b.row < b.cap ? job->nrows-b.row : b.cap;
+        batch_eval(&b, job->prog->root, NULL);
+        for (size_t i = 0; i < b.n; i++) {
+            job->out[b.row+i] = from_value(vec_value(root, i));
         }
-        // fall through
-    case STEP_SUMS:
-        if ((ctx->steps & STEP_SUMS) == STEP_SUMS) {
-            return eval_sums(expr, len, ctx, depth);
+    }
+    efree0(b.mem);
+}
+
+static void *pool_main(void *arg) {
+    struct pool_thread *pt = arg;
+    struct pool *pool = pt->pool;
+    uint64_t gen = 0;
+    pthread_mutex_lock(&pool->mu);
+    while (1) {
+        while (!pool->stop && pool->gen == gen) {
+            pthread_cond_wait(&pool->start, &pool->mu);
+        }
+        if (pool->stop) {
+            break;
         }
-        // fall through
-    case STEP_FACTS:
-        if ((ctx->steps & STEP_FACTS) == STEP_FACTS) {
-            return eval_facts(expr, len, ctx, depth);
+        gen = pool->gen;
+        struct pool_job *job = pool->job;
+        pthread_mutex_unlock(&pool->mu);
+        if (pt->index < job->nworkers) {
+            // the results of the last job are no longer used
+            xv_cleanup();
+            pool_work(job, pt->index);
+        }
+        pthread_mutex_lock(&pool->mu);
+        if (--pool->active == 0) {
+            pthread_cond_signal(&pool->done);
         }
-        // fall through
-    default:
-        return eval_atom(expr, len, ctx, depth);
     }
+    pthread_mutex_unlock(&pool->mu);
+    xv_cleanup_thread();
+    return NULL;
 }
 
-static struct value eval_expr(const uint8_t *expr, size_t len, 
-    struct eval_context *ctx, int depth)
+static void pool_free(struct pool *pool) {
+    pthread_mutex_lock(&pool->mu);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mu);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i].thread, NULL);
+    }
+    pthread_mutex_destroy(&pool->mu);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    efree0(pool->threads);
+    efree0(pool);
+}
+
+// pool_new starts a pool of nthreads threads, or as many as could be started.
+static struct pool *pool_new(int nthreads) {
+    struct pool *pool = emalloc0(sizeof(struct pool));
+    if (!pool) return NULL;
+    memset(pool, 0, sizeof(struct pool));
+    pool->threads = emalloc0(sizeof(struct pool_thread)*(size_t)nthreads);
+    if (!pool->threads) {
+        efree0(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mu, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        struct pool_thread *pt = &pool->threads[i];
+        pt->pool = pool;
+        pt->index = i+1;
+        if (pthread_create(&pt->thread, NULL, pool_main, pt) != 0) {
+            break;
+        }
+        pool->nthreads++;
+    }
+    return pool;
+}
+
+bool xv_program_eval_parallel(const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows, 
+    struct xv *out, int nthreads)
 {
-    // the only place where the depth is increased
-    return eval_auto(STEP_COMMA, expr, len, ctx, depth+1);
+    if (nthreads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n > 0 ? (int)n : 1;
+    }
+    // a chunk is one block, so a batch never has to hold more than one
+    size_t nchunks = (nrows+XV_BATCH_SIZE-1)/XV_BATCH_SIZE;
+    if (nchunks > UINT32_MAX) {
+        return false;
+    }
+    if ((size_t)nthreads > nchunks) {
+        nthreads = (int)nchunks;
+    }
+    if (nthreads <= 1) {
+        return xv_program_eval_batch(prog, columns, ncolumns, nrows, out);
+    }
+    if (tpool && tpool->nthreads < nthreads-1) {
+        pool_free(tpool);
+        tpool = NULL;
+    }
+    if (!tpool) {
+        tpool = pool_new(nthreads-1);
+        if (!tpool) {
+            return false;
+        }
+    }
+    if (nthreads-1 > tpool->nthreads) {
+        nthreads = tpool->nthreads+1;
+    }
+    struct pool_deque *deques = emalloc0(sizeof(struct pool_deque)*
+        (size_t)nthreads);
+    if (!deques) {
+        return false;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        deques[i].range = deque_range(nchunks*(size_t)i/(size_t)nthreads,
+            nchunks*(size_t)(i+1)/(size_t)nthreads);
+    }
+    struct pool_job job = {
+        .prog = prog,
+        .columns = columns,
+        .ncolumns = ncolumns,
+        .nrows = nrows,
+        .out = out,
+        .nworkers = nthreads,
+        .deques = deques,
+    };
+    pthread_mutex_lock(&tpool->mu);
+    tpool->job = &job;
+    tpool->gen++;
+    tpool->active = tpool->nthreads;
+    pthread_cond_broadcast(&tpool->start);
+    pthread_mutex_unlock(&tpool->mu);
+    pool_work(&job, 0);
+    pthread_mutex_lock(&tpool->mu);
+    while (tpool->active > 0) {
+        pthread_cond_wait(&tpool->done, &tpool->mu);
+    }
+    pthread_mutex_unlock(&tpool->mu);
+    efree0(deques);
+    return !job.failed;
 }
 
-static struct value eval_foreach(const uint8_t *expr, size_t len, 
-    struct xv_env *env, void (*iter)(struct value, void *udata), void *udata,
-    int depth)
+///////////////////////////////////////////
+// Rule sets
+///////////////////////////////////////////
+
+// A rule set is many expressions that are compiled together into one program,
+// where a node that equals one that was already added is shared. Rules that
+// test the same path or subexpression, such as json.user.tier == 'gold', share
+// its nodes, and paths with a common prefix share the members of the prefix.
+// xv_ruleset_match evaluates the nodes that the rules need for one row, each
+// at most once.
+//
+// Most rules are gated on a path, such as json.event == 'login' && ... , so
+// each rule's top level '&&' conjunction is searched for a guard, which is an
+// equality of a path and a constant, a set of them joined by '||' on the same
+// path, or a comparison of a path and a number. The guards are indexed by
+// their paths. Equalities are looked up by their string or number key, and
+// comparisons are bounds that are kept sorted, so that the guards that hold
+// for a path's value are found by a binary search. A rule can only be truthy
+// when its guard is, so only the rules that the index finds, and the ones
+// without a guard, are evaluated.
+//
+// The index finds every guard that may hold, and sometimes more. Values of
+// other kinds are compared by their numbers, so number keys are also looked
+// up by a string's number, and a string key that is a number is also a number
+// key. Comparisons with bounds are never strict, since int64 values may round
+// to the same double.
+
+struct guard_key {
+    double num;           // number key or bound
+    uint64_t hash;        // hash of a string key
+    const uint8_t *str;   // string key
+    size_t len;           //
+    size_t rule;
+};
+
+struct guard_list {
+    struct guard_key *keys;
+    size_t len;
+    size_t cap;
+};
+
+// struct guard_path is the index of the guards that test one path.
+struct guard_path {
+    int node;                // the path
+    struct guard_list strs;  // string keys of equalities, by hash
+    struct guard_list nums;  // number keys of equalities, by number
+    struct guard_list lows;  // lower bounds, as in path > 5, by number
+    struct guard_list highs; // upper bounds, as in path < 5, by number
+};
+
+struct xv_ruleset {
+    struct xv_program prog;   // the nodes of all rules
+    int *roots;               // the root node of each rule
+    size_t nrules;
+    struct guard_path *paths; // the index, for each path that guards test
+    size_t npaths;
+    uint64_t *always;         // rules without a guard, which are always 
+                              // evaluated
+    size_t nindexed;          // rules with a guard
+    size_t nkeys;             // keys and bounds in the index
+    uint64_t *counts;         // calls and evaluated rules, updated atomically
+};
+
+// guard_hash hashes a string key, or its case folding with no_case, which
+// folds the codepoints the same way that the string operators do.
+static uint64_t guard_hash(const uint8_t *s, size_t len, bool no_case) {
+    if (!no_case) {
+        return wyhash(s, len, 0);
+    }
+    uint64_t h = wyp[0];
+    for (size_t i = 0; i < len; ) {
+        size_t n;
+        h = wymix(h^fold_codepoint(utf8_next(s+i, len-i, &n)), wyp[1]);
+        i += n;
+    }
+    return h;
+}
+
+static bool guard_reads_path(const struct prog_node *node) {
+    return node->op == PROG_COLUMN || node->op == PROG_MEMBER;
+}
+
+// guard_operands finds the path and the constant of a comparison, where
+// swapped is set when the constant is on the left. The constant is a string
+// or a number that isn't NaN, or only a number when nums is set.
+static bool guard_operands(const struct xv_program *prog, 
+    const struct prog_node *node, bool nums, int *path, struct value *key,
+    bool *swapped)
 {
-    expr = trim(expr, len, &len);
-    if (len == 0) return undefined();
+    for (int i = 0; i < 2; i++) {
+        const struct prog_node *x = &prog->nodes[i == 0 ? node->a : node->b];
+        const struct prog_node *y = &prog->nodes[i == 0 ? node->b : node->a];
+        if (!guard_reads_path(x) || y->op != PROG_CONST) continue;
+        struct value value = y->value;
+        bool ok = isnumkind(value) ? !isnan(to_f64(value)) : 
+            !nums && value.kind == STR_KIND;
+        if (!ok) continue;
+        *path = i == 0 ? node->a : node->b;
+        *key = value;
+        *swapped = i == 1;
+        return true;
+    }
+    return false;
+}
 
-    // Determine which steps are (possibly) needed by scanning every byte in
-    // the input expression and looking for potential candidate characters.
-    int steps = 0;
-    for (size_t i = 0; i < len; i++) {
-        steps |= (int)op_steps[expr[i]];
+// guard_equal returns the path of an equality, or of a set of equalities of
+// the same path that are joined by '||', or -1.
+static int guard_equal(const struct xv_program *prog, int index) {
+    const struct prog_node *node = &prog->nodes[index];
+    if (node->op == PROG_OR) {
+        int a = guard_equal(prog, node->a);
+        int b = guard_equal(prog, node->b);
+        return a >= 0 && a == b ? a : -1;
+    }
+    int path;
+    struct value key;
+    bool swapped;
+    if ((node->op != PROG_EQ && node->op != PROG_SEQ) || 
+        !guard_operands(prog, node, false, &path, &key, &swapped))
+    {
+        return -1;
     }
+    return path;
+}
 
-    if (iter) {
-        // require the comma step when using an iterator.
-        steps |= STEP_COMMA;
+// guard_range returns the path of a comparison of a path and a number, or -1.
+static int guard_range(const struct xv_program *prog, int index) {
+    const struct prog_node *node = &prog->nodes[index];
+    int path;
+    struct value key;
+    bool swapped;
+    if (node->op < PROG_LT || node->op > PROG_GTE ||
+        !guard_operands(prog, node, true, &path, &key, &swapped))
+    {
+        return -1;
     }
+    return path;
+}
 
-    struct eval_context ctx = {
-        .expr = (uint8_t*)expr, 
-        .len = len, 
-        .steps = steps, 
-        .iter = iter,
-        .iter_udata = udata,
-        .env = env,
-    };
-    return eval_expr(expr, len, &ctx, depth);
+// rule_guard finds the guard of a rule in the conjunction at index, where an
+// equality or a set is chosen before a comparison.
+static void rule_guard(const struct xv_program *prog, int index, int *equal,
+    int *range)
+{
+    const struct prog_node *node = &prog->nodes[index];
+    if (node->op == PROG_AND) {
+        rule_guard(prog, node->a, equal, range);
+        rule_guard(prog, node->b, equal, range);
+    } else if (*equal < 0 && guard_equal(prog, index) >= 0) {
+        *equal = index;
+    } else if (*range < 0 && guard_range(prog, index) >= 0) {
+        *range = index;
+    }
 }
 
-static struct value eval(const uint8_t *expr, size_t len, 
-    struct xv_env *env, int depth)
+static bool guard_push(struct guard_list *list, struct guard_key key) {
+    if (list->len == list->cap) {
+        size_t cap = list->cap == 0 ? 8 : list->cap*2;
+        struct guard_key *keys = emalloc0(sizeof(struct guard_key)*cap);
+        if (!keys) return false;
+        if (list->keys) {
+            memcpy(keys, list->keys, sizeof(struct guard_key)*list->len);
+            efree0(list->keys);
+        }
+        list->keys = keys;
+        list->cap = cap;
+    }
+    list->keys[list->len++] = key;
+    return true;
+}
+
+// guard_add adds the keys or the bound of a guard to the index of its path.
+static bool guard_add(struct xv_ruleset *rs, struct guard_path *gp, int index,
+    size_t rule)
 {
-    return eval_foreach(expr, len, env, NULL, NULL, depth);
+    const struct xv_program *prog = &rs->prog;
+    const struct prog_node *node = &prog->nodes[index];
+    if (node->op == PROG_OR) {
+        return guard_add(rs, gp, node->a, rule) && 
+            guard_add(rs, gp, node->b, rule);
+    }
+    int path;
+    struct value value;
+    bool swapped;
+    bool nums = node->op != PROG_EQ && node->op != PROG_SEQ;
+    guard_operands(prog, node, nums, &path, &value, &swapped);
+    struct guard_key key = { .num = to_f64(value), .rule = rule };
+    if (key.num == 0) key.num = 0; // -0 == 0
+    struct guard_list *list;
+    if (nums) {
+        bool gt = node->op == PROG_GT || node->op == PROG_GTE;
+        list = gt != swapped ? &gp->lows : &gp->highs;
+    } else if (value.kind == STR_KIND) {
+        key.str = value.str;
+        key.len = value.len;
+        key.hash = guard_hash(value.str, value.len, prog->env.no_case);
+        if (!isnan(key.num)) {
+            // also equal to a number
+            if (!guard_push(&gp->nums, key)) return false;
+            rs->nkeys++;
+        }
+        list = &gp->strs;
+    } else {
+        list = &gp->nums;
+    }
+    rs->nkeys++;
+    return guard_push(list, key);
 }
 
-struct xv xv_eval(const char *expr, struct xv_env *env) {
-    return xv_evaln(expr, strlen(expr), env);
+static int guard_cmp_hash(const void *a, const void *b) {
+    uint64_t x = ((const struct guard_key*)a)->hash;
+    uint64_t y = ((const struct guard_key*)b)->hash;
+    return (x > y) - (x < y);
 }
 
-struct xv xv_evaln(const char *expr, size_t len, 
-    struct xv_env *env)
+static int guard_cmp_num(const void *a, const void *b) {
+    double x = ((const struct guard_key*)a)->num;
+    double y = ((const struct guard_key*)b)->num;
+    return (x > y) - (x < y);
+}
+
+// guard_sort sorts a list, which has no keys array when it's empty.
+static void guard_sort(struct guard_list *list, 
+    int (*cmp)(const void *a, const void *b))
 {
-    assert(sizeof(struct value) == sizeof(struct xv)); // static_assert?
-    struct value value = eval((uint8_t*)expr, len, env, 0);
-    struct xv fvalue;
-    memcpy(&fvalue, &value, sizeof(struct xv));
-    return fvalue;
+    if (list->len > 0) {
+        qsort(list->keys, list->len, sizeof(struct guard_key), cmp);
+    }
 }
 
-static void write_error(struct writer *wr, struct value value) {
-    if ((value.flag&FLAG_ENOTFUNC) == FLAG_ENOTFUNC) {
-        write_cstr(wr, "TypeError: ");
-        write_bytes(wr, value.str, value.len);
-        write_cstr(wr, " is not a function");
-    } else if ((value.flag&FLAG_ESYNTAX) == FLAG_ESYNTAX) {
-        write_cstr(wr, "SyntaxError");
-        if ((value.flag&FLAG_EUNSUPKEYWORD) == FLAG_EUNSUPKEYWORD) {
-            write_cstr(wr, ": Unsupported keyword '");
-            write_bytes(wr, value.str, value.len);
-            write_cstr(wr, "'");
+// ruleset_index finds the guard of each rule and builds the index.
+static bool ruleset_index(struct xv_ruleset *rs) {
+    const struct xv_program *prog = &rs->prog;
+    int *pathof = emalloc0(sizeof(int)*(size_t)(prog->nnodes+1));
+    if (!pathof) return false;
+    for (int i = 0; i < prog->nnodes; i++) {
+        pathof[i] = -1;
+    }
+    bool ok = true;
+    for (size_t i = 0; i < rs->nrules && ok; i++) {
+        int equal = -1;
+        int range = -1;
+        rule_guard(prog, rs->roots[i], &equal, &range);
+        int guard = equal >= 0 ? equal : range;
+        if (guard < 0) {
+            rs->always[i>>6] |= (uint64_t)1<<(i&63);
+            continue;
         }
-    } else if ((value.flag&FLAG_EUNDEFINED) == FLAG_EUNDEFINED) {
-        if ((value.flag&FLAG_CHAIN) == FLAG_CHAIN) {
-            write_cstr(wr, "TypeError: Cannot read properties of undefined "
-                "(reading '");
-            write_bytes(wr, value.str, value.len);
-            write_cstr(wr, "')");
-        } else {
-            write_cstr(wr, "ReferenceError: Can't find variable: '");
-            write_bytes(wr, value.str, value.len);
-            write_cstr(wr, "'");
+        int path = equal >= 0 ? guard_equal(prog, guard) : 
+            guard_range(prog, guard);
+        if (pathof[path] < 0) {
+            if ((rs->npaths&(rs->npaths-1)) == 0) {
+                // grow at powers of two
+                size_t cap = rs->npaths == 0 ? 1 : rs->npaths*2;
+                struct guard_path *paths = 
+                    emalloc0(sizeof(struct guard_path)*cap);
+                if (!paths) {
+                    ok = false;
+                    break;
+                }
+                if (rs->paths) {
+                    memcpy(paths, rs->paths, 
+                        sizeof(struct guard_path)*rs->npaths);
+                    efree0(rs->paths);
+                }
+                rs->paths = paths;
+            }
+            memset(&rs->paths[rs->npaths], 0, sizeof(struct guard_path));
+            rs->paths[rs->npaths].node = path;
+            pathof[path] = (int)rs->npaths++;
         }
-    } else if ((value.flag&FLAG_EOOM) == FLAG_EOOM) {
-        write_cstr(wr, "MemoryError: Out of memory");
-    } else { // if ((value.flag&FLAG_EMSG) == FLAG_EMSG) {
-        if (value.len == 0) {
-            write_cstr(wr, "");
-        } else {
-            write_bytes(wr, value.str, value.len);
+        ok = guard_add(rs, &rs->paths[pathof[path]], guard, i);
+        rs->nindexed++;
+    }
+    efree0(pathof);
+    for (size_t i = 0; i < rs->npaths; i++) {
+        struct guard_path *gp = &rs->paths[i];
+        guard_sort(&gp->strs, guard_cmp_hash);
+        guard_sort(&gp->nums, guard_cmp_num);
+        guard_sort(&gp->lows, guard_cmp_num);
+        guard_sort(&gp->highs, guard_cmp_num);
+    }
+    return ok;
+}
+
+struct xv_ruleset *xv_ruleset_new(const char *const *exprs, size_t nrules,
+    struct xv_env *env)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < nrules; i++) {
+        size += strlen(exprs[i]);
+    }
+    size_t nwords = (nrules+63)/64;
+    struct xv_ruleset *rs = emalloc0(sizeof(struct xv_ruleset) + 
+        sizeof(uint64_t)*(nwords+2) + sizeof(int)*nrules + size);
+    if (!rs) return NULL;
+    memset(rs, 0, sizeof(struct xv_ruleset));
+    struct xv_program *prog = &rs->prog;
+    if (env) prog->env = *env;
+    rs->always = (uint64_t*)(rs+1);
+    memset(rs->always, 0, sizeof(uint64_t)*nwords);
+    rs->counts = rs->always+nwords;
+    rs->counts[0] = 0;
+    rs->counts[1] = 0;
+    rs->roots = (int*)(rs->counts+2);
+    rs->nrules = nrules;
+    prog->expr = (uint8_t*)(rs->roots+nrules);
+    prog->len = size;
+    prog->ndedup = 64;
+    prog->dedup = emalloc0(sizeof(int)*(size_t)prog->ndedup);
+    if (!prog->dedup) {
+        efree0(rs);
+        return NULL;
+    }
+    memset(prog->dedup, 0, sizeof(int)*(size_t)prog->ndedup);
+    uint8_t *text = prog->expr;
+    for (size_t i = 0; i < nrules; i++) {
+        size_t len = strlen(exprs[i]);
+        memcpy(text, exprs[i], len);
+        const uint8_t *expr = trim(text, len, &len);
+        int root = len == 0 ? prog_const(prog, make_undefined(), expr, 0) :
+            prog_expr(prog, expr, len, 1);
+        if (root < 0) {
+            xv_ruleset_free(rs);
+            return NULL;
         }
+        rs->roots[i] = root;
+        text += strlen(exprs[i]);
     }
+    // nodes are only shared while compiling
+    efree0(prog->dedup);
+    prog->dedup = NULL;
+    if (!ruleset_index(rs)) {
+        xv_ruleset_free(rs);
+        return NULL;
+    }
+    return rs;
 }
 
-size_t xv_string_copy(struct xv value, char *dst, size_t n) {
-    struct value fvalue = to_value(value);
-    struct writer wr = { .dst = dst, .n = n };    
-    write_value(&wr, fvalue);
-    write_nullterm(&wr);
-    return wr.count;
+void xv_ruleset_free(struct xv_ruleset *rs) {
+    if (!rs) return;
+    for (size_t i = 0; i < rs->npaths; i++) {
+        struct guard_path *gp = &rs->paths[i];
+        if (gp->strs.keys) efree0(gp->strs.keys);
+        if (gp->nums.keys) efree0(gp->nums.keys);
+        if (gp->lows.keys) efree0(gp->lows.keys);
+        if (gp->highs.keys) efree0(gp->highs.keys);
+    }
+    if (rs->paths) efree0(rs->paths);
+    if (rs->prog.nodes) efree0(rs->prog.nodes);
+    if (rs->prog.dedup) efree0(rs->prog.dedup);
+    efree0(rs);
+}
+
+struct xv_ruleset_stats xv_ruleset_stats(const struct xv_ruleset *rs) {
+    return (struct xv_ruleset_stats) {
+        .rules = rs->nrules,
+        .nodes = (size_t)rs->prog.nnodes,
+        .shared = (size_t)rs->prog.nshared,
+        .indexed = rs->nindexed,
+        .paths = rs->npaths,
+        .keys = rs->nkeys,
+        .calls = __atomic_load_n(&rs->counts[0], __ATOMIC_RELAXED),
+        .evaluated = __atomic_load_n(&rs->counts[1], __ATOMIC_RELAXED),
+    };
 }
 
-double xv_double(struct xv value) {
-    return to_f64(to_value(value));
+struct rule_state {
+    const struct xv_program *prog;
+    const struct xv_column *columns;
+    size_t ncolumns;
+    size_t row;
+    struct xv_env env;
+    struct eval_context ctx; // for the operators
+    struct scope *scope;     // the columns of the row, for islands
+    struct value *values;    // the value of each node that was evaluated
+    uint8_t *done;           // the nodes that were evaluated
+};
+
+// rule_eval returns the value of a node for the row, evaluating it only the
+// first time.
+static struct value rule_eval(struct rule_state *st, int index) {
+    if (st->done[index]) {
+        return st->values[index];
+    }
+    const struct prog_node *node = &st->prog->nodes[index];
+    const struct xv_column *col;
+    struct value val;
+    switch (node->op) {
+    case PROG_CONST:
+        val = node->value;
+        break;
+    case PROG_COLUMN:
+        col = find_column(st->columns, st->ncolumns, node->text, node->len);
+        if (col) {
+            val = column_value(col, st->row, st->env.int_math);
+            break;
+        }
+        // fall through
+    case PROG_ISLAND: {
+        if (node->folded && !reads_columns(node, st->columns, st->ncolumns)) {
+            val = node->value;
+            break;
+        }
+        // every column is bound, which is the same as binding the ones that
+        // the island names
+        struct eval_context ctx = {
+            .expr = node->text,
+            .len = node->len,
+            .steps = node->steps,
+            .env = &st->env,
+            .scope = st->scope,
+        };
+        val = eval_auto(node->step, node->text, node->len, &ctx, node->depth);
+        break;
+    }
+    case PROG_MEMBER:
+        val = prog_member(rule_eval(st, node->a), node, &st->ctx);
+        break;
+    case PROG_TRUTHY: case PROG_NOT: case PROG_NEG:
+        val = batch_op(node->op, rule_eval(st, node->a), make_undefined(),
+            &st->ctx);
+        break;
+    default:
+        val = rule_eval(st, node->a);
+        val = batch_op(node->op, val, rule_eval(st, node->b), &st->ctx);
+    }
+    st->values[index] = val;
+    st->done[index] = 1;
+    return val;
 }
 
-int64_t xv_int64(struct xv value) {
-    return to_i64(to_value(value));
+// guard_bound returns the index of the first key with a number that is above
+// x, or with above unset, that is not below x.
+static size_t guard_bound(const struct guard_list *list, double x, 
+    bool above)
+{
+    size_t i = 0;
+    size_t j = list->len;
+    while (i < j) {
+        size_t h = i + (j-i)/2;
+        double num = list->keys[h].num;
+        if (num < x || (above && num == x)) {
+            i = h + 1;
+        } else {
+            j = h;
+        }
+    }
+    return i;
 }
 
-uint64_t xv_uint64(struct xv value) {
-    return to_u64(to_value(value));
+static void guard_mark(const struct guard_list *list, size_t i, size_t j,
+    uint64_t *cand)
+{
+    for (; i < j; i++) {
+        size_t rule = list->keys[i].rule;
+        cand[rule>>6] |= (uint64_t)1<<(rule&63);
+    }
 }
 
-bool xv_bool(struct xv value) {
-    return to_bool(to_value(value));
+// guard_candidates marks the rules with a guard on the path that may hold for
+// the path's value.
+static void guard_candidates(const struct guard_path *gp, struct value val,
+    bool no_case, uint64_t *cand)
+{
+    if (val.kind == STR_KIND && gp->strs.len > 0) {
+        uint64_t hash = guard_hash(val.str, val.len, no_case);
+        size_t i = 0;
+        size_t j = gp->strs.len;
+        while (i < j) {
+            size_t h = i + (j-i)/2;
+            if (gp->strs.keys[h].hash < hash) {
+                i = h + 1;
+            } else {
+                j = h;
+            }
+        }
+        for (; i < gp->strs.len && gp->strs.keys[i].hash == hash; i++) {
+            const struct guard_key *key = &gp->strs.keys[i];
+            if (string_equal(val.str, val.len, key->str, key->len, no_case)) {
+                cand[key->rule>>6] |= (uint64_t)1<<(key->rule&63);
+            }
+        }
+    }
+    double x = to_f64(val);
+    if (isnan(x)) {
+        return;
+    }
+    guard_mark(&gp->nums, guard_bound(&gp->nums, x, false), 
+        guard_bound(&gp->nums, x, true), cand);
+    guard_mark(&gp->lows, 0, guard_bound(&gp->lows, x, true), cand);
+    guard_mark(&gp->highs, guard_bound(&gp->highs, x, false), gp->highs.len,
+        cand);
 }
 
-enum xv_type xv_type(struct xv value) {
-    switch (to_value(value).kind) {
-    case UNDEF_KIND:
-        return XV_UNDEFINED;
-    case BOOL_KIND:
-        return XV_BOOLEAN;
-    case FLOAT_KIND: case INT_KIND: case UINT_KIND:
-        return XV_NUMBER;
-    case FUNC_KIND:
-        return XV_FUNCTION;
-    case STR_KIND:
-        return XV_STRING;
-    default:
-        return XV_OBJECT;
+bool xv_ruleset_match(const struct xv_ruleset *rs, 
+    const struct xv_column *columns, size_t ncolumns, size_t row, 
+    uint8_t *matches)
+{
+    if (!columns_valid(columns, ncolumns, row+1)) {
+        return false;
+    }
+    size_t nnodes = (size_t)rs->prog.nnodes;
+    size_t nwords = (rs->nrules+63)/64;
+    struct mark mark = mark_memory();
+    char *mem = emalloc(nnodes*sizeof(struct value) + 
+        ncolumns*sizeof(struct scope) + nwords*sizeof(uint64_t) + nnodes);
+    if (!mem) {
+        return false;
+    }
+    struct rule_state st = {
+        .prog = &rs->prog,
+        .columns = columns,
+        .ncolumns = ncolumns,
+        .row = row,
+        .env = rs->prog.env,
+        .values = (struct value*)mem,
+    };
+    st.ctx.env = &st.env;
+    struct scope *scopes = (struct scope*)(st.values+nnodes);
+    for (size_t i = 0; i < ncolumns; i++) {
+        scopes[i] = (struct scope) {
+            .name = (const uint8_t*)columns[i].name,
+            .len = strlen(columns[i].name),
+            .value = column_value(&columns[i], row, st.env.int_math),
+            .parent = i > 0 ? &scopes[i-1] : NULL,
+        };
+    }
+    st.scope = ncolumns > 0 ? &scopes[ncolumns-1] : NULL;
+    uint64_t *cand = (uint64_t*)(scopes+ncolumns);
+    st.done = (uint8_t*)(cand+nwords);
+    memset(st.done, 0, nnodes);
+    memset(matches, 0, (rs->nrules+7)/8);
+    // a path that fails has no guards that hold
+    memcpy(cand, rs->always, nwords*sizeof(uint64_t));
+    for (size_t i = 0; i < rs->npaths; i++) {
+        struct value val = rule_eval(&st, rs->paths[i].node);
+        if (!is_err(val)) {
+            guard_candidates(&rs->paths[i], val, st.env.no_case, cand);
+        }
+    }
+    uint64_t evaluated = 0;
+    for (size_t w = 0; w < nwords; w++) {
+        for (uint64_t t = cand[w]; t; t &= t-1) {
+            size_t i = w*64 + (size_t)__builtin_ctzll(t);
+            struct value val = rule_eval(&st, rs->roots[i]);
+            if (!is_err(val) && to_bool(val)) {
+                matches[i>>3] |= (uint8_t)(1<<(i&7));
+            }
+            evaluated++;
+        }
     }
+    __atomic_fetch_add(&rs->counts[0], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&rs->counts[1], evaluated, __ATOMIC_RELAXED);
+    // only the matches outlive the evaluation
+    release_memory(mark);
+    return true;
 }
 
 ///////////////////////////////////////////
@@ -2587,12 +11066,17 @@ static bool isnumch(char c) {
 // Returns NaN for invalid syntax
 static double conv_atof(const char *a, size_t alen) {
     if (alen == 0) return NAN;
-    if (!a[1] || isnumch(a[0]) || (a[0] == '-' && isnumch(a[1])) ||
-        (a[0] == '+' && isnumch(a[1])))
+    if (isnumch(a[0]) || (alen > 1 && (a[0] == '-' || a[0] == '+') && 
+        isnumch(a[1])))
     {
-        char *end = NULL;
-        double f = strtod((char*)a, &end);
-        return (size_t)(end-a) == alen ? f : NAN;
+        bool ok;
+        double f;
+        if (alen > 2 && a[0] == '0' && (a[1] == 'x' || a[1] == 'X')) {
+            f = (double)parse_uint((uint8_t*)a+2, alen-2, 16, &ok);
+        } else {
+            f = parse_float((uint8_t*)a, alen, &ok);
+        }
+        return ok ? f : NAN;
     } 
     else if (alen == 8 && memcmp(a, "Infinity", 8) == 0) return INFINITY;
     else if (alen == 9 && memcmp(a, "+Infinity", 9) == 0) return INFINITY;
@@ -2604,9 +11088,9 @@ static double conv_atof(const char *a, size_t alen) {
 // Returns 0 for invalid syntax
 static int64_t conv_atoi(const char *a, size_t alen) {
     if (alen == 0) return 0;
-    char *end = NULL;
-    int64_t i = strtoll(a, &end, 10);
-    if ((size_t)(end-a) == alen) return i;
+    bool ok;
+    int64_t i = parse_int((uint8_t*)a, alen, 10, &ok);
+    if (ok) return i;
     return conv_ftoi(conv_atof(a, alen));
 }
 
@@ -2614,10 +11098,10 @@ static int64_t conv_atoi(const char *a, size_t alen) {
 // Returns 0 for invalid syntax
 static uint64_t conv_atou(const char *a, size_t alen) {
     if (alen == 0) return 0;
-    char *end = NULL;
-    uint64_t u = strtoull(a, &end, 10);
-    if ((size_t)(end-a) == alen) return u;
-    return conv_ftoi(conv_atof(a, alen));
+    bool ok;
+    uint64_t u = parse_uint((uint8_t*)a, alen, 10, &ok);
+    if (ok) return u;
+    return conv_ftou(conv_atof(a, alen));
 }
 
 ////////////////////////////////////
@@ -2663,7 +11147,7 @@ struct xv xv_new_function(struct xv (*func)(
 }
 
 struct xv xv_new_jsonn(const char *json, size_t len) {
-    return from_value(make_json((uint8_t*)json, len));
+    return from_value(make_json((uint8_t*)json, len, false));
 }
 
 struct xv xv_new_json(const char *json) {
@@ -2681,8 +11165,17 @@ static int strcmpn(const char *a, size_t alen, const char *b, size_t blen) {
 
 static int nonstr_strcmpn(struct value value, const uint8_t *str, size_t len) {
     char dst[1024];
-    xv_string_copy(from_value(value), dst, sizeof(dst));
-    return strcmpn(dst, strlen(dst), (char*)str, len);
+    size_t n = xv_string_copy(from_value(value), dst, sizeof(dst));
+    if (n < sizeof(dst)) {
+        return strcmpn(dst, n, (char*)str, len);
+    }
+    // too long for the stack buffer
+    char *mem = emalloc0(n+1);
+    if (!mem) return strcmpn(dst, sizeof(dst)-1, (char*)str, len);
+    xv_string_copy(from_value(value), mem, n+1);
+    int cmp = strcmpn(mem, n, (char*)str, len);
+    efree0(mem);
+    return cmp;
 }
 
 static int string_comparen(struct value value, const uint8_t *str, size_t len) {
@@ -2715,6 +11208,43 @@ int xv_string_equaln(struct xv value, const char *str, size_t len) {
     return string_equaln(to_value(value), (uint8_t*)str, len);
 }
 
+bool xv_equals(struct xv a, struct xv b, bool strict) {
+    struct value va = to_value(a);
+    struct value vb = to_value(b);
+    return strict ? vseq(va, vb, NULL).t : veq(va, vb, NULL).t;
+}
+
+int xv_compare(struct xv a, struct xv b) {
+    return vcompare(to_value(a), to_value(b), NULL);
+}
+
+// xv_hash follows the strict equality of vseq. Numbers are hashed by their
+// double value, so that 5 and 5i64 have the same hash, and strings by their
+// bytes. Arrays, objects, and the other kinds are compared by their numbers
+// when they are the same kind, which is equal whenever either one is NaN, so
+// those can only be hashed by their kind.
+uint64_t xv_hash(struct xv value, uint64_t seed) {
+    struct value v = to_value(value);
+    uint8_t b[9] = { (uint8_t)v.kind };
+    switch (v.kind) {
+    case STR_KIND:
+        return wyhash(v.str, v.len, seed);
+    case FLOAT_KIND: case INT_KIND: case UINT_KIND: case BOOL_KIND: {
+        double x = to_f64(v);
+        if (x == 0) x = 0; // -0 === 0
+        uint64_t bits;
+        memcpy(&bits, &x, 8);
+        b[0] = v.kind == BOOL_KIND ? BOOL_KIND : FLOAT_KIND;
+        for (int i = 0; i < 8; i++) {
+            b[i+1] = (uint8_t)(bits >> (i*8));
+        }
+        return wyhash(b, 9, seed);
+    }
+    default:
+        return wyhash(b, 1, seed);
+    }
+}
+
 struct xv xv_new_object(const void *ptr, uint32_t tag) {
     return from_value(make_object(ptr, tag));
 }
@@ -2738,7 +11268,7 @@ uint32_t xv_object_tag(struct xv value) {
 // array value
 size_t xv_array_length(struct xv value) {
     struct value tvalue = to_value(value);
-    if (tvalue.kind == ARRAY_KIND){
+    if (tvalue.kind == ARRAY_KIND || tvalue.kind == TYPED_KIND){
         return tvalue.len;
     }
     return 0;
@@ -2751,6 +11281,11 @@ struct xv xv_array_at(struct xv value, size_t index) {
             return from_value(tvalue.arr[index]);
         }
     }
+    if (tvalue.kind == TYPED_KIND){
+        if (index < tvalue.len) {
+            return from_value(typed_at(tvalue, index, true));
+        }
+    }
     return xv_new_undefined();
 }
 
@@ -2772,6 +11307,19 @@ struct xv xv_new_array(const struct xv *const*values,
     return from_value(make_array((struct value*)values, nvalues));
 }
 
+struct xv xv_new_typed_array(const void *ptr, size_t len, 
+    enum xv_elem_type type)
+{
+    if ((!ptr && len > 0) || type < XV_FLOAT64 || type > XV_INT32) {
+        return xv_new_undefined();
+    }
+    if ((uint64_t)len >= (uint64_t)1<<48) {
+        // doesn't fit in the 48 bits of value.len
+        return xv_new_undefined();
+    }
+    return from_value(make_typed(ptr, len, type));
+}
+
 struct xv_memstats xv_memstats(void) {
     return (struct xv_memstats) {
         .thread_total_size = sizeof(tmem),
@@ -17,6 +17,12 @@ enum xv_type {
     XV_BOOLEAN, XV_FUNCTION, XV_OBJECT,
 };
 
+// enum xv_elem_type is the element type of a typed array or a column.
+// XV_UTF8 and XV_VALUE are for columns only.
+enum xv_elem_type {
+    XV_FLOAT64, XV_FLOAT32, XV_INT64, XV_INT32, XV_UTF8, XV_VALUE,
+};
+
 // struct xv_env is a custom environment that is provided to xv_eval.
 struct xv_env {
     // no_case tells xv_eval to perform case-insensitive comparisons.
@@ -24,8 +30,15 @@ struct xv_env {
     // udata is custom user data.
     void *udata;
     // ref is a callback that returns a reference value for unknown
-    // identifiers, properties, and functions.
+    // identifiers, properties, and functions. It's also called for the names
+    // of built-ins, such as sum and Math, and a value other than undefined is
+    // used in place of the built-in.
     struct xv (*ref)(struct xv this, struct xv ident, void *udata);
+    // int_math tells xv_eval to keep integral number literals and JSON
+    // integers as int64 values. Integer arithmetic is overflow-checked and
+    // promotes to a double only when the result overflows, is not integral,
+    // or is -0.
+    bool int_math;
 };
 
 // xv_eval evaluate an expression and returns the resulting value.
@@ -35,6 +48,151 @@ struct xv_env {
 struct xv xv_eval(const char *expr, struct xv_env *env);
 struct xv xv_evaln(const char *expr, size_t len, struct xv_env *env);
 
+// xv_eval_each evaluates a comma-separated list of expressions, such as
+// "a, b + 1, c", and calls cb with each result in order, without building
+// an array of them.
+//
+// The memory used by a result is released when its callback returns, so
+// memory stays flat no matter how many results there are. The value must not
+// be used after the callback returns, and xv_cleanup should not be called
+// from the callback.
+//
+// Returns the error that stopped the evaluation, or undefined.
+struct xv xv_eval_each(const char *expr, size_t len, struct xv_env *env,
+    void (*cb)(struct xv value, void *udata), void *udata);
+
+// struct xv_program is an expression that is compiled by xv_program_new.
+struct xv_program;
+
+// struct xv_column is a column of values for xv_program_eval_batch.
+struct xv_column {
+    // name is the identifier that the column is bound to.
+    const char *name;
+    // type is the element type of data. For XV_UTF8, the string of row i is
+    // the bytes from data+offsets[i] to data+offsets[i+1]. For XV_VALUE, data
+    // is an array of 'struct xv', such as values from xv_new_json.
+    enum xv_elem_type type;
+    const void *data;
+    const uint64_t *offsets;
+    // validity is an optional bitmap where row i is null when bit i is zero,
+    // as in Apache Arrow.
+    const uint8_t *validity;
+};
+
+// xv_program_new compiles an expression that can be evaluated many times.
+// The environment is copied, and its ref callback is used for identifiers
+// that are not columns.
+//
+// Returns NULL if system is out of memory.
+struct xv_program *xv_program_new(const char *expr, size_t len, 
+    struct xv_env *env);
+
+// xv_program_free frees a program.
+void xv_program_free(struct xv_program *prog);
+
+// xv_program_eval_batch evaluates a program for nrows rows of the columns,
+// and writes the result of each row to out. The results are the same as
+// evaluating the expression for each row with xv_eval, where identifiers
+// that name a column are the value of that column's row.
+//
+// Operators over number and boolean columns are evaluated a block of rows at
+// a time. As with xv_eval, xv_cleanup should be called when the results are
+// no longer used.
+//
+// Returns false if a column is invalid or the system is out of memory.
+bool xv_program_eval_batch(const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows, 
+    struct xv *out);
+
+// xv_program_select evaluates a program as a predicate for nrows rows of the
+// columns, and writes the indexes of the rows where the result is truthy to
+// sel, which must have room for nrows indexes. The number of indexes is
+// written to nsel.
+//
+// Unlike xv_eval, the '&&' and '||' operators short-circuit as they do in
+// Javascript. The right operand of '&&' is only evaluated for the rows where
+// the left is truthy, so in "qty > 5 && expensive(id)", expensive is only
+// called for rows where qty > 5. Rows where the result is an error are not
+// selected. Memory used during the evaluation is released before returning.
+//
+// Returns false if a column is invalid or the system is out of memory.
+bool xv_program_select(const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows, 
+    size_t *sel, size_t *nsel);
+
+// xv_program_bitmap is like xv_program_select, but sets bit i of the bitmap
+// when row i is selected, and clears it otherwise. The bitmap has the same
+// layout as a column's validity bitmap, and must have room for nrows bits.
+bool xv_program_bitmap(const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows, 
+    uint8_t *bitmap);
+
+// xv_program_eval_parallel is like xv_program_eval_batch, but splits the rows
+// over nthreads threads. The results are written to out in the order of the
+// rows. When nthreads is zero or less, one thread for each online CPU is used.
+//
+// The threads belong to the calling thread and are reused by its next calls.
+// The results are valid until xv_cleanup or the next xv_program_eval_parallel
+// is called from the same thread. The ref callback of the program's
+// environment may be called from many threads at once.
+//
+// Returns false if a column is invalid or the system is out of memory.
+bool xv_program_eval_parallel(const struct xv_program *prog, 
+    const struct xv_column *columns, size_t ncolumns, size_t nrows, 
+    struct xv *out, int nthreads);
+
+// struct xv_ruleset is many expressions that are compiled together by
+// xv_ruleset_new.
+struct xv_ruleset;
+
+// xv_ruleset_new compiles nrules expressions into a rule set, where the nodes
+// that are the same in many rules, such as reading json.user.tier or testing
+// json.user.tier == 'gold', are only compiled and evaluated once. The
+// environment is copied, as with xv_program_new.
+//
+// Rules that are gated on a path, such as json.event == 'login' && ... or
+// json.amount >= 100 && ... , are indexed by the value of the path, and only
+// the rules whose guard may hold for a row are evaluated. Guards are found in
+// the top level '&&' of a rule, and are an == or === of a path and a string
+// or number, many of them on the same path joined by '||', or a comparison
+// of a path and a number.
+//
+// Returns NULL if system is out of memory.
+struct xv_ruleset *xv_ruleset_new(const char *const *exprs, size_t nrules,
+    struct xv_env *env);
+
+// xv_ruleset_free frees a rule set.
+void xv_ruleset_free(struct xv_ruleset *rs);
+
+// xv_ruleset_match evaluates the rules for one row of the columns, and sets
+// bit i of matches when rule i is truthy, as its xv_eval result would be. A
+// document can be matched with an XV_VALUE column that holds it. The matches
+// must have room for one bit for each rule. Memory used during the evaluation
+// is released before returning, and a rule set may be matched by many threads
+// at once.
+//
+// Returns false if a column is invalid or the system is out of memory.
+bool xv_ruleset_match(const struct xv_ruleset *rs, 
+    const struct xv_column *columns, size_t ncolumns, size_t row, 
+    uint8_t *matches);
+
+// struct xv_ruleset_stats is returned by xv_ruleset_stats
+struct xv_ruleset_stats {
+    size_t rules;       // number of rules
+    size_t nodes;       // number of nodes for all rules
+    size_t shared;      // number of nodes that were shared instead of added
+    size_t indexed;     // number of rules that are indexed by a guard
+    size_t paths;       // number of paths that the index looks up
+    size_t keys;        // number of values and bounds in the index
+    uint64_t calls;     // number of xv_ruleset_match calls
+    uint64_t evaluated; // number of rules that the calls evaluated
+};
+
+// xv_ruleset_stats returns the statistics of a rule set. The selectivity of
+// the index is evaluated / (calls * rules), which is the part of the rules
+// that are evaluated for a row.
+struct xv_ruleset_stats xv_ruleset_stats(const struct xv_ruleset *rs);
+
 // xv_cleanup resets the environment and frees any allocated memory
 // that may have occured during an xv_eval.
 //
@@ -49,6 +207,13 @@ struct xv xv_evaln(const char *expr, size_t len, struct xv_env *env);
 // variables and allocations.
 void xv_cleanup(void);
 
+// xv_cleanup_thread does what xv_cleanup does and also frees the memory that
+// the calling thread keeps between evaluations, such as its cache of compiled
+// regular expressions, and stops the threads of xv_program_eval_parallel.
+//
+// This should be called before a thread that used xv_eval exits.
+void xv_cleanup_thread(void);
+
 // xv_string_copy copies a value as a string representation into the
 // provided C string buffer.
 //
@@ -138,6 +303,24 @@ int xv_string_comparen(struct xv value, const char *str, size_t len);
 int xv_string_equal(struct xv value, const char *str);
 int xv_string_equaln(struct xv value, const char *str, size_t len);
 
+// xv_equals returns true if the values are equal by the rules of the '=='
+// operator, or the '===' operator when strict, without formatting them.
+//
+// Values are compared as they would be with the default environment, which is
+// case-sensitive and without int_math.
+bool xv_equals(struct xv a, struct xv b, bool strict);
+
+// xv_compare compares two values by the rules of the '<' operator.
+// Returns -1, 0, 1 for less-than, equal-to, greater-than, or 2 when the values
+// can't be ordered, such as when either is NaN.
+int xv_compare(struct xv a, struct xv b);
+
+// xv_hash returns a 64-bit hash of the value. Values that are strictly equal
+// by xv_equals have the same hash, so values can be used as keys in hash
+// tables. Loose equality has no such hash, because '1' == 1 and 1 == '1.0',
+// but '1' != '1.0'.
+uint64_t xv_hash(struct xv value, uint64_t seed);
+
 
 // value construction
 struct xv xv_new_string(const char *str);
@@ -153,6 +336,14 @@ struct xv xv_new_undefined(void);
 struct xv xv_new_null(void);
 struct xv xv_new_error(const char *msg);
 struct xv xv_new_array(const struct xv *const *values, size_t nvalues);
+// xv_new_typed_array returns an array that is a view over len elements at
+// ptr, such as a double* or int64_t* buffer, without copying them. The
+// memory must stay valid and aligned for its type while the value is used.
+//
+// Returns undefined if ptr is NULL and len is not zero, if type is not an
+// element type of a typed array, or if len is 2^48 or more.
+struct xv xv_new_typed_array(const void *ptr, size_t len, 
+    enum xv_elem_type type);
 struct xv xv_new_function(struct xv (*func)(
     struct xv this, const struct xv args, void *udata));
 